@@ -42,6 +42,8 @@ if [ $status -ne 0 ]; then exit $status; fi
 
 # add pg_pathman to shared_preload_libraries and restart cluster 'test'
 echo "port = 55435" >> $PGDATA/postgresql.conf
+echo "shared_preload_libraries = 'clickhouse_fdw'" >> $PGDATA/postgresql.conf
+echo "clickhouse_fdw.result_cache_size = '8MB'" >> $PGDATA/postgresql.conf
 pg_ctl start -l /tmp/postgres.log -w
 
 # check startup
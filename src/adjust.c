@@ -1,13 +1,18 @@
 #include "postgres.h"
 #include "strings.h"
+#include "access/genam.h"
 #include "access/heapam.h"
 #include "access/htup.h"
 #include "access/htup_details.h"
+#include "access/sysattr.h"
 #include "catalog/dependency.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_extension.h"
 #include "catalog/pg_proc.h"
 #include "catalog/pg_type.h"
 #include "commands/defrem.h"
 #include "commands/extension.h"
+#include "commands/trigger.h"
 #include "parser/parse_func.h"
 #include "utils/builtins.h"
 #include "utils/fmgroids.h"
@@ -20,7 +25,49 @@
 #include "clickhousedb_fdw.h"
 
 static HTAB *custom_objects_cache = NULL;
-static HTAB *custom_columns_cache = NULL;
+
+/* Options of a foreign table and its columns */
+typedef struct CustomTableInfo
+{
+	Oid			relid;			/* hash key */
+	bool		valid;			/* false if options should be read again */
+	MemoryContext cxt;			/* holds all the pointers below */
+
+	CHRemoteTableEngine table_engine;
+	char		sign_field[NAMEDATALEN];
+	char	   *parallel_key;
+	Bitmapset  *prewhere_attrs;	/* offset as in pull_varattnos */
+	char	   *sample;			/* SAMPLE clause, or NULL */
+	double		sample_fraction;
+	bool		sample_scale;
+	char	   *dictionary;		/* dictionary backing the table, or NULL */
+	AttrNumber	dictionary_key;	/* attnum of the key of the dictionary */
+	int			natts;
+	CustomColumnInfo *columns;	/* by attnum - 1 */
+} CustomTableInfo;
+
+static HTAB *custom_tables_cache = NULL;
+
+/*
+ * Contents of ch_function_map table, keyed by function oid. The table is
+ * read again after its trigger (or anything else) invalidates its relcache
+ * entry. Databases with older versions of the extension have no such table,
+ * then it is looked for again only when a relation of its name is created
+ * in the schema of the extension, by ALTER EXTENSION UPDATE. Old contents
+ * are freed only on reload, so entries returned from here are copied.
+ */
+static HTAB *function_map_cache = NULL;
+static MemoryContext function_map_cxt = NULL;
+static Oid	function_map_relid = InvalidOid;
+static Oid	function_map_nspid = InvalidOid;	/* schema of the extension */
+static uint32 function_map_hash = 0;	/* of the name in RELNAMENSP */
+static bool function_map_valid = false;
+
+#define FUNCTION_MAP_TABLE			"ch_function_map"
+#define Anum_function_map_pgfunc		1
+#define Anum_function_map_chtemplate	2
+
+PG_FUNCTION_INFO_V1(clickhousedb_function_map_invalidate);
 
 static HTAB *
 create_custom_objects_cache(void)
@@ -33,36 +80,43 @@ create_custom_objects_cache(void)
 	return hash_create("clickhouse_fdw custom functions", 20, &ctl, HASH_ELEM);
 }
 
+/*
+ * Options of a table are read again when something changes its relcache
+ * entry, like ALTER FOREIGN TABLE of the table or its columns.
+ */
 static void
-invalidate_custom_columns_cache(Datum arg, int cacheid, uint32 hashvalue)
+invalidate_custom_tables_cache(Datum arg, Oid relid)
 {
 	HASH_SEQ_STATUS status;
-	CustomColumnInfo *entry;
+	CustomTableInfo *entry;
 
-	hash_seq_init(&status, custom_columns_cache);
-	while ((entry = (CustomColumnInfo *) hash_seq_search(&status)) != NULL)
+	if (OidIsValid(relid))
 	{
-		if (hash_search(custom_columns_cache,
-						(void *) &entry->relid,
-						HASH_REMOVE,
-						NULL) == NULL)
-			elog(ERROR, "hash table corrupted");
+		entry = hash_search(custom_tables_cache, (void *) &relid, HASH_FIND,
+							NULL);
+		if (entry)
+			entry->valid = false;
+		return;
 	}
+
+	hash_seq_init(&status, custom_tables_cache);
+	while ((entry = (CustomTableInfo *) hash_seq_search(&status)) != NULL)
+		entry->valid = false;
 }
 
 static HTAB *
-create_custom_columns_cache(void)
+create_custom_tables_cache(void)
 {
 	HASHCTL		ctl;
 
-	ctl.keysize = sizeof(Oid) + sizeof(int);
-	ctl.entrysize = sizeof(CustomColumnInfo);
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(CustomTableInfo);
 
-	CacheRegisterSyscacheCallback(ATTNUM,
-								  invalidate_custom_columns_cache,
-								  (Datum) 0);
+	CacheRegisterRelcacheCallback(invalidate_custom_tables_cache, (Datum) 0);
 
-	return hash_create("clickhouse_fdw custom functions", 20, &ctl, HASH_ELEM | HASH_BLOBS);
+	return hash_create("clickhouse_fdw table options", 64, &ctl,
+					   HASH_ELEM | HASH_BLOBS);
 }
 
 inline static void
@@ -72,12 +126,188 @@ init_custom_entry(CustomObjectDef *entry)
 	entry->custom_name[0] = '\0';
 	entry->context = NULL;
 	entry->rowfunc = InvalidOid;
+	entry->chtemplate = NULL;
+}
+
+static void
+invalidate_function_map(Datum arg, Oid relid)
+{
+	/* without the extension there is no schema to watch, any change counts */
+	if (!OidIsValid(relid) || relid == function_map_relid ||
+			(!OidIsValid(function_map_relid) && !OidIsValid(function_map_nspid)))
+		function_map_valid = false;
+}
+
+/*
+ * While the table is absent, wait for a relation of its name in the schema
+ * of the extension.
+ */
+static void
+invalidate_function_map_name(Datum arg, int cacheid, uint32 hashvalue)
+{
+	if (!OidIsValid(function_map_relid) &&
+			(hashvalue == 0 || hashvalue == function_map_hash))
+		function_map_valid = false;
+}
+
+static Oid
+get_extension_namespace(Oid extoid)
+{
+	Relation	rel;
+	SysScanDesc	scan;
+	ScanKeyData	key;
+	HeapTuple	tuple;
+	Oid			result = InvalidOid;
+
+	rel = heap_open(ExtensionRelationId, AccessShareLock);
+	ScanKeyInit(&key,
+#if PG_VERSION_NUM >= 120000
+				Anum_pg_extension_oid,
+#else
+				ObjectIdAttributeNumber,
+#endif
+				BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(extoid));
+	scan = systable_beginscan(rel, ExtensionOidIndexId, true, NULL, 1, &key);
+	tuple = systable_getnext(scan);
+	if (HeapTupleIsValid(tuple))
+		result = ((Form_pg_extension) GETSTRUCT(tuple))->extnamespace;
+	systable_endscan(scan);
+	heap_close(rel, AccessShareLock);
+
+	return result;
+}
+
+static void
+load_function_map(void)
+{
+	HASHCTL		ctl;
+	Oid			extoid;
+	Relation	rel;
+	SysScanDesc	scan;
+	HeapTuple	tuple;
+
+	if (function_map_cxt == NULL)
+	{
+		CacheRegisterRelcacheCallback(invalidate_function_map, (Datum) 0);
+		CacheRegisterSyscacheCallback(RELNAMENSP, invalidate_function_map_name,
+									  (Datum) 0);
+	}
+	else
+		MemoryContextDelete(function_map_cxt);
+
+	function_map_cxt = AllocSetContextCreate(CacheMemoryContext,
+											 "clickhouse_fdw function map",
+											 ALLOCSET_SMALL_SIZES);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(CustomObjectDef);
+	ctl.hcxt = function_map_cxt;
+	function_map_cache = hash_create("clickhouse_fdw function map", 32, &ctl,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* invalidations received while reading will cause another reload */
+	function_map_valid = true;
+	function_map_relid = InvalidOid;
+	function_map_nspid = InvalidOid;
+
+	extoid = get_extension_oid("clickhouse_fdw", true);
+	if (OidIsValid(extoid))
+	{
+		function_map_nspid = get_extension_namespace(extoid);
+		function_map_hash = GetSysCacheHashValue2(RELNAMENSP,
+							CStringGetDatum(FUNCTION_MAP_TABLE),
+							ObjectIdGetDatum(function_map_nspid));
+		function_map_relid = get_relname_relid(FUNCTION_MAP_TABLE,
+											   function_map_nspid);
+	}
+
+	/* extension is not updated yet */
+	if (!OidIsValid(function_map_relid))
+		return;
+
+	rel = heap_open(function_map_relid, AccessShareLock);
+	scan = systable_beginscan(rel, InvalidOid, false, NULL, 0, NULL);
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+	{
+		CustomObjectDef	*entry;
+		Datum		val;
+		bool		isnull;
+		Oid			funcid;
+
+		val = heap_getattr(tuple, Anum_function_map_pgfunc,
+						   RelationGetDescr(rel), &isnull);
+		if (isnull)
+			continue;
+
+		funcid = DatumGetObjectId(val);
+		val = heap_getattr(tuple, Anum_function_map_chtemplate,
+						   RelationGetDescr(rel), &isnull);
+		if (isnull)
+			continue;
+
+		entry = hash_search(function_map_cache, (void *) &funcid, HASH_ENTER, NULL);
+		init_custom_entry(entry);
+		entry->cf_oid = funcid;
+		entry->cf_type = CF_CH_TEMPLATE;
+		entry->custom_name[0] = '\1';	/* complex */
+		entry->chtemplate = MemoryContextStrdup(function_map_cxt,
+												TextDatumGetCString(val));
+	}
+	systable_endscan(scan);
+	heap_close(rel, AccessShareLock);
+}
+
+/*
+ * Returns a copy of ch_function_map entry for the function, NULL if there is
+ * no mapping.
+ */
+static CustomObjectDef *
+lookup_function_map(Oid funcid)
+{
+	CustomObjectDef	*entry;
+	CustomObjectDef	*res;
+
+	if (!function_map_valid)
+		load_function_map();
+
+	entry = hash_search(function_map_cache, (void *) &funcid, HASH_FIND, NULL);
+	if (!entry)
+		return NULL;
+
+	res = palloc(sizeof(CustomObjectDef));
+	memcpy(res, entry, sizeof(CustomObjectDef));
+	res->chtemplate = pstrdup(entry->chtemplate);
+
+	return res;
+}
+
+/*
+ * Trigger on ch_function_map, makes all backends read it again.
+ */
+Datum
+clickhousedb_function_map_invalidate(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "clickhousedb_function_map_invalidate: not called by trigger manager");
+
+	CacheInvalidateRelcache(trigdata->tg_relation);
+
+	return PointerGetDatum(NULL);
 }
 
 CustomObjectDef *chfdw_check_for_custom_function(Oid funcid)
 {
 	CustomObjectDef	*entry;
 
+	/* user defined mappings take precedence over everything below */
+	entry = lookup_function_map(funcid);
+	if (entry)
+		return entry;
+
 	if (chfdw_is_builtin(funcid))
 	{
 		switch (funcid)
@@ -390,126 +620,354 @@ CustomObjectDef *chfdw_check_for_custom_operator(Oid opoid, Form_pg_operator for
 	return entry;
 }
 
+static bool
+is_merge_tree(const char *engine)
+{
+	static const char *merge_tree_text = "mergetree";
+	const char *p;
+
+	for (p = engine; *p && *p != '('; p++)
+		if (pg_strncasecmp(p, merge_tree_text, strlen(merge_tree_text)) == 0)
+			return true;
+
+	return false;
+}
+
 /*
- * Parse options from foreign table and apply them to fpinfo.
+ * Returns the list of plain columns used in ClickHouse key expression, like
+ * sorting_key or partition_key of system.tables. Other expressions are
+ * skipped.
+ */
+List *
+chfdw_parse_key_columns(const char *key)
+{
+	List	   *result = NIL;
+	const char *start = key;
+	const char *p;
+	int			depth = 0;
+
+	for (p = key;; p++)
+	{
+		if (*p == '(')
+			depth++;
+		else if (*p == ')')
+			depth--;
+		else if (*p == '\0' || (*p == ',' && depth == 0))
+		{
+			const char *end = p;
+			const char *c;
+			bool		valid;
+
+			while (start < end && isspace((unsigned char) *start))
+				start++;
+			while (end > start && isspace((unsigned char) end[-1]))
+				end--;
+
+			if (end - start > 2 && *start == '`' && end[-1] == '`')
+			{
+				start++;
+				end--;
+			}
+
+			valid = (start < end && !isdigit((unsigned char) *start));
+			for (c = start; valid && c < end; c++)
+				valid = (isalnum((unsigned char) *c) || *c == '_');
+
+			if (valid)
+				result = lappend(result, pnstrdup(start, end - start));
+
+			if (*p == '\0')
+				break;
+
+			start = p + 1;
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Parse the engine option, CollapsingMergeTree(sign) gives the sign column.
+ */
+static void
+parse_engine(CustomTableInfo *entry, char *val)
+{
+	static char *collapsing_text = "collapsingmergetree",
+				*aggregating_text = "aggregatingmergetree";
+
+	if (strncasecmp(val, collapsing_text, strlen(collapsing_text)) == 0)
+	{
+		char   *start = index(val, '('),
+			   *end = rindex(val, ')');
+
+		entry->table_engine = CH_COLLAPSING_MERGE_TREE;
+		if (start == end)
+		{
+			strcpy(entry->sign_field, "sign");
+			return;
+		}
+
+		if (end - start > NAMEDATALEN)
+			elog(ERROR, "invalid format of ClickHouse engine");
+
+		strncpy(entry->sign_field, start + 1, end - start - 1);
+		entry->sign_field[end - start - 1] = '\0';
+	}
+	else if (strncasecmp(val, aggregating_text, strlen(aggregating_text)) == 0)
+		entry->table_engine = CH_AGGREGATING_MERGE_TREE;
+}
+
+/*
+ * Read options of the foreign table and its columns into the cache entry.
  *
- * New options might also require tweaking merge_fdw_options().
+ * Columns worth to be read before others in PREWHERE are columns of
+ * sorting and partition keys, and other fixed width columns, which are small
+ * comparing to strings and arrays. The prewhere option of a column overrides
+ * that.
  */
-void
-chfdw_apply_custom_table_options(CHFdwRelationInfo *fpinfo, Oid relid)
+static void
+fill_custom_table_info(CustomTableInfo *entry)
 {
+	ForeignTable *table = GetForeignTable(entry->relid);
 	ListCell	*lc;
 	TupleDesc	tupdesc;
 	int			attnum;
 	Relation	rel;
-	List	   *options;
-
-	foreach(lc, fpinfo->table->options)
+	List	   *key_columns = NIL;
+	bool		use_prewhere = true;
+	bool		merge_tree = false;
+	char	   *sample = NULL;
+	char	   *sample_offset = NULL;
+	char	   *dictionary_key = NULL;
+	MemoryContext oldcxt;
+
+	foreach(lc, table->options)
 	{
 		DefElem    *def = (DefElem *) lfirst(lc);
+
 		if (strcmp(def->defname, "engine") == 0)
 		{
-			static char *collapsing_text = "collapsingmergetree",
-						*aggregating_text = "aggregatingmergetree";
+			parse_engine(entry, defGetString(def));
+			merge_tree = is_merge_tree(defGetString(def));
+		}
+		else if (strcmp(def->defname, "parallel_key") == 0)
+			entry->parallel_key = MemoryContextStrdup(entry->cxt,
+													  defGetString(def));
+		else if (strcmp(def->defname, "sorting_key") == 0 ||
+				 strcmp(def->defname, "partition_key") == 0)
+			key_columns = list_concat(key_columns,
+									  chfdw_parse_key_columns(defGetString(def)));
+		else if (strcmp(def->defname, "prewhere") == 0)
+			use_prewhere = defGetBoolean(def);
+		else if (strcmp(def->defname, "sample") == 0)
+			sample = defGetString(def);
+		else if (strcmp(def->defname, "sample_offset") == 0)
+			sample_offset = defGetString(def);
+		else if (strcmp(def->defname, "sample_scale") == 0)
+			entry->sample_scale = defGetBoolean(def);
+		else if (strcmp(def->defname, "dictionary") == 0)
+			entry->dictionary = MemoryContextStrdup(entry->cxt,
+													defGetString(def));
+		else if (strcmp(def->defname, "dictionary_key") == 0)
+			dictionary_key = defGetString(def);
+	}
 
-			char *val = defGetString(def);
-			if (strncasecmp(val, collapsing_text, strlen(collapsing_text)) == 0)
-			{
-				char   *start = index(val, '('),
-					   *end = rindex(val, ')');
+	/*
+	 * The table is read with SAMPLE, values are checked by the validator.
+	 * A sample bigger than 1 is an approximate number of rows.
+	 */
+	if (sample)
+	{
+		entry->sample = MemoryContextStrdup(entry->cxt, sample_offset ?
+				psprintf("%s OFFSET %s", sample, sample_offset) : sample);
+		entry->sample_fraction = strtod(sample, NULL);
+	}
+	else
+		entry->sample_scale = false;
 
-				fpinfo->ch_table_engine = CH_COLLAPSING_MERGE_TREE;
-				if (start == end)
-				{
-					strcpy(fpinfo->ch_table_sign_field, "sign");
-					continue;
-				}
+	rel = heap_open(entry->relid, NoLock);
+	tupdesc = RelationGetDescr(rel);
 
-				if (end - start > NAMEDATALEN)
-					elog(ERROR, "invalid format of ClickHouse engine");
+	/* the key is a column of the foreign table, checked only here */
+	if (dictionary_key)
+	{
+		for (attnum = 1; attnum <= tupdesc->natts; attnum++)
+		{
+			Form_pg_attribute attr = TupleDescAttr(tupdesc, attnum - 1);
 
-				strncpy(fpinfo->ch_table_sign_field, start + 1, end - start - 1);
-				fpinfo->ch_table_sign_field[end - start] = '\0';
-			}
-			else if (strncasecmp(val, aggregating_text, strlen(aggregating_text)) == 0)
-			{
-				fpinfo->ch_table_engine = CH_AGGREGATING_MERGE_TREE;
-			}
+			if (!attr->attisdropped &&
+					strcmp(NameStr(attr->attname), dictionary_key) == 0)
+				entry->dictionary_key = attnum;
 		}
-	}
 
-	if (custom_columns_cache == NULL)
-		custom_columns_cache = create_custom_columns_cache();
+		if (entry->dictionary_key == InvalidAttrNumber)
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_COLUMN),
+					 errmsg("column \"%s\" of option \"dictionary_key\" does not exist in foreign table \"%s\"",
+							dictionary_key, RelationGetRelationName(rel))));
+	}
 
-	rel = heap_open(relid, NoLock);
-	tupdesc = RelationGetDescr(rel);
+	entry->natts = tupdesc->natts;
+	entry->columns = MemoryContextAllocZero(entry->cxt,
+			sizeof(CustomColumnInfo) * Max(tupdesc->natts, 1));
 
 	for (attnum = 1; attnum <= tupdesc->natts; attnum++)
 	{
-		bool				found;
 		CustomObjectDef	   *cdef;
-		CustomColumnInfo	entry_key,
-						   *entry;
+		CustomColumnInfo   *cinfo = &entry->columns[attnum - 1];
 		custom_object_type	cf_type = CF_ISTORE_ARR;
+		bool				cheap = false;
+		bool				forced = false;
 
 		Form_pg_attribute attr = TupleDescAttr(tupdesc, attnum - 1);
-		entry_key.relid = relid;
-		entry_key.varattno = attnum;
 
-		entry = hash_search(custom_columns_cache,
-				(void *) &entry_key.relid, HASH_ENTER, &found);
-		if (found)
-			continue;
-
-		entry->relid = relid;
-		entry->varattno = attnum;
-		entry->table_engine = fpinfo->ch_table_engine;
-		entry->coltype = CF_USUAL;
-		entry->is_aggregation_func = false;
-		strcpy(entry->colname, NameStr(attr->attname));
-		strcpy(entry->signfield, fpinfo->ch_table_sign_field);
+		cinfo->relid = entry->relid;
+		cinfo->varattno = attnum;
+		cinfo->table_engine = entry->table_engine;
+		cinfo->coltype = CF_USUAL;
+		cinfo->is_aggregation_func = false;
+		strcpy(cinfo->colname, NameStr(attr->attname));
+		strcpy(cinfo->signfield, entry->sign_field);
 
 		/* If a column has the column_name FDW option, use that value */
-		options = GetForeignColumnOptions(relid, attnum);
-		foreach (lc, options)
+		foreach (lc, GetForeignColumnOptions(entry->relid, attnum))
 		{
 			DefElem    *def = (DefElem *) lfirst(lc);
 
 			if (strcmp(def->defname, "column_name") == 0)
 			{
-				strncpy(entry->colname, defGetString(def), NAMEDATALEN);
-				entry->colname[NAMEDATALEN - 1] = '\0';
+				strncpy(cinfo->colname, defGetString(def), NAMEDATALEN);
+				cinfo->colname[NAMEDATALEN - 1] = '\0';
 			}
 			else if (strcmp(def->defname, "aggregatefunction") == 0)
-				entry->is_aggregation_func = true;
+				cinfo->is_aggregation_func = true;
 			else if (strcmp(def->defname, "arrays") == 0)
 				cf_type = CF_ISTORE_ARR;
 			else if (strcmp(def->defname, "keys") == 0)
 				cf_type = CF_ISTORE_COL;
+			else if (strcmp(def->defname, "prewhere") == 0)
+			{
+				forced = true;
+				cheap = defGetBoolean(def);
+			}
 		}
 
 		cdef = chfdw_check_for_custom_type(attr->atttypid);
 		if (cdef && cdef->cf_type == CF_ISTORE_TYPE)
-			entry->coltype = cf_type;
+			cinfo->coltype = cf_type;
+
+		if (!use_prewhere || attr->attisdropped)
+			continue;
+
+		if (!forced && (merge_tree || key_columns != NIL) &&
+				!cinfo->is_aggregation_func)
+		{
+			cheap = (attr->attlen > 0);
+			foreach (lc, key_columns)
+				if (strcmp((char *) lfirst(lc), cinfo->colname) == 0)
+					cheap = true;
+		}
+
+		if (cheap)
+		{
+			oldcxt = MemoryContextSwitchTo(entry->cxt);
+			entry->prewhere_attrs = bms_add_member(entry->prewhere_attrs,
+					attnum - FirstLowInvalidHeapAttributeNumber);
+			MemoryContextSwitchTo(oldcxt);
+		}
 	}
+
 	heap_close(rel, NoLock);
 }
 
-/* Get foreign relation options */
+/*
+ * Options of the foreign table, read once and kept until the relcache entry
+ * of the table is invalidated, which ALTER FOREIGN TABLE does.
+ */
+static CustomTableInfo *
+get_custom_table_info(Oid relid)
+{
+	CustomTableInfo *entry;
+	bool		found;
+
+	if (custom_tables_cache == NULL)
+		custom_tables_cache = create_custom_tables_cache();
+
+	entry = hash_search(custom_tables_cache, (void *) &relid, HASH_ENTER,
+						&found);
+	if (found && entry->valid)
+		return entry;
+
+	if (!found)
+		entry->cxt = AllocSetContextCreate(CacheMemoryContext,
+										   "clickhouse_fdw table options",
+										   ALLOCSET_SMALL_SIZES);
+	else
+		MemoryContextReset(entry->cxt);
+
+	entry->valid = false;
+	entry->table_engine = CH_DEFAULT;
+	entry->sign_field[0] = '\0';
+	entry->parallel_key = NULL;
+	entry->prewhere_attrs = NULL;
+	entry->sample = NULL;
+	entry->sample_fraction = 0;
+	entry->sample_scale = false;
+	entry->dictionary = NULL;
+	entry->dictionary_key = InvalidAttrNumber;
+	entry->natts = 0;
+	entry->columns = NULL;
+
+	fill_custom_table_info(entry);
+	entry->valid = true;
+
+	return entry;
+}
+
+/*
+ * Apply options of the foreign table to fpinfo.
+ *
+ * New options might also require tweaking merge_fdw_options().
+ */
+void
+chfdw_apply_custom_table_options(CHFdwRelationInfo *fpinfo, Oid relid)
+{
+	CustomTableInfo *entry = get_custom_table_info(relid);
+
+	/* the cache entry could be rebuilt while fpinfo is in use */
+	fpinfo->ch_table_engine = entry->table_engine;
+	strcpy(fpinfo->ch_table_sign_field, entry->sign_field);
+	if (entry->parallel_key)
+		fpinfo->ch_parallel_key = pstrdup(entry->parallel_key);
+	fpinfo->ch_prewhere_attrs = bms_copy(entry->prewhere_attrs);
+	if (entry->sample)
+	{
+		fpinfo->ch_sample = pstrdup(entry->sample);
+		fpinfo->ch_sample_fraction = entry->sample_fraction;
+		fpinfo->ch_sample_scale = entry->sample_scale;
+	}
+	if (entry->dictionary)
+	{
+		fpinfo->ch_dictionary = pstrdup(entry->dictionary);
+		fpinfo->ch_dictionary_key = entry->dictionary_key;
+	}
+}
+
+/*
+ * Get options of the column of a foreign relation.  The result is a palloc'd
+ * copy, the cache entry is rebuilt on invalidation while it could be in use.
+ */
 CustomColumnInfo *
 chfdw_get_custom_column_info(Oid relid, uint16 varattno)
 {
-	CustomColumnInfo	entry_key,
-					   *entry;
-
-	entry_key.relid = relid;
-	entry_key.varattno = varattno;
+	CustomTableInfo *entry = get_custom_table_info(relid);
+	CustomColumnInfo *cinfo;
 
-	if (custom_columns_cache == NULL)
-		custom_columns_cache = create_custom_columns_cache();
+	if (varattno < 1 || varattno > entry->natts)
+		return NULL;
 
-	entry = hash_search(custom_columns_cache,
-			(void *) &entry_key.relid, HASH_FIND, NULL);
+	cinfo = palloc(sizeof(CustomColumnInfo));
+	memcpy(cinfo, &entry->columns[varattno - 1], sizeof(CustomColumnInfo));
 
-	return entry;
+	return cinfo;
 }
@@ -2,11 +2,16 @@
 #include <endian.h>
 #include <cassert>
 #include <stdexcept>
+#include <chrono>
+#include <functional>
+#include <climits>
+#include <uuid/uuid.h>
 
 #include "clickhouse/columns/nullable.h"
 #include "clickhouse/columns/factory.h"
 #include <clickhouse/client.h>
 #include <clickhouse/types/types.h>
+#include <clickhouse/base/wire_format.h>
 
 extern "C" {
 
@@ -143,49 +148,308 @@ set_state_error(ch_binary_read_state_t *state, const char *str)
 	strcpy(state->error, str);
 }
 
-ch_binary_response_t *ch_binary_simple_query(ch_binary_connection_t *conn,
-	const char *query, bool (*check_cancel)(void) )
+static void column_append(clickhouse::ColumnRef col, Datum val, Oid valtype,
+		bool isnull);
+
+/* memory limit for blocks of the following results, 0 means no limit */
+static size_t		memory_limit = 0;
+static const ch_temp_file_ops *temp_ops = NULL;
+
+void ch_binary_set_memory_limit(size_t limit, const ch_temp_file_ops *ops)
 {
-	Client	*client = (Client *) conn->client;
-	ch_binary_response_t	*resp;
-	std::vector<std::vector<clickhouse::ColumnRef>> *values;
+	memory_limit = limit;
+	temp_ops = ops;
+}
 
-	try
+/* receiver of the progress of the following queries */
+static ch_binary_progress_func	progress_func = NULL;
+static uint32_t		progress_ticket = 0;
+
+void ch_binary_set_progress_func(ch_binary_progress_func func, uint32_t ticket)
+{
+	progress_func = func;
+	progress_ticket = ticket;
+}
+
+/*
+ * Generate the query_id of the query, the server makes up its own if it is
+ * not sent.
+ */
+static std::string
+new_query_id(ch_binary_response_t *resp)
+{
+	uuid_t	id;
+
+	uuid_generate(id);
+	uuid_unparse(id, resp->query_id);
+	return resp->query_id;
+}
+
+/*
+ * Blocks of the result beyond the memory limit are saved in Native format to
+ * a temporary file. They are loaded back one at a time while the result is
+ * read.
+ */
+struct ch_binary_spill_t
+{
+	size_t		limit;
+	const ch_temp_file_ops *ops;
+	size_t		used;		/* bytes of the blocks kept in memory */
+	size_t		next_size;	/* bytes of the block being received */
+	int			file;		/* -1 until the first block is saved */
+	off_t		size;		/* size of the file */
+	std::vector<std::pair<off_t, size_t>> blocks;	/* place in the file */
+	size_t		loaded;		/* number of the loaded block */
+
+	ch_binary_spill_t(size_t limit, const ch_temp_file_ops *ops)
+		: limit(limit), ops(ops), used(0), next_size(0), file(-1), size(0),
+		  loaded(SIZE_MAX) {}
+
+	~ch_binary_spill_t()
 	{
-		resp = new ch_binary_response_t();
-		values = new std::vector<std::vector<clickhouse::ColumnRef>>();
+		if (file >= 0)
+			ops->close(file);
+	}
+};
+
+static void
+write_native_block(const Block& block, CodedOutputStream *output)
+{
+	WireFormat::WriteUInt64(output, block.GetColumnCount());
+	WireFormat::WriteUInt64(output, block.GetRowCount());
 
-		client->SelectCancelable(std::string(query),
-				[&resp, &values, &check_cancel] (const Block& block) {
+	for (Block::Iterator bi(block); bi.IsValid(); bi.Next())
+	{
+		WireFormat::WriteString(output, bi.Name());
+		WireFormat::WriteString(output, bi.Type()->GetName());
+		bi.Column()->Save(output);
+	}
+}
+
+static void
+read_native_block(CodedInputStream *input, std::vector<clickhouse::ColumnRef>& vec)
+{
+	uint64_t	columns,
+				rows;
+
+	if (!WireFormat::ReadUInt64(input, &columns) ||
+			!WireFormat::ReadUInt64(input, &rows))
+		throw std::runtime_error("clickhouse_fdw: could not read saved block");
+
+	for (uint64_t i = 0; i < columns; i++)
+	{
+		std::string	name,
+					type;
+
+		if (!WireFormat::ReadString(input, &name) ||
+				!WireFormat::ReadString(input, &type))
+			throw std::runtime_error("clickhouse_fdw: could not read saved block");
+
+		auto col = clickhouse::CreateColumnByType(type);
+		if (col == nullptr || !col->Load(input, rows))
+			throw std::runtime_error("clickhouse_fdw: could not read saved block");
+
+		vec.push_back(col);
+	}
+}
+
+/*
+ * Save the block if the memory limit is reached. Returns false if the block
+ * stays in memory.
+ *
+ * The size of the block in memory is taken to be its uncompressed size on
+ * the wire, which is the Native format of its columns, so only the blocks
+ * going to the file are encoded.
+ */
+static bool
+spill_block(ch_binary_spill_t *spill, const Block& block)
+{
+	if (spill->file < 0 && spill->used + spill->next_size <= spill->limit)
+	{
+		spill->used += spill->next_size;
+		return false;
+	}
+
+	Buffer				buf;
+	BufferOutput		out(&buf);
+	CodedOutputStream	coded(&out);
+
+	write_native_block(block, &coded);
+	coded.Flush();
+
+	if (spill->file < 0)
+	{
+		spill->file = spill->ops->create();
+		if (spill->file < 0)
+			throw std::runtime_error("clickhouse_fdw: could not create temporary file");
+	}
 
-			if (check_cancel && check_cancel())
+	if (!spill->ops->write(spill->file, (const char *) buf.data(), buf.size(),
+			spill->size))
+		throw std::runtime_error("clickhouse_fdw: could not write to temporary file");
+
+	spill->blocks.push_back(std::make_pair(spill->size, buf.size()));
+	spill->size += buf.size();
+	return true;
+}
+
+/*
+ * Load the saved block to its place in the result, the block loaded before
+ * is dropped.
+ */
+static void
+load_spilled_block(ch_binary_response_t *resp, size_t n)
+{
+	auto	spill = (ch_binary_spill_t *) resp->spill;
+	auto&	values = *((std::vector<std::vector<clickhouse::ColumnRef>> *) resp->values);
+	auto	place = spill->blocks.at(n);
+	Buffer	buf(place.second);
+
+	if (!spill->ops->read(spill->file, (char *) buf.data(), buf.size(),
+			place.first))
+		throw std::runtime_error("clickhouse_fdw: could not read temporary file");
+
+	ArrayInput			in(buf.data(), buf.size());
+	CodedInputStream	coded(&in);
+
+	read_native_block(&coded, values[n]);
+	if (spill->loaded != SIZE_MAX)
+		values[spill->loaded].clear();
+	spill->loaded = n;
+}
+
+/*
+ * Add external tables to the query and collect the blocks of its result into
+ * the response, along with the statistics of the query.
+ */
+static void
+prepare_query(Query *q, ch_binary_response_t *resp,
+	std::vector<std::vector<clickhouse::ColumnRef>> *values,
+	std::function<bool(void)> canceled,
+	ch_binary_external_table_t *tables, size_t ntables)
+{
+	for (size_t i = 0; i < ntables; i++)
+	{
+		Block	block;
+		auto	col = clickhouse::CreateColumnByType(tables[i].type_name);
+
+		for (size_t j = 0; j < tables[i].len; j++)
+			column_append(col, tables[i].datums[j], tables[i].typid, false);
+
+		block.AppendColumn("value", col);
+		q->AddExternalTable(tables[i].name, block);
+	}
+
+	if (memory_limit > 0)
+		resp->spill = new ch_binary_spill_t(memory_limit, temp_ops);
+
+	auto	started = std::chrono::steady_clock::now();
+
+	/* called before the block it is about */
+	q->OnDataStats([resp] (const DataStats& stats) {
+		if (resp->spill)
+			((ch_binary_spill_t *) resp->spill)->next_size = stats.uncompressed_bytes;
+		resp->bytes += stats.bytes;
+		resp->uncompressed_bytes += stats.uncompressed_bytes;
+		resp->wait_time += stats.wait_ns / 1000000.0;
+		resp->decompress_time += stats.decompress_ns / 1000000.0;
+		resp->decode_time += stats.decode_ns / 1000000.0;
+	});
+
+	/* the packets carry the increments since the previous one */
+	q->OnProgress([resp, func = progress_func, ticket = progress_ticket]
+			(const Progress& progress) {
+		resp->server_rows_read += progress.rows;
+		resp->server_bytes_read += progress.bytes;
+		resp->server_total_rows += progress.total_rows;
+		if (func)
+			func(ticket, resp->query_id, resp->server_rows_read,
+				resp->server_bytes_read, resp->server_total_rows);
+	});
+
+	q->OnDataCancelable([resp, values, canceled, started] (const Block& block) {
+
+		/* the query is being canceled after an error */
+		if (resp->error)
+			return false;
+
+		if (canceled && canceled())
+		{
+			set_resp_error(resp, "query was canceled");
+			resp->canceled = true;
+			return false;
+		}
+
+		/* some empty block */
+		if (block.GetColumnCount() == 0)
+			return true;
+
+		auto vec = std::vector<clickhouse::ColumnRef>();
+
+		if (resp->columns_count && block.GetColumnCount() != resp->columns_count)
+		{
+			set_resp_error(resp, "columns mismatch in blocks");
+			return false;
+		}
+
+		resp->columns_count = block.GetColumnCount();
+		resp->rows += block.GetRowCount();
+		if (resp->blocks_count == 0)
+			resp->first_block_time = std::chrono::duration<double, std::milli>(
+				std::chrono::steady_clock::now() - started).count();
+
+		/* saved blocks have an empty place in values */
+		if (resp->spill)
+		{
+			auto spill = (ch_binary_spill_t *) resp->spill;
+			bool spilled;
+
+			try
 			{
-				set_resp_error(resp, "query was canceled");
+				spilled = spill_block(spill, block);
+			}
+			catch (const std::exception& e)
+			{
+				set_resp_error(resp, e.what());
 				return false;
 			}
 
-			/* some empty block */
-			if (block.GetColumnCount() == 0)
+			if (spilled)
+			{
+				resp->blocks_count++;
+				values->push_back(std::move(vec));
 				return true;
+			}
+			spill->blocks.push_back(std::make_pair(0, 0));
+		}
 
-			auto vec = std::vector<clickhouse::ColumnRef>();
+		resp->blocks_count++;
+		for (size_t i = 0; i < resp->columns_count; ++i)
+			vec.push_back(block[i]);
 
-			if (resp->columns_count && block.GetColumnCount() != resp->columns_count)
-			{
-				set_resp_error(resp, "columns mismatch in blocks");
-				return false;
-			}
+		values->push_back(std::move(vec));
+		return true;
+	});
+}
 
-			resp->columns_count = block.GetColumnCount();
-			resp->blocks_count++;
+ch_binary_response_t *ch_binary_simple_query(ch_binary_connection_t *conn,
+	const char *query, bool (*check_cancel)(void),
+	ch_binary_external_table_t *tables, size_t ntables)
+{
+	Client	*client = (Client *) conn->client;
+	ch_binary_response_t	*resp;
+	std::vector<std::vector<clickhouse::ColumnRef>> *values;
+	auto	started = std::chrono::steady_clock::now();
 
-			for (size_t i = 0; i < resp->columns_count; ++i)
-				vec.push_back(block[i]);
+	try
+	{
+		resp = new ch_binary_response_t();
+		values = new std::vector<std::vector<clickhouse::ColumnRef>>();
 
-			values->push_back(std::move(vec));
-			return true;
-		});
+		Query q(query, new_query_id(resp));
 
+		prepare_query(&q, resp, values, check_cancel, tables, ntables);
+		client->Execute(q);
 		resp->values = (void *) values;
 	}
 	catch (const std::exception& e)
@@ -196,6 +460,9 @@ ch_binary_response_t *ch_binary_simple_query(ch_binary_connection_t *conn,
 		values = NULL;
 	}
 
+	resp->total_time = std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - started).count();
+
 	resp->success = (resp->error == NULL);
 	return resp;
 }
@@ -575,6 +842,9 @@ void ch_binary_response_free(ch_binary_response_t *resp)
 	if (resp->error)
 		free(resp->error);
 
+	if (resp->spill)
+		delete (ch_binary_spill_t *) resp->spill;
+
 	delete resp;
 }
 
@@ -880,6 +1150,9 @@ bool ch_binary_read_row(ch_binary_read_state_t *state)
 	try {
 again:
 		assert(state->block < state->resp->blocks_count);
+		if (values[state->block].empty())
+			load_spilled_block(state->resp, state->block);
+
 		auto&	block = values[state->block];
 		size_t	row_count  = block[0]->Size();
 
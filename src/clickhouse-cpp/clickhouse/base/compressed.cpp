@@ -4,6 +4,7 @@
 #include <cityhash/city.h>
 #include <lz4/lz4.h>
 
+#include <chrono>
 #include <system_error>
 
 #define DBMS_MAX_COMPRESSED_SIZE    0x40000000ULL   // 1GB
@@ -77,10 +78,12 @@ bool CompressedInput::Decompress() {
 
         if (!WireFormat::ReadBytes(input_, tmp.data() + 9, compressed - 9)) {
             return false;
-        } else {
-            if (hash != CityHash128((const char*)tmp.data(), compressed)) {
-                throw std::runtime_error("data was corrupted");
-            }
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+
+        if (hash != CityHash128((const char*)tmp.data(), compressed)) {
+            throw std::runtime_error("data was corrupted");
         }
 
         data_ = Buffer(original);
@@ -90,6 +93,10 @@ bool CompressedInput::Decompress() {
         } else {
             mem_.Reset(data_.data(), original);
         }
+
+        bytes_ += original;
+        decompress_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
     }
 
     return true;
@@ -9,6 +9,16 @@ public:
      CompressedInput(CodedInputStream* input);
     ~CompressedInput();
 
+    /// Bytes of data after decompression.
+    inline uint64_t Bytes() const noexcept {
+        return bytes_;
+    }
+
+    /// Nanoseconds spent checking and decompressing data.
+    inline uint64_t DecompressNs() const noexcept {
+        return decompress_ns_;
+    }
+
 protected:
     size_t DoNext(const void** ptr, size_t len) override;
 
@@ -19,6 +29,8 @@ private:
 
     Buffer data_;
     ArrayInput mem_;
+    uint64_t bytes_ = 0;
+    uint64_t decompress_ns_ = 0;
 };
 
 }
@@ -2,6 +2,7 @@
 #include "singleton.h"
 
 #include <assert.h>
+#include <chrono>
 #include <stdexcept>
 #include <system_error>
 #include <unordered_set>
@@ -178,9 +179,14 @@ SocketInput::SocketInput(SOCKET s)
 SocketInput::~SocketInput() = default;
 
 size_t SocketInput::DoRead(void* buf, size_t len) {
+    const auto start = std::chrono::steady_clock::now();
     const ssize_t ret = ::recv(s_, (char*)buf, (int)len, 0);
 
+    wait_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
     if (ret > 0) {
+        received_ += ret;
         return (size_t)ret;
     }
 
@@ -5,6 +5,7 @@
 #include "platform.h"
 
 #include <cstddef>
+#include <cstdint>
 #include <string>
 
 #if defined(_win_)
@@ -76,11 +77,23 @@ public:
     explicit SocketInput(SOCKET s);
     ~SocketInput();
 
+    /// Bytes received so far.
+    inline uint64_t Received() const noexcept {
+        return received_;
+    }
+
+    /// Nanoseconds spent waiting for the received bytes.
+    inline uint64_t WaitNs() const noexcept {
+        return wait_ns_;
+    }
+
 protected:
     size_t DoRead(void* buf, size_t len) override;
 
 private:
     SOCKET s_;
+    uint64_t received_ = 0;
+    uint64_t wait_ns_ = 0;
 };
 
 class SocketOutput : public OutputStream {
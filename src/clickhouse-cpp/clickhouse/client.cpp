@@ -13,6 +13,7 @@
 
 #include <assert.h>
 #include <atomic>
+#include <chrono>
 #include <system_error>
 #include <thread>
 #include <vector>
@@ -89,9 +90,11 @@ private:
 
     bool ReceivePacket(uint64_t* server_packet = nullptr);
 
-    void SendQuery(const std::string& query);
+    void SendQuery(const std::string& query,
+                   const ExternalTables& external_tables = ExternalTables(),
+                   const std::string& query_id = std::string());
 
-    void SendData(const Block& block);
+    void SendData(const Block& block, const std::string& table_name = std::string());
 
     bool SendHello();
 
@@ -156,6 +159,10 @@ private:
     CodedOutputStream output_;
 
     ServerInfo server_info_;
+
+    /// Socket counters at the previous data packet of the query.
+    uint64_t received_ = 0;
+    uint64_t waited_ = 0;
 };
 
 
@@ -201,7 +208,7 @@ void Client::Impl::ExecuteQuery(Query query) {
         RetryGuard([this]() { Ping(); });
     }
 
-    SendQuery(query.GetText());
+    SendQuery(query.GetText(), query.GetExternalTables(), query.GetQueryID());
 
     while (ReceivePacket()) {
         ;
@@ -544,6 +551,10 @@ bool Client::Impl::ReceiveData(bool log) {
         }
     }
 
+    DataStats stats;
+    const auto start = std::chrono::steady_clock::now();
+    const uint64_t wait_start = socket_input_.WaitNs();
+
     if (compression_ == CompressionState::Enable) {
         CompressedInput compressed(&input_);
         CodedInputStream coded(&compressed);
@@ -551,14 +562,30 @@ bool Client::Impl::ReceiveData(bool log) {
         if (!ReadBlock(&block, &coded)) {
             return false;
         }
+        stats.uncompressed_bytes = compressed.Bytes();
+        stats.decompress_ns = compressed.DecompressNs();
     } else {
         if (!ReadBlock(&block, &input_)) {
             return false;
         }
     }
 
+    const uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    const uint64_t other = socket_input_.WaitNs() - wait_start + stats.decompress_ns;
+
+    stats.decode_ns = elapsed > other ? elapsed - other : 0;
+    stats.bytes = socket_input_.Received() - received_;
+    stats.wait_ns = socket_input_.WaitNs() - waited_;
+    if (compression_ != CompressionState::Enable) {
+        stats.uncompressed_bytes = stats.bytes;
+    }
+    received_ = socket_input_.Received();
+    waited_ = socket_input_.WaitNs();
+
 	/* Now we just ignore log blocks */
     if (events_ && !log) {
+        events_->OnDataStats(stats);
         events_->OnData(block);
         if (!events_->OnDataCancelable(block)) {
             SendCancel();
@@ -615,9 +642,11 @@ void Client::Impl::SendCancel() {
     output_.Flush();
 }
 
-void Client::Impl::SendQuery(const std::string& query) {
+void Client::Impl::SendQuery(const std::string& query,
+                             const ExternalTables& external_tables,
+                             const std::string& query_id) {
     WireFormat::WriteUInt64(&output_, ClientCodes::Query);
-    WireFormat::WriteString(&output_, std::string());
+    WireFormat::WriteString(&output_, query_id);
 
     /// Client info.
     if (server_info_.revision >= DBMS_MIN_REVISION_WITH_CLIENT_INFO) {
@@ -656,11 +685,23 @@ void Client::Impl::SendQuery(const std::string& query) {
     WireFormat::WriteUInt64(&output_, Stages::Complete);
     WireFormat::WriteUInt64(&output_, compression_);
     WireFormat::WriteString(&output_, query);
+
+    // Send data of temporary tables, which should be non-empty
+    if (server_info_.revision >= DBMS_MIN_REVISION_WITH_TEMPORARY_TABLES) {
+        for (const auto& table : external_tables) {
+            if (table.second.GetRowCount() > 0)
+                SendData(table.second, table.first);
+        }
+    }
+
     // Send empty block as marker of
     // end of data
     SendData(Block());
 
     output_.Flush();
+
+    received_ = socket_input_.Received();
+    waited_ = socket_input_.WaitNs();
 }
 
 
@@ -685,11 +726,11 @@ void Client::Impl::WriteBlock(const Block& block, CodedOutputStream* output) {
     }
 }
 
-void Client::Impl::SendData(const Block& block) {
+void Client::Impl::SendData(const Block& block, const std::string& table_name) {
     WireFormat::WriteUInt64(&output_, ClientCodes::Data);
 
     if (server_info_.revision >= DBMS_MIN_REVISION_WITH_TEMPORARY_TABLES) {
-        WireFormat::WriteString(&output_, std::string());
+        WireFormat::WriteString(&output_, table_name);
     }
 
     if (compression_ == CompressionState::Enable) {
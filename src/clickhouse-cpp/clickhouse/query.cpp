@@ -15,6 +15,12 @@ Query::Query(const std::string& query)
 {
 }
 
+Query::Query(const std::string& query, const std::string& query_id)
+    : query_(query)
+    , query_id_(query_id)
+{
+}
+
 Query::~Query()
 { }
 
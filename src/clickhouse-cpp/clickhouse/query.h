@@ -6,6 +6,8 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace clickhouse {
 
@@ -60,6 +62,20 @@ struct Progress {
 };
 
 
+/// Reading of a data packet by the client.
+struct DataStats {
+    /// Bytes received since the previous data packet, compressed if
+    /// compression is enabled.
+    uint64_t bytes = 0;
+    uint64_t uncompressed_bytes = 0;
+    /// Time waiting for the socket since the previous data packet.
+    uint64_t wait_ns = 0;
+    uint64_t decompress_ns = 0;
+    /// Time reading the block, without waiting and decompression.
+    uint64_t decode_ns = 0;
+};
+
+
 class QueryEvents {
 public:
     virtual ~QueryEvents()
@@ -75,15 +91,22 @@ public:
 
     virtual void OnProgress(const Progress& progress) = 0;
 
+    virtual void OnDataStats(const DataStats& stats) {
+        (void)stats;
+    }
+
     virtual void OnFinish() = 0;
 };
 
 
 using ExceptionCallback        = std::function<void(const Exception& e)>;
 using ProgressCallback         = std::function<void(const Progress& progress)>;
+using ProfileCallback          = std::function<void(const Profile& profile)>;
+using DataStatsCallback        = std::function<void(const DataStats& stats)>;
 using SelectCallback           = std::function<void(const Block& block)>;
 using SelectCancelableCallback = std::function<bool(const Block& block)>;
 using InsertCallback           = std::function<void(const Block& sample_block)>;
+using ExternalTables           = std::vector<std::pair<std::string, Block>>;
 
 
 class Query : public QueryEvents {
@@ -91,6 +114,7 @@ public:
      Query();
      Query(const char* query);
      Query(const std::string& query);
+     Query(const std::string& query, const std::string& query_id);
     ~Query();
 
     ///
@@ -98,6 +122,12 @@ public:
         return query_;
     }
 
+    /// Identifier of the query on the server, generated by the server if
+    /// empty.
+    inline const std::string& GetQueryID() const {
+        return query_id_;
+    }
+
     /// Set handler for receiving result data.
     inline Query& OnData(SelectCallback cb) {
         select_cb_ = cb;
@@ -115,6 +145,17 @@ public:
         return *this;
     }
 
+    /// Attach a block of data which is available to the query as
+    /// a temporary table \p name.
+    inline Query& AddExternalTable(const std::string& name, const Block& block) {
+        external_tables_.emplace_back(name, block);
+        return *this;
+    }
+
+    inline const ExternalTables& GetExternalTables() const {
+        return external_tables_;
+    }
+
     /// Set handler for receiving server's exception.
     inline Query& OnException(ExceptionCallback cb) {
         exception_cb_ = cb;
@@ -128,6 +169,18 @@ public:
         return *this;
     }
 
+    /// Set handler for receiving the profile of query execution.
+    inline Query& OnProfile(ProfileCallback cb) {
+        profile_cb_ = cb;
+        return *this;
+    }
+
+    /// Set handler for receiving sizes and timings of data packets.
+    inline Query& OnDataStats(DataStatsCallback cb) {
+        data_stats_cb_ = cb;
+        return *this;
+    }
+
 private:
     void OnData(const Block& block) override {
         if (select_cb_) {
@@ -152,7 +205,15 @@ private:
     }
 
     void OnProfile(const Profile& profile) override {
-        (void)profile;
+        if (profile_cb_) {
+            profile_cb_(profile);
+        }
+    }
+
+    void OnDataStats(const DataStats& stats) override {
+        if (data_stats_cb_) {
+            data_stats_cb_(stats);
+        }
     }
 
     void OnProgress(const Progress& progress) override {
@@ -166,8 +227,12 @@ private:
 
 private:
     std::string query_;
+    std::string query_id_;
+    ExternalTables external_tables_;
     ExceptionCallback exception_cb_;
     ProgressCallback progress_cb_;
+    ProfileCallback profile_cb_;
+    DataStatsCallback data_stats_cb_;
     SelectCallback select_cb_;
     InsertCallback insert_cb_;
     SelectCancelableCallback select_cancelable_cb_;
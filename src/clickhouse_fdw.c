@@ -13,12 +13,13 @@
 /* PosrgreSQL main header file */
 #include "postgres.h"
 
-#include <sys/time.h>
+#include <ctype.h>
 #include "access/htup_details.h"
 #include "catalog/pg_class_d.h"
 #include "catalog/pg_type_d.h"
 #include "commands/defrem.h"
 #include "commands/explain.h"
+#include "commands/vacuum.h"
 #include "foreign/fdwapi.h"
 #include "funcapi.h"
 #include "fmgr.h"
@@ -32,14 +33,24 @@
 #include "optimizer/restrictinfo.h"
 #include "optimizer/tlist.h"
 #include "parser/parsetree.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/guc.h"
 #include "utils/lsyscache.h"
 #include "utils/palloc.h"
 #include "utils/rel.h"
+#include "utils/selfuncs.h"
+#include "utils/tuplestore.h"
 
 #if PG_VERSION_NUM >= 120000
 #include "access/table.h"
 #include "optimizer/optimizer.h"
+#else
+#include "optimizer/clauses.h"
+#include "optimizer/var.h"
 #endif
 
 #include "clickhousedb_fdw.h"
@@ -71,6 +82,12 @@ enum FdwScanPrivateIndex
 	FdwScanPrivateRetrievedAttrs,
 	/* Integer representing the desired fetch_size */
 	FdwScanPrivateFetchSize,
+	/* Condition selecting a slice of the table in parallel scan (String) */
+	FdwScanPrivateSliceCond,
+	/* Integer number of slices, 0 if the scan is not parallel */
+	FdwScanPrivateSlices,
+	/* Integer list of ChParamKind of the remote parameters (fdw_exprs) */
+	FdwScanPrivateParamKinds,
 
 	/*
 	 * String describing join i.e. names of relations being joined and types
@@ -79,6 +96,21 @@ enum FdwScanPrivateIndex
 	FdwScanPrivateRelations
 };
 
+/*
+ * This enum describes what's kept in the fdw_private list for a ForeignPath.
+ * We store:
+ *
+ * 1) Boolean flag showing if the remote query has the final sort
+ * 2) Boolean flag showing if the remote query has the LIMIT clause
+ */
+enum FdwPathPrivateIndex
+{
+	/* has-final-sort flag (as an integer Value node) */
+	FdwPathPrivateHasFinalSort,
+	/* has-limit flag (as an integer Value node) */
+	FdwPathPrivateHasLimit
+};
+
 /*
  * Similarly, this enum describes what's kept in the fdw_private list for
  * a ModifyTable node referencing a postgres_fdw foreign table.  We store:
@@ -100,6 +132,47 @@ enum FdwModifyPrivateIndex
 /*
  * Execution state of a foreign scan using postgres_fdw.
  */
+/*
+ * Value of an array parameter used on the right side of IN. Small arrays are
+ * inlined as a list of literals, larger ones are sent as an external table.
+ * Over HTTP scalar parameters are sent as query parameters, they use table
+ * too.
+ */
+typedef struct ChParamSet
+{
+	char	   *literal;		/* "(1, 2, 3)", NULL if table is used */
+	ch_external_table *table;
+} ChParamSet;
+
+/*
+ * Shared state of a parallel foreign scan.  Participants take slices of the
+ * table one by one until all of them are read.
+ */
+typedef struct ChFdwParallelState
+{
+	pg_atomic_uint32 next_slice;	/* next slice to be read */
+} ChFdwParallelState;
+
+/*
+ * Foreign scans that are direct children of the same Append or MergeAppend.
+ * When one of them starts, the remote queries of the next APPEND_SEND_AHEAD
+ * siblings are sent too, so they run on the server while this one is read.
+ * The window is kept small, a parent that stops early, like Append under
+ * LIMIT, would leave the queries of the rest of the siblings wasted.
+ */
+#define APPEND_SEND_AHEAD	1
+
+typedef struct ChFdwAppendGroup
+{
+	EState	   *estate;
+	Plan	   *append;			/* parent Append or MergeAppend */
+	List	   *scans;			/* ChFdwScanStates of the children */
+	MemoryContextCallback callback;	/* forgets the group with the query */
+} ChFdwAppendGroup;
+
+/* groups of the running queries, list cells are in TopMemoryContext */
+static List *append_groups = NIL;
+
 typedef struct ChFdwScanState
 {
 	Relation	rel;			/* relcache entry for the foreign table. NULL
@@ -114,10 +187,35 @@ typedef struct ChFdwScanState
 	/* for remote query execution */
 	ch_connection	conn;			/* connection for the scan */
 	int			numParams;		/* number of parameters passed to query */
-	FmgrInfo   *param_flinfo;	/* output conversion functions for them */
 	List	   *param_exprs;	/* executable expressions for param values */
-	const char **param_values;	/* textual values of query parameters */
+	List	   *param_kinds;	/* how the parameters are used */
+	const char **param_values;	/* literals of query parameters */
+	ChParamSet **param_sets;	/* array parameters used as sets */
 	ch_cursor  *ch_cursor;		/* result of query from clickhouse */
+	ch_query_stats stats;		/* of the results released so far */
+
+	/* for parallel scan */
+	char	   *slice_cond;		/* condition without the slice number */
+	int			nslices;		/* number of slices of the table */
+	ChFdwParallelState *pstate;	/* shared state, NULL if not parallel */
+
+	/* for running along with other children of an Append */
+	ChFdwAppendGroup *group;	/* NULL if not a child of an Append */
+	void	   *pending;		/* query sent, result not taken yet */
+
+	/* for rescans without changed parameters */
+	Tuplestorestate *replay;	/* rows read so far, NULL if not kept */
+	TupleTableSlot *replay_slot;	/* slot to read them back */
+	bool		eof_reached;	/* all rows of the result are read */
+
+	/* for the shared result cache */
+	UserMapping *user;			/* results are kept per user mapping */
+	int			cache_ttl;		/* seconds the result is kept, 0 if not */
+	char	   *cache_key;		/* query and shape of the rows */
+	char	   *cached_rows;	/* rows of the cached result, or NULL */
+	Size		cached_len;
+	Size		cached_pos;		/* offset of the next row */
+	StringInfo	cache_buf;		/* rows read to be cached, or NULL */
 
 	/* for storing result tuple */
 	HeapTuple  tuple;			/* array of currently-retrieved tuples */
@@ -162,7 +260,6 @@ PG_FUNCTION_INFO_V1(clickhousedb_fdw_handler);
 PG_FUNCTION_INFO_V1(clickhousedb_raw_query);
 PG_FUNCTION_INFO_V1(clickhousedb_mock);
 extern PGDLLEXPORT void _PG_init(void);
-static double time_used = 0;
 
 /*
  * FDW callback routines
@@ -184,7 +281,22 @@ clickhouseAcquireSampleRowsFunc(Relation relation, int elevel,
                                 double *totaldeadrows);
 static void clickhouseBeginForeignScan(ForeignScanState *node, int eflags);
 static TupleTableSlot *clickhouseIterateForeignScan(ForeignScanState *node);
+static void clickhouseReScanForeignScan(ForeignScanState *node);
 static void clickhouseEndForeignScan(ForeignScanState *node);
+static bool clickhouseIsForeignScanParallelSafe(PlannerInfo *root,
+        RelOptInfo *rel,
+        RangeTblEntry *rte);
+static Size clickhouseEstimateDSMForeignScan(ForeignScanState *node,
+        ParallelContext *pcxt);
+static void clickhouseInitializeDSMForeignScan(ForeignScanState *node,
+        ParallelContext *pcxt,
+        void *coordinate);
+static void clickhouseReInitializeDSMForeignScan(ForeignScanState *node,
+        ParallelContext *pcxt,
+        void *coordinate);
+static void clickhouseInitializeWorkerForeignScan(ForeignScanState *node,
+        shm_toc *toc,
+        void *coordinate);
 static List *clickhousePlanForeignModify(PlannerInfo *root,
         ModifyTable *plan,
         Index resultRelation,
@@ -234,13 +346,28 @@ static void finish_foreign_modify(CHFdwModifyState *fmstate);
 static void prepare_query_params(PlanState *node,
                                  List *fdw_exprs,
                                  int numParams,
-                                 FmgrInfo **param_flinfo,
                                  List **param_exprs,
-                                 const char ***param_values);
+                                 const char ***param_values,
+                                 ChParamSet ***param_sets);
+static void process_query_params(ExprContext *econtext,
+                                 List *param_exprs,
+                                 List *param_kinds,
+                                 const char **param_values,
+                                 ChParamSet **param_sets,
+                                 bool typed_params);
+static ChParamSet *make_param_set(int paramno, Datum value, bool isnull,
+                                  Oid arraytype);
+static ChParamSet *make_typed_param(int paramno, Datum value, Oid type);
+static char *substitute_query_params(const char *query, int numParams,
+                                 List *param_kinds,
+                                 const char **param_values,
+                                 ChParamSet **param_sets,
+                                 List **tables);
 static int postgresAcquireSampleRowsFunc(Relation relation, int elevel,
         HeapTuple *rows, int targrows,
         double *totalrows,
         double *totaldeadrows);
+static bool semijoin_target_ok(RelOptInfo *joinrel, RelOptInfo *innerrel);
 static bool foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel,
                             JoinType jointype, RelOptInfo *outerrel, RelOptInfo *innerrel,
                             JoinPathExtraData *extra);
@@ -251,18 +378,62 @@ static List *get_useful_pathkeys_for_relation(PlannerInfo *root,
 static List *get_useful_ecs_for_relation(PlannerInfo *root, RelOptInfo *rel);
 static void add_paths_with_pathkeys_for_rel(PlannerInfo *root, RelOptInfo *rel,
         Path *epq_path);
+static bool ec_member_matches_foreign(PlannerInfo *root, RelOptInfo *rel,
+                                      EquivalenceClass *ec, EquivalenceMember *em,
+                                      void *arg);
+static bool param_path_is_worthwhile(PlannerInfo *root, RelOptInfo *baserel,
+                                     ParamPathInfo *param_info);
+static void add_foreign_partial_path(PlannerInfo *root, RelOptInfo *baserel);
+static bool send_remote_query(ForeignScanState *node);
+static void release_remote_query(ChFdwScanState *fsstate);
+static void explain_query_stats(ChFdwScanState *fsstate, ExplainState *es);
+static char *bind_query_params(ForeignScanState *node, char *query,
+							   List **tables);
+static bool early_dispatch_enabled(ForeignTable *table);
+static int	result_cache_ttl(ForeignScan *fsplan, EState *estate);
+static char *result_cache_key(ChFdwScanState *fsstate, const char *query,
+							  List *tables);
+static void keep_cached_tuple(ChFdwScanState *fsstate, HeapTuple tup);
+static HeapTuple next_cached_tuple(ChFdwScanState *fsstate);
+static Plan *find_parent_append(Plan *plan, Plan *child);
+static void register_append_child(ForeignScanState *node);
+static void send_append_group(ChFdwAppendGroup *group,
+							  ChFdwScanState *first);
+#if PG_VERSION_NUM >= 120000
+static void add_foreign_ordered_paths(PlannerInfo *root,
+                                      RelOptInfo *input_rel,
+                                      RelOptInfo *ordered_rel);
+static void add_foreign_final_paths(PlannerInfo *root,
+                                    RelOptInfo *input_rel,
+                                    RelOptInfo *final_rel,
+                                    FinalPathExtraData *extra);
+#endif
 static void add_foreign_grouping_paths(PlannerInfo *root,
                                        RelOptInfo *input_rel,
                                        RelOptInfo *grouped_rel,
                                        GroupPathExtraData *extra);
+static void add_foreign_distinct_paths(PlannerInfo *root,
+                                       RelOptInfo *input_rel,
+                                       RelOptInfo *distinct_rel);
+static void add_foreign_window_paths(PlannerInfo *root,
+                                     RelOptInfo *input_rel,
+                                     RelOptInfo *window_rel);
 static void apply_server_options(CHFdwRelationInfo *fpinfo);
 static void apply_table_options(CHFdwRelationInfo *fpinfo);
 static void merge_fdw_options(CHFdwRelationInfo *fpinfo,
                               const CHFdwRelationInfo *fpinfo_o,
                               const CHFdwRelationInfo *fpinfo_i);
 
-/* empty _PG_init_ function */
-void _PG_init(void){}
+void
+_PG_init(void)
+{
+	chfdw_init_result_cache();
+	chfdw_init_stat_statements();
+	chfdw_init_progress();
+
+	if (process_shared_preload_libraries_in_progress)
+		EmitWarningsOnPlaceholders("clickhouse_fdw");
+}
 
 
 /* Make one query and close the connection */
@@ -272,7 +443,7 @@ clickhousedb_raw_query(PG_FUNCTION_ARGS)
 	char *connstring = TextDatumGetCString(PG_GETARG_TEXT_P(1)),
 		 *query = TextDatumGetCString(PG_GETARG_TEXT_P(0));
 
-	ch_connection	conn = chfdw_http_connect(connstring);
+	ch_connection	conn = chfdw_http_connect(connstring, InvalidOid);
 	ch_cursor	   *cursor = conn.methods->simple_query(conn.conn, query);
 	text		   *res = chfdw_http_fetch_raw_data(cursor);
 
@@ -285,17 +456,6 @@ clickhousedb_raw_query(PG_FUNCTION_ARGS)
 	PG_RETURN_NULL();
 }
 
-//calculate difference
-double
-time_diff(struct timeval * prior, struct timeval * latter)
-{
-	double x =
-		(double)(latter->tv_usec - prior->tv_usec) / 1000.0L +
-		(double)(latter->tv_sec - prior->tv_sec) * 1000.0L;
-
-	return x;
-}
-
 /*
  * clickhouseGetForeignRelSize
  *		Estimate # of rows and width of the result of the scan
@@ -379,6 +539,23 @@ clickhouseGetForeignRelSize(PlannerInfo *root,
 
 	cost_qual_eval(&fpinfo->local_conds_cost, fpinfo->local_conds, root);
 
+	/*
+	 * If the table has been analyzed, estimate its size from local
+	 * statistics, otherwise keep the default estimate of the core code.
+	 */
+	if (baserel->tuples > 0)
+		set_baserel_size_estimates(root, baserel);
+
+	/* Sampled tables return only a part of the rows */
+	if (fpinfo->ch_sample)
+	{
+		if (fpinfo->ch_sample_fraction <= 1.0)
+			baserel->rows = clamp_row_est(baserel->rows *
+										  fpinfo->ch_sample_fraction);
+		else
+			baserel->rows = Min(baserel->rows, fpinfo->ch_sample_fraction);
+	}
+
 	/*
 	 * Set cached relation costs to some negative value, so that we can detect
 	 * when they are set to some sensible costs during one (usually the first)
@@ -538,6 +715,7 @@ get_useful_pathkeys_for_relation(PlannerInfo *root, RelOptInfo *rel)
 	 * Pushing the query_pathkeys to the remote server is always worth
 	 * considering, because it might let us avoid a local sort.
 	 */
+	fpinfo->qp_is_pushdown_safe = false;
 	if (root->query_pathkeys)
 	{
 		bool		query_pathkeys_ok = true;
@@ -570,6 +748,7 @@ get_useful_pathkeys_for_relation(PlannerInfo *root, RelOptInfo *rel)
 		if (query_pathkeys_ok)
 		{
 			useful_pathkeys_list = list_make1(list_copy(root->query_pathkeys));
+			fpinfo->qp_is_pushdown_safe = true;
 		}
 	}
 
@@ -641,13 +820,295 @@ clickhouseGetForeignPaths(PlannerInfo *root,
 {
 	ForeignPath			*path;
 	CHFdwRelationInfo	*fpinfo = (CHFdwRelationInfo *) baserel->fdw_private;
+	List				*ppi_list;
+	ListCell			*lc;
+	bool				parallel;
+	Cost				run_cost = 0;
+
+	/* Parallel scan is possible if the table can be split into slices */
+	parallel = fpinfo->ch_parallel_key && baserel->consider_parallel &&
+		max_parallel_workers_per_gather > 0;
+
+	/*
+	 * Costs of the foreign paths leave out the conversion of the rows.  That
+	 * is the part of the scan shared by the workers of a parallel scan, so
+	 * take it into account when there is a partial path to compare with.
+	 */
+	if (parallel)
+		run_cost = baserel->rows * (cpu_tuple_cost + fpinfo->fdw_tuple_cost);
 
 	path= create_foreignscan_path(root, baserel, NULL,
-		fpinfo->rows, fpinfo->startup_cost, fpinfo->total_cost,
+		fpinfo->rows, fpinfo->startup_cost, fpinfo->total_cost + run_cost,
 		NULL, NULL, NULL, NIL);
 
 	add_path(baserel, (Path *) path);
 	add_paths_with_pathkeys_for_rel(root, baserel, NULL);
+
+	if (parallel)
+		add_foreign_partial_path(root, baserel);
+
+	/*
+	 * Thumb through all join clauses for the rel to identify which outer
+	 * relations could supply one or more safe-to-send-to-remote join clauses.
+	 * We'll build a parameterized path for each such outer relation.
+	 *
+	 * It's convenient to manage this by representing each candidate outer
+	 * relation by the ParamPathInfo node for it.  We can then use the
+	 * ppi_clauses list in the ParamPathInfo node directly as a list of the
+	 * interesting join clauses for that rel.  This takes care of the
+	 * possibility that there are multiple safe join clauses for such a rel,
+	 * and also ensures that we account for unsafe join clauses that we'll
+	 * still have to enforce locally (since the parameterized-path machinery
+	 * insists that we handle all movable clauses).
+	 */
+	ppi_list = NIL;
+	foreach(lc, baserel->joininfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		Relids		required_outer;
+		ParamPathInfo *param_info;
+
+		/* Check if clause can be moved to this rel */
+		if (!join_clause_is_movable_to(rinfo, baserel))
+			continue;
+
+		/* See if it is safe to send to remote */
+		if (!chfdw_is_foreign_expr(root, baserel, rinfo->clause))
+			continue;
+
+		/* Calculate required outer rels for the resulting path */
+		required_outer = bms_union(rinfo->clause_relids,
+		                           baserel->lateral_relids);
+		/* We do not want the foreign rel itself listed in required_outer */
+		required_outer = bms_del_member(required_outer, baserel->relid);
+
+		/*
+		 * required_outer probably can't be empty here, but if it were, we
+		 * couldn't make a parameterized path.
+		 */
+		if (bms_is_empty(required_outer))
+			continue;
+
+		/* Get the ParamPathInfo */
+		param_info = get_baserel_parampathinfo(root, baserel,
+		                                       required_outer);
+		Assert(param_info != NULL);
+
+		/*
+		 * Add it to list unless we already have it.  Testing pointer equality
+		 * is OK since get_baserel_parampathinfo won't make duplicates.
+		 */
+		ppi_list = list_append_unique_ptr(ppi_list, param_info);
+	}
+
+	/*
+	 * The above scan examined only "generic" join clauses, not those that
+	 * were absorbed into EquivalenceClauses.  See if we can make anything out
+	 * of EquivalenceClauses.
+	 */
+	if (baserel->has_eclass_joins)
+	{
+		/*
+		 * We repeatedly scan the eclass list looking for column references
+		 * (or expressions) belonging to the foreign rel.  Each time we find
+		 * one, we generate a list of equivalence joinclauses for it, and then
+		 * see if any are safe to send to the remote.  Repeat till there are
+		 * no more candidate EC members.
+		 */
+		ec_member_foreign_arg arg;
+
+		arg.already_used = NIL;
+		for (;;)
+		{
+			List	   *clauses;
+
+			/* Make clauses, skipping any that join to lateral_referencers */
+			arg.current = NULL;
+			clauses = generate_implied_equalities_for_column(root,
+			                                                 baserel,
+			                                                 ec_member_matches_foreign,
+			                                                 (void *) &arg,
+			                                                 baserel->lateral_referencers);
+
+			/* Done if there are no more expressions in the foreign rel */
+			if (arg.current == NULL)
+			{
+				Assert(clauses == NIL);
+				break;
+			}
+
+			/* Scan the extracted join clauses */
+			foreach(lc, clauses)
+			{
+				RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+				Relids		required_outer;
+				ParamPathInfo *param_info;
+
+				/* Check if clause can be moved to this rel */
+				if (!join_clause_is_movable_to(rinfo, baserel))
+					continue;
+
+				/* See if it is safe to send to remote */
+				if (!chfdw_is_foreign_expr(root, baserel, rinfo->clause))
+					continue;
+
+				/* Calculate required outer rels for the resulting path */
+				required_outer = bms_union(rinfo->clause_relids,
+				                           baserel->lateral_relids);
+				required_outer = bms_del_member(required_outer, baserel->relid);
+				if (bms_is_empty(required_outer))
+					continue;
+
+				/* Get the ParamPathInfo */
+				param_info = get_baserel_parampathinfo(root, baserel,
+				                                       required_outer);
+				Assert(param_info != NULL);
+
+				/* Add it to list unless we already have it */
+				ppi_list = list_append_unique_ptr(ppi_list, param_info);
+			}
+
+			/* Try again, now ignoring the expression we found this time */
+			arg.already_used = lappend(arg.already_used, arg.current);
+		}
+	}
+
+	/*
+	 * Now build a path for each useful outer relation.
+	 */
+	foreach(lc, ppi_list)
+	{
+		ParamPathInfo *param_info = (ParamPathInfo *) lfirst(lc);
+
+		if (!param_path_is_worthwhile(root, baserel, param_info))
+			continue;
+
+		/*
+		 * Like the plain scan, leave out the fixed cost of the remote query,
+		 * param_path_is_worthwhile has already weighed the round trips, and
+		 * cost the path by the rows it fetches for one outer row.  Pushed
+		 * down joins still win, their costs are below any of these.
+		 */
+		path = create_foreignscan_path(root, baserel,
+		                               NULL,	/* default pathtarget */
+		                               param_info->ppi_rows,
+		                               fpinfo->startup_cost,
+		                               fpinfo->total_cost +
+		                               param_info->ppi_rows *
+		                               (cpu_tuple_cost + fpinfo->fdw_tuple_cost),
+		                               NIL, /* no pathkeys */
+		                               param_info->ppi_req_outer,
+		                               NULL,
+		                               NIL);	/* no fdw_private list */
+		add_path(baserel, (Path *) path);
+	}
+}
+
+/*
+ * Add a parallel-aware path for the base relation.
+ *
+ * Each participant of the parallel scan reads its own slices of the table,
+ * selected by hash of the parallel_key table option, over its own
+ * connection.  There is one slice per participant.
+ *
+ * The rows are converted by the participants in parallel, so the path is
+ * costed by the rows of one participant, divided the same way the core code
+ * does for parallel sequential scans.  Gather over it wins over the plain
+ * scan when the saved conversion outweighs parallel_setup_cost and
+ * parallel_tuple_cost.
+ */
+static void
+add_foreign_partial_path(PlannerInfo *root, RelOptInfo *baserel)
+{
+	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) baserel->fdw_private;
+	int			nworkers = max_parallel_workers_per_gather;
+	double		parallel_divisor = nworkers;
+	double		rows;
+	ForeignPath *path;
+
+	if (parallel_leader_participation)
+	{
+		double		leader_contribution = 1.0 - (0.3 * nworkers);
+
+		if (leader_contribution > 0)
+			parallel_divisor += leader_contribution;
+	}
+	rows = clamp_row_est(baserel->rows / parallel_divisor);
+
+	path = create_foreignscan_path(root, baserel,
+	                               NULL,	/* default pathtarget */
+	                               rows,
+	                               fpinfo->startup_cost,
+	                               fpinfo->total_cost +
+	                               rows * (cpu_tuple_cost + fpinfo->fdw_tuple_cost),
+	                               NIL,		/* no pathkeys */
+	                               NULL,	/* no required_outer */
+	                               NULL,
+	                               NIL);	/* no fdw_private list */
+	path->path.parallel_aware = true;
+	path->path.parallel_workers = nworkers;
+
+	add_partial_path(baserel, (Path *) path);
+}
+
+/*
+ * Decide whether a parameterized scan could be cheaper than the plain one.
+ *
+ * The parameterized scan sends one remote query per outer row, so it only
+ * pays off when the outer side is small compared to the foreign table.
+ * Costs of the foreign paths are not real estimates, so compare the number
+ * of round trips and transferred rows here, and let the chosen path win by
+ * its cost.
+ */
+static bool
+param_path_is_worthwhile(PlannerInfo *root, RelOptInfo *baserel,
+                         ParamPathInfo *param_info)
+{
+	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) baserel->fdw_private;
+	double		outer_rows = 1;
+	Cost		param_cost;
+	Cost		plain_cost;
+	int			relid = -1;
+
+	while ((relid = bms_next_member(param_info->ppi_req_outer, relid)) >= 0)
+	{
+		RelOptInfo *outerrel = find_base_rel(root, relid);
+
+		outer_rows *= outerrel->rows;
+	}
+
+	param_cost = outer_rows * (fpinfo->fdw_startup_cost +
+							   param_info->ppi_rows * fpinfo->fdw_tuple_cost);
+	plain_cost = fpinfo->fdw_startup_cost +
+		baserel->rows * fpinfo->fdw_tuple_cost;
+
+	return param_cost < plain_cost;
+}
+
+static bool
+ec_member_matches_foreign(PlannerInfo *root, RelOptInfo *rel,
+                          EquivalenceClass *ec, EquivalenceMember *em,
+                          void *arg)
+{
+	ec_member_foreign_arg *state = (ec_member_foreign_arg *) arg;
+	Expr	   *expr = em->em_expr;
+
+	/*
+	 * If we've identified what we're processing in the current scan, we only
+	 * want to match that expression.
+	 */
+	if (state->current != NULL)
+		return equal(expr, state->current);
+
+	/*
+	 * Otherwise, ignore anything we've already processed.
+	 */
+	if (list_member(state->already_used, expr))
+		return false;
+
+	/* This is the new target to process. */
+	state->current = expr;
+	return true;
 }
 
 /*
@@ -669,14 +1130,28 @@ clickhouseGetForeignPlan(PlannerInfo *root,
 	List	   *remote_exprs = NIL;
 	List	   *local_exprs = NIL;
 	List	   *params_list = NIL;
+	List	   *param_kinds = NIL;
 	List	   *fdw_scan_tlist = NIL;
 	List	   *fdw_recheck_quals = NIL;
 	List	   *retrieved_attrs;
 	StringInfoData sql;
+	StringInfoData slice_cond;
+	int			nslices = 0;
+	bool		has_final_sort = false;
+	bool		has_limit = false;
+	bool		has_where;
 	ListCell   *lc;
-	struct timeval time1,time2;
 
-	gettimeofday(&time1, NULL);
+	/*
+	 * Get FDW private data created by clickhouseGetForeignUpperPaths(), if any.
+	 */
+	if (best_path->fdw_private)
+	{
+		has_final_sort = intVal(list_nth(best_path->fdw_private,
+										 FdwPathPrivateHasFinalSort));
+		has_limit = intVal(list_nth(best_path->fdw_private,
+									FdwPathPrivateHasLimit));
+	}
 
 	if (IS_SIMPLE_REL(foreignrel))
 	{
@@ -807,27 +1282,43 @@ clickhouseGetForeignPlan(PlannerInfo *root,
 	 * expressions to be sent as parameters.
 	 */
 	initStringInfo(&sql);
-	chfdw_deparse_select_stmt_for_rel(&sql, root, foreignrel, fdw_scan_tlist,
-	                        remote_exprs, best_path->path.pathkeys,
-	                        false, &retrieved_attrs, &params_list);
+	has_where = chfdw_deparse_select_stmt_for_rel(&sql, root, foreignrel,
+							fdw_scan_tlist, remote_exprs,
+							best_path->path.pathkeys, has_final_sort,
+							has_limit, false, &retrieved_attrs, &params_list,
+							&param_kinds);
 
 	/* Remember remote_exprs for possible use by postgresPlanDirectModify */
 	fpinfo->final_remote_exprs = remote_exprs;
 
+	/*
+	 * A parallel scan reads the table by slices.  The query of the base
+	 * relation has neither ORDER BY nor LIMIT then, so the condition selecting
+	 * the slice is simply added to its end.
+	 */
+	initStringInfo(&slice_cond);
+	if (best_path->path.parallel_aware)
+	{
+		Assert(IS_SIMPLE_REL(foreignrel) && fpinfo->ch_parallel_key);
+		nslices = best_path->path.parallel_workers + 1;
+		chfdw_deparse_slice_cond(&slice_cond, fpinfo->ch_parallel_key,
+								 nslices, has_where);
+	}
+
 	/*
 	 * Build the fdw_private list that will be available to the executor.
 	 * Items in the list must match order in enum FdwScanPrivateIndex.
 	 */
-	fdw_private = list_make3(makeString(sql.data),
+	fdw_private = list_make4(makeString(sql.data),
 							 retrieved_attrs,
-							 makeInteger(fpinfo->fetch_size));
+							 makeInteger(fpinfo->fetch_size),
+							 makeString(slice_cond.data));
+	fdw_private = lappend(fdw_private, makeInteger(nslices));
+	fdw_private = lappend(fdw_private, param_kinds);
 	if (IS_JOIN_REL(foreignrel) || IS_UPPER_REL(foreignrel))
 		fdw_private = lappend(fdw_private,
 							  makeString(fpinfo->relation_name->data));
 
-	gettimeofday(&time2, NULL);
-	time_used += time_diff(&time1, &time2);
-
 	/*
 	 * Create the ForeignScan node for the given relation.
 	 *
@@ -896,6 +1387,8 @@ clickhouseBeginForeignScan(ForeignScanState *node, int eflags)
 	 * establish new connection if necessary.
 	 */
 	fsstate->conn = chfdw_get_connection(user);
+	fsstate->user = user;
+	fsstate->cache_ttl = result_cache_ttl(fsplan, estate);
 
 	/* Get private info created by planner functions. */
 	fsstate->query = strVal(list_nth(fsplan->fdw_private,
@@ -904,6 +1397,12 @@ clickhouseBeginForeignScan(ForeignScanState *node, int eflags)
 												 FdwScanPrivateRetrievedAttrs);
 	fsstate->fetch_size = intVal(list_nth(fsplan->fdw_private,
 										  FdwScanPrivateFetchSize));
+	fsstate->slice_cond = strVal(list_nth(fsplan->fdw_private,
+										  FdwScanPrivateSliceCond));
+	fsstate->nslices = intVal(list_nth(fsplan->fdw_private,
+									   FdwScanPrivateSlices));
+	fsstate->param_kinds = (List *) list_nth(fsplan->fdw_private,
+											 FdwScanPrivateParamKinds);
 
 	/* Create contexts for batches of tuples and per-tuple temp workspace. */
 	fsstate->batch_cxt = AllocSetContextCreate(estate->es_query_cxt,
@@ -930,6 +1429,22 @@ clickhouseBeginForeignScan(ForeignScanState *node, int eflags)
 
 	fsstate->attinmeta = TupleDescGetAttInMetadata(fsstate->tupdesc);
 
+	/*
+	 * When rescans without parameter changes are expected, keep the rows
+	 * read so far to replay them.  The tuplestore stays in memory up to
+	 * work_mem and spills to a temporary file beyond that.
+	 */
+	if ((eflags & EXEC_FLAG_REWIND) && !fsplan->scan.plan.parallel_aware)
+	{
+		fsstate->replay = tuplestore_begin_heap(false, false, work_mem);
+#if PG_VERSION_NUM >= 120000
+		fsstate->replay_slot = MakeSingleTupleTableSlot(fsstate->tupdesc,
+														&TTSOpsMinimalTuple);
+#else
+		fsstate->replay_slot = MakeSingleTupleTableSlot(fsstate->tupdesc);
+#endif
+	}
+
 	/*
 	 * Prepare for processing of parameters used in remote query, if any.
 	 */
@@ -939,110 +1454,371 @@ clickhouseBeginForeignScan(ForeignScanState *node, int eflags)
 		prepare_query_params((PlanState *) node,
 							 fsplan->fdw_exprs,
 							 numParams,
-							 &fsstate->param_flinfo,
 							 &fsstate->param_exprs,
-							 &fsstate->param_values);
+							 &fsstate->param_values,
+							 &fsstate->param_sets);
+
+	/*
+	 * Queries of parallel scans and scans with parameters are only known
+	 * when they start, others can be sent along with their siblings.
+	 * Results which can come from the cache are looked up first.  Only the
+	 * HTTP driver can send a query without waiting for it.
+	 */
+	if (numParams == 0 && !fsplan->scan.plan.parallel_aware &&
+		fsstate->cache_ttl == 0 && fsstate->conn.methods->send_query != NULL)
+		register_append_child(node);
+
+	/*
+	 * With early_dispatch the query is sent right away and runs on the
+	 * server while the rest of the plan starts.  Parameters computed by the
+	 * plan itself are not known yet, so such scans wait for the first fetch.
+	 * The binary driver has no way to do it and ignores the option.
+	 */
+	if (!fsplan->scan.plan.parallel_aware &&
+		bms_is_empty(fsplan->scan.plan.extParam) &&
+		fsstate->cache_ttl == 0 &&
+		fsstate->conn.methods->send_query != NULL &&
+		early_dispatch_enabled(table))
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(fsstate->batch_cxt);
+		List	   *tables = NIL;
+		char	   *query = bind_query_params(node, fsstate->query, &tables);
+
+		fsstate->pending = fsstate->conn.methods->send_query(
+				fsstate->conn.conn, query, tables);
+		MemoryContextSwitchTo(oldcxt);
+	}
 }
 
 /*
- * Create a tuple from the specified row of the PGresult.
- *
- * rel is the local representation of the foreign table, attinmeta is
- * conversion data for the rel's tupdesc, and retrieved_attrs is an
- * integer list of the table column numbers present in the PGresult.
- * temp_context is a working context that can be reset after each tuple.
+ * Check the early_dispatch option, the table option overrides the server one.
  */
-static HeapTuple
-fetch_tuple(ChFdwScanState *fsstate, TupleDesc tupdesc)
+static bool
+early_dispatch_enabled(ForeignTable *table)
 {
-	AttInMetadata *attinmeta = fsstate->attinmeta;
-	Datum	   *values;
-	HeapTuple	tuple = NULL;
-	ItemPointer ctid = NULL;
+	ForeignServer *server = GetForeignServer(table->serverid);
+	bool		enabled = false;
 	ListCell   *lc;
-	MemoryContext oldcontext;
-	bool	   *nulls;
-	int			j;
-	int			r;
-	void      **row_values;
 
-	oldcontext = MemoryContextSwitchTo(fsstate->temp_cxt);
+	foreach(lc, server->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
 
-	values = (Datum *) palloc0(tupdesc->natts * sizeof(Datum));
-	nulls = (bool *) palloc(tupdesc->natts * sizeof(bool));
+		if (strcmp(def->defname, "early_dispatch") == 0)
+			enabled = defGetBoolean(def);
+	}
 
-	/* Initialize to nulls for any columns not present in result */
-	memset(nulls, true, tupdesc->natts * sizeof(bool));
+	foreach(lc, table->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
 
-	row_values = fsstate->conn.methods->fetch_row(fsstate->ch_cursor,
-		fsstate->retrieved_attrs, tupdesc, values, nulls);
+		if (strcmp(def->defname, "early_dispatch") == 0)
+			enabled = defGetBoolean(def);
+	}
 
-	/* in both cases (binary and non binary), NULL means end of tuples */
-	if (row_values == NULL)
-		goto cleanup;
+	return enabled;
+}
 
-	/* Parse clickhouse result */
-	if (!fsstate->conn.is_binary)
+/*
+ * Value of the cache_ttl option in the list, or ttl if it is not set.
+ */
+static int
+get_cache_ttl(List *options, int ttl)
+{
+	ListCell   *lc;
+
+	foreach(lc, options)
 	{
-		/*
-		 * for non binary connections we will get strings which we will try
-		 * convert using postgres functions.
-		 */
-		j = 0;
-		foreach(lc, fsstate->retrieved_attrs)
-		{
-			int		i = lfirst_int(lc);
-			char   *valstr = (char *) row_values[j];
+		DefElem    *def = (DefElem *) lfirst(lc);
 
-			Oid pgtype = TupleDescAttr(tupdesc, i - 1)->atttypid;
+		if (strcmp(def->defname, "cache_ttl") == 0)
+			ttl = atoi(defGetString(def));
+	}
 
-			/* that's the easy way to check array, otherwise use get_element_type on pgtype */
-			if (valstr && valstr[0] == '[')
-			{
-				size_t	pos = 0;
+	return ttl;
+}
 
-				while (valstr[pos] != '\0')
-				{
-					if (valstr[pos] == '[')
-						valstr[pos] = '{';
-					if (valstr[pos] == ']')
-						valstr[pos] = '}';
-					pos++;
-				}
-			}
-            else if (valstr && valstr[0] == '0' && valstr[1] == '0')
-            {
-                /* clickhouse supports such values which are invalid in postgres,
-                 * so we just set set as NULL
-                 */
-                if (strcmp(valstr, "0000-00-00 00:00:00") == 0)
-                    valstr = NULL;
-            }
-			else if (valstr && pgtype == VARCHAROID
-					&& TupleDescAttr(tupdesc, i - 1)->atttypmod != 0)
-			{
-				char *pos;
-				if ((pos = strstr(valstr, "\\0")) != NULL)
-					pos[0] = '\0';
-			}
+/*
+ * Seconds the result of the scan is kept in the result cache, the least of
+ * cache_ttl of the scanned tables.  0 means it is not cached, as well as
+ * results of parallel scans, which are read in slices.
+ */
+static int
+result_cache_ttl(ForeignScan *fsplan, EState *estate)
+{
+	int			ttl = -1;
+	int			rtindex = -1;
 
-			/* Apply the input function even to nulls, to support domains */
-			nulls[i - 1] = (valstr == NULL);
-			values[i - 1] = InputFunctionCall(&attinmeta->attinfuncs[i - 1],
-										  valstr,
-										  attinmeta->attioparams[i - 1],
-										  attinmeta->atttypmods[i - 1]);
-			j++;
-		}
-	}
+	if (!chfdw_result_cache_enabled() || fsplan->scan.plan.parallel_aware)
+		return 0;
 
-	MemoryContextSwitchTo(oldcontext);
+	while ((rtindex = bms_next_member(fsplan->fs_relids, rtindex)) >= 0)
+	{
+		RangeTblEntry *rte = rt_fetch(rtindex, estate->es_range_table);
+		ForeignTable *table;
+		int			table_ttl;
 
-	tuple = heap_form_tuple(tupdesc, values, nulls);
+		if (rte->rtekind != RTE_RELATION)
+			continue;
 
-	/*
-	 * If we have a CTID to return, install it in both t_self and t_ctid.
-	 * t_self is the normal place, but if the tuple is converted to a
+		table = GetForeignTable(rte->relid);
+		table_ttl = get_cache_ttl(GetForeignServer(table->serverid)->options, 0);
+		table_ttl = get_cache_ttl(table->options, table_ttl);
+
+		if (ttl < 0 || table_ttl < ttl)
+			ttl = table_ttl;
+	}
+
+	return Max(ttl, 0);
+}
+
+/*
+ * Find the Append or MergeAppend which has the child among its direct
+ * subplans.
+ */
+static Plan *
+find_parent_append(Plan *plan, Plan *child)
+{
+	List	   *subplans = NIL;
+	ListCell   *lc;
+	Plan	   *res;
+
+	if (plan == NULL)
+		return NULL;
+
+	switch (nodeTag(plan))
+	{
+		case T_Append:
+			subplans = ((Append *) plan)->appendplans;
+			if (list_member_ptr(subplans, child))
+				return plan;
+			break;
+		case T_MergeAppend:
+			subplans = ((MergeAppend *) plan)->mergeplans;
+			if (list_member_ptr(subplans, child))
+				return plan;
+			break;
+		case T_ModifyTable:
+			subplans = ((ModifyTable *) plan)->plans;
+			break;
+		case T_CustomScan:
+			subplans = ((CustomScan *) plan)->custom_plans;
+			break;
+		case T_SubqueryScan:
+			return find_parent_append(((SubqueryScan *) plan)->subplan, child);
+		default:
+			break;
+	}
+
+	foreach(lc, subplans)
+	{
+		if ((res = find_parent_append(lfirst(lc), child)) != NULL)
+			return res;
+	}
+
+	if ((res = find_parent_append(plan->lefttree, child)) != NULL)
+		return res;
+
+	return find_parent_append(plan->righttree, child);
+}
+
+static void
+forget_append_group(void *arg)
+{
+	append_groups = list_delete_ptr(append_groups, arg);
+}
+
+/*
+ * Add the scan to the group of its parent Append, if it has one.
+ */
+static void
+register_append_child(ForeignScanState *node)
+{
+	ChFdwScanState *fsstate = (ChFdwScanState *) node->fdw_state;
+	EState	   *estate = node->ss.ps.state;
+	PlannedStmt *pstmt = estate->es_plannedstmt;
+	ChFdwAppendGroup *group = NULL;
+	Plan	   *append;
+	MemoryContext oldcxt;
+	ListCell   *lc;
+
+	append = find_parent_append(pstmt->planTree, node->ss.ps.plan);
+	foreach(lc, pstmt->subplans)
+	{
+		if (append != NULL)
+			break;
+		append = find_parent_append(lfirst(lc), node->ss.ps.plan);
+	}
+
+	if (append == NULL)
+		return;
+
+	foreach(lc, append_groups)
+	{
+		ChFdwAppendGroup *g = (ChFdwAppendGroup *) lfirst(lc);
+
+		if (g->estate == estate && g->append == append)
+		{
+			group = g;
+			break;
+		}
+	}
+
+	if (group == NULL)
+	{
+		group = MemoryContextAllocZero(estate->es_query_cxt,
+									   sizeof(ChFdwAppendGroup));
+		group->estate = estate;
+		group->append = append;
+		group->callback.func = forget_append_group;
+		group->callback.arg = group;
+		MemoryContextRegisterResetCallback(estate->es_query_cxt,
+										   &group->callback);
+
+		oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+		append_groups = lappend(append_groups, group);
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	oldcxt = MemoryContextSwitchTo(estate->es_query_cxt);
+	group->scans = lappend(group->scans, fsstate);
+	MemoryContextSwitchTo(oldcxt);
+
+	fsstate->group = group;
+}
+
+/*
+ * Send the queries of the first scan and of the APPEND_SEND_AHEAD scans that
+ * follow it in the group, unless they have started already.  Their results
+ * are taken when the scans start.
+ */
+static void
+send_append_group(ChFdwAppendGroup *group, ChFdwScanState *first)
+{
+	ListCell   *lc;
+	int			nscans = -1;
+
+	foreach(lc, group->scans)
+	{
+		ChFdwScanState *scan = (ChFdwScanState *) lfirst(lc);
+		MemoryContext oldcxt;
+
+		if (scan == first)
+			nscans = 0;
+		if (nscans < 0)
+			continue;
+		if (nscans++ > APPEND_SEND_AHEAD)
+			break;
+
+		if (scan->ch_cursor != NULL || scan->pending != NULL)
+			continue;
+
+		oldcxt = MemoryContextSwitchTo(scan->batch_cxt);
+		scan->pending = scan->conn.methods->send_query(scan->conn.conn,
+													   scan->query, NIL);
+		MemoryContextSwitchTo(oldcxt);
+	}
+}
+
+/*
+ * Create a tuple from the specified row of the PGresult.
+ *
+ * rel is the local representation of the foreign table, attinmeta is
+ * conversion data for the rel's tupdesc, and retrieved_attrs is an
+ * integer list of the table column numbers present in the PGresult.
+ * temp_context is a working context that can be reset after each tuple.
+ */
+static HeapTuple
+fetch_tuple(ChFdwScanState *fsstate, TupleDesc tupdesc)
+{
+	AttInMetadata *attinmeta = fsstate->attinmeta;
+	Datum	   *values;
+	HeapTuple	tuple = NULL;
+	ItemPointer ctid = NULL;
+	ListCell   *lc;
+	MemoryContext oldcontext;
+	bool	   *nulls;
+	int			j;
+	int			r;
+	void      **row_values;
+
+	oldcontext = MemoryContextSwitchTo(fsstate->temp_cxt);
+
+	values = (Datum *) palloc0(tupdesc->natts * sizeof(Datum));
+	nulls = (bool *) palloc(tupdesc->natts * sizeof(bool));
+
+	/* Initialize to nulls for any columns not present in result */
+	memset(nulls, true, tupdesc->natts * sizeof(bool));
+
+	row_values = fsstate->conn.methods->fetch_row(fsstate->ch_cursor,
+		fsstate->retrieved_attrs, tupdesc, values, nulls);
+
+	/* in both cases (binary and non binary), NULL means end of tuples */
+	if (row_values == NULL)
+		goto cleanup;
+
+	/* Parse clickhouse result */
+	if (!fsstate->conn.is_binary)
+	{
+		/*
+		 * for non binary connections we will get strings which we will try
+		 * convert using postgres functions.
+		 */
+		j = 0;
+		foreach(lc, fsstate->retrieved_attrs)
+		{
+			int		i = lfirst_int(lc);
+			char   *valstr = (char *) row_values[j];
+
+			Oid pgtype = TupleDescAttr(tupdesc, i - 1)->atttypid;
+
+			/* that's the easy way to check array, otherwise use get_element_type on pgtype */
+			if (valstr && valstr[0] == '[')
+			{
+				size_t	pos = 0;
+
+				while (valstr[pos] != '\0')
+				{
+					if (valstr[pos] == '[')
+						valstr[pos] = '{';
+					if (valstr[pos] == ']')
+						valstr[pos] = '}';
+					pos++;
+				}
+			}
+            else if (valstr && valstr[0] == '0' && valstr[1] == '0')
+            {
+                /* clickhouse supports such values which are invalid in postgres,
+                 * so we just set set as NULL
+                 */
+                if (strcmp(valstr, "0000-00-00 00:00:00") == 0)
+                    valstr = NULL;
+            }
+			else if (valstr && pgtype == VARCHAROID
+					&& TupleDescAttr(tupdesc, i - 1)->atttypmod != 0)
+			{
+				char *pos;
+				if ((pos = strstr(valstr, "\\0")) != NULL)
+					pos[0] = '\0';
+			}
+
+			/* Apply the input function even to nulls, to support domains */
+			nulls[i - 1] = (valstr == NULL);
+			values[i - 1] = InputFunctionCall(&attinmeta->attinfuncs[i - 1],
+										  valstr,
+										  attinmeta->attioparams[i - 1],
+										  attinmeta->atttypmods[i - 1]);
+			j++;
+		}
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	tuple = heap_form_tuple(tupdesc, values, nulls);
+
+	/*
+	 * If we have a CTID to return, install it in both t_self and t_ctid.
+	 * t_self is the normal place, but if the tuple is converted to a
 	 * composite Datum, t_self will be lost; setting t_ctid allows CTID to be
 	 * preserved during EvalPlanQual re-evaluations (see ROW_MARK_COPY code).
 	 */
@@ -1066,6 +1842,50 @@ cleanup:
 	return tuple;
 }
 
+/*
+ * Fetch the next tuple, the time spent on making it is measured only when
+ * the scan is instrumented by EXPLAIN ANALYZE.
+ */
+static HeapTuple
+timed_fetch_tuple(ForeignScanState *node, TupleDesc tupdesc)
+{
+	ChFdwScanState *fsstate = (ChFdwScanState *) node->fdw_state;
+	HeapTuple	tup;
+	instr_time	start,
+				duration;
+
+	if (!node->ss.ps.instrument)
+		return fetch_tuple(fsstate, tupdesc);
+
+	INSTR_TIME_SET_CURRENT(start);
+	tup = fetch_tuple(fsstate, tupdesc);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	fsstate->stats.convert_time += INSTR_TIME_GET_MILLISEC(duration);
+
+	return tup;
+}
+
+/*
+ * Add the statistics of a remote query to the totals of the scan.
+ */
+static void
+add_query_stats(ch_query_stats *to, const ch_query_stats *from)
+{
+	to->first_block_time += from->first_block_time;
+	to->wait_time += from->wait_time;
+	to->decompress_time += from->decompress_time;
+	to->decode_time += from->decode_time;
+	to->convert_time += from->convert_time;
+	to->server_time += from->server_time;
+	to->bytes += from->bytes;
+	to->uncompressed_bytes += from->uncompressed_bytes;
+	to->blocks += from->blocks;
+	to->rows += from->rows;
+	to->server_rows_read += from->server_rows_read;
+	to->server_bytes_read += from->server_bytes_read;
+}
+
 /*
  * clickhouseIterateForeignScan
  *		Retrieve next row from the result set, or clear tuple slot to indicate
@@ -1077,20 +1897,21 @@ clickhouseIterateForeignScan(ForeignScanState *node)
 	HeapTuple		tup;
 	ChFdwScanState *fsstate = (ChFdwScanState *) node->fdw_state;
 	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
-	struct timeval time1,time2;
 	TupleDesc		tupdesc;
 
-	/* make query if needed */
-	if (fsstate->ch_cursor == NULL)
-	{
-		EState	*estate = node->ss.ps.state;
-		MemoryContext	old = MemoryContextSwitchTo(fsstate->batch_cxt);
-		fsstate->ch_cursor = fsstate->conn.methods->simple_query(fsstate->conn.conn,
-				fsstate->query);
+	/* rows read before a rescan are replayed first */
+	if (fsstate->replay && !tuplestore_ateof(fsstate->replay) &&
+		tuplestore_gettupleslot(fsstate->replay, true, false,
+								fsstate->replay_slot))
+		return ExecCopySlot(slot, fsstate->replay_slot);
 
-		time_used += fsstate->ch_cursor->request_time;
-		MemoryContextSwitchTo(old);
-	}
+	if (fsstate->eof_reached)
+		return ExecClearTuple(slot);
+
+	/* make query if needed */
+	if (fsstate->ch_cursor == NULL && fsstate->cached_rows == NULL &&
+		!send_remote_query(node))
+		return ExecClearTuple(slot);
 
 	if (fsstate->rel)
 		tupdesc = RelationGetDescr(fsstate->rel);
@@ -1100,13 +1921,45 @@ clickhouseIterateForeignScan(ForeignScanState *node)
 		tupdesc = node->ss.ss_ScanTupleSlot->tts_tupleDescriptor;
 	}
 
-	gettimeofday(&time1, NULL);
-	tup = fetch_tuple(fsstate, tupdesc);
-	gettimeofday(&time2, NULL);
-	time_used += time_diff(&time1, &time2);
+	if (fsstate->cached_rows != NULL)
+		tup = next_cached_tuple(fsstate);
+	else
+		tup = timed_fetch_tuple(node, tupdesc);
+
+	/* Parallel scan goes on with the next slice of the table */
+	while (tup == NULL && fsstate->pstate)
+	{
+		add_query_stats(&fsstate->stats, &fsstate->ch_cursor->stats);
+		MemoryContextDelete(fsstate->ch_cursor->memcxt);
+		fsstate->ch_cursor = NULL;
+		MemoryContextReset(fsstate->batch_cxt);
+
+		if (!send_remote_query(node))
+			break;
+		tup = timed_fetch_tuple(node, tupdesc);
+	}
 
 	if (tup == NULL)
+	{
+		fsstate->eof_reached = true;
+
+		/* the whole result is read, share it */
+		if (fsstate->cache_buf != NULL)
+		{
+			chfdw_result_cache_store(fsstate->user, fsstate->cache_key,
+									 fsstate->cache_buf->data,
+									 fsstate->cache_buf->len,
+									 fsstate->cache_ttl);
+			fsstate->cache_buf = NULL;
+		}
 		return ExecClearTuple(slot);
+	}
+
+	if (fsstate->replay)
+		tuplestore_puttuple(fsstate->replay, tup);
+
+	if (fsstate->cache_buf)
+		keep_cached_tuple(fsstate, tup);
 
 	/*
 	 * Return the next tuple.
@@ -1116,62 +1969,384 @@ clickhouseIterateForeignScan(ForeignScanState *node)
 }
 
 /*
- * clickhouseEndForeignScan
- *		Finish scanning foreign table and dispose objects used for this scan
+ * Send the remote query of the scan, or take the result of the query sent
+ * ahead of time.
+ *
+ * In a parallel scan the query reads the next slice of the table that is not
+ * taken by other participants yet.  Returns false when there are none left.
  */
-static void
-clickhouseEndForeignScan(ForeignScanState *node)
+static bool
+send_remote_query(ForeignScanState *node)
 {
 	ChFdwScanState *fsstate = (ChFdwScanState *) node->fdw_state;
+	MemoryContext	old = MemoryContextSwitchTo(fsstate->batch_cxt);
+	char		   *query = fsstate->query;
+	List		   *tables = NIL;
 
-	time_used = 0;
-	if (fsstate && fsstate->ch_cursor)
+	if (fsstate->group != NULL && list_length(fsstate->group->scans) > 1)
+		send_append_group(fsstate->group, fsstate);
+
+	if (fsstate->pending != NULL)
 	{
-		MemoryContextDelete(fsstate->ch_cursor->memcxt);
-		fsstate->ch_cursor = NULL;
+		fsstate->ch_cursor = fsstate->conn.methods->wait_query(
+				fsstate->conn.conn, fsstate->pending);
+		fsstate->pending = NULL;
 	}
-}
+	else
+	{
+		if (fsstate->pstate)
+		{
+			uint32		slice;
 
-/*
- * clickhousePlanForeignModify
- *		Plan an insert operation on a foreign table
- */
-static List *
-clickhousePlanForeignModify(PlannerInfo *root,
-                            ModifyTable *plan,
-                            Index resultRelation,
-                            int subplan_index)
-{
-	CmdType		operation = plan->operation;
-	RangeTblEntry *rte = planner_rt_fetch(resultRelation, root);
-	Relation	rel;
-	StringInfoData sql;
-	List	   *targetAttrs = NIL;
+			slice = pg_atomic_fetch_add_u32(&fsstate->pstate->next_slice, 1);
+			if (slice >= fsstate->nslices)
+			{
+				MemoryContextSwitchTo(old);
+				return false;
+			}
 
-	initStringInfo(&sql);
+			query = psprintf("%s%s%u", query, fsstate->slice_cond, slice);
+		}
 
-	/*
-	 * Core code already has some lock on each rel being planned, so we can
-	 * use NoLock here.
-	 */
-	rel = heap_open(rte->relid, NoLock);
-	if (operation == CMD_INSERT)
-	{
-		TupleDesc	tupdesc = RelationGetDescr(rel);
-		int			attnum;
+		query = bind_query_params(node, query, &tables);
 
-		for (attnum = 1; attnum <= tupdesc->natts; attnum++)
+		/* the result kept in the cache is read without sending the query */
+		if (fsstate->cache_ttl > 0 &&
+			(fsstate->cache_key = result_cache_key(fsstate, query, tables)) != NULL)
 		{
-			Form_pg_attribute attr = TupleDescAttr(tupdesc, attnum - 1);
-
-			if (!attr->attisdropped)
-				targetAttrs = lappend_int(targetAttrs, attnum);
+			fsstate->cached_rows = chfdw_result_cache_lookup(fsstate->user,
+					fsstate->cache_key, &fsstate->cached_len);
+			fsstate->cached_pos = 0;
+			if (fsstate->cached_rows != NULL)
+			{
+				MemoryContextSwitchTo(old);
+				return true;
+			}
+			fsstate->cache_buf = makeStringInfo();
 		}
+
+		if (tables != NIL)
+			fsstate->ch_cursor = fsstate->conn.methods->external_query(
+					fsstate->conn.conn, query, tables);
+		else
+			fsstate->ch_cursor = fsstate->conn.methods->simple_query(
+					fsstate->conn.conn, query);
 	}
 
-	/*
-	 * Construct the SQL command string.
-	 */
+	MemoryContextSwitchTo(old);
+
+	return true;
+}
+
+/*
+ * Substitute the current values of parameters into the query.  Array
+ * parameters sent as external tables and query parameters are added to
+ * *tables.
+ */
+static char *
+bind_query_params(ForeignScanState *node, char *query, List **tables)
+{
+	ChFdwScanState *fsstate = (ChFdwScanState *) node->fdw_state;
+
+	if (fsstate->numParams == 0)
+		return query;
+
+	process_query_params(node->ss.ps.ps_ExprContext,
+						 fsstate->param_exprs,
+						 fsstate->param_kinds,
+						 fsstate->param_values,
+						 fsstate->param_sets,
+						 !fsstate->conn.is_binary);
+	return substitute_query_params(query, fsstate->numParams,
+								   fsstate->param_kinds,
+								   fsstate->param_values,
+								   fsstate->param_sets,
+								   tables);
+}
+
+/*
+ * Key of the result in the result cache: the query, values of its query
+ * parameters and the shape of the rows made of the result.  Returns NULL if
+ * the query uses external tables, such results are not cached.
+ */
+static char *
+result_cache_key(ChFdwScanState *fsstate, const char *query, List *tables)
+{
+	StringInfoData key;
+	ListCell   *lc;
+
+	initStringInfo(&key);
+	appendStringInfoString(&key, query);
+
+	foreach(lc, tables)
+	{
+		ch_external_table *table = (ch_external_table *) lfirst(lc);
+		Oid			typoutput;
+		bool		typisvarlena;
+
+		if (!table->as_param)
+		{
+			pfree(key.data);
+			return NULL;
+		}
+
+		getTypeOutputInfo(table->typid, &typoutput, &typisvarlena);
+		appendStringInfo(&key, "\n%s = %s", table->name,
+						 OidOutputFunctionCall(typoutput, table->values[0]));
+	}
+
+	appendStringInfo(&key, "\n%d", fsstate->tupdesc->natts);
+	foreach(lc, fsstate->retrieved_attrs)
+	{
+		int			attnum = lfirst_int(lc);
+		Form_pg_attribute attr = TupleDescAttr(fsstate->tupdesc, attnum - 1);
+
+		appendStringInfo(&key, " %d:%u:%d", attnum, attr->atttypid,
+						 attr->atttypmod);
+	}
+
+	return key.data;
+}
+
+/*
+ * Add the row to the result to be cached.  Rows are kept as formed tuples,
+ * each one MAXALIGNed after its length.  Results larger than the cache can
+ * hold are not collected.
+ */
+static void
+keep_cached_tuple(ChFdwScanState *fsstate, HeapTuple tup)
+{
+	StringInfo	buf = fsstate->cache_buf;
+	uint32		len = tup->t_len;
+
+	if (buf->len + MAXALIGN(sizeof(uint32)) + MAXALIGN(len) >
+		chfdw_result_cache_max_size())
+	{
+		pfree(buf->data);
+		pfree(buf);
+		fsstate->cache_buf = NULL;
+		return;
+	}
+
+	appendBinaryStringInfo(buf, (char *) &len, sizeof(uint32));
+	while (buf->len % MAXIMUM_ALIGNOF != 0)
+		appendStringInfoChar(buf, '\0');
+
+	appendBinaryStringInfo(buf, (char *) tup->t_data, len);
+	while (buf->len % MAXIMUM_ALIGNOF != 0)
+		appendStringInfoChar(buf, '\0');
+}
+
+/*
+ * Next row of the cached result, or NULL at the end of it.  The tuple points
+ * into the cached rows.
+ */
+static HeapTuple
+next_cached_tuple(ChFdwScanState *fsstate)
+{
+	HeapTuple	tup;
+	uint32		len;
+
+	if (fsstate->cached_pos >= fsstate->cached_len)
+		return NULL;
+
+	memcpy(&len, fsstate->cached_rows + fsstate->cached_pos, sizeof(uint32));
+	fsstate->cached_pos += MAXALIGN(sizeof(uint32));
+
+	tup = (HeapTuple) palloc0(HEAPTUPLESIZE);
+	tup->t_len = len;
+	ItemPointerSetInvalid(&tup->t_self);
+	tup->t_tableOid = InvalidOid;
+	tup->t_data = (HeapTupleHeader) (fsstate->cached_rows + fsstate->cached_pos);
+	fsstate->cached_pos += MAXALIGN(len);
+
+	return tup;
+}
+
+/*
+ * Dispose the result of the remote query and the query sent ahead, if any.
+ */
+static void
+release_remote_query(ChFdwScanState *fsstate)
+{
+	if (fsstate->ch_cursor)
+	{
+		add_query_stats(&fsstate->stats, &fsstate->ch_cursor->stats);
+		MemoryContextDelete(fsstate->ch_cursor->memcxt);
+		fsstate->ch_cursor = NULL;
+		MemoryContextReset(fsstate->batch_cxt);
+	}
+	else if (fsstate->pending)
+	{
+		/* the result was never taken, abandon the query */
+		fsstate->pending = NULL;
+		MemoryContextReset(fsstate->batch_cxt);
+	}
+	else if (fsstate->cached_rows)
+	{
+		fsstate->cached_rows = NULL;
+		MemoryContextReset(fsstate->batch_cxt);
+	}
+
+	/* rows being collected for the cache were in batch_cxt */
+	fsstate->cache_buf = NULL;
+	fsstate->eof_reached = false;
+}
+
+/*
+ * clickhouseReScanForeignScan
+ *		Restart the scan.
+ */
+static void
+clickhouseReScanForeignScan(ForeignScanState *node)
+{
+	ChFdwScanState *fsstate = (ChFdwScanState *) node->fdw_state;
+
+	/*
+	 * Without changed parameters the result is the same, so the rows read so
+	 * far are replayed and the rest is read from the remote query still open.
+	 */
+	if (fsstate->replay && node->ss.ps.chgParam == NULL)
+	{
+		tuplestore_rescan(fsstate->replay);
+		return;
+	}
+
+	if (fsstate->replay)
+		tuplestore_clear(fsstate->replay);
+	release_remote_query(fsstate);
+}
+
+/*
+ * clickhouseEndForeignScan
+ *		Finish scanning foreign table and dispose objects used for this scan
+ */
+static void
+clickhouseEndForeignScan(ForeignScanState *node)
+{
+	ChFdwScanState *fsstate = (ChFdwScanState *) node->fdw_state;
+
+	if (fsstate == NULL)
+		return;
+
+	release_remote_query(fsstate);
+	if (fsstate->replay)
+	{
+		tuplestore_end(fsstate->replay);
+		ExecDropSingleTupleTableSlot(fsstate->replay_slot);
+		fsstate->replay = NULL;
+	}
+}
+
+/*
+ * clickhouseIsForeignScanParallelSafe
+ *		Scans of foreign tables can run in parallel workers.
+ *
+ * A scan doesn't depend on the state of the backend: each worker opens its
+ * own connection with the user mapping of the query, and parameters from
+ * the leader are passed as usual.  Joins and aggregates pushed down are
+ * built only from the base relations, so they are safe when all of them
+ * are.
+ */
+static bool
+clickhouseIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel,
+                                    RangeTblEntry *rte)
+{
+	return IS_SIMPLE_REL(rel) && rte->rtekind == RTE_RELATION;
+}
+
+/*
+ * clickhouseEstimateDSMForeignScan
+ *		Estimate the size of shared state of a parallel scan
+ */
+static Size
+clickhouseEstimateDSMForeignScan(ForeignScanState *node,
+                                 ParallelContext *pcxt)
+{
+	return sizeof(ChFdwParallelState);
+}
+
+/*
+ * clickhouseInitializeDSMForeignScan
+ *		Initialize shared state of a parallel scan
+ */
+static void
+clickhouseInitializeDSMForeignScan(ForeignScanState *node,
+                                   ParallelContext *pcxt, void *coordinate)
+{
+	ChFdwScanState	   *fsstate = (ChFdwScanState *) node->fdw_state;
+	ChFdwParallelState *pstate = (ChFdwParallelState *) coordinate;
+
+	pg_atomic_init_u32(&pstate->next_slice, 0);
+	fsstate->pstate = pstate;
+}
+
+/*
+ * clickhouseReInitializeDSMForeignScan
+ *		Reset shared state of a parallel scan before a rescan
+ */
+static void
+clickhouseReInitializeDSMForeignScan(ForeignScanState *node,
+                                     ParallelContext *pcxt, void *coordinate)
+{
+	ChFdwParallelState *pstate = (ChFdwParallelState *) coordinate;
+
+	pg_atomic_write_u32(&pstate->next_slice, 0);
+}
+
+/*
+ * clickhouseInitializeWorkerForeignScan
+ *		Attach a parallel worker to the shared state of the scan
+ */
+static void
+clickhouseInitializeWorkerForeignScan(ForeignScanState *node,
+                                      shm_toc *toc, void *coordinate)
+{
+	ChFdwScanState *fsstate = (ChFdwScanState *) node->fdw_state;
+
+	fsstate->pstate = (ChFdwParallelState *) coordinate;
+}
+
+/*
+ * clickhousePlanForeignModify
+ *		Plan an insert operation on a foreign table
+ */
+static List *
+clickhousePlanForeignModify(PlannerInfo *root,
+                            ModifyTable *plan,
+                            Index resultRelation,
+                            int subplan_index)
+{
+	CmdType		operation = plan->operation;
+	RangeTblEntry *rte = planner_rt_fetch(resultRelation, root);
+	Relation	rel;
+	StringInfoData sql;
+	List	   *targetAttrs = NIL;
+
+	initStringInfo(&sql);
+
+	/*
+	 * Core code already has some lock on each rel being planned, so we can
+	 * use NoLock here.
+	 */
+	rel = heap_open(rte->relid, NoLock);
+	if (operation == CMD_INSERT)
+	{
+		TupleDesc	tupdesc = RelationGetDescr(rel);
+		int			attnum;
+
+		for (attnum = 1; attnum <= tupdesc->natts; attnum++)
+		{
+			Form_pg_attribute attr = TupleDescAttr(tupdesc, attnum - 1);
+
+			if (!attr->attisdropped)
+				targetAttrs = lappend_int(targetAttrs, attnum);
+		}
+	}
+
+	/*
+	 * Construct the SQL command string.
+	 */
 	char *table_name;
 
 	switch (operation)
@@ -1425,12 +2600,60 @@ clickhouseExplainForeignScan(ForeignScanState *node, ExplainState *es)
 	 */
 	if (es->verbose)
 	{
+		int		nslices = intVal(list_nth(fdw_private, FdwScanPrivateSlices));
+
 		sql = strVal(list_nth(fdw_private, FdwScanPrivateSelectSql));
 		ExplainPropertyText("Remote SQL", sql, es);
+
+		/* Parallel scan reads the table by slices */
+		if (nslices > 0)
+			ExplainPropertyInteger("Remote Slices", NULL, nslices, es);
+	}
+
+	if (es->analyze && node->fdw_state)
+		explain_query_stats((ChFdwScanState *) node->fdw_state, es);
+}
+
+/*
+ * Show the statistics of the remote queries of the scan, summed over all
+ * its loops.  Times are shown only with TIMING, and numbers the protocol
+ * does not provide are omitted.
+ */
+static void
+explain_query_stats(ChFdwScanState *fsstate, ExplainState *es)
+{
+	ch_query_stats stats = fsstate->stats;
+
+	if (fsstate->ch_cursor)
+		add_query_stats(&stats, &fsstate->ch_cursor->stats);
+
+	if (es->timing)
+	{
+		ExplainPropertyFloat("Remote First Block Time", "ms",
+							 stats.first_block_time, 3, es);
+		ExplainPropertyFloat("Remote Wait Time", "ms", stats.wait_time, 3, es);
+		if (stats.decompress_time > 0)
+			ExplainPropertyFloat("Remote Decompress Time", "ms",
+								 stats.decompress_time, 3, es);
+		if (fsstate->conn.is_binary)
+			ExplainPropertyFloat("Remote Decode Time", "ms",
+								 stats.decode_time, 3, es);
+		ExplainPropertyFloat("Tuple Conversion Time", "ms",
+							 stats.convert_time, 3, es);
+		if (stats.server_time > 0)
+			ExplainPropertyFloat("Server Elapsed Time", "ms",
+								 stats.server_time, 3, es);
 	}
 
-	if (es->timing && time_used > 0)
-		ExplainPropertyFloat("FDW Time", "ms", time_used, 3, es);
+	ExplainPropertyInteger("Remote Rows", NULL, stats.rows, es);
+	ExplainPropertyInteger("Remote Blocks", NULL, stats.blocks, es);
+	ExplainPropertyInteger("Remote Bytes", NULL, stats.bytes, es);
+	if (stats.uncompressed_bytes != stats.bytes)
+		ExplainPropertyInteger("Remote Uncompressed Bytes", NULL,
+							   stats.uncompressed_bytes, es);
+	ExplainPropertyInteger("Server Rows Read", NULL, stats.server_rows_read, es);
+	ExplainPropertyInteger("Server Bytes Read", NULL,
+						   stats.server_bytes_read, es);
 }
 
 /*
@@ -1531,30 +2754,12 @@ static void
 prepare_query_params(PlanState *node,
                      List *fdw_exprs,
                      int numParams,
-                     FmgrInfo **param_flinfo,
                      List **param_exprs,
-                     const char ***param_values)
+                     const char ***param_values,
+                     ChParamSet ***param_sets)
 {
-	int			i;
-	ListCell   *lc;
-
 	Assert(numParams > 0);
 
-	/* Prepare for output conversion of parameters used in remote query. */
-	*param_flinfo = (FmgrInfo *) palloc0(sizeof(FmgrInfo) * numParams);
-
-	i = 0;
-	foreach (lc, fdw_exprs)
-	{
-		Node	   *param_expr = (Node *) lfirst(lc);
-		Oid			typefnoid;
-		bool		isvarlena;
-
-		getTypeOutputInfo(exprType(param_expr), &typefnoid, &isvarlena);
-		fmgr_info(typefnoid, &(*param_flinfo)[i]);
-		i++;
-	}
-
 	/*
 	 * Prepare remote-parameter expressions for evaluation.  (Note: in
 	 * practice, we expect that all these expressions will be just Params, so
@@ -1565,84 +2770,525 @@ prepare_query_params(PlanState *node,
 	 */
 	*param_exprs = ExecInitExprList(fdw_exprs, node);
 
-	/* Allocate buffer for text form of query parameters. */
+	/* Allocate buffer for literals of query parameters. */
 	*param_values = (const char **) palloc0(numParams * sizeof(char *));
+	*param_sets = (ChParamSet **) palloc0(numParams * sizeof(ChParamSet *));
 }
 
 /*
- * clickhouseAnalyzeForeignTable
- *		Test whether analyzing this foreign table is supported
+ * Construct ClickHouse literals of the parameters used in remote query.
+ *
+ * With typed_params, scalar values are also prepared to be sent as query
+ * parameters, so the query text stays the same for all values and
+ * ClickHouse doesn't parse them from the query.  LIMIT takes only literals.
+ *
+ * The local Limit node is removed when LIMIT is pushed down, so negative
+ * values are rejected here as ExecLimit does.  ClickHouse would return the
+ * last rows instead.
  */
-static bool
-clickhouseAnalyzeForeignTable(Relation relation,
-                              AcquireSampleRowsFunc *func,
-                              BlockNumber *totalpages)
+static void
+process_query_params(ExprContext *econtext,
+                     List *param_exprs,
+                     List *param_kinds,
+                     const char **param_values,
+                     ChParamSet **param_sets,
+                     bool typed_params)
 {
-	*func = clickhouseAcquireSampleRowsFunc;
-	return true;
+	int			i;
+	ListCell   *lc,
+			   *lc2;
+
+	i = 0;
+	forboth(lc, param_exprs, lc2, param_kinds)
+	{
+		ExprState  *expr_state = (ExprState *) lfirst(lc);
+		ChParamKind	kind = (ChParamKind) lfirst_int(lc2);
+		Datum		expr_value;
+		bool		isNull;
+		StringInfoData	buf;
+		Oid			type = exprType((Node *) expr_state->expr);
+
+		/* Evaluate the parameter expression */
+		expr_value = ExecEvalExpr(expr_state, econtext, &isNull);
+
+		if (kind == CH_PARAM_OFFSET && DatumGetInt64(expr_value) < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_ROW_COUNT_IN_RESULT_OFFSET_CLAUSE),
+					 errmsg("OFFSET must not be negative")));
+		if (kind == CH_PARAM_LIMIT && DatumGetInt64(expr_value) < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_ROW_COUNT_IN_LIMIT_CLAUSE),
+					 errmsg("LIMIT must not be negative")));
+
+		initStringInfo(&buf);
+		chfdw_deparse_literal(&buf, expr_value, isNull, type,
+							  exprTypmod((Node *) expr_state->expr));
+		param_values[i] = buf.data;
+
+		if (kind == CH_PARAM_SET)
+			param_sets[i] = make_param_set(i + 1, expr_value, isNull, type);
+		else if (typed_params && kind == CH_PARAM_VALUE && !isNull &&
+				 !type_is_array(type) &&
+				 chfdw_external_type_name(type) != NULL)
+			param_sets[i] = make_typed_param(i + 1, expr_value, type);
+		else
+			param_sets[i] = NULL;
+		i++;
+	}
 }
 
 /*
- * Acquire a random sample of rows from foreign table managed by postgres_fdw.
- *
- * We fetch the whole table from the remote side and pick out some sample rows.
- *
- * Selected rows are returned in the caller-allocated array rows[],
- * which must have at least targrows entries.
- * The actual number of rows selected is returned as the function result.
- * We also count the total number of rows in the table and return it into
- * *totalrows.  Note that *totaldeadrows is always set to 0.
+ * Make the value of array parameter used as a set.
  *
- * Note that the returned list of rows is not always in order by physical
- * position in the table.  Therefore, correlation estimates derived later
- * may be meaningless, but it's OK because we don't use the estimates
- * currently (the planner only pays attention to correlation for indexscans).
+ * ClickHouse doesn't take NULLs from the set into account, and an empty or
+ * NULL array makes the condition false rather than NULL.  Sets are only used
+ * by top-level conditions, where both are the same (see
+ * deparseScalarArrayOpExpr).
  */
-static int
-clickhouseAcquireSampleRowsFunc(Relation relation, int elevel,
-                                HeapTuple *rows, int targrows,
-                                double *totalrows,
-                                double *totaldeadrows)
+static ChParamSet *
+make_param_set(int paramno, Datum value, bool isnull, Oid arraytype)
 {
-	return 0;
-}
+	ChParamSet *set = palloc0(sizeof(ChParamSet));
+	Oid			elemtype = get_element_type(arraytype);
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	bool		has_nulls = false;
+	StringInfoData	buf;
+
+	if (isnull)
+	{
+		set->literal = "(NULL)";
+		return set;
+	}
 
-static bool
-is_simple_join_clause(Expr *expr)
-{
-	if (IsA(expr, RestrictInfo))
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+	deconstruct_array(DatumGetArrayTypeP(value), elemtype, typlen, typbyval,
+					  typalign, &elems, &nulls, &nelems);
+
+	for (int i = 0; i < nelems; i++)
+		has_nulls |= nulls[i];
+
+	if (nelems >= EXTERNAL_TABLE_MIN_VALUES && !has_nulls &&
+		chfdw_external_type_name(elemtype) != NULL)
 	{
-		expr = ((RestrictInfo *) expr)->clause;
+		set->table = palloc0(sizeof(ch_external_table));
+		set->table->name = psprintf("_pg_param_%d", paramno);
+		set->table->typid = elemtype;
+		set->table->nvalues = nelems;
+		set->table->values = elems;
+		return set;
 	}
 
-	if (IsA(expr, OpExpr))
+	initStringInfo(&buf);
+	appendStringInfoChar(&buf, '(');
+	for (int i = 0; i < nelems; i++)
 	{
-		OpExpr	*opexpr = (OpExpr *) expr;
-		if (chfdw_is_equal_op(opexpr->opno) == 1
-				&& list_length(opexpr->args) == 2
-				&& IsA(list_nth(opexpr->args, 0), Var)
-				&& IsA(list_nth(opexpr->args, 1), Var))
-			return true;
+		if (i > 0)
+			appendStringInfoString(&buf, ", ");
+		chfdw_deparse_literal(&buf, elems[i], nulls[i], elemtype, -1);
 	}
-	return false;
+	if (nelems == 0)
+		appendStringInfoString(&buf, "NULL");
+	appendStringInfoChar(&buf, ')');
+	set->literal = buf.data;
+
+	return set;
 }
 
-static List *
-extract_join_equals(List *conds, List **to)
+/*
+ * Make the value of scalar parameter sent as query parameter {name:Type}.
+ */
+static ChParamSet *
+make_typed_param(int paramno, Datum value, Oid type)
 {
-	ListCell *lc;
-	List *res = NIL;
-	foreach (lc, conds)
-	{
-		Expr	   *expr = (Expr *) lfirst(lc);
-		if (is_simple_join_clause(expr))
-			*to = lappend(*to, expr);
+	ChParamSet *set = palloc0(sizeof(ChParamSet));
+	int16		typlen;
+	bool		typbyval;
+
+	get_typlenbyval(type, &typlen, &typbyval);
+
+	set->table = palloc0(sizeof(ch_external_table));
+	set->table->name = psprintf("_pg_param_%d", paramno);
+	set->table->typid = type;
+	set->table->nvalues = 1;
+	set->table->values = palloc(sizeof(Datum));
+	set->table->values[0] = datumCopy(value, typbyval, typlen);
+	set->table->as_param = true;
+
+	return set;
+}
+
+/*
+ * Replace $N placeholders in the remote query by values of parameters.
+ *
+ * Placeholders are not looked for in string literals and quoted identifiers.
+ * A placeholder of a set is replaced by the set made from the array
+ * parameter, external tables used for that are added to *tables.  Scalar
+ * parameters prepared as query parameters are replaced by {name:Type} and
+ * added to *tables too.
+ */
+static char *
+substitute_query_params(const char *query, int numParams,
+                        List *param_kinds,
+                        const char **param_values,
+                        ChParamSet **param_sets,
+                        List **tables)
+{
+	StringInfoData	buf;
+	const char	   *pos = query;
+	char			quote = '\0';
+
+	initStringInfo(&buf);
+	while (*pos)
+	{
+		if (quote)
+		{
+			if (*pos == '\\' && pos[1] != '\0')
+			{
+				appendBinaryStringInfo(&buf, pos, 2);
+				pos += 2;
+				continue;
+			}
+			else if (*pos == quote)
+				quote = '\0';
+		}
+		else if (*pos == '\'' || *pos == '"' || *pos == '`')
+			quote = *pos;
+		else if (*pos == '$' && isdigit((unsigned char) pos[1]))
+		{
+			char   *end;
+			long	paramno = strtol(pos + 1, &end, 10);
+
+			if (paramno < 1 || paramno > numParams)
+				elog(ERROR, "clickhouse_fdw: invalid parameter number %ld in remote query",
+					 paramno);
+
+			if (list_nth_int(param_kinds, paramno - 1) == CH_PARAM_SET)
+			{
+				ChParamSet *set = param_sets[paramno - 1];
+
+				if (set == NULL || (set->table && set->table->as_param))
+					elog(ERROR, "clickhouse_fdw: parameter %ld is not an array",
+						 paramno);
+
+				if (set->table)
+				{
+					appendStringInfoString(&buf, set->table->name);
+					*tables = list_append_unique_ptr(*tables, set->table);
+				}
+				else
+					appendStringInfoString(&buf, set->literal);
+			}
+			else if (param_sets[paramno - 1] &&
+					 param_sets[paramno - 1]->table &&
+					 param_sets[paramno - 1]->table->as_param)
+			{
+				ch_external_table *param = param_sets[paramno - 1]->table;
+
+				appendStringInfo(&buf, "{%s:%s}", param->name,
+								 chfdw_external_type_name(param->typid));
+				*tables = list_append_unique_ptr(*tables, param);
+			}
+			else
+				appendStringInfoString(&buf, param_values[paramno - 1]);
+			pos = end;
+			continue;
+		}
+
+		appendStringInfoChar(&buf, *pos);
+		pos++;
+	}
+
+	return buf.data;
+}
+
+/*
+ * clickhouseAnalyzeForeignTable
+ *		Test whether analyzing this foreign table is supported
+ */
+static bool
+clickhouseAnalyzeForeignTable(Relation relation,
+                              AcquireSampleRowsFunc *func,
+                              BlockNumber *totalpages)
+{
+	*func = clickhouseAcquireSampleRowsFunc;
+	return true;
+}
+
+/*
+ * Fetch number of rows and sampling key of the remote table.
+ *
+ * Returns -1 in *totalrows if the engine of the remote table doesn't track
+ * the number of rows.
+ */
+static void
+get_remote_table_info(ch_connection conn, Relation relation,
+					  double *totalrows, bool *has_sampling_key)
+{
+	StringInfoData	sql;
+	ch_cursor	   *cursor;
+	char		  **row;
+
+	*totalrows = -1;
+	*has_sampling_key = false;
+
+	initStringInfo(&sql);
+	chfdw_deparse_analyze_info_sql(&sql, relation);
+	cursor = conn.methods->simple_query(conn.conn, sql.data);
+
+	row = (char **) conn.methods->fetch_row(cursor, list_make2_int(1, 2),
+			NULL, NULL, NULL);
+	if (row != NULL)
+	{
+		char   *rows = row[0],
+			   *sampling_key = row[1];
+
+		if (conn.is_binary)
+		{
+			rows = TextDatumGetCString(PointerGetDatum(rows));
+			sampling_key = TextDatumGetCString(PointerGetDatum(sampling_key));
+		}
+
+		if (rows && rows[0] != '\0')
+			*totalrows = strtod(rows, NULL);
+
+		*has_sampling_key = (sampling_key && sampling_key[0] != '\0');
+	}
+
+	MemoryContextDelete(cursor->memcxt);
+
+	if (*totalrows < 0)
+	{
+		/* count() is cheap for most of engines */
+		resetStringInfo(&sql);
+		appendStringInfoString(&sql, "SELECT toString(count()) FROM ");
+		chfdw_deparse_relation_name(&sql, relation);
+		cursor = conn.methods->simple_query(conn.conn, sql.data);
+
+		row = (char **) conn.methods->fetch_row(cursor, list_make1_int(1),
+				NULL, NULL, NULL);
+		if (row != NULL && row[0] != NULL)
+		{
+			char *rows = row[0];
+
+			if (conn.is_binary)
+				rows = TextDatumGetCString(PointerGetDatum(rows));
+			*totalrows = strtod(rows, NULL);
+		}
+		MemoryContextDelete(cursor->memcxt);
+	}
+
+	pfree(sql.data);
+}
+
+/*
+ * Acquire a random sample of rows from foreign table managed by clickhouse_fdw.
+ *
+ * We get the number of rows in the remote table from system.tables and ask
+ * the remote side to read only the part of the table that is enough
+ * for targrows rows.  If the table has a sampling key SAMPLE clause is used,
+ * otherwise rows are filtered by rand().  The rows are converted by the
+ * same functions that are used in foreign scans.
+ *
+ * Selected rows are returned in the caller-allocated array rows[],
+ * which must have at least targrows entries.
+ * The actual number of rows selected is returned as the function result.
+ * We also return the total number of rows in the table into *totalrows.
+ * Note that *totaldeadrows is always set to 0.
+ *
+ * Note that the returned list of rows is not always in order by physical
+ * position in the table.  Therefore, correlation estimates derived later
+ * may be meaningless, but it's OK because we don't use the estimates
+ * currently (the planner only pays attention to correlation for indexscans).
+ */
+static int
+clickhouseAcquireSampleRowsFunc(Relation relation, int elevel,
+                                HeapTuple *rows, int targrows,
+                                double *totalrows,
+                                double *totaldeadrows)
+{
+	ForeignTable   *table;
+	UserMapping	   *user;
+	ChFdwScanState	fsstate;
+	StringInfoData	sql;
+	TupleDesc		tupdesc = RelationGetDescr(relation);
+	double			samplerows;
+	bool			has_sampling_key;
+	int				numrows = 0;
+
+	table = GetForeignTable(RelationGetRelid(relation));
+	user = GetUserMapping(relation->rd_rel->relowner, table->serverid);
+
+	memset(&fsstate, 0, sizeof(fsstate));
+	fsstate.rel = relation;
+	fsstate.conn = chfdw_get_connection(user);
+	fsstate.attinmeta = TupleDescGetAttInMetadata(tupdesc);
+	fsstate.temp_cxt = AllocSetContextCreate(CurrentMemoryContext,
+	                    "clickhouse_fdw temporary data",
+	                    ALLOCSET_SMALL_SIZES);
+
+	get_remote_table_info(fsstate.conn, relation, totalrows, &has_sampling_key);
+	*totaldeadrows = 0;
+
+	/*
+	 * Ask for a bit more rows than we need, SAMPLE and rand() give only
+	 * approximate number of rows.
+	 */
+	samplerows = targrows * 1.2;
+
+	initStringInfo(&sql);
+	chfdw_deparse_analyze_sql(&sql, relation, samplerows, *totalrows,
+							  has_sampling_key, targrows,
+							  &fsstate.retrieved_attrs);
+
+	fsstate.ch_cursor = fsstate.conn.methods->simple_query(fsstate.conn.conn,
+			sql.data);
+
+	while (numrows < targrows)
+	{
+		HeapTuple	tup;
+
+		vacuum_delay_point();
+
+		tup = fetch_tuple(&fsstate, tupdesc);
+		if (tup == NULL)
+			break;
+
+		rows[numrows++] = tup;
+	}
+
+	MemoryContextDelete(fsstate.ch_cursor->memcxt);
+	MemoryContextDelete(fsstate.temp_cxt);
+
+	/* we could get less rows than expected from SAMPLE */
+	if (*totalrows < numrows)
+		*totalrows = numrows;
+
+	ereport(elevel,
+			(errmsg("\"%s\": table contains %.0f rows, %d rows in sample",
+					RelationGetRelationName(relation),
+					*totalrows, numrows)));
+
+	return numrows;
+}
+
+static bool
+is_simple_join_clause(Expr *expr)
+{
+	if (IsA(expr, RestrictInfo))
+	{
+		expr = ((RestrictInfo *) expr)->clause;
+	}
+
+	if (IsA(expr, OpExpr))
+	{
+		OpExpr	*opexpr = (OpExpr *) expr;
+		if (chfdw_is_equal_op(opexpr->opno) == 1
+				&& list_length(opexpr->args) == 2
+				&& IsA(list_nth(opexpr->args, 0), Var)
+				&& IsA(list_nth(opexpr->args, 1), Var))
+			return true;
+	}
+	return false;
+}
+
+static List *
+extract_join_equals(List *conds, List **to)
+{
+	ListCell *lc;
+	List *res = NIL;
+	foreach (lc, conds)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc);
+		if (is_simple_join_clause(expr))
+			*to = lappend(*to, expr);
 		else
 			res = lappend(res, expr);
 	}
 	return res;
 }
 
+/*
+ * Check that the target list of a semi-join doesn't reference the inner
+ * relation.
+ */
+static bool
+semijoin_target_ok(RelOptInfo *joinrel, RelOptInfo *innerrel)
+{
+	ListCell   *lc;
+
+	foreach(lc, joinrel->reltarget->exprs)
+	{
+		Relids		relids = pull_varnos((Node *) lfirst(lc));
+
+		if (bms_overlap(relids, innerrel->relids))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Find the clause that joins the key column of the dictionary table innerrel
+ * with an expression of outerrel, and return it with the expression in
+ * *key.  Such joins are replaced by lookups in the dictionary, which work
+ * for inner joins and for left joins that have no other join clauses.
+ */
+static RestrictInfo *
+find_dictionary_key(RelOptInfo *outerrel, RelOptInfo *innerrel,
+					List *clauses, Expr **key)
+{
+	CHFdwRelationInfo *fpinfo_i = (CHFdwRelationInfo *) innerrel->fdw_private;
+	ListCell   *lc;
+
+	if (!IS_SIMPLE_REL(innerrel) || fpinfo_i->ch_dictionary == NULL)
+		return NULL;
+
+	foreach (lc, clauses)
+	{
+		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+		OpExpr	   *opexpr = (OpExpr *) rinfo->clause;
+		int			i;
+
+		if (!IsA(opexpr, OpExpr) || list_length(opexpr->args) != 2 ||
+				chfdw_is_equal_op(opexpr->opno) != 1)
+			continue;
+
+		for (i = 0; i < 2; i++)
+		{
+			Expr	   *expr = (Expr *) list_nth(opexpr->args, i);
+			Expr	   *other = (Expr *) list_nth(opexpr->args, 1 - i);
+			Var		   *var;
+
+			while (IsA(expr, RelabelType))
+				expr = ((RelabelType *) expr)->arg;
+
+			if (!IsA(expr, Var))
+				continue;
+
+			var = (Var *) expr;
+			if (var->varno != innerrel->relid || var->varlevelsup != 0 ||
+					var->varattno != fpinfo_i->ch_dictionary_key)
+				continue;
+
+			/* the key is computed once per row for every lookup */
+			if (!bms_is_subset(i == 0 ? rinfo->right_relids : rinfo->left_relids,
+							   outerrel->relids) ||
+					contain_volatile_functions((Node *) other))
+				continue;
+
+			*key = other;
+			return rinfo;
+		}
+	}
+
+	return NULL;
+}
+
 /*
  * Assess whether the join between inner and outer relations can be pushed down
  * to the foreign server. As a side effect, save information we obtain in this
@@ -1660,12 +3306,23 @@ foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 	List	   *joinclauses;
 
 	/*
-	 * We support pushing down INNER, LEFT, RIGHT and FULL OUTER joins.
-	 * Constructing queries representing SEMI and ANTI joins is hard, hence
-	 * not considered right now.
+	 * We support pushing down INNER, LEFT, RIGHT and FULL OUTER joins, and
+	 * SEMI and ANTI joins which ClickHouse executes as LEFT SEMI and LEFT
+	 * ANTI joins.
 	 */
 	if (jointype != JOIN_INNER && jointype != JOIN_LEFT &&
-	        jointype != JOIN_RIGHT && jointype != JOIN_FULL)
+	        jointype != JOIN_RIGHT && jointype != JOIN_FULL &&
+	        jointype != JOIN_SEMI && jointype != JOIN_ANTI)
+	{
+		return false;
+	}
+
+	/*
+	 * Columns of the inner side of a semi-join are not available above the
+	 * join, we can't push it down if they are referenced there.
+	 */
+	if (jointype == JOIN_SEMI &&
+	        !semijoin_target_ok(joinrel, innerrel))
 	{
 		return false;
 	}
@@ -1683,6 +3340,42 @@ foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 		return false;
 	}
 
+	/*
+	 * Dictionary tables are looked up only from the inner side of a join, an
+	 * inner join can be turned around for that.  Lookups are not pushed down
+	 * on the inner side of a join or on the outer side of RIGHT and FULL
+	 * joins, since inner joins with dictionaries filter the rows of the whole
+	 * query (see appendDictionaryConds).
+	 */
+	if (jointype == JOIN_INNER &&
+			(fpinfo_o->ch_dictionary || fpinfo_o->ch_dict_rels) &&
+			!(fpinfo_i->ch_dictionary || fpinfo_i->ch_dict_rels))
+	{
+		RelOptInfo *rel = outerrel;
+		CHFdwRelationInfo *rel_fpinfo = fpinfo_o;
+
+		outerrel = innerrel;
+		innerrel = rel;
+		fpinfo_o = fpinfo_i;
+		fpinfo_i = rel_fpinfo;
+	}
+
+	if (fpinfo_i->ch_dict_rels ||
+			(fpinfo_o->ch_dict_rels &&
+			 (jointype == JOIN_RIGHT || jointype == JOIN_FULL)))
+	{
+		return false;
+	}
+
+	/*
+	 * SAMPLE applies to the whole query, not to a joined table, so sampled
+	 * tables are joined locally.
+	 */
+	if (fpinfo_o->ch_sample || fpinfo_i->ch_sample)
+	{
+		return false;
+	}
+
 	/*
 	 * If joining relations have local conditions, those conditions are
 	 * required to be applied before joining the relations. Hence the join can
@@ -1724,7 +3417,7 @@ foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 		bool		is_remote_clause = chfdw_is_foreign_expr(root, joinrel,
 													   rinfo->clause);
 
-		if (IS_OUTER_JOIN(jointype) &&
+		if ((IS_OUTER_JOIN(jointype) || jointype == JOIN_SEMI) &&
 			!RINFO_IS_PUSHED_DOWN(rinfo, joinrel->relids))
 		{
 			if (!is_remote_clause)
@@ -1766,6 +3459,33 @@ foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 		}
 	}
 
+	/*
+	 * Replace the dictionary table by lookups in the dictionary if it's
+	 * joined by its key.  A left join can't have other conditions on the
+	 * dictionary, those would decide whether the row is found.
+	 */
+	fpinfo->ch_dict_key = NULL;
+	if (jointype == JOIN_INNER)
+	{
+		RestrictInfo *rinfo = find_dictionary_key(outerrel, innerrel,
+												  fpinfo->remote_conds,
+												  &fpinfo->ch_dict_key);
+
+		if (rinfo)
+			fpinfo->remote_conds = list_delete_ptr(fpinfo->remote_conds, rinfo);
+	}
+	else if (jointype == JOIN_LEFT && list_length(joinclauses) == 1 &&
+			 fpinfo_i->remote_conds == NIL &&
+			 find_dictionary_key(outerrel, innerrel, joinclauses,
+								 &fpinfo->ch_dict_key))
+		joinclauses = NIL;
+
+	fpinfo->ch_dict_rels = bms_union(fpinfo_o->ch_dict_rels,
+									 fpinfo_i->ch_dict_rels);
+	if (fpinfo->ch_dict_key)
+		fpinfo->ch_dict_rels = bms_add_members(fpinfo->ch_dict_rels,
+											   innerrel->relids);
+
 	/* Save the join clauses, for later use. */
 	fpinfo->joinclauses = joinclauses;
 
@@ -1792,11 +3512,11 @@ foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 	 * wherever possible. This avoids building subqueries at every join step.
 	 *
 	 * For an inner join, clauses from both the relations are added to the
-	 * other remote clauses. For LEFT and RIGHT OUTER join, the clauses from
-	 * the outer side are added to remote_conds since those can be evaluated
-	 * after the join is evaluated. The clauses from inner side are added to
-	 * the joinclauses, since they need to be evaluated while constructing the
-	 * join.
+	 * other remote clauses. For LEFT and RIGHT OUTER join, and for SEMI and
+	 * ANTI joins, the clauses from the outer side are added to remote_conds
+	 * since those can be evaluated after the join is evaluated. The clauses
+	 * from inner side are added to the joinclauses, since they need to be
+	 * evaluated while constructing the join.
 	 *
 	 * For a FULL OUTER JOIN, the other clauses from either relation can not
 	 * be added to the joinclauses or remote_conds, since each relation acts
@@ -1819,11 +3539,14 @@ foreign_join_ok(PlannerInfo *root, RelOptInfo *joinrel, JoinType jointype,
 		 * join to be deparsed without requiring subqueries.
 		 */
 		Assert(!fpinfo->joinclauses);
-		fpinfo->remote_conds = extract_join_equals(fpinfo->remote_conds,
-										&fpinfo->joinclauses);
+		if (!fpinfo->ch_dict_key)
+			fpinfo->remote_conds = extract_join_equals(fpinfo->remote_conds,
+											&fpinfo->joinclauses);
 		break;
 
 	case JOIN_LEFT:
+	case JOIN_SEMI:
+	case JOIN_ANTI:
 		fpinfo->joinclauses = list_concat(fpinfo->joinclauses,
 		                                  list_copy(fpinfo_i->remote_conds));
 		fpinfo->remote_conds = list_concat(fpinfo->remote_conds,
@@ -2050,9 +3773,6 @@ clickhouseGetForeignJoinPaths(PlannerInfo *root,
 	Path	   *epq_path;		/* Path to create plan to be executed when
 					 * EvalPlanQual gets triggered. */
 
-	struct timeval time1,time2;
-	gettimeofday(&time1, NULL);
-
 	/*
 	 * Skip if this join combination has been considered already.
 	 */
@@ -2136,9 +3856,6 @@ clickhouseGetForeignJoinPaths(PlannerInfo *root,
 
 	/* Consider pathkeys for the join relation */
 	add_paths_with_pathkeys_for_rel(root, joinrel, epq_path);
-
-	gettimeofday(&time2, NULL);
-	time_used += time_diff(&time1, &time2);
 }
 
 /*
@@ -2228,202 +3945,750 @@ foreign_grouping_ok(PlannerInfo *root, RelOptInfo *grouped_rel,
 				aggvars = pull_var_clause((Node *) expr,
 				                          PVC_INCLUDE_AGGREGATES);
 
-				/*
-				 * If any aggregate expression is not shippable, then we
-				 * cannot push down aggregation to the foreign server.
-				 */
-				if (!chfdw_is_foreign_expr(root, grouped_rel, (Expr *) aggvars))
-					return false;
+				/*
+				 * If any aggregate expression is not shippable, then we
+				 * cannot push down aggregation to the foreign server.
+				 */
+				if (!chfdw_is_foreign_expr(root, grouped_rel, (Expr *) aggvars))
+					return false;
+
+				/*
+				 * Add aggregates, if any, into the targetlist.  Plain Vars
+				 * outside an aggregate can be ignored, because they should be
+				 * either same as some GROUP BY column or part of some GROUP
+				 * BY expression.  In either case, they are already part of
+				 * the targetlist and thus no need to add them again.  In fact
+				 * including plain Vars in the tlist when they do not match a
+				 * GROUP BY column would cause the foreign server to complain
+				 * that the shipped query is invalid.
+				 */
+				foreach(l, aggvars)
+				{
+					Expr	   *expr = (Expr *) lfirst(l);
+
+					if (IsA(expr, Aggref))
+						tlist = add_to_flat_tlist(tlist, list_make1(expr));
+				}
+			}
+		}
+
+		i++;
+	}
+
+	/*
+	 * Classify the pushable and non-pushable HAVING clauses and save them in
+	 * remote_conds and local_conds of the grouped rel's fpinfo.
+	 */
+	if (havingQual)
+	{
+		ListCell   *lc;
+
+		foreach(lc, (List *) havingQual)
+		{
+			Expr	   *expr = (Expr *) lfirst(lc);
+			RestrictInfo *rinfo;
+
+			/*
+			 * Currently, the core code doesn't wrap havingQuals in
+			 * RestrictInfos, so we must make our own.
+			 */
+			Assert(!IsA(expr, RestrictInfo));
+			rinfo = make_restrictinfo(expr,
+									  true,
+									  false,
+									  false,
+									  root->qual_security_level,
+									  grouped_rel->relids,
+									  NULL,
+									  NULL);
+			if (chfdw_is_foreign_expr(root, grouped_rel, expr))
+				fpinfo->remote_conds = lappend(fpinfo->remote_conds, rinfo);
+			else
+				fpinfo->local_conds = lappend(fpinfo->local_conds, rinfo);
+		}
+	}
+
+	/*
+	 * If there are any local conditions, pull Vars and aggregates from it and
+	 * check whether they are safe to pushdown or not.
+	 */
+	if (fpinfo->local_conds)
+	{
+		List	   *aggvars = NIL;
+		ListCell   *lc;
+
+		foreach(lc, fpinfo->local_conds)
+		{
+			RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+
+			aggvars = list_concat(aggvars,
+								  pull_var_clause((Node *) rinfo->clause,
+												  PVC_INCLUDE_AGGREGATES));
+		}
+
+		foreach(lc, aggvars)
+		{
+			Expr	   *expr = (Expr *) lfirst(lc);
+
+			/*
+			 * If aggregates within local conditions are not safe to push
+			 * down, then we cannot push down the query.  Vars are already
+			 * part of GROUP BY clause which are checked above, so no need to
+			 * access them again here.
+			 */
+			if (IsA(expr, Aggref))
+			{
+				if (!chfdw_is_foreign_expr(root, grouped_rel, expr))
+					return false;
+
+				tlist = add_to_flat_tlist(tlist, list_make1(expr));
+			}
+		}
+	}
+
+	/* Store generated targetlist */
+	fpinfo->grouped_tlist = tlist;
+
+	/* Safe to pushdown */
+	fpinfo->pushdown_safe = true;
+
+	/*
+	 * Set cached relation costs to some negative value, so that we can detect
+	 * when they are set to some sensible costs, during one (usually the
+	 * first) of the calls to estimate_path_cost_size().
+	 */
+	fpinfo->rel_startup_cost = -1;
+	fpinfo->rel_total_cost = -1;
+
+	/*
+	 * Set the string describing this grouped relation to be used in EXPLAIN
+	 * output of corresponding ForeignScan.
+	 */
+	fpinfo->relation_name = makeStringInfo();
+	appendStringInfo(fpinfo->relation_name, "%s on (%s)",
+					 fpinfo->stage == UPPERREL_PARTIAL_GROUP_AGG ?
+					 "Partial aggregate" : "Aggregate",
+					 ofpinfo->relation_name->data);
+
+	return true;
+}
+
+/*
+ * clickhouseGetForeignUpperPaths
+ *		Add paths for post-join operations like aggregation, grouping etc. if
+ *		corresponding operations are safe to push down.
+ */
+static void
+clickhouseGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
+                               RelOptInfo *input_rel, RelOptInfo *output_rel,
+                               void *extra)
+{
+	CHFdwRelationInfo *fpinfo;
+
+	/*
+	 * If input rel is not safe to pushdown, then simply return as we cannot
+	 * perform any post-join operations on the foreign server.
+	 */
+	if (!input_rel->fdw_private ||
+	        !((CHFdwRelationInfo *) input_rel->fdw_private)->pushdown_safe)
+		return;
+
+	/* Ignore stages we don't support; and skip any duplicate calls. */
+	if ((stage != UPPERREL_GROUP_AGG
+		 && stage != UPPERREL_PARTIAL_GROUP_AGG
+		 && stage != UPPERREL_WINDOW
+		 && stage != UPPERREL_DISTINCT
+#if PG_VERSION_NUM >= 120000
+		 && stage != UPPERREL_ORDERED
+		 && stage != UPPERREL_FINAL
+#endif
+		) || output_rel->fdw_private)
+		return;
+
+	fpinfo = (CHFdwRelationInfo *) palloc0(sizeof(CHFdwRelationInfo));
+	fpinfo->pushdown_safe = false;
+	fpinfo->stage = stage;
+	output_rel->fdw_private = fpinfo;
+
+	switch (stage)
+	{
+		case UPPERREL_GROUP_AGG:
+		case UPPERREL_PARTIAL_GROUP_AGG:
+			add_foreign_grouping_paths(root, input_rel, output_rel,
+			                           (GroupPathExtraData *) extra);
+			break;
+		case UPPERREL_WINDOW:
+			add_foreign_window_paths(root, input_rel, output_rel);
+			break;
+		case UPPERREL_DISTINCT:
+			add_foreign_distinct_paths(root, input_rel, output_rel);
+			break;
+#if PG_VERSION_NUM >= 120000
+		case UPPERREL_ORDERED:
+			add_foreign_ordered_paths(root, input_rel, output_rel);
+			break;
+		case UPPERREL_FINAL:
+			add_foreign_final_paths(root, input_rel, output_rel,
+			                        (FinalPathExtraData *) extra);
+			break;
+#endif
+		default:
+			elog(ERROR, "unexpected upper relation: %d", (int) stage);
+			break;
+	}
+}
+
+/*
+ * add_foreign_grouping_paths
+ *		Add foreign path for grouping and/or aggregation.
+ *
+ * Given input_rel represents the underlying scan.  The paths are added to the
+ * given grouped_rel.  For partitionwise aggregation with partial aggregates
+ * grouped_rel is the partially grouped relation of a partition, and the
+ * partial results are combined locally.
+ */
+static void
+add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
+                           RelOptInfo *grouped_rel,
+                           GroupPathExtraData *extra)
+{
+	Query	   *parse = root->parse;
+	CHFdwRelationInfo *ifpinfo = input_rel->fdw_private;
+	CHFdwRelationInfo *fpinfo = grouped_rel->fdw_private;
+	ForeignPath *grouppath;
+	Node	   *havingQual = extra->havingQual;
+	double		rows;
+	int			width;
+	Cost		startup_cost;
+	Cost		total_cost;
+
+	/* Nothing to be done, if there is no grouping or aggregation required. */
+	if (!parse->groupClause && !parse->groupingSets && !parse->hasAggs &&
+		!root->hasHavingQual)
+		return;
+
+	/* HAVING is applied only after partial results are combined */
+	if (fpinfo->stage == UPPERREL_PARTIAL_GROUP_AGG)
+	{
+		Assert(extra->patype == PARTITIONWISE_AGGREGATE_PARTIAL);
+		havingQual = NULL;
+	}
+	else
+		Assert(extra->patype == PARTITIONWISE_AGGREGATE_NONE ||
+			   extra->patype == PARTITIONWISE_AGGREGATE_FULL);
+
+	/* save the input_rel as outerrel in fpinfo */
+	fpinfo->outerrel = input_rel;
+
+	/*
+	 * Copy foreign table, foreign server, user mapping, FDW options etc.
+	 * details from the input relation's fpinfo.
+	 */
+	fpinfo->table = ifpinfo->table;
+	fpinfo->server = ifpinfo->server;
+	fpinfo->user = ifpinfo->user;
+	merge_fdw_options(fpinfo, ifpinfo, NULL);
+
+	/*
+	 * Assess if it is safe to push down aggregation and grouping.
+	 *
+	 * Use HAVING qual from extra. In case of child partition, it will have
+	 * translated Vars.
+	 */
+	if (!foreign_grouping_ok(root, grouped_rel, havingQual))
+		return;
+
+	/* Estimate the cost of push down */
+	estimate_path_cost_size(&rows, &width, &startup_cost, &total_cost, 0.1);
+
+	/* Now update this information in the fpinfo */
+	fpinfo->rows = rows;
+	fpinfo->width = width;
+	fpinfo->startup_cost = startup_cost;
+	fpinfo->total_cost = total_cost;
+
+	/* Create and add foreign path to the grouping relation. */
+#if (PG_VERSION_NUM < 120000)
+	grouppath = create_foreignscan_path(root,
+	                                    grouped_rel,
+	                                    grouped_rel->reltarget,
+	                                    rows,
+	                                    startup_cost,
+	                                    total_cost,
+	                                    NIL,	/* no pathkeys */
+	                                    NULL,	/* no required_outer */
+	                                    NULL,
+	                                    NIL);	/* no fdw_private */
+#else
+	grouppath = create_foreign_upper_path(root,
+										  grouped_rel,
+										  grouped_rel->reltarget,
+										  rows,
+										  startup_cost,
+										  total_cost,
+										  NIL,	/* no pathkeys */
+										  NULL,
+										  NIL); /* no fdw_private */
+#endif
+
+	/* Add generated path into grouped_rel by add_path(). */
+	add_path(grouped_rel, (Path *) grouppath);
+}
+
+/*
+ * add_foreign_distinct_paths
+ *		Add foreign path for SELECT DISTINCT and DISTINCT ON.
+ *
+ * Plain DISTINCT is sent as is, DISTINCT ON is sent as LIMIT 1 BY over the
+ * rows sorted by DISTINCT ON expressions.  Given input_rel represents the
+ * underlying scan, DISTINCT on top of remote aggregation isn't supported yet.
+ */
+static void
+add_foreign_distinct_paths(PlannerInfo *root, RelOptInfo *input_rel,
+                           RelOptInfo *distinct_rel)
+{
+	Query	   *parse = root->parse;
+	CHFdwRelationInfo *ifpinfo = input_rel->fdw_private;
+	CHFdwRelationInfo *fpinfo = distinct_rel->fdw_private;
+	PathTarget *target = root->upper_targets[UPPERREL_DISTINCT];
+	ForeignPath *distinctpath;
+	List	   *tlist = NIL;
+	List	   *distinctExprs;
+	List	   *pathkeys = NIL;
+	List	   *fdw_private = NIL;
+	ListCell   *lc;
+	double		rows;
+	int			width;
+	Cost		startup_cost;
+	Cost		total_cost;
+	int			i;
+
+	/* We don't support cases where there are any SRFs in the targetlist */
+	if (parse->hasTargetSRFs)
+		return;
+
+	/* The input_rel should be a base or join relation */
+	if (input_rel->reloptkind != RELOPT_BASEREL &&
+		input_rel->reloptkind != RELOPT_JOINREL)
+		return;
+
+	/*
+	 * If underlying scan relation has any local conditions, those conditions
+	 * are required to be applied before removing duplicates.
+	 */
+	if (ifpinfo->local_conds)
+		return;
+
+	/* save the input_rel as outerrel in fpinfo */
+	fpinfo->outerrel = input_rel;
+
+	/*
+	 * Copy foreign table, foreign server, user mapping, FDW options etc.
+	 * details from the input relation's fpinfo.
+	 */
+	fpinfo->table = ifpinfo->table;
+	fpinfo->server = ifpinfo->server;
+	fpinfo->user = ifpinfo->user;
+	merge_fdw_options(fpinfo, ifpinfo, NULL);
+
+	/*
+	 * All output expressions are computed remotely, so each of them should
+	 * be shippable.  Keep duplicate entries along with their sortgrouprefs,
+	 * as foreign_grouping_ok does.
+	 */
+	i = 0;
+	foreach(lc, target->exprs)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc);
+		TargetEntry *tle;
+
+		if (!chfdw_is_foreign_expr(root, distinct_rel, expr))
+			return;
+
+		tle = makeTargetEntry(expr, list_length(tlist) + 1, NULL, false);
+		tle->ressortgroupref = get_pathtarget_sortgroupref(target, i);
+		tlist = lappend(tlist, tle);
+		i++;
+	}
+
+	/* Safe to pushdown */
+	fpinfo->grouped_tlist = tlist;
+	fpinfo->pushdown_safe = true;
+
+	/*
+	 * The core code doesn't set the target of the DISTINCT relation, but
+	 * the sort expressions of the paths above are looked up in it.
+	 */
+	distinct_rel->reltarget = target;
+
+	fpinfo->relation_name = makeStringInfo();
+	appendStringInfo(fpinfo->relation_name, "Distinct on (%s)",
+					 ifpinfo->relation_name->data);
+
+	/*
+	 * DISTINCT ON keeps the first row of each group, so the result is sorted
+	 * the same way as the core code does it for Unique.
+	 */
+	if (parse->hasDistinctOn)
+	{
+		if (list_length(root->distinct_pathkeys) <
+			list_length(root->sort_pathkeys))
+			pathkeys = root->sort_pathkeys;
+		else
+			pathkeys = root->distinct_pathkeys;
+
+		/* Items in the list must match order in enum FdwPathPrivateIndex */
+		fdw_private = list_make2(makeInteger(true), makeInteger(false));
+	}
+
+	/* Estimate the cost of push down */
+	estimate_path_cost_size(&rows, &width, &startup_cost, &total_cost, 0.1);
+
+	/* The number of rows is the number of groups, as for local Unique */
+	distinctExprs = get_sortgrouplist_exprs(parse->distinctClause,
+	                                        parse->targetList);
+	rows = estimate_num_groups(root, distinctExprs, input_rel->rows, NULL);
+
+	/* Now update this information in the fpinfo */
+	fpinfo->rows = rows;
+	fpinfo->width = width;
+	fpinfo->startup_cost = startup_cost;
+	fpinfo->total_cost = total_cost;
+
+	/* Create and add foreign path to the distinct relation. */
+#if (PG_VERSION_NUM < 120000)
+	distinctpath = create_foreignscan_path(root,
+	                                       distinct_rel,
+	                                       target,
+	                                       rows,
+	                                       startup_cost,
+	                                       total_cost,
+	                                       pathkeys,
+	                                       NULL,	/* no required_outer */
+	                                       NULL,
+	                                       fdw_private);
+#else
+	distinctpath = create_foreign_upper_path(root,
+	                                         distinct_rel,
+	                                         target,
+	                                         rows,
+	                                         startup_cost,
+	                                         total_cost,
+	                                         pathkeys,
+	                                         NULL,
+	                                         fdw_private);
+#endif
+
+	add_path(distinct_rel, (Path *) distinctpath);
+}
+
+/*
+ * add_foreign_window_paths
+ *		Add foreign path for window functions.
+ *
+ * Window functions are computed over the rows of the given input_rel, which
+ * should be a base or join relation.  Whether each window function and its
+ * window clause can be sent is checked by chfdw_is_foreign_expr.
+ */
+static void
+add_foreign_window_paths(PlannerInfo *root, RelOptInfo *input_rel,
+                         RelOptInfo *window_rel)
+{
+	Query	   *parse = root->parse;
+	CHFdwRelationInfo *ifpinfo = input_rel->fdw_private;
+	CHFdwRelationInfo *fpinfo = window_rel->fdw_private;
+	PathTarget *target = root->upper_targets[UPPERREL_WINDOW];
+	ForeignPath *windowpath;
+	List	   *tlist = NIL;
+	ListCell   *lc;
+	double		rows;
+	int			width;
+	Cost		startup_cost;
+	Cost		total_cost;
+	int			i;
+
+	/* We don't support cases where there are any SRFs in the targetlist */
+	if (parse->hasTargetSRFs)
+		return;
+
+	/* The input_rel should be a base or join relation */
+	if (input_rel->reloptkind != RELOPT_BASEREL &&
+		input_rel->reloptkind != RELOPT_JOINREL)
+		return;
+
+	/*
+	 * Local conditions would have to be applied before computing window
+	 * functions.
+	 */
+	if (ifpinfo->local_conds)
+		return;
+
+	/* save the input_rel as outerrel in fpinfo */
+	fpinfo->outerrel = input_rel;
+
+	/*
+	 * Copy foreign table, foreign server, user mapping, FDW options etc.
+	 * details from the input relation's fpinfo.
+	 */
+	fpinfo->table = ifpinfo->table;
+	fpinfo->server = ifpinfo->server;
+	fpinfo->user = ifpinfo->user;
+	merge_fdw_options(fpinfo, ifpinfo, NULL);
+
+	/* All output expressions, window functions included, are sent */
+	i = 0;
+	foreach(lc, target->exprs)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc);
+		TargetEntry *tle;
+
+		if (!chfdw_is_foreign_expr(root, window_rel, expr))
+			return;
+
+		tle = makeTargetEntry(expr, list_length(tlist) + 1, NULL, false);
+		tle->ressortgroupref = get_pathtarget_sortgroupref(target, i);
+		tlist = lappend(tlist, tle);
+		i++;
+	}
+
+	/* Safe to pushdown */
+	fpinfo->grouped_tlist = tlist;
+	fpinfo->pushdown_safe = true;
+
+	/* As for DISTINCT, the core code leaves the target of the relation unset */
+	window_rel->reltarget = target;
+
+	fpinfo->relation_name = makeStringInfo();
+	appendStringInfo(fpinfo->relation_name, "Window on (%s)",
+					 ifpinfo->relation_name->data);
+
+	/* Estimate the cost of push down */
+	estimate_path_cost_size(&rows, &width, &startup_cost, &total_cost, 0.1);
+
+	/* Window functions don't change the number of rows */
+	rows = input_rel->rows;
+
+	fpinfo->rows = rows;
+	fpinfo->width = width;
+	fpinfo->startup_cost = startup_cost;
+	fpinfo->total_cost = total_cost;
+
+	/* Create and add foreign path to the window relation. */
+#if (PG_VERSION_NUM < 120000)
+	windowpath = create_foreignscan_path(root,
+	                                     window_rel,
+	                                     target,
+	                                     rows,
+	                                     startup_cost,
+	                                     total_cost,
+	                                     NIL,	/* no pathkeys */
+	                                     NULL,	/* no required_outer */
+	                                     NULL,
+	                                     NIL);	/* no fdw_private */
+#else
+	windowpath = create_foreign_upper_path(root,
+	                                       window_rel,
+	                                       target,
+	                                       rows,
+	                                       startup_cost,
+	                                       total_cost,
+	                                       NIL,	/* no pathkeys */
+	                                       NULL,
+	                                       NIL);	/* no fdw_private */
+#endif
+
+	add_path(window_rel, (Path *) windowpath);
+}
+
+#if PG_VERSION_NUM >= 120000
+/*
+ * add_foreign_ordered_paths
+ *		Add foreign paths for performing the final sort remotely.
+ *
+ * Given input_rel contains the source-data Paths.  The paths are added to the
+ * given ordered_rel.
+ */
+static void
+add_foreign_ordered_paths(PlannerInfo *root, RelOptInfo *input_rel,
+                          RelOptInfo *ordered_rel)
+{
+	Query	   *parse = root->parse;
+	CHFdwRelationInfo *ifpinfo = input_rel->fdw_private;
+	CHFdwRelationInfo *fpinfo = ordered_rel->fdw_private;
+	double		rows;
+	int			width;
+	Cost		startup_cost;
+	Cost		total_cost;
+	List	   *fdw_private;
+	ForeignPath *ordered_path;
+	ListCell   *lc;
+
+	/* Shouldn't get here unless the query has ORDER BY */
+	Assert(parse->sortClause);
 
-				/*
-				 * Add aggregates, if any, into the targetlist.  Plain Vars
-				 * outside an aggregate can be ignored, because they should be
-				 * either same as some GROUP BY column or part of some GROUP
-				 * BY expression.  In either case, they are already part of
-				 * the targetlist and thus no need to add them again.  In fact
-				 * including plain Vars in the tlist when they do not match a
-				 * GROUP BY column would cause the foreign server to complain
-				 * that the shipped query is invalid.
-				 */
-				foreach(l, aggvars)
-				{
-					Expr	   *expr = (Expr *) lfirst(l);
+	/* We don't support cases where there are any SRFs in the targetlist */
+	if (parse->hasTargetSRFs)
+		return;
 
-					if (IsA(expr, Aggref))
-						tlist = add_to_flat_tlist(tlist, list_make1(expr));
-				}
-			}
-		}
+	/* Save the input_rel as outerrel in fpinfo */
+	fpinfo->outerrel = input_rel;
 
-		i++;
-	}
+	/*
+	 * Copy foreign table, foreign server, user mapping, FDW options etc.
+	 * details from the input relation's fpinfo.
+	 */
+	fpinfo->table = ifpinfo->table;
+	fpinfo->server = ifpinfo->server;
+	fpinfo->user = ifpinfo->user;
+	merge_fdw_options(fpinfo, ifpinfo, NULL);
 
 	/*
-	 * Classify the pushable and non-pushable HAVING clauses and save them in
-	 * remote_conds and local_conds of the grouped rel's fpinfo.
+	 * If the input_rel is a base or join relation, we would already have
+	 * considered pushing down the final sort to the remote server when
+	 * creating pre-sorted foreign paths for that relation, because the
+	 * query_pathkeys is set to the root->sort_pathkeys in that case (see
+	 * standard_qp_callback()).  We only remember if it is safe, so that
+	 * the sort could be sent together with LIMIT.
 	 */
-	if (havingQual)
+	if (input_rel->reloptkind == RELOPT_BASEREL ||
+		input_rel->reloptkind == RELOPT_JOINREL)
 	{
-		ListCell   *lc;
-
-		foreach(lc, (List *) havingQual)
-		{
-			Expr	   *expr = (Expr *) lfirst(lc);
-			RestrictInfo *rinfo;
+		Assert(root->query_pathkeys == root->sort_pathkeys);
 
-			/*
-			 * Currently, the core code doesn't wrap havingQuals in
-			 * RestrictInfos, so we must make our own.
-			 */
-			Assert(!IsA(expr, RestrictInfo));
-			rinfo = make_restrictinfo(expr,
-									  true,
-									  false,
-									  false,
-									  root->qual_security_level,
-									  grouped_rel->relids,
-									  NULL,
-									  NULL);
-			if (chfdw_is_foreign_expr(root, grouped_rel, expr))
-				fpinfo->remote_conds = lappend(fpinfo->remote_conds, rinfo);
-			else
-				fpinfo->local_conds = lappend(fpinfo->local_conds, rinfo);
-		}
+		/* Safe to push down if the query_pathkeys is safe to push down */
+		fpinfo->pushdown_safe = ifpinfo->qp_is_pushdown_safe;
+		return;
 	}
 
+	/* The input_rel should be a grouping, window or distinct relation */
+	Assert(input_rel->reloptkind == RELOPT_UPPER_REL &&
+		   (ifpinfo->stage == UPPERREL_GROUP_AGG ||
+			ifpinfo->stage == UPPERREL_WINDOW ||
+			ifpinfo->stage == UPPERREL_DISTINCT));
+
 	/*
-	 * If there are any local conditions, pull Vars and aggregates from it and
-	 * check whether they are safe to pushdown or not.
+	 * We try to create a path below by extending a simple foreign path for
+	 * the underlying upper relation to perform the final sort remotely,
+	 * which is stored into the fdw_private list of the resulting path.
 	 */
-	if (fpinfo->local_conds)
-	{
-		List	   *aggvars = NIL;
-		ListCell   *lc;
-
-		foreach(lc, fpinfo->local_conds)
-		{
-			RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
 
-			aggvars = list_concat(aggvars,
-								  pull_var_clause((Node *) rinfo->clause,
-												  PVC_INCLUDE_AGGREGATES));
-		}
+	/* Assess if it is safe to push down the final sort */
+	foreach(lc, root->sort_pathkeys)
+	{
+		PathKey    *pathkey = (PathKey *) lfirst(lc);
+		EquivalenceClass *pathkey_ec = pathkey->pk_eclass;
+		Expr	   *sort_expr;
 
-		foreach(lc, aggvars)
-		{
-			Expr	   *expr = (Expr *) lfirst(lc);
+		/*
+		 * chfdw_is_foreign_expr would detect volatile expressions as well,
+		 * but checking ec_has_volatile here saves some cycles.
+		 */
+		if (pathkey_ec->ec_has_volatile)
+			return;
 
-			/*
-			 * If aggregates within local conditions are not safe to push
-			 * down, then we cannot push down the query.  Vars are already
-			 * part of GROUP BY clause which are checked above, so no need to
-			 * access them again here.
-			 */
-			if (IsA(expr, Aggref))
-			{
-				if (!chfdw_is_foreign_expr(root, grouped_rel, expr))
-					return false;
+		/* Get the sort expression for the pathkey_ec */
+		sort_expr = chfdw_find_em_expr_for_input_target(root,
+		                                                pathkey_ec,
+		                                                input_rel->reltarget);
 
-				tlist = add_to_flat_tlist(tlist, list_make1(expr));
-			}
-		}
+		/* If it's unsafe to remote, we cannot push down the final sort */
+		if (!chfdw_is_foreign_expr(root, input_rel, sort_expr))
+			return;
 	}
 
-	/* Store generated targetlist */
-	fpinfo->grouped_tlist = tlist;
-
-	/* Safe to pushdown */
+	/* Safe to push down */
 	fpinfo->pushdown_safe = true;
 
 	/*
-	 * Set cached relation costs to some negative value, so that we can detect
-	 * when they are set to some sensible costs, during one (usually the
-	 * first) of the calls to estimate_path_cost_size().
+	 * Remote sort should win over the local Sort above the foreign grouping
+	 * path, so make it slightly cheaper than the grouping path itself.
 	 */
-	fpinfo->rel_startup_cost = -1;
-	fpinfo->rel_total_cost = -1;
+	estimate_path_cost_size(&rows, &width, &startup_cost, &total_cost, 0.05);
 
 	/*
-	 * Set the string describing this grouped relation to be used in EXPLAIN
-	 * output of corresponding ForeignScan.
+	 * Build the fdw_private list that will be used by clickhouseGetForeignPlan.
+	 * Items in the list must match order in enum FdwPathPrivateIndex.
 	 */
-	fpinfo->relation_name = makeStringInfo();
-	appendStringInfo(fpinfo->relation_name, "Aggregate on (%s)",
-					 ofpinfo->relation_name->data);
-
-	return true;
+	fdw_private = list_make2(makeInteger(true), makeInteger(false));
+
+	/* Create foreign ordering path */
+	ordered_path = create_foreign_upper_path(root,
+	                                         input_rel,
+	                                         root->upper_targets[UPPERREL_ORDERED],
+	                                         rows,
+	                                         startup_cost,
+	                                         total_cost,
+	                                         root->sort_pathkeys,
+	                                         NULL,	/* no extra plan */
+	                                         fdw_private);
+
+	/* and add it to the ordered_rel */
+	add_path(ordered_rel, (Path *) ordered_path);
 }
 
 /*
- * clickhouseGetForeignUpperPaths
- *		Add paths for post-join operations like aggregation, grouping etc. if
- *		corresponding operations are safe to push down.
+ * Check that LIMIT or OFFSET expression can be sent to the remote side.
  *
- * Right now, we only support aggregate, grouping and having clause pushdown.
+ * Anything except constants is evaluated locally at execution time and sent
+ * as a parameter (see deparseLimitExpr), negative values are rejected then.
  */
-static void
-clickhouseGetForeignUpperPaths(PlannerInfo *root, UpperRelationKind stage,
-                               RelOptInfo *input_rel, RelOptInfo *output_rel,
-                               void *extra)
+static bool
+is_foreign_limit_expr(Node *expr)
 {
-	CHFdwRelationInfo *fpinfo;
-	struct timeval time1,time2;
-
-	gettimeofday(&time1, NULL);
-
-	/*
-	 * If input rel is not safe to pushdown, then simply return as we cannot
-	 * perform any post-join operations on the foreign server.
-	 */
-	if (!input_rel->fdw_private ||
-	        !((CHFdwRelationInfo *) input_rel->fdw_private)->pushdown_safe)
-		return;
-
-	/* Ignore stages we don't support; and skip any duplicate calls. */
-	if (stage != UPPERREL_GROUP_AGG || output_rel->fdw_private)
-		return;
-
-	fpinfo = (CHFdwRelationInfo *) palloc0(sizeof(CHFdwRelationInfo));
-	fpinfo->pushdown_safe = false;
-	output_rel->fdw_private = fpinfo;
+	/* LIMIT NULL and negative values are handled by the local Limit node */
+	if (expr && IsA(expr, Const))
+	{
+		Const	   *c = (Const *) expr;
 
-	add_foreign_grouping_paths(root, input_rel, output_rel,
-	                           (GroupPathExtraData *) extra);
+		return !c->constisnull && DatumGetInt64(c->constvalue) >= 0;
+	}
 
-	gettimeofday(&time2, NULL);
-	time_used += time_diff(&time1, &time2);
+	return true;
 }
 
 /*
- * add_foreign_grouping_paths
- *		Add foreign path for grouping and/or aggregation.
+ * add_foreign_final_paths
+ *		Add foreign paths for performing the final processing remotely.
  *
- * Given input_rel represents the underlying scan.  The paths are added to the
- * given grouped_rel.
+ * Given input_rel contains the source-data Paths.  The paths are added to the
+ * given final_rel.  Right now we push down only LIMIT/OFFSET, together with
+ * the final sort if there is one.
  */
 static void
-add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
-                           RelOptInfo *grouped_rel,
-                           GroupPathExtraData *extra)
+add_foreign_final_paths(PlannerInfo *root, RelOptInfo *input_rel,
+                        RelOptInfo *final_rel,
+                        FinalPathExtraData *extra)
 {
 	Query	   *parse = root->parse;
-	CHFdwRelationInfo *ifpinfo = input_rel->fdw_private;
-	CHFdwRelationInfo *fpinfo = grouped_rel->fdw_private;
-	ForeignPath *grouppath;
+	CHFdwRelationInfo *ifpinfo = (CHFdwRelationInfo *) input_rel->fdw_private;
+	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) final_rel->fdw_private;
+	bool		has_final_sort = false;
+	List	   *pathkeys = NIL;
 	double		rows;
 	int			width;
 	Cost		startup_cost;
 	Cost		total_cost;
+	List	   *fdw_private;
+	ForeignPath *final_path;
 
-	/* Nothing to be done, if there is no grouping or aggregation required. */
-	if (!parse->groupClause && !parse->groupingSets && !parse->hasAggs &&
-		!root->hasHavingQual)
+	/*
+	 * Currently, we only support this for SELECT commands
+	 */
+	if (parse->commandType != CMD_SELECT)
+		return;
+
+	/*
+	 * No work if there is no need to add a LIMIT node.  FOR UPDATE/SHARE
+	 * is meaningless for ClickHouse, so we don't consider it here.
+	 */
+	if (!extra->limit_needed || parse->rowMarks)
 		return;
 
-	Assert(extra->patype == PARTITIONWISE_AGGREGATE_NONE ||
-		   extra->patype == PARTITIONWISE_AGGREGATE_FULL);
+	/* We don't support cases where there are any SRFs in the targetlist */
+	if (parse->hasTargetSRFs)
+		return;
 
-	/* save the input_rel as outerrel in fpinfo */
+	/* Save the input_rel as outerrel in fpinfo */
 	fpinfo->outerrel = input_rel;
 
 	/*
@@ -2436,50 +4701,74 @@ add_foreign_grouping_paths(PlannerInfo *root, RelOptInfo *input_rel,
 	merge_fdw_options(fpinfo, ifpinfo, NULL);
 
 	/*
-	 * Assess if it is safe to push down aggregation and grouping.
-	 *
-	 * Use HAVING qual from extra. In case of child partition, it will have
-	 * translated Vars.
+	 * If the input_rel is an ordered relation, replace the input_rel with its
+	 * input relation
 	 */
-	if (!foreign_grouping_ok(root, grouped_rel, extra->havingQual))
+	if (input_rel->reloptkind == RELOPT_UPPER_REL &&
+		ifpinfo->stage == UPPERREL_ORDERED)
+	{
+		input_rel = ifpinfo->outerrel;
+		ifpinfo = (CHFdwRelationInfo *) input_rel->fdw_private;
+		has_final_sort = true;
+		pathkeys = root->sort_pathkeys;
+	}
+
+	/* The input_rel should be a base, join or pushed down upper relation */
+	if (input_rel->reloptkind == RELOPT_UPPER_REL &&
+		ifpinfo->stage != UPPERREL_GROUP_AGG &&
+		ifpinfo->stage != UPPERREL_WINDOW &&
+		ifpinfo->stage != UPPERREL_DISTINCT)
 		return;
 
-	/* Estimate the cost of push down */
-	estimate_path_cost_size(&rows, &width, &startup_cost, &total_cost, 0.1);
+	/*
+	 * If the underlying relation has any local conditions, the LIMIT/OFFSET
+	 * cannot be pushed down.
+	 */
+	if (ifpinfo->local_conds)
+		return;
 
-	/* Now update this information in the fpinfo */
-	fpinfo->rows = rows;
-	fpinfo->width = width;
-	fpinfo->startup_cost = startup_cost;
-	fpinfo->total_cost = total_cost;
+	/*
+	 * Also, the LIMIT/OFFSET cannot be pushed down, if their expressions are
+	 * not safe to remote.
+	 */
+	if (!is_foreign_limit_expr(parse->limitOffset) ||
+		!is_foreign_limit_expr(parse->limitCount))
+		return;
 
-	/* Create and add foreign path to the grouping relation. */
-#if (PG_VERSION_NUM < 120000)
-	grouppath = create_foreignscan_path(root,
-	                                    grouped_rel,
-	                                    grouped_rel->reltarget,
-	                                    rows,
-	                                    startup_cost,
-	                                    total_cost,
-	                                    NIL,	/* no pathkeys */
-	                                    NULL,	/* no required_outer */
-	                                    NULL,
-	                                    NIL);	/* no fdw_private */
-#else
-	grouppath = create_foreign_upper_path(root,
-										  grouped_rel,
-										  grouped_rel->reltarget,
-										  rows,
-										  startup_cost,
-										  total_cost,
-										  NIL,	/* no pathkeys */
-										  NULL,
-										  NIL); /* no fdw_private */
-#endif
+	/* Safe to push down */
+	fpinfo->pushdown_safe = true;
 
-	/* Add generated path into grouped_rel by add_path(). */
-	add_path(grouped_rel, (Path *) grouppath);
+	/*
+	 * We don't have real estimates, so just make sure the path is cheaper
+	 * than a local Limit over any foreign path of the input relation.
+	 */
+	estimate_path_cost_size(&rows, &width, &startup_cost, &total_cost, -1.0);
+
+	/*
+	 * Build the fdw_private list that will be used by clickhouseGetForeignPlan.
+	 * Items in the list must match order in enum FdwPathPrivateIndex.
+	 */
+	fdw_private = list_make2(makeInteger(has_final_sort),
+							 makeInteger(true));
+
+	/*
+	 * Create foreign final path; this gets rid of a no-longer-needed outer
+	 * plan (if any), which makes the EXPLAIN output look cleaner
+	 */
+	final_path = create_foreign_upper_path(root,
+										   input_rel,
+										   root->upper_targets[UPPERREL_FINAL],
+										   rows,
+										   startup_cost,
+										   total_cost,
+										   pathkeys,
+										   NULL,	/* no extra plan */
+										   fdw_private);
+
+	/* and add it to the final_rel */
+	add_path(final_rel, (Path *) final_path);
 }
+#endif
 
 /*
  * Find an equivalence class member expression, all of whose Vars, come from
@@ -2510,6 +4799,68 @@ chfdw_find_em_expr(EquivalenceClass *ec, RelOptInfo *rel)
 	return NULL;
 }
 
+/*
+ * Find an equivalence class member expression to be computed as a sort column
+ * in the given target.
+ */
+Expr *
+chfdw_find_em_expr_for_input_target(PlannerInfo *root,
+                                    EquivalenceClass *ec,
+                                    PathTarget *target)
+{
+	ListCell   *lc1;
+	int			i;
+
+	i = 0;
+	foreach(lc1, target->exprs)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc1);
+		Index		sgref = get_pathtarget_sortgroupref(target, i);
+		ListCell   *lc2;
+
+		/* Ignore non-sort expressions */
+		if (sgref == 0 ||
+			get_sortgroupref_clause_noerr(sgref,
+										  root->parse->sortClause) == NULL)
+		{
+			i++;
+			continue;
+		}
+
+		/* We ignore binary-compatible relabeling on both ends */
+		while (expr && IsA(expr, RelabelType))
+			expr = ((RelabelType *) expr)->arg;
+
+		/* Locate an EquivalenceClass member matching this expr, if any */
+		foreach(lc2, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lc2);
+			Expr	   *em_expr;
+
+			/* Don't match constants */
+			if (em->em_is_const)
+				continue;
+
+			/* Ignore child members */
+			if (em->em_is_child)
+				continue;
+
+			/* Match if same expression (after stripping relabel) */
+			em_expr = em->em_expr;
+			while (em_expr && IsA(em_expr, RelabelType))
+				em_expr = ((RelabelType *) em_expr)->arg;
+
+			if (equal(em_expr, expr))
+				return em->em_expr;
+		}
+
+		i++;
+	}
+
+	elog(ERROR, "could not find pathkey item to sort");
+	return NULL;				/* keep compiler quiet */
+}
+
 static List *
 clickhouseImportForeignSchema(ImportForeignSchemaStmt *stmt, Oid serverOid)
 {
@@ -2535,9 +4886,16 @@ clickhousedb_fdw_handler(PG_FUNCTION_ARGS)
 	routine->GetForeignPlan = clickhouseGetForeignPlan;
 	routine->BeginForeignScan = clickhouseBeginForeignScan;
 	routine->IterateForeignScan = clickhouseIterateForeignScan;
-	routine->ReScanForeignScan = clickhouseEndForeignScan;
+	routine->ReScanForeignScan = clickhouseReScanForeignScan;
 	routine->EndForeignScan = clickhouseEndForeignScan;
 
+	/* Functions for parallel scans */
+	routine->IsForeignScanParallelSafe = clickhouseIsForeignScanParallelSafe;
+	routine->EstimateDSMForeignScan = clickhouseEstimateDSMForeignScan;
+	routine->InitializeDSMForeignScan = clickhouseInitializeDSMForeignScan;
+	routine->ReInitializeDSMForeignScan = clickhouseReInitializeDSMForeignScan;
+	routine->InitializeWorkerForeignScan = clickhouseInitializeWorkerForeignScan;
+
 	/* Functions for updating foreign tables */
 	routine->PlanForeignModify = clickhousePlanForeignModify;
 	routine->BeginForeignModify = clickhouseBeginForeignModify;
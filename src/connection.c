@@ -43,7 +43,8 @@ clickhouse_connect(ForeignServer *server, UserMapping *user)
 	char	   *driver = "http";
 
 	/* default settings */
-	ch_connection_details	details = {"127.0.0.1", 8123, NULL, NULL, "default"};
+	ch_connection_details	details = {"127.0.0.1", 8123, NULL, NULL, "default",
+									   server->serverid};
 
 	chfdw_extract_options(server->options, &driver, &details.host,
 		&details.port, &details.dbname, &details.username, &details.password);
@@ -64,7 +65,7 @@ clickhouse_connect(ForeignServer *server, UserMapping *user)
 		else
 			connstring = psprintf("http://%s:%d/", details.host, details.port);
 
-		conn = chfdw_http_connect(connstring);
+		conn = chfdw_http_connect(connstring, server->serverid);
 		pfree(connstring);
 		return conn;
 	}
@@ -16,13 +16,17 @@
 #include "access/heapam.h"
 #include "access/htup_details.h"
 #include "access/sysattr.h"
+#include "catalog/pg_aggregate.h"
+#include "catalog/pg_class.h"
 #include "catalog/pg_namespace.h"
 #include "catalog/pg_proc.h"
 #include "catalog/pg_type.h"
 #include "commands/defrem.h"
+#include "nodes/makefuncs.h"
 #include "nodes/nodeFuncs.h"
 #include "nodes/nodes.h"
 #include "nodes/primnodes.h"
+#include "optimizer/cost.h"
 #include "optimizer/tlist.h"
 #include "parser/parsetree.h"
 #include "utils/arrayaccess.h"
@@ -45,6 +49,9 @@
 
 #define MAXINT8LEN		25
 
+/* Conditions that keep more rows are not worth to be moved to PREWHERE */
+#define PREWHERE_MAX_SELECTIVITY	0.5
+
 /* variable counter */
 static uint32 var_counter = 0;
 
@@ -76,13 +83,45 @@ typedef struct deparse_expr_cxt
 								 * a base relation. */
 	StringInfo	buf;			/* output buffer to append to */
 	List	  **params_list;	/* exprs that will become remote Params */
+	List	  **param_kinds;	/* ChParamKind of each of params_list */
 	CustomObjectDef	*func;		/* custom function deparse */
 	void		*func_arg;		/* custom function context args */
 	CHFdwRelationInfo *fpinfo;	/* fdw relation info */
 	bool		interval_op;
 	bool		array_as_tuple;
+	Expr	   *top_qual;		/* condition being deparsed by appendConditions */
 } deparse_expr_cxt;
 
+/*
+ * Window functions that can be sent to ClickHouse.
+ *
+ * lag and lead are shipped only with an explicit default, ClickHouse
+ * returns the default value of the type instead of NULL otherwise.  They are
+ * evaluated over the whole partition, as in PostgreSQL.  first_value and
+ * last_value are missing because they skip NULLs in ClickHouse.
+ */
+typedef struct WindowFuncName
+{
+	const char *pgname;
+	const char *chname;
+	int			nargs;			/* -1 if any */
+	bool		whole_partition;	/* needs full frame in ClickHouse */
+} WindowFuncName;
+
+static const WindowFuncName window_funcs[] = {
+	{"row_number", "row_number", 0, false},
+	{"rank", "rank", 0, false},
+	{"dense_rank", "dense_rank", 0, false},
+	{"lag", "lagInFrame", 3, true},
+	{"lead", "leadInFrame", 3, true},
+	{"sum", "sum", 1, false},
+	{"min", "min", 1, false},
+	{"max", "max", 1, false},
+	{"avg", "avg", 1, false},
+	{"count", "count", -1, false},
+	{NULL, NULL, 0, false}
+};
+
 #define REL_ALIAS_PREFIX	"r"
 /* Handy macro to add relation name qualification */
 #define ADD_REL_QUALIFIER(buf, varno)	\
@@ -90,6 +129,14 @@ typedef struct deparse_expr_cxt
 #define SUBQUERY_REL_ALIAS_PREFIX	"s"
 #define SUBQUERY_COL_ALIAS_PREFIX	"c"
 
+/*
+ * Rows of CollapsingMergeTree count with their sign, and sampled rows with
+ * _sample_factor, in sum(), avg() and count().
+ */
+#define HAS_ROW_WEIGHT(fpinfo) \
+		((fpinfo)->ch_table_engine == CH_COLLAPSING_MERGE_TREE || \
+		 (fpinfo)->ch_sample_scale)
+
 /*
  * Functions to determine whether an expression can be evaluated safely on
  * remote server.
@@ -121,6 +168,9 @@ static void deparseReturningList(StringInfo buf, RangeTblEntry *rte,
 static void deparseColumnRef(StringInfo buf, CustomObjectDef *cdef,
 	int varno, int varattno, RangeTblEntry *rte, bool qualify_col);
 static void deparseRelation(StringInfo buf, Relation rel);
+static void get_remote_relation_name(Relation rel, char **dbname_out,
+						 char **relname_out);
+static void deparseStringLiteral(StringInfo buf, const char *val, bool quote);
 static void deparseExpr(Expr *expr, deparse_expr_cxt *context);
 static void deparseVar(Var *node, deparse_expr_cxt *context);
 static void deparseConst(Const *node, deparse_expr_cxt *context, int showtype);
@@ -145,21 +195,54 @@ static void printRemotePlaceholder(Oid paramtype, int32 paramtypmod,
 static void deparseSelectSql(List *tlist, bool is_subquery, List **retrieved_attrs,
 				 deparse_expr_cxt *context);
 static void deparseLockingClause(deparse_expr_cxt *context);
-static void appendOrderByClause(List *pathkeys, deparse_expr_cxt *context);
+static void appendOrderByClause(List *pathkeys, bool has_final_sort,
+					deparse_expr_cxt *context);
+static void appendLimitClause(deparse_expr_cxt *context);
+static void deparseLimitExpr(Node *node, int64 nullval, ChParamKind kind,
+				 deparse_expr_cxt *context);
+static int	get_param_index(Node *node, ChParamKind kind,
+							deparse_expr_cxt *context);
 static void appendConditions(List *exprs, deparse_expr_cxt *context);
 static void deparseFromExprForRel(StringInfo buf, PlannerInfo *root,
 					  RelOptInfo *foreignrel, bool use_alias,
 					  Index ignore_rel, List **ignore_conds,
-					  List **params_list);
-static void deparseFromExpr(List *quals, deparse_expr_cxt *context);
+					  List **params_list, List **param_kinds);
+static bool deparseFromExpr(List *quals, deparse_expr_cxt *context);
+static void appendDictionaryConds(RelOptInfo *rel, bool *has_where,
+					  deparse_expr_cxt *context);
+static RelOptInfo *find_dictionary_join(RelOptInfo *rel, Index varno);
+static void deparseDictionaryCall(const char *func, const char *attname,
+					  RelOptInfo *joinrel, deparse_expr_cxt *context);
+static void deparseDictionaryVar(Var *node, RelOptInfo *joinrel,
+					 deparse_expr_cxt *context);
+static void split_prewhere_conds(List *quals, deparse_expr_cxt *context,
+					 List **prewhere_conds, List **where_conds);
 static void deparseRangeTblRef(StringInfo buf, PlannerInfo *root,
 				   RelOptInfo *foreignrel, bool make_subquery,
-				   Index ignore_rel, List **ignore_conds, List **params_list);
+				   Index ignore_rel, List **ignore_conds, List **params_list,
+				   List **param_kinds);
 static void deparseAggref(Aggref *node, deparse_expr_cxt *context);
+static void deparseWindowFunc(WindowFunc *node, deparse_expr_cxt *context);
+static bool partial_agg_ok(Aggref *agg);
+static bool agg_order_is_default(Aggref *agg);
+static const char *template_placeholder(const char *p, int *n,
+										bool *is_const);
+static bool template_args_ok(const char *chtemplate, List *args);
+static List *aggregate_template_args(Aggref *agg);
+static void deparseFunctionTemplate(const char *chtemplate, List *args,
+						deparse_expr_cxt *context);
+static const WindowFuncName *find_window_func(Oid funcid);
+static WindowClause *find_window_clause(PlannerInfo *root, Index winref);
+static bool window_clause_is_shippable(WindowClause *wc,
+									   foreign_glob_cxt *glob_cxt,
+									   foreign_loc_cxt *outer_cxt);
 static void appendGroupByClause(List *tlist, deparse_expr_cxt *context);
+static void appendLimitByClause(List *tlist, deparse_expr_cxt *context);
 static void appendAggOrderBy(List *orderList, List *targetList,
 				 deparse_expr_cxt *context);
 static CustomObjectDef *appendFunctionName(Oid funcid, deparse_expr_cxt *context);
+static void appendRowWeight(StringInfo buf, CHFdwRelationInfo *fpinfo);
+static bool is_large_set(Const *node);
 static Node *deparseSortGroupClause(Index ref, List *tlist, bool force_colno,
 					   deparse_expr_cxt *context);
 static void deparseCoerceViaIO(CoerceViaIO *node, deparse_expr_cxt *context);
@@ -335,11 +418,11 @@ foreign_expr_walker(Node *node,
 	case T_Const:
 	break;
 	case T_Param:
-	{
-		/* We are not supporting param push down*/
-		return false;
-	}
-	break;
+		/*
+		 * Param values are substituted into the remote query at execution
+		 * time, see substitute_query_params().
+		 */
+		break;
 	case T_SubscriptingRef:
 	{
 		SubscriptingRef   *ar = (SubscriptingRef *) node;
@@ -387,6 +470,10 @@ foreign_expr_walker(Node *node,
 		if (cdef && cdef->cf_type == CF_ISTORE_ACCUMULATE && (!IsA(linitial(fe->args), Var)))
 			return false;
 
+		if (cdef && cdef->cf_type == CF_CH_TEMPLATE &&
+				!template_args_ok(cdef->chtemplate, fe->args))
+			return false;
+
 		/*
 		 * Recurse to input subexpressions.
 		 */
@@ -513,21 +600,50 @@ foreign_expr_walker(Node *node,
 	{
 		Aggref	   *agg = (Aggref *) node;
 		ListCell   *lc;
+		CustomObjectDef	*cdef = NULL;
+		bool		templated;
 
 		/* Not safe to pushdown when not in grouping context */
 		if (!IS_UPPER_REL(glob_cxt->foreignrel))
 			return false;
 
-		/* Only non-split aggregates are pushable. */
-		if (agg->aggsplit != AGGSPLIT_SIMPLE)
+		/*
+		 * Only non-split aggregates are pushable, and partial ones which
+		 * transition state is the same as the result of the aggregate.
+		 */
+		if (agg->aggsplit != AGGSPLIT_SIMPLE && !partial_agg_ok(agg))
 			return false;
 
 		/* As usual, it must be shippable. */
-		if (!chfdw_is_shippable(agg->aggfnoid, ProcedureRelationId, fpinfo, NULL))
+		if (!chfdw_is_shippable(agg->aggfnoid, ProcedureRelationId, fpinfo, &cdef))
 			return false;
 
+		templated = (cdef && cdef->cf_type == CF_CH_TEMPLATE);
+		if (templated)
+		{
+			/*
+			 * Template is the whole call, there is no place for DISTINCT,
+			 * If or State suffixes. Direct arguments of ordered-set
+			 * aggregates come first in the placeholders.
+			 */
+			if (agg->aggsplit != AGGSPLIT_SIMPLE || agg->aggdistinct ||
+					agg->aggfilter)
+				return false;
+
+			if (!template_args_ok(cdef->chtemplate,
+								  aggregate_template_args(agg)))
+				return false;
+
+			if (agg->aggorder && !(AGGKIND_IS_ORDERED_SET(agg->aggkind) &&
+					agg_order_is_default(agg)))
+				return false;
+
+			if (!foreign_expr_walker((Node *) agg->aggdirectargs,
+									 glob_cxt, &inner_cxt))
+				return false;
+		}
 		/* Features that ClickHouse doesn't support */
-		if (agg->aggorder)
+		else if (agg->aggorder)
 			return false;
 
 		if (agg->aggdistinct && agg->aggfilter)
@@ -558,7 +674,12 @@ foreign_expr_walker(Node *node,
 				return false;
 
 			if (inner_cxt.found_aggregation_func)
+			{
+				if (templated)
+					return false;
+
 				agg->location = -2;
+			}
 		}
 
 		/* Check aggregate filter */
@@ -567,6 +688,40 @@ foreign_expr_walker(Node *node,
 			return false;
 	}
 	break;
+	case T_WindowFunc:
+	{
+		WindowFunc *wf = (WindowFunc *) node;
+		CHFdwRelationInfo *ofpinfo;
+
+		/* Not safe to pushdown when not in window context */
+		if (!IS_UPPER_REL(glob_cxt->foreignrel) ||
+		        fpinfo->stage != UPPERREL_WINDOW)
+			return false;
+
+		/* Only functions that have a counterpart in ClickHouse */
+		if (find_window_func(wf->winfnoid) == NULL)
+			return false;
+
+		if (wf->aggfilter)
+			return false;
+
+		/*
+		 * Sign of CollapsingMergeTree and _sample_factor are only handled
+		 * with GROUP BY
+		 */
+		ofpinfo = (CHFdwRelationInfo *) fpinfo->outerrel->fdw_private;
+		if (wf->winagg && HAS_ROW_WEIGHT(ofpinfo))
+			return false;
+
+		if (!foreign_expr_walker((Node *) wf->args, glob_cxt, &inner_cxt))
+			return false;
+
+		if (!window_clause_is_shippable(find_window_clause(glob_cxt->root,
+		                                                   wf->winref),
+		                                glob_cxt, &inner_cxt))
+			return false;
+	}
+	break;
 	case T_CaseExpr:
 	{
 		CaseExpr   *caseexpr = (CaseExpr *) node;
@@ -900,27 +1055,37 @@ chfdw_build_tlist_to_deparse(RelOptInfo *foreignrel)
  *
  * If params_list is not NULL, it receives a list of Params and other-relation
  * Vars used in the clauses; these values must be transmitted to the remote
- * server as parameter values.
+ * server as parameter values.  param_kinds receives how each of them is used
+ * in the query (ChParamKind).
  *
  * If params_list is NULL, we're generating the query for EXPLAIN purposes,
  * so Params and other-relation Vars should be replaced by dummy values.
  *
  * pathkeys is the list of pathkeys to order the result by.
  *
+ * has_final_sort means that pathkeys came from the final sort of the query
+ * and sort expressions should be looked up in the relation's target.
+ * has_limit means that LIMIT/OFFSET of the query should be added.
+ *
  * is_subquery is the flag to indicate whether to deparse the specified
  * relation as a subquery.
  *
  * List of columns selected is returned in retrieved_attrs.
+ *
+ * Returns true if the statement has WHERE clause, some conditions of base
+ * relations could be moved to PREWHERE.
  */
-void
+bool
 chfdw_deparse_select_stmt_for_rel(StringInfo buf, PlannerInfo *root, RelOptInfo *rel,
 						List *tlist, List *remote_conds, List *pathkeys,
+						bool has_final_sort, bool has_limit,
 						bool is_subquery, List **retrieved_attrs,
-						List **params_list)
+						List **params_list, List **param_kinds)
 {
 	deparse_expr_cxt context;
 	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) rel->fdw_private;
 	List	   *quals;
+	bool		has_where;
 
 	elog(DEBUG2, "> %s:%d", __FUNCTION__, __LINE__);
 	/*
@@ -935,9 +1100,11 @@ chfdw_deparse_select_stmt_for_rel(StringInfo buf, PlannerInfo *root, RelOptInfo
 	context.foreignrel = rel;
 	context.scanrel = IS_UPPER_REL(rel) ? fpinfo->outerrel : rel;
 	context.params_list = params_list;
+	context.param_kinds = param_kinds;
 	context.func = NULL;
 	context.interval_op = false;
 	context.array_as_tuple = false;
+	context.top_qual = NULL;
 
 	/* Construct SELECT clause */
 	deparseSelectSql(tlist, is_subquery, retrieved_attrs, &context);
@@ -958,9 +1125,10 @@ chfdw_deparse_select_stmt_for_rel(StringInfo buf, PlannerInfo *root, RelOptInfo
 		quals = remote_conds;
 
 	/* Construct FROM and WHERE clauses */
-	deparseFromExpr(quals, &context);
+	has_where = deparseFromExpr(quals, &context);
 
-	if (IS_UPPER_REL(rel))
+	if (IS_UPPER_REL(rel) && (fpinfo->stage == UPPERREL_GROUP_AGG ||
+							  fpinfo->stage == UPPERREL_PARTIAL_GROUP_AGG))
 	{
 		/* Append GROUP BY clause */
 		appendGroupByClause(tlist, &context);
@@ -975,7 +1143,27 @@ chfdw_deparse_select_stmt_for_rel(StringInfo buf, PlannerInfo *root, RelOptInfo
 
 	/* Add ORDER BY clause if we found any useful pathkeys */
 	if (pathkeys)
-		appendOrderByClause(pathkeys, &context);
+		appendOrderByClause(pathkeys, has_final_sort, &context);
+
+	if (IS_UPPER_REL(rel) && fpinfo->stage == UPPERREL_DISTINCT &&
+		root->parse->hasDistinctOn)
+	{
+		/*
+		 * DISTINCT ON is deparsed as LIMIT 1 BY, which takes the first row of
+		 * each group in ORDER BY order, so the rows must be sorted by the
+		 * DISTINCT ON expressions at least.
+		 */
+		if (!pathkeys)
+			appendOrderByClause(root->distinct_pathkeys, true, &context);
+
+		appendLimitByClause(tlist, &context);
+	}
+
+	/* Add LIMIT clause if necessary */
+	if (has_limit)
+		appendLimitClause(&context);
+
+	return has_where;
 }
 
 /*
@@ -1019,6 +1207,12 @@ deparseSelectSql(List *tlist, bool is_subquery, List **retrieved_attrs,
 	}
 	else if (IS_JOIN_REL(foreignrel) || IS_UPPER_REL(foreignrel))
 	{
+		/* Plain DISTINCT maps to DISTINCT, DISTINCT ON to LIMIT BY */
+		if (IS_UPPER_REL(foreignrel) &&
+			fpinfo->stage == UPPERREL_DISTINCT &&
+			!root->parse->hasDistinctOn)
+			appendStringInfoString(buf, "DISTINCT ");
+
 		/*
 		 * For a join or upper relation the input tlist gives the list of
 		 * columns required to be fetched from the foreign server.
@@ -1047,17 +1241,22 @@ deparseSelectSql(List *tlist, bool is_subquery, List **retrieved_attrs,
 }
 
 /*
- * Construct a FROM clause and, if needed, a WHERE clause, and append those to
- * "buf".
+ * Construct a FROM clause and, if needed, PREWHERE and WHERE clauses, and
+ * append those to "buf".
  *
  * quals is the list of clauses to be included in the WHERE clause.
  * (These may or may not include RestrictInfo decoration.)
+ *
+ * Returns true if WHERE clause was added.
  */
-static void
+static bool
 deparseFromExpr(List *quals, deparse_expr_cxt *context)
 {
 	StringInfo	buf = context->buf;
 	RelOptInfo *scanrel = context->scanrel;
+	List	   *prewhere_conds;
+	List	   *where_conds;
+	bool		has_where;
 
 	/* For upper relations, scanrel must be either a joinrel or a baserel */
 	Assert(!IS_UPPER_REL(context->foreignrel) ||
@@ -1069,11 +1268,192 @@ deparseFromExpr(List *quals, deparse_expr_cxt *context)
 						  (bms_num_members(scanrel->relids) > 1),
 						  (Index) 0, NULL, context->params_list);
 
-	/* Construct WHERE clause */
-	if (quals != NIL)
+	/* Sampled tables are never joined remotely */
+	if (IS_SIMPLE_REL(scanrel))
+	{
+		CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) scanrel->fdw_private;
+
+		if (fpinfo->ch_sample)
+			appendStringInfo(buf, " SAMPLE %s", fpinfo->ch_sample);
+	}
+
+	/* Construct PREWHERE and WHERE clauses */
+	split_prewhere_conds(quals, context, &prewhere_conds, &where_conds);
+	if (prewhere_conds != NIL)
+	{
+		appendStringInfoString(buf, " PREWHERE ");
+		appendConditions(prewhere_conds, context);
+	}
+
+	if (where_conds != NIL)
 	{
 		appendStringInfoString(buf, " WHERE ");
-		appendConditions(quals, context);
+		appendConditions(where_conds, context);
+	}
+
+	has_where = (where_conds != NIL);
+	appendDictionaryConds(scanrel, &has_where, context);
+
+	return has_where;
+}
+
+/*
+ * Inner joins replaced by lookups in dictionaries keep only the rows that
+ * have their keys in the dictionaries, add such conditions to WHERE clause.
+ * Dictionary joins are on the outer sides of the joins only, so the rows
+ * can be filtered after all joins.
+ */
+static void
+appendDictionaryConds(RelOptInfo *rel, bool *has_where,
+					  deparse_expr_cxt *context)
+{
+	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) rel->fdw_private;
+
+	if (!IS_JOIN_REL(rel) || bms_is_empty(fpinfo->ch_dict_rels))
+		return;
+
+	if (fpinfo->ch_dict_key && fpinfo->jointype == JOIN_INNER)
+	{
+		appendStringInfoString(context->buf, *has_where ? " AND (" : " WHERE (");
+		deparseDictionaryCall("dictHas", NULL, rel, context);
+		appendStringInfoChar(context->buf, ')');
+		*has_where = true;
+	}
+
+	appendDictionaryConds(fpinfo->outerrel, has_where, context);
+}
+
+/*
+ * Find the join under rel that replaced the dictionary table varno by
+ * lookups, or return NULL.
+ */
+static RelOptInfo *
+find_dictionary_join(RelOptInfo *rel, Index varno)
+{
+	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) rel->fdw_private;
+
+	if (!IS_JOIN_REL(rel) || !bms_is_member(varno, fpinfo->ch_dict_rels))
+		return NULL;
+
+	if (fpinfo->ch_dict_key && bms_is_member(varno, fpinfo->innerrel->relids))
+		return rel;
+
+	return find_dictionary_join(fpinfo->outerrel, varno);
+}
+
+/*
+ * Deparse func('dictionary', 'attname', key) for the dictionary join, or
+ * func('dictionary', key) without attname.  Dictionaries with a simple key
+ * are looked up by UInt64, others by a tuple.
+ */
+static void
+deparseDictionaryCall(const char *func, const char *attname,
+					  RelOptInfo *joinrel, deparse_expr_cxt *context)
+{
+	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) joinrel->fdw_private;
+	CHFdwRelationInfo *fpinfo_d = (CHFdwRelationInfo *) fpinfo->innerrel->fdw_private;
+	StringInfo	buf = context->buf;
+	Oid			keytype = exprType((Node *) fpinfo->ch_dict_key);
+
+	appendStringInfo(buf, "%s(", func);
+	deparseStringLiteral(buf, fpinfo_d->ch_dictionary, true);
+	if (attname)
+	{
+		appendStringInfoString(buf, ", ");
+		deparseStringLiteral(buf, attname, true);
+	}
+	if (keytype == INT2OID || keytype == INT4OID || keytype == INT8OID)
+		appendStringInfoString(buf, ", toUInt64(");
+	else
+		appendStringInfoString(buf, ", tuple(");
+	deparseExpr(fpinfo->ch_dict_key, context);
+	appendStringInfoString(buf, "))");
+}
+
+/*
+ * Deparse a column of the dictionary table replaced by the join.  The key
+ * column is the key itself.  Left joins check that the key exists and give
+ * NULLs otherwise, where dictGet would return default values.
+ */
+static void
+deparseDictionaryVar(Var *node, RelOptInfo *joinrel, deparse_expr_cxt *context)
+{
+	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) joinrel->fdw_private;
+	CHFdwRelationInfo *fpinfo_d = (CHFdwRelationInfo *) fpinfo->innerrel->fdw_private;
+	StringInfo	buf = context->buf;
+	bool		nullable = (fpinfo->jointype == JOIN_LEFT);
+
+	if (node->varattno <= 0)
+		elog(ERROR, "ClickHouse does not support system attributes");
+
+	if (nullable)
+	{
+		appendStringInfoString(buf, "if(");
+		deparseDictionaryCall("dictHas", NULL, joinrel, context);
+		appendStringInfoString(buf, ", ");
+	}
+
+	if (node->varattno == fpinfo_d->ch_dictionary_key)
+		deparseExpr(fpinfo->ch_dict_key, context);
+	else
+	{
+		RangeTblEntry *rte = planner_rt_fetch(node->varno, context->root);
+		CustomColumnInfo *cinfo;
+
+		cinfo = chfdw_get_custom_column_info(rte->relid, node->varattno);
+		deparseDictionaryCall("dictGet", cinfo ? cinfo->colname :
+							  get_attname(rte->relid, node->varattno, false),
+							  joinrel, context);
+	}
+
+	if (nullable)
+		appendStringInfoString(buf, ", NULL)");
+}
+
+/*
+ * Split conditions of a base relation between PREWHERE and WHERE clauses.
+ *
+ * MergeTree tables read columns used in PREWHERE first, and the rest of
+ * the columns only for the granules that passed it.  So selective conditions
+ * that use only columns listed in ch_prewhere_attrs go there.
+ */
+static void
+split_prewhere_conds(List *quals, deparse_expr_cxt *context,
+					 List **prewhere_conds, List **where_conds)
+{
+	RelOptInfo *scanrel = context->scanrel;
+	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) scanrel->fdw_private;
+	ListCell   *lc;
+
+	*prewhere_conds = NIL;
+	*where_conds = NIL;
+
+	if (!IS_SIMPLE_REL(scanrel) || bms_is_empty(fpinfo->ch_prewhere_attrs))
+	{
+		*where_conds = quals;
+		return;
+	}
+
+	foreach (lc, quals)
+	{
+		Node	   *node = (Node *) lfirst(lc);
+		Node	   *clause = node;
+		Bitmapset  *attrs = NULL;
+
+		if (IsA(node, RestrictInfo))
+			clause = (Node *) ((RestrictInfo *) node)->clause;
+
+		pull_varattnos(clause, scanrel->relid, &attrs);
+
+		if (!bms_is_empty(attrs) &&
+				bms_is_subset(attrs, fpinfo->ch_prewhere_attrs) &&
+				clause_selectivity(context->root, node, 0, JOIN_INNER,
+								   NULL) <= PREWHERE_MAX_SELECTIVITY)
+			*prewhere_conds = lappend(*prewhere_conds, node);
+		else
+			*where_conds = lappend(*where_conds, node);
+
+		bms_free(attrs);
 	}
 }
 
@@ -1182,7 +1562,9 @@ appendConditions(List *exprs, deparse_expr_cxt *context)
 		}
 
 		appendStringInfoChar(buf, '(');
+		context->top_qual = expr;
 		deparseExpr(expr, context);
+		context->top_qual = NULL;
 		appendStringInfoChar(buf, ')');
 
 		is_first = false;
@@ -1207,6 +1589,12 @@ chfdw_get_jointype_name(JoinType jointype)
 	case JOIN_FULL:
 		return "FULL";
 
+	case JOIN_SEMI:
+		return "SEMI";
+
+	case JOIN_ANTI:
+		return "ANTI";
+
 	default:
 		/* Shouldn't come here, but protect from buggy code. */
 		elog(ERROR, "unsupported join type %d", jointype);
@@ -1302,7 +1690,7 @@ deparseSubqueryTargetList(deparse_expr_cxt *context)
 static void
 deparseFromExprForRel(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
                       bool use_alias, Index ignore_rel, List **ignore_conds,
-                      List **params_list)
+                      List **params_list, List **param_kinds)
 {
 	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) foreignrel->fdw_private;
 
@@ -1315,6 +1703,16 @@ deparseFromExprForRel(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
 		bool		outerrel_is_target = false;
 		bool		innerrel_is_target = false;
 
+		/* The dictionary table is replaced by lookups in the dictionary */
+		if (fpinfo->ch_dict_key)
+		{
+			deparseRangeTblRef(buf, root, outerrel,
+			                   fpinfo->make_outerrel_subquery,
+			                   ignore_rel, ignore_conds, params_list,
+			                   param_kinds);
+			return;
+		}
+
 		if (ignore_rel > 0 && bms_is_member(ignore_rel, foreignrel->relids))
 		{
 			/*
@@ -1354,7 +1752,8 @@ deparseFromExprForRel(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
 			initStringInfo(&join_sql_o);
 			deparseRangeTblRef(&join_sql_o, root, outerrel,
 			                   fpinfo->make_outerrel_subquery,
-			                   ignore_rel, ignore_conds, params_list);
+			                   ignore_rel, ignore_conds, params_list,
+			                   param_kinds);
 
 			/*
 			 * If inner relation is the target relation, skip deparsing it.
@@ -1380,7 +1779,8 @@ deparseFromExprForRel(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
 			initStringInfo(&join_sql_i);
 			deparseRangeTblRef(&join_sql_i, root, innerrel,
 			                   fpinfo->make_innerrel_subquery,
-			                   ignore_rel, ignore_conds, params_list);
+			                   ignore_rel, ignore_conds, params_list,
+			                   param_kinds);
 
 			/*
 			 * If outer relation is the target relation, skip deparsing it.
@@ -1402,9 +1802,19 @@ deparseFromExprForRel(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
 		 * For a join relation FROM clause entry is deparsed as
 		 *
 		 * ((outer relation) <join type> (inner relation) ON (joinclauses))
+		 *
+		 * SEMI and ANTI joins map to ClickHouse LEFT SEMI and LEFT ANTI
+		 * joins, which return each outer row at most once.  Rows with NULL
+		 * keys never match, like in PostgreSQL.
 		 */
-		appendStringInfo(buf, " %s ALL %s JOIN %s ON ", join_sql_o.data,
-		                 chfdw_get_jointype_name(fpinfo->jointype), join_sql_i.data);
+		if (fpinfo->jointype == JOIN_SEMI || fpinfo->jointype == JOIN_ANTI)
+			appendStringInfo(buf, " %s LEFT %s JOIN %s ON ", join_sql_o.data,
+			                 chfdw_get_jointype_name(fpinfo->jointype),
+			                 join_sql_i.data);
+		else
+			appendStringInfo(buf, " %s ALL %s JOIN %s ON ", join_sql_o.data,
+			                 chfdw_get_jointype_name(fpinfo->jointype),
+			                 join_sql_i.data);
 
 		/* Append join clause; (TRUE) if no join clause */
 		if (fpinfo->joinclauses)
@@ -1416,9 +1826,11 @@ deparseFromExprForRel(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
 			context.scanrel = foreignrel;
 			context.root = root;
 			context.params_list = params_list;
+			context.param_kinds = param_kinds;
 			context.func = NULL;
 			context.interval_op = false;
 			context.array_as_tuple = false;
+			context.top_qual = NULL;
 
 			appendStringInfoChar(buf, '(');
 			appendConditions(fpinfo->joinclauses, &context);
@@ -1461,7 +1873,7 @@ deparseFromExprForRel(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
 static void
 deparseRangeTblRef(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
                    bool make_subquery, Index ignore_rel, List **ignore_conds,
-                   List **params_list)
+                   List **params_list, List **param_kinds)
 {
 	CHFdwRelationInfo *fpinfo = (CHFdwRelationInfo *) foreignrel->fdw_private;
 
@@ -1487,8 +1899,8 @@ deparseRangeTblRef(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
 		/* Deparse the subquery representing the relation. */
 		appendStringInfoChar(buf, '(');
 		chfdw_deparse_select_stmt_for_rel(buf, root, foreignrel, NIL,
-		                        fpinfo->remote_conds, NIL, true,
-		                        &retrieved_attrs, params_list);
+		                        fpinfo->remote_conds, NIL, false, false, true,
+		                        &retrieved_attrs, params_list, param_kinds);
 		appendStringInfoChar(buf, ')');
 
 		/* Append the relation alias. */
@@ -1520,7 +1932,7 @@ deparseRangeTblRef(StringInfo buf, PlannerInfo *root, RelOptInfo *foreignrel,
 	}
 	else
 		deparseFromExprForRel(buf, root, foreignrel, true, ignore_rel,
-		                      ignore_conds, params_list);
+		                      ignore_conds, params_list, param_kinds);
 }
 
 /*
@@ -1562,6 +1974,89 @@ chfdw_deparse_insert_sql(StringInfo buf, RangeTblEntry *rte,
 	return table_name.data;
 }
 
+/*
+ * Construct a query that fetches the number of rows and the sampling key
+ * of the remote table from system.tables.
+ *
+ * Both columns are returned as strings, so they can be read in the same way
+ * by both drivers.  total_rows is NULL for engines that don't track it,
+ * in that case an empty string is returned.
+ */
+void
+chfdw_deparse_analyze_info_sql(StringInfo buf, Relation rel)
+{
+	char	   *dbname;
+	char	   *relname;
+
+	get_remote_relation_name(rel, &dbname, &relname);
+
+	appendStringInfoString(buf, "SELECT ifNull(toString(total_rows), ''), "
+			"sampling_key FROM system.tables WHERE database = ");
+	deparseStringLiteral(buf, dbname, true);
+	appendStringInfoString(buf, " AND name = ");
+	deparseStringLiteral(buf, relname, true);
+}
+
+/*
+ * Construct a condition that selects one slice of the table in a parallel
+ * scan.  Rows are distributed between nslices slices by the hash of
+ * parallel_key, the number of the slice is appended by the executor.
+ */
+void
+chfdw_deparse_slice_cond(StringInfo buf, const char *parallel_key,
+						 int nslices, bool has_where)
+{
+	appendStringInfo(buf, " %s (cityHash64(%s) %% %d) = ",
+					 has_where ? "AND" : "WHERE", parallel_key, nslices);
+}
+
+/*
+ * Construct a query that fetches random sample rows of the remote table.
+ *
+ * samplerows is the number of rows we want to read out of totalrows.  If
+ * the table has a sampling key we use SAMPLE clause with the number of rows,
+ * so ClickHouse reads only that part of the data and computes the ratio
+ * itself: a fraction printed by us could be rounded to zero for a very big
+ * table and SAMPLE 0 means the whole table.  Otherwise rows are filtered by
+ * rand().  In both cases result is limited by targrows.  All columns of the
+ * relation are fetched, the list of them is returned in retrieved_attrs.
+ */
+void
+chfdw_deparse_analyze_sql(StringInfo buf, Relation rel, double samplerows,
+						  double totalrows, bool has_sampling_key,
+						  int targrows, List **retrieved_attrs)
+{
+	RangeTblEntry  *rte = makeNode(RangeTblEntry);
+	Bitmapset	   *attrs_used;
+
+	rte->rtekind = RTE_RELATION;
+	rte->relid = RelationGetRelid(rel);
+	rte->relkind = RELKIND_FOREIGN_TABLE;
+
+	/* whole row reference fetches all columns */
+	attrs_used = bms_make_singleton(0 - FirstLowInvalidHeapAttributeNumber);
+
+	appendStringInfoString(buf, "SELECT ");
+	deparseTargetList(buf, rte, 1, rel, attrs_used, false, retrieved_attrs);
+	appendStringInfoString(buf, " FROM ");
+	deparseRelation(buf, rel);
+
+	if (samplerows < totalrows)
+	{
+		if (has_sampling_key)
+			appendStringInfo(buf, " SAMPLE %.0f", samplerows);
+		else
+		{
+			/* rand() returns UInt32, never let the threshold drop to zero */
+			uint32	threshold = samplerows / totalrows * PG_UINT32_MAX;
+
+			appendStringInfo(buf, " WHERE rand() <= %u", Max(threshold, 1));
+		}
+	}
+
+	appendStringInfo(buf, " LIMIT %d", targrows);
+}
+
 /*
  * Construct name to use for given column, and emit it into buf.
  * If it has a column_name FDW option, use that instead of attribute name.
@@ -1685,9 +2180,33 @@ deparseColumnRef(StringInfo buf, CustomObjectDef *cdef,
  */
 static void
 deparseRelation(StringInfo buf, Relation rel)
+{
+	char       *dbname;
+	char       *relname;
+
+	get_remote_relation_name(rel, &dbname, &relname);
+	appendStringInfo(buf, "%s.%s", quote_identifier(dbname),
+	                 quote_identifier(relname));
+}
+
+/*
+ * Append remote name of specified foreign table to buf, exported version
+ * of deparseRelation.
+ */
+void
+chfdw_deparse_relation_name(StringInfo buf, Relation rel)
+{
+	deparseRelation(buf, rel);
+}
+
+/*
+ * Get remote database and table names of specified foreign table.
+ */
+static void
+get_remote_relation_name(Relation rel, char **dbname_out, char **relname_out)
 {
 	ForeignTable *table;
-	const char *relname = NULL;
+	char       *relname = NULL;
 	char       *dbname = "default";
 	ForeignServer *server = chfdw_get_foreign_server(rel);
 	ListCell    *lc;
@@ -1714,8 +2233,8 @@ deparseRelation(StringInfo buf, Relation rel)
 		relname = RelationGetRelationName(rel);
 	}
 
-	appendStringInfo(buf, "%s.%s", quote_identifier(dbname),
-	                 quote_identifier(relname));
+	*dbname_out = dbname;
+	*relname_out = relname;
 }
 
 /*
@@ -1811,6 +2330,9 @@ deparseExpr(Expr *node, deparse_expr_cxt *context)
 	case T_Aggref:
 		deparseAggref((Aggref *) node, context);
 		break;
+	case T_WindowFunc:
+		deparseWindowFunc((WindowFunc *) node, context);
+		break;
 	case T_CaseExpr:
 		deparseCaseExpr((CaseExpr *) node, context);
 		break;
@@ -1829,6 +2351,9 @@ deparseExpr(Expr *node, deparse_expr_cxt *context)
 	case T_RowExpr:
 		deparseRowExpr((RowExpr *) node, context);
 		break;
+	case T_Param:
+		deparseParam((Param *) node, context);
+		break;
 	default:
 		elog(ERROR, "unsupported expression type for deparse: %d",
 		     (int) nodeTag(node));
@@ -1873,28 +2398,147 @@ deparseVar(Var *node, deparse_expr_cxt *context)
 		cdef = chfdw_check_for_custom_type(node->vartype);
 
 	if (bms_is_member(node->varno, relids) && node->varlevelsup == 0)
-		deparseColumnRef(context->buf, cdef,
-						 node->varno, node->varattno,
-						 planner_rt_fetch(node->varno, context->root),
-		                 qualify_col);
+	{
+		RelOptInfo *dictjoin = find_dictionary_join(context->scanrel,
+													node->varno);
+
+		/* columns of dictionary tables are looked up in the dictionaries */
+		if (dictjoin)
+			deparseDictionaryVar(node, dictjoin, context);
+		else
+			deparseColumnRef(context->buf, cdef,
+							 node->varno, node->varattno,
+							 planner_rt_fetch(node->varno, context->root),
+							 qualify_col);
+	}
 	else
-		elog(ERROR, "clickhouse_fdw does not support params");
-}
+	{
+		/* Treat like a Param */
+		if (context->params_list)
+		{
+			int			pindex = get_param_index((Node *) node,
+												 CH_PARAM_VALUE, context);
 
-#define USE_ISO_DATES			1
+			printRemoteParam(pindex, node->vartype, node->vartypmod, context);
+		}
+		else
+		{
+			printRemotePlaceholder(node->vartype, node->vartypmod, context);
+		}
+	}
+}
 
-Datum
-ch_time_out(PG_FUNCTION_ARGS)
+/*
+ * Deparse given Param node.
+ *
+ * If we're generating the query "for real", add the Param to
+ * context->params_list if it's not already present, and then use its index
+ * in that list as the remote parameter number.  During EXPLAIN, there's
+ * no need to identify a parameter number.
+ */
+static void
+deparseParam(Param *node, deparse_expr_cxt *context)
 {
-	TimeADT		time = PG_GETARG_TIMEADT(0);
-	char	   *result;
-	struct pg_tm tt,
-			   *tm = &tt;
-	fsec_t		fsec;
-	char		buf[MAXDATELEN + 1];
+	if (context->params_list)
+	{
+		int			pindex = get_param_index((Node *) node, CH_PARAM_VALUE,
+											 context);
 
-	time2tm(time, tm, &fsec);
-	EncodeTimeOnly(tm, fsec, false, 0, USE_ISO_DATES, buf);
+		printRemoteParam(pindex, node->paramtype, node->paramtypmod, context);
+	}
+	else
+	{
+		printRemotePlaceholder(node->paramtype, node->paramtypmod, context);
+	}
+}
+
+/*
+ * Find index of the expression used as kind in context->params_list, add it
+ * to the list if it's not already present.  Indexes start from 1.
+ */
+static int
+get_param_index(Node *node, ChParamKind kind, deparse_expr_cxt *context)
+{
+	int			pindex = 0;
+	ListCell   *lc,
+			   *lc2;
+
+	forboth(lc, *context->params_list, lc2, *context->param_kinds)
+	{
+		pindex++;
+		if (lfirst_int(lc2) == kind && equal(node, (Node *) lfirst(lc)))
+			return pindex;
+	}
+
+	/* not in list, so add it */
+	*context->params_list = lappend(*context->params_list, node);
+	*context->param_kinds = lappend_int(*context->param_kinds, kind);
+	return pindex + 1;
+}
+
+/*
+ * Print the representation of a parameter to be sent to the remote side.
+ *
+ * ClickHouse has no prepared statements, so we print $N placeholder that
+ * is replaced by the literal value of the parameter just before the query
+ * is sent (see chfdw_deparse_literal).
+ */
+static void
+printRemoteParam(int paramindex, Oid paramtype, int32 paramtypmod,
+				 deparse_expr_cxt *context)
+{
+	appendStringInfo(context->buf, "$%d", paramindex);
+}
+
+/*
+ * Print the representation of a placeholder for a parameter that will be
+ * sent to the remote side at execution time.
+ *
+ * This is used when we're just trying to EXPLAIN the remote query.
+ */
+static void
+printRemotePlaceholder(Oid paramtype, int32 paramtypmod,
+					   deparse_expr_cxt *context)
+{
+	appendStringInfoString(context->buf, "NULL");
+}
+
+/*
+ * Append ClickHouse literal of given value to buf.
+ *
+ * Used to substitute values of parameters in the remote query, the value is
+ * printed in the same way as constants in the query.
+ */
+void
+chfdw_deparse_literal(StringInfo buf, Datum value, bool isnull,
+					  Oid type, int32 typmod)
+{
+	deparse_expr_cxt context;
+	Const	   *node;
+
+	memset(&context, 0, sizeof(context));
+	context.buf = buf;
+
+	node = makeConst(type, typmod, InvalidOid, get_typlen(type), value,
+					 isnull, get_typbyval(type));
+	deparseConst(node, &context, 0);
+	pfree(node);
+}
+
+#define USE_ISO_DATES			1
+
+Datum
+ch_time_out(PG_FUNCTION_ARGS)
+{
+	TimeADT		time = PG_GETARG_TIMEADT(0);
+	char	   *result;
+	struct pg_tm tt,
+			   *tm = &tt;
+	fsec_t		fsec;
+	char		buf[MAXDATELEN + 1];
+
+	time2tm(time, tm, &fsec);
+	EncodeTimeOnly(tm, fsec, false, 0, USE_ISO_DATES, buf);
 
 	result = pstrdup(buf);
 	PG_RETURN_CSTRING(result);
@@ -2263,6 +2907,14 @@ deparseFuncExpr(FuncExpr *node, deparse_expr_cxt *context)
 	CustomObjectDef	 funcdef;
 	CHFdwRelationInfo *fpinfo = context->scanrel->fdw_private;
 
+	/* Mapped functions are deparsed as is, even casts */
+	cdef = chfdw_check_for_custom_function(node->funcid);
+	if (cdef && cdef->cf_type == CF_CH_TEMPLATE)
+	{
+		deparseFunctionTemplate(cdef->chtemplate, node->args, context);
+		return;
+	}
+
 	/*
 	 * If the function call came from an implicit coercion, then just show the
 	 * first argument.
@@ -2947,12 +3599,445 @@ static void deparseAsIn(ScalarArrayOpExpr *node, deparse_expr_cxt *context, int
 	else
 		appendStringInfoString(buf, " NOT IN ");
 
-	Assert(IsA(arg2, Const));
+	Assert(IsA(arg2, Const) || IsA(arg2, Param));
+
+	/*
+	 * Large constant sets are sent as parameters like the sets known only at
+	 * execution, so the query text doesn't depend on the values.  Like those
+	 * they lose NULL elements, so only conditions which filter rows use them.
+	 */
+	if (IsA(arg2, Const) && context->params_list &&
+		(Expr *) node == context->top_qual && is_large_set((Const *) arg2))
+	{
+		printRemoteParam(get_param_index((Node *) arg2, CH_PARAM_SET, context),
+						 ((Const *) arg2)->consttype, -1, context);
+		return;
+	}
+
+	if (IsA(arg2, Param))
+	{
+		printRemoteParam(get_param_index((Node *) arg2, CH_PARAM_SET, context),
+						 ((Param *) arg2)->paramtype, -1, context);
+		return;
+	}
+
 	context->array_as_tuple = true;
 	deparseExpr(arg2, context);
 	context->array_as_tuple = false;
 }
 
+/*
+ * Check that the constant array would be sent as an external table, see
+ * make_param_set().
+ */
+static bool
+is_large_set(Const *node)
+{
+	ArrayType  *arr;
+	Oid			elemtype;
+
+	if (node->constisnull)
+		return false;
+
+	elemtype = get_element_type(node->consttype);
+	if (chfdw_external_type_name(elemtype) == NULL)
+		return false;
+
+	arr = DatumGetArrayTypeP(node->constvalue);
+	return (ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr)) >= EXTERNAL_TABLE_MIN_VALUES &&
+			!ARR_HASNULL(arr));
+}
+
+/*
+ * Check that the partial aggregate can be computed by ClickHouse.
+ *
+ * ClickHouse aggregate states (-State combinators) can't be combined by
+ * PostgreSQL, so we only send aggregates without final function and with
+ * non-internal transition state, like count, sum of integers, min and max.
+ * For these the transition state is the result of the aggregate itself.
+ */
+static bool
+partial_agg_ok(Aggref *agg)
+{
+	HeapTuple	aggtup;
+	Form_pg_aggregate aggform;
+	bool		res;
+
+	if (agg->aggsplit != AGGSPLIT_INITIAL_SERIAL)
+		return false;
+
+	aggtup = SearchSysCache1(AGGFNOID, ObjectIdGetDatum(agg->aggfnoid));
+	if (!HeapTupleIsValid(aggtup))
+		elog(ERROR, "cache lookup failed for aggregate %u", agg->aggfnoid);
+	aggform = (Form_pg_aggregate) GETSTRUCT(aggtup);
+
+	res = (!OidIsValid(aggform->aggfinalfn) &&
+		   OidIsValid(aggform->aggcombinefn) &&
+		   aggform->aggtranstype != INTERNALOID &&
+		   aggform->aggtranstype == agg->aggtype);
+
+	ReleaseSysCache(aggtup);
+	return res;
+}
+
+/*
+ * Ordered-set aggregates are mapped to ClickHouse functions that always sort
+ * ascending, so only default ordering of arguments could be shipped.
+ */
+static bool
+agg_order_is_default(Aggref *agg)
+{
+	ListCell   *lc;
+
+	foreach (lc, agg->aggorder)
+	{
+		SortGroupClause *sgc = (SortGroupClause *) lfirst(lc);
+		TargetEntry *tle = get_sortgroupref_tle(sgc->tleSortGroupRef, agg->args);
+		TypeCacheEntry *typentry;
+
+		typentry = lookup_type_cache(exprType((Node *) tle->expr),
+									 TYPECACHE_LT_OPR);
+		if (sgc->sortop != typentry->lt_opr || sgc->nulls_first)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns the end of the string literal or quoted identifier starting at p
+ * in a function template: the closing quote, or the terminating zero if it
+ * is missing.
+ */
+static const char *
+template_quote_end(const char *p)
+{
+	char		quote = *p++;
+
+	for (; *p && *p != quote; p++)
+	{
+		if (*p == '\\' && p[1] != '\0')
+			p++;
+	}
+
+	return p;
+}
+
+/*
+ * Parses the placeholder of a function template starting at p, which is
+ * either $n or $constn, the latter accepts only constant arguments.  Returns
+ * the last character of the placeholder, or NULL if p does not start one.
+ * Numbers that are out of range are returned as 0.
+ */
+static const char *
+template_placeholder(const char *p, int *n, bool *is_const)
+{
+	*n = 0;
+	*is_const = false;
+
+	if (*p != '$')
+		return NULL;
+
+	if (strncmp(p + 1, "const", 5) == 0 && isdigit((unsigned char) p[6]))
+	{
+		*is_const = true;
+		p += 5;
+	}
+	else if (!isdigit((unsigned char) p[1]))
+		return NULL;
+
+	while (isdigit((unsigned char) p[1]))
+	{
+		if (*n <= FUNC_MAX_ARGS)
+			*n = *n * 10 + (p[1] - '0');
+		p++;
+	}
+
+	if (*n > FUNC_MAX_ARGS)
+		*n = 0;
+
+	return p;
+}
+
+/*
+ * Checks that every placeholder of a function template refers to one of
+ * args, and that $constn ones get non-null constants: ClickHouse requires
+ * them for parameters of parametric aggregates and for arguments that are
+ * used outside of the aggregate calls in the template.
+ */
+static bool
+template_args_ok(const char *chtemplate, List *args)
+{
+	const char *p;
+
+	for (p = chtemplate; *p; p++)
+	{
+		const char *end;
+		int			n;
+		bool		is_const;
+
+		if (*p == '\'' || *p == '"' || *p == '`')
+		{
+			p = template_quote_end(p);
+			if (*p == '\0')
+				break;
+			continue;
+		}
+
+		end = template_placeholder(p, &n, &is_const);
+		if (end == NULL)
+			continue;
+
+		/* $0 is never valid */
+		if (n < 1 || n > list_length(args))
+			return false;
+
+		if (is_const && (!IsA(list_nth(args, n - 1), Const) ||
+						 ((Const *) list_nth(args, n - 1))->constisnull))
+			return false;
+
+		p = end;
+	}
+
+	return true;
+}
+
+/*
+ * Arguments of an aggregate that are referred by placeholders of its
+ * template: direct arguments of ordered-set aggregates come first.
+ */
+static List *
+aggregate_template_args(Aggref *agg)
+{
+	List	   *args = list_copy(agg->aggdirectargs);
+	ListCell   *lc;
+
+	foreach (lc, agg->args)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+		if (!tle->resjunk)
+			args = lappend(args, tle->expr);
+	}
+
+	return args;
+}
+
+/*
+ * Deparse a function from ch_function_map, $n and $constn placeholders in
+ * the template are replaced by deparsed arguments.  String literals and quoted
+ * identifiers are copied as they are.
+ */
+static void
+deparseFunctionTemplate(const char *chtemplate, List *args,
+						deparse_expr_cxt *context)
+{
+	StringInfo	buf = context->buf;
+	const char *p;
+
+	for (p = chtemplate; *p; p++)
+	{
+		const char *end;
+		int			n;
+		bool		is_const;
+
+		if (*p == '\'' || *p == '"' || *p == '`')
+		{
+			end = template_quote_end(p);
+
+			appendBinaryStringInfo(buf, p, end - p + (*end ? 1 : 0));
+			if (*end == '\0')
+				break;
+			p = end;
+			continue;
+		}
+
+		end = template_placeholder(p, &n, &is_const);
+		if (end == NULL)
+		{
+			appendStringInfoChar(buf, *p);
+			continue;
+		}
+		p = end;
+
+		if (n < 1 || n > list_length(args))
+			elog(ERROR, "clickhouse_fdw: function template \"%s\" refers to missing argument $%d",
+				 chtemplate, n);
+
+		deparseExpr((Expr *) list_nth(args, n - 1), context);
+	}
+}
+
+/*
+ * Find window function in the list of shippable ones, NULL if not found.
+ */
+static const WindowFuncName *
+find_window_func(Oid funcid)
+{
+	HeapTuple	proctup;
+	Form_pg_proc procform;
+	const WindowFuncName *wf;
+	const WindowFuncName *res = NULL;
+
+	if (!chfdw_is_builtin(funcid))
+		return NULL;
+
+	proctup = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid));
+	if (!HeapTupleIsValid(proctup))
+		elog(ERROR, "cache lookup failed for function %u", funcid);
+	procform = (Form_pg_proc) GETSTRUCT(proctup);
+
+	for (wf = window_funcs; wf->pgname; wf++)
+	{
+		if (strcmp(NameStr(procform->proname), wf->pgname) == 0 &&
+			(wf->nargs == -1 || wf->nargs == procform->pronargs))
+		{
+			res = wf;
+			break;
+		}
+	}
+
+	ReleaseSysCache(proctup);
+	return res;
+}
+
+static WindowClause *
+find_window_clause(PlannerInfo *root, Index winref)
+{
+	ListCell   *lc;
+
+	foreach(lc, root->parse->windowClause)
+	{
+		WindowClause *wc = lfirst_node(WindowClause, lc);
+
+		if (wc->winref == winref)
+			return wc;
+	}
+
+	elog(ERROR, "could not find window clause for winref %u", winref);
+	return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * Check that PARTITION BY and ORDER BY of the window can be sent to
+ * ClickHouse.  Only the default frame is supported, which is the same in
+ * both systems.
+ */
+static bool
+window_clause_is_shippable(WindowClause *wc, foreign_glob_cxt *glob_cxt,
+						   foreign_loc_cxt *outer_cxt)
+{
+	List	   *tlist = glob_cxt->root->parse->targetList;
+	ListCell   *lc;
+
+	if (wc->frameOptions != FRAMEOPTION_DEFAULTS)
+		return false;
+
+	foreach(lc, wc->partitionClause)
+	{
+		SortGroupClause *sgc = lfirst_node(SortGroupClause, lc);
+		Node	   *expr = get_sortgroupclause_expr(sgc, tlist);
+
+		if (!foreign_expr_walker(expr, glob_cxt, outer_cxt))
+			return false;
+	}
+
+	foreach(lc, wc->orderClause)
+	{
+		SortGroupClause *sgc = lfirst_node(SortGroupClause, lc);
+		Node	   *expr = get_sortgroupclause_expr(sgc, tlist);
+		TypeCacheEntry *typentry;
+
+		if (!foreign_expr_walker(expr, glob_cxt, outer_cxt))
+			return false;
+
+		/* Only the default ordering of the type can be sent */
+		typentry = lookup_type_cache(exprType(expr),
+									 TYPECACHE_LT_OPR | TYPECACHE_GT_OPR);
+		if (sgc->sortop != typentry->lt_opr && sgc->sortop != typentry->gt_opr)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Deparse a window function as "func(args) OVER (PARTITION BY ... ORDER BY
+ * ...)".
+ */
+static void
+deparseWindowFunc(WindowFunc *node, deparse_expr_cxt *context)
+{
+	StringInfo	buf = context->buf;
+	List	   *tlist = context->root->parse->targetList;
+	WindowClause *wc = find_window_clause(context->root, node->winref);
+	const WindowFuncName *wf = find_window_func(node->winfnoid);
+	const char *delim = "";
+	ListCell   *lc;
+
+	Assert(wf != NULL);
+
+	appendStringInfo(buf, "%s(", wf->chname);
+	if (node->winstar)
+		appendStringInfoChar(buf, '*');
+	else
+	{
+		foreach(lc, node->args)
+		{
+			if (lc != list_head(node->args))
+				appendStringInfoString(buf, ", ");
+			deparseExpr((Expr *) lfirst(lc), context);
+		}
+	}
+	appendStringInfoString(buf, ") OVER (");
+
+	if (wc->partitionClause)
+	{
+		appendStringInfoString(buf, "PARTITION BY ");
+		foreach(lc, wc->partitionClause)
+		{
+			SortGroupClause *sgc = lfirst_node(SortGroupClause, lc);
+
+			if (lc != list_head(wc->partitionClause))
+				appendStringInfoString(buf, ", ");
+			deparseExpr((Expr *) get_sortgroupclause_expr(sgc, tlist), context);
+		}
+		delim = " ";
+	}
+
+	if (wc->orderClause)
+	{
+		appendStringInfo(buf, "%sORDER BY ", delim);
+		foreach(lc, wc->orderClause)
+		{
+			SortGroupClause *sgc = lfirst_node(SortGroupClause, lc);
+			Node	   *expr = get_sortgroupclause_expr(sgc, tlist);
+			TypeCacheEntry *typentry;
+
+			if (lc != list_head(wc->orderClause))
+				appendStringInfoString(buf, ", ");
+			deparseExpr((Expr *) expr, context);
+
+			typentry = lookup_type_cache(exprType(expr), TYPECACHE_LT_OPR);
+			if (sgc->sortop == typentry->lt_opr)
+				appendStringInfoString(buf, " ASC");
+			else
+				appendStringInfoString(buf, " DESC");
+
+			/* ClickHouse puts NULLs last by default in both directions */
+			if (sgc->nulls_first)
+				appendStringInfoString(buf, " NULLS FIRST");
+		}
+		delim = " ";
+	}
+
+	if (wf->whole_partition)
+		appendStringInfo(buf, "%sROWS BETWEEN UNBOUNDED PRECEDING AND "
+						 "UNBOUNDED FOLLOWING", delim);
+
+	appendStringInfoChar(buf, ')');
+}
+
 /*
  * Deparse given ScalarArrayOpExpr expression.  To avoid problems
  * around priority of operations, we always parenthesize the arguments.
@@ -2982,6 +4067,16 @@ deparseScalarArrayOpExpr(ScalarArrayOpExpr *node, deparse_expr_cxt *context)
 		/* very narrow case for = ANY(ARRAY) */
 		if (optype == 1 && IsA(arg2, Const))
 			deparseAsIn(node, context, optype);
+		else if (optype == 1 && IsA(arg2, Param) && context->params_list &&
+				 (Expr *) node == context->top_qual)
+		{
+			/*
+			 * The set is made from the array value at execution.  ClickHouse
+			 * ignores NULLs in the set and gives false where PostgreSQL gives
+			 * NULL, so this is done only for conditions which filter rows.
+			 */
+			deparseAsIn(node, context, optype);
+		}
 		else
 		{
 			if (optype == 1)
@@ -3162,13 +4257,45 @@ deparseAggref(Aggref *node, deparse_expr_cxt *context)
 	bool	sign_count_filter = false;
 	uint8	brcount = 1;
 
-	/* Only basic, non-split aggregation accepted. */
-	Assert(node->aggsplit == AGGSPLIT_SIMPLE);
+	/*
+	 * Only basic, non-split aggregation accepted.  Partial aggregates are
+	 * deparsed the same way, see partial_agg_ok().
+	 */
+	Assert(node->aggsplit == AGGSPLIT_SIMPLE ||
+		   node->aggsplit == AGGSPLIT_INITIAL_SERIAL);
+
+	/*
+	 * Sums scaled by _sample_factor are Float64, round them back for integer
+	 * results.
+	 */
+	if (fpinfo->ch_sample_scale && node->aggtype == INT8OID &&
+			chfdw_is_builtin(node->aggfnoid) &&
+			chfdw_check_for_custom_function(node->aggfnoid) == NULL)
+	{
+		char   *proname = get_func_name(node->aggfnoid);
+
+		if (strcmp(proname, "count") == 0 || strcmp(proname, "sum") == 0)
+		{
+			appendStringInfoString(buf, "toInt64(round(");
+			brcount += 2;
+		}
+	}
 
 	/* Find aggregate name from aggfnoid which is a pg_proc entry */
 	cdef = context->func;
 	context->func = appendFunctionName(node->aggfnoid, context);
 
+	if (context->func && context->func->cf_type == CF_CH_TEMPLATE)
+	{
+		List	   *args = aggregate_template_args(node);
+
+		deparseFunctionTemplate(context->func->chtemplate, args, context);
+		list_free(args);
+
+		context->func = cdef;
+		return;
+	}
+
 	/* 'If' part */
 	if (context->func && context->func->cf_type == CF_SIGN_COUNT && !node->aggstar)
 		sign_count_filter = true;
@@ -3193,8 +4320,8 @@ deparseAggref(Aggref *node, deparse_expr_cxt *context)
 	{
 		if (context->func && context->func->cf_type == CF_SIGN_COUNT)
 		{
-			Assert(fpinfo && fpinfo->ch_table_engine == CH_COLLAPSING_MERGE_TREE);
-			appendStringInfoString(buf, fpinfo->ch_table_sign_field);
+			Assert(fpinfo && HAS_ROW_WEIGHT(fpinfo));
+			appendRowWeight(buf, fpinfo);
 		}
 		else
 			appendStringInfoChar(buf, '*');
@@ -3210,7 +4337,7 @@ deparseAggref(Aggref *node, deparse_expr_cxt *context)
 		/* Add all the arguments */
 		if (sign_count_filter)
 			/* in case if COUNT(col) we should get countIf(sign, col is not null) */
-			appendStringInfoString(buf, fpinfo->ch_table_sign_field);
+			appendRowWeight(buf, fpinfo);
 		else
 		{
 			/* default columns output */
@@ -3232,9 +4359,9 @@ deparseAggref(Aggref *node, deparse_expr_cxt *context)
 
 			if (signMultiply)
 			{
-				Assert(fpinfo->ch_table_engine == CH_COLLAPSING_MERGE_TREE);
+				Assert(HAS_ROW_WEIGHT(fpinfo));
 				appendStringInfoString(buf, " * ");
-				appendStringInfoString(buf, fpinfo->ch_table_sign_field);
+				appendRowWeight(buf, fpinfo);
 			}
 		}
 	}
@@ -3269,7 +4396,7 @@ deparseAggref(Aggref *node, deparse_expr_cxt *context)
 	if (context->func && context->func->cf_type == CF_SIGN_AVG)
 	{
 		appendStringInfoString(buf, " / sumIf(");
-		appendStringInfoString(buf, fpinfo->ch_table_sign_field);
+		appendRowWeight(buf, fpinfo);
 		appendStringInfoChar(buf, ',');
 		if (node->aggfilter)
 		{
@@ -3528,16 +4655,44 @@ appendGroupByClause(List *tlist, deparse_expr_cxt *context)
 	}
 }
 
+/*
+ * Deparse LIMIT 1 BY clause for DISTINCT ON.
+ */
+static void
+appendLimitByClause(List *tlist, deparse_expr_cxt *context)
+{
+	StringInfo	buf = context->buf;
+	Query	   *query = context->root->parse;
+	ListCell   *lc;
+	bool		first = true;
+
+	Assert(query->hasDistinctOn);
+
+	appendStringInfoString(buf, " LIMIT 1 BY ");
+
+	foreach (lc, query->distinctClause)
+	{
+		SortGroupClause *grp = (SortGroupClause *) lfirst(lc);
+
+		if (!first)
+			appendStringInfoString(buf, ", ");
+
+		first = false;
+
+		deparseSortGroupClause(grp->tleSortGroupRef, tlist, true, context);
+	}
+}
+
 /*
  * Deparse ORDER BY clause according to the given pathkeys for given base
  * relation. From given pathkeys expressions belonging entirely to the given
  * base relation are obtained and deparsed.
  */
 static void
-appendOrderByClause(List *pathkeys, deparse_expr_cxt *context)
+appendOrderByClause(List *pathkeys, bool has_final_sort,
+					deparse_expr_cxt *context)
 {
 	ListCell   *lcell;
-	int			nestlevel;
 	char	   *delim = " ";
 	RelOptInfo *baserel = context->scanrel;
 	StringInfo	buf = context->buf;
@@ -3548,7 +4703,19 @@ appendOrderByClause(List *pathkeys, deparse_expr_cxt *context)
 		PathKey    *pathkey = lfirst(lcell);
 		Expr	   *em_expr;
 
-		em_expr = chfdw_find_em_expr(pathkey->pk_eclass, baserel);
+		if (has_final_sort && IS_UPPER_REL(context->foreignrel))
+		{
+			/*
+			 * By construction, context->foreignrel is the input relation to
+			 * the final sort.
+			 */
+			em_expr = chfdw_find_em_expr_for_input_target(context->root,
+												pathkey->pk_eclass,
+												context->foreignrel->reltarget);
+		}
+		else
+			em_expr = chfdw_find_em_expr(pathkey->pk_eclass, baserel);
+
 		Assert(em_expr != NULL);
 
 		appendStringInfoString(buf, delim);
@@ -3558,10 +4725,81 @@ appendOrderByClause(List *pathkeys, deparse_expr_cxt *context)
 		else
 			appendStringInfoString(buf, " DESC");
 
+		/* ClickHouse puts NULLs last by default in both directions */
+		if (pathkey->pk_nulls_first)
+			appendStringInfoString(buf, " NULLS FIRST");
+
 		delim = ", ";
 	}
 }
 
+/*
+ * Deparse LIMIT/OFFSET clause.
+ *
+ * We use "LIMIT offset, count" form, because ClickHouse doesn't allow OFFSET
+ * without LIMIT.
+ */
+static void
+appendLimitClause(deparse_expr_cxt *context)
+{
+	PlannerInfo *root = context->root;
+	StringInfo	buf = context->buf;
+
+	appendStringInfoString(buf, " LIMIT ");
+	if (root->parse->limitOffset)
+	{
+		deparseLimitExpr(root->parse->limitOffset, 0, CH_PARAM_OFFSET,
+						 context);
+		appendStringInfoString(buf, ", ");
+	}
+
+	if (root->parse->limitCount)
+		deparseLimitExpr(root->parse->limitCount, PG_INT64_MAX,
+						 CH_PARAM_LIMIT, context);
+	else
+		appendStringInfo(buf, INT64_FORMAT, PG_INT64_MAX);
+}
+
+/*
+ * Deparse LIMIT or OFFSET value.
+ *
+ * LIMIT and OFFSET can't reference the relation, so anything except
+ * constants is evaluated locally at execution time and sent as parameter.
+ * NULL means no limit (or no offset) in PostgreSQL, so the expression is
+ * wrapped into COALESCE with nullval.  Negative values are rejected when the
+ * parameter is evaluated, see process_query_params().
+ */
+static void
+deparseLimitExpr(Node *node, int64 nullval, ChParamKind kind,
+				 deparse_expr_cxt *context)
+{
+	CoalesceExpr   *coalesce;
+
+	if (IsA(node, Const))
+	{
+		deparseConst((Const *) node, context, 0);
+		return;
+	}
+
+	Assert(exprType(node) == INT8OID);
+
+	coalesce = makeNode(CoalesceExpr);
+	coalesce->coalescetype = INT8OID;
+	coalesce->coalescecollid = InvalidOid;
+	coalesce->args = list_make2(node,
+								makeConst(INT8OID, -1, InvalidOid,
+										  sizeof(int64),
+										  Int64GetDatum(nullval),
+										  false, FLOAT8PASSBYVAL));
+	coalesce->location = -1;
+
+	if (context->params_list)
+		printRemoteParam(get_param_index((Node *) coalesce, kind, context),
+						 INT8OID, -1, context);
+	else
+		printRemotePlaceholder(INT8OID, -1, context);
+}
+
 /*
  * appendFunctionName
  *		Deparses function name from given function oid.
@@ -3594,7 +4832,7 @@ appendFunctionName(Oid funcid, deparse_expr_cxt *context)
 
 	/* we have some additional conditions on aggregation functions */
 	if (chfdw_is_builtin(funcid) && procform->prokind == PROKIND_AGGREGATE
-			&& fpinfo->ch_table_engine == CH_COLLAPSING_MERGE_TREE)
+			&& HAS_ROW_WEIGHT(fpinfo))
 	{
 		cdef = palloc(sizeof(CustomObjectDef));
 		cdef->cf_oid = funcid;
@@ -3626,6 +4864,24 @@ appendFunctionName(Oid funcid, deparse_expr_cxt *context)
 	return cdef;
 }
 
+/*
+ * appendRowWeight
+ *		Deparses the weight of a row, see HAS_ROW_WEIGHT.
+ */
+static void
+appendRowWeight(StringInfo buf, CHFdwRelationInfo *fpinfo)
+{
+	if (fpinfo->ch_table_engine == CH_COLLAPSING_MERGE_TREE)
+	{
+		appendStringInfoString(buf, fpinfo->ch_table_sign_field);
+		if (fpinfo->ch_sample_scale)
+			appendStringInfoString(buf, " * ");
+	}
+
+	if (fpinfo->ch_sample_scale)
+		appendStringInfoString(buf, "_sample_factor");
+}
+
 /*
  * Appends a sort or group clause.
  *
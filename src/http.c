@@ -3,7 +3,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #include <uuid/uuid.h>
 #include <clickhouse_http.h>
@@ -13,8 +15,12 @@ static char curl_error_buffer[CURL_ERROR_SIZE];
 static bool curl_error_happened = false;
 static int	curl_verbose = 0;
 static void *curl_progressfunc = NULL;
+static ch_http_progress_report_func curl_reportfunc = NULL;
+static uint32_t curl_report_ticket = 0;
 static bool curl_initialized = false;
 static char ch_query_id_prefix[5];
+static size_t curl_memory_limit = 0;	/* 0 means no limit */
+static const ch_temp_file_ops *curl_temp_ops = NULL;
 
 void ch_http_init(int verbose, uint32_t query_id_prefix)
 {
@@ -33,11 +39,73 @@ void ch_http_set_progress_func(void *progressfunc)
 	curl_progressfunc = progressfunc;
 }
 
+/*
+ * Ask ClickHouse to send the progress of the following queries in headers
+ * and pass it to the function.
+ */
+void ch_http_set_progress_report(ch_http_progress_report_func func,
+		uint32_t ticket)
+{
+	curl_reportfunc = func;
+	curl_report_ticket = ticket;
+}
+
+/*
+ * Responses bigger than the limit are written to a temporary file, which is
+ * mapped to memory when the response is complete.
+ */
+void ch_http_set_memory_limit(size_t limit, const ch_temp_file_ops *ops)
+{
+	curl_memory_limit = limit;
+	curl_temp_ops = ops;
+}
+
+/*
+ * Move the data received so far to a temporary file, the rest of the
+ * response is appended to it.
+ */
+static bool spill_response(ch_http_response_t *res)
+{
+	int		file = curl_temp_ops->create();
+
+	if (file < 0)
+		return false;
+
+	if (res->datasize > 0 &&
+			!curl_temp_ops->write(file, res->data, res->datasize, 0))
+	{
+		curl_temp_ops->close(file);
+		return false;
+	}
+
+	free(res->data);
+	res->data = NULL;
+	res->spill_file = file;
+	res->spilled = true;
+	return true;
+}
+
 size_t write_data(void *contents, size_t size, size_t nmemb, void *userp)
 {
 	size_t realsize			= size * nmemb;
 	ch_http_response_t *res	= userp;
 
+	/* returning less than realsize fails the transfer */
+	if (!res->spilled && res->memory_limit > 0 &&
+			res->datasize + realsize > res->memory_limit &&
+			!spill_response(res))
+		return 0;
+
+	if (res->spilled)
+	{
+		if (!curl_temp_ops->write(res->spill_file, contents, realsize,
+					res->datasize))
+			return 0;
+
+		res->datasize += realsize;
+		return realsize;
+	}
+
 	if (res->data == NULL)
 		res->data = malloc(realsize + 1);
 	else
@@ -50,6 +118,68 @@ size_t write_data(void *contents, size_t size, size_t nmemb, void *userp)
 	return realsize;
 }
 
+/*
+ * Get the value of the key from the header, ClickHouse sends the numbers
+ * as JSON strings. Returns 0 if there is no such key.
+ */
+static uint64_t summary_value(const char *header, size_t len, const char *key)
+{
+	char	pattern[64];
+	char	buf[32];
+	size_t	plen,
+			i;
+
+	plen = snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+	for (i = 0; i + plen < len; i++)
+	{
+		size_t	n = 0;
+
+		if (memcmp(header + i, pattern, plen) != 0)
+			continue;
+
+		for (i += plen; i < len && n < sizeof(buf) - 1 &&
+				header[i] >= '0' && header[i] <= '9'; i++)
+			buf[n++] = header[i];
+		buf[n] = '\0';
+
+		return strtoull(buf, NULL, 10);
+	}
+
+	return 0;
+}
+
+/*
+ * Collect the statistics of the query from X-ClickHouse-Summary. The header
+ * is sent along with the first data, so for long queries it can be behind
+ * the actual numbers. X-ClickHouse-Progress headers come before it, while
+ * the query runs, and are only passed on.
+ */
+static size_t header_data(char *buffer, size_t size, size_t nitems, void *userp)
+{
+	static const char	name[] = "X-ClickHouse-Summary:";
+	static const char	progress[] = "X-ClickHouse-Progress:";
+	size_t	len = size * nitems;
+	ch_http_response_t *res = userp;
+
+	if (len > sizeof(name) - 1 &&
+			strncasecmp(buffer, name, sizeof(name) - 1) == 0)
+	{
+		res->server_rows_read = summary_value(buffer, len, "read_rows");
+		res->server_bytes_read = summary_value(buffer, len, "read_bytes");
+		res->server_elapsed_ns = summary_value(buffer, len, "elapsed_ns");
+	}
+	else if (res->progress_report && len > sizeof(progress) - 1 &&
+			strncasecmp(buffer, progress, sizeof(progress) - 1) == 0)
+	{
+		res->progress_report(res->progress_ticket, res->query_id,
+				summary_value(buffer, len, "read_rows"),
+				summary_value(buffer, len, "read_bytes"),
+				summary_value(buffer, len, "total_rows_to_read"));
+	}
+
+	return len;
+}
+
 ch_http_connection_t *ch_http_connection(char *connstring)
 {
 	curl_error_happened = false;
@@ -92,79 +222,383 @@ static void set_query_id(ch_http_response_t *resp)
 
 ch_http_response_t *ch_http_simple_query(ch_http_connection_t *conn, const char *query)
 {
-	char		*url;
-	CURLcode	errcode;
-	static char errbuffer[CURL_ERROR_SIZE];
+	return ch_http_external_query(conn, query, NULL, 0);
+}
 
-	ch_http_response_t	*resp = calloc(sizeof(ch_http_response_t), 1);
-	if (resp == NULL)
+/*
+ * Append "&name=value" to the url, value is escaped. Returns NULL on OOM.
+ */
+static char *append_url_param(CURL *curl, char *url, const char *name,
+		const char *suffix, const char *value)
+{
+	char   *escaped = curl_easy_escape(curl, value, 0);
+	char   *res;
+
+	if (escaped == NULL)
+	{
+		free(url);
 		return NULL;
+	}
 
-	set_query_id(resp);
+	res = realloc(url, strlen(url) + strlen(name) + strlen(suffix) +
+			strlen(escaped) + 3);
+	if (res == NULL)
+		free(url);
+	else
+		sprintf(res + strlen(res), "&%s%s=%s", name, suffix, escaped);
 
-	assert(conn && conn->curl);
+	curl_free(escaped);
+	return res;
+}
+
+/*
+ * Prepare the easy handle for the query. Query parameters are added to the
+ * url. If there are any external tables, the query is moved to the url too
+ * and the tables are sent as multipart form data. Returns the url, which must
+ * live until the transfer is over, or NULL on OOM.
+ */
+static char *setup_request(ch_http_connection_t *conn, CURL *curl,
+		const char *query, ch_http_external_table *tables, size_t ntables,
+		ch_http_response_t *resp, char *errbuffer, void *progressdata,
+		curl_mime **mime)
+{
+	char   *url;
+	size_t	nparts = 0;
+
+	*mime = NULL;
 
 	/* construct url */
 	url = malloc(conn->base_url_len + 37 + 12 /* query_id + ?query_id= */);
+	if (url == NULL)
+		return NULL;
 	sprintf(url, "%s?query_id=%s", conn->base_url, resp->query_id);
 
+	for (size_t i = 0; url != NULL && i < ntables; i++)
+	{
+		if (tables[i].structure == NULL)
+			url = append_url_param(curl, url, "param_", tables[i].name,
+					tables[i].data);
+		else
+			nparts++;
+	}
+	if (url == NULL)
+		return NULL;
+
+	/*
+	 * A header is sent on every interval until the first data, keep them
+	 * few for long queries.
+	 */
+	if (curl_reportfunc)
+	{
+		resp->progress_report = curl_reportfunc;
+		resp->progress_ticket = curl_report_ticket;
+		url = append_url_param(curl, url, "send_progress_in_http_headers",
+				"", "1");
+		if (url != NULL)
+			url = append_url_param(curl, url,
+					"http_headers_progress_interval_ms", "", "1000");
+		if (url == NULL)
+			return NULL;
+	}
+
+	if (nparts > 0)
+	{
+		url = append_url_param(curl, url, "query", "", query);
+		for (size_t i = 0; url != NULL && i < ntables; i++)
+		{
+			if (tables[i].structure == NULL)
+				continue;
+
+			url = append_url_param(curl, url, tables[i].name,
+					"_structure", tables[i].structure);
+			if (url != NULL)
+				url = append_url_param(curl, url, tables[i].name,
+						"_format", "TabSeparated");
+		}
+		if (url == NULL)
+			return NULL;
+
+		*mime = curl_mime_init(curl);
+		for (size_t i = 0; i < ntables; i++)
+		{
+			curl_mimepart *part;
+
+			if (tables[i].structure == NULL)
+				continue;
+
+			part = curl_mime_addpart(*mime);
+
+			curl_mime_name(part, tables[i].name);
+			curl_mime_filename(part, tables[i].name);
+			curl_mime_data(part, tables[i].data, tables[i].datasize);
+		}
+	}
+
 	/* constant */
-	errbuffer[0] = '\0';
-	curl_easy_reset(conn->curl);
-	curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION, write_data);
-	curl_easy_setopt(conn->curl, CURLOPT_ERRORBUFFER, errbuffer);
-	curl_easy_setopt(conn->curl, CURLOPT_PATH_AS_IS, 1);
-	curl_easy_setopt(conn->curl, CURLOPT_URL, url);
-	curl_easy_setopt(conn->curl, CURLOPT_NOSIGNAL, 1);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuffer);
+	curl_easy_setopt(curl, CURLOPT_PATH_AS_IS, 1);
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
 
 	/* variable */
-	curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, resp);
-	curl_easy_setopt(conn->curl, CURLOPT_POSTFIELDS, query);
-	curl_easy_setopt(conn->curl, CURLOPT_VERBOSE, curl_verbose);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, resp);
+	if (*mime)
+		curl_easy_setopt(curl, CURLOPT_MIMEPOST, *mime);
+	else
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, query);
+	curl_easy_setopt(curl, CURLOPT_VERBOSE, curl_verbose);
 	if (curl_progressfunc)
 	{
-		curl_easy_setopt(conn->curl, CURLOPT_NOPROGRESS, 0L);
-		curl_easy_setopt(conn->curl, CURLOPT_XFERINFOFUNCTION, curl_progressfunc);
-		curl_easy_setopt(conn->curl, CURLOPT_XFERINFODATA, conn);
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+		curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, curl_progressfunc);
+		curl_easy_setopt(curl, CURLOPT_XFERINFODATA, progressdata);
 	}
 	else
-		curl_easy_setopt(conn->curl, CURLOPT_NOPROGRESS, 1L);
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
 
-	curl_error_happened = false;
-	errcode = curl_easy_perform(conn->curl);
-	free(url);
+	return url;
+}
 
+/*
+ * Fill the response status and timings after the transfer is over.
+ */
+static void finish_request(CURL *curl, CURLcode errcode,
+		ch_http_response_t *resp, const char *errbuffer)
+{
 	if (errcode == CURLE_ABORTED_BY_CALLBACK)
 	{
 		resp->http_status = 418; /* I'm teapot */
-		return resp;
+		return;
 	}
 	else if (errcode != CURLE_OK)
 	{
 		resp->http_status = 419; /* unlegal http status */
 		resp->data = strdup(errbuffer);
 		resp->datasize = strlen(errbuffer);
-		return resp;
+		return;
 	}
 
-	errcode = curl_easy_getinfo(conn->curl, CURLINFO_PRETRANSFER_TIME,
+	errcode = curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME,
 			&resp->pretransfer_time);
 	if (errcode != CURLE_OK)
 		resp->pretransfer_time = 0;
 
-	errcode = curl_easy_getinfo(conn->curl, CURLINFO_TOTAL_TIME, &resp->total_time);
+	errcode = curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME,
+			&resp->starttransfer_time);
+	if (errcode != CURLE_OK)
+		resp->starttransfer_time = 0;
+
+	errcode = curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &resp->total_time);
 	if (errcode != CURLE_OK)
 		resp->total_time = 0;
 
 	// all good with request, but we need http status to make sure
 	// query went ok
-	curl_easy_getinfo(conn->curl, CURLINFO_RESPONSE_CODE, &resp->http_status);
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp->http_status);
+
+	if (resp->spilled && resp->datasize > 0)
+	{
+		int		fd = curl_temp_ops->get_fd(resp->spill_file);
+		void   *data = fd < 0 ? MAP_FAILED :
+			mmap(NULL, resp->datasize, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (data == MAP_FAILED)
+		{
+			resp->http_status = 419;
+			resp->data = strdup("could not map temporary file");
+			resp->datasize = strlen(resp->data);
+			return;
+		}
+
+		resp->data = data;
+		resp->mapped = true;
+	}
 	if (curl_verbose && resp->http_status != 200)
 		fprintf(stderr, "%s", resp->data);
+}
+
+/*
+ * Execute the query with external tables.
+ */
+ch_http_response_t *ch_http_external_query(ch_http_connection_t *conn, const char *query,
+		ch_http_external_table *tables, size_t ntables)
+{
+	char		*url;
+	CURLcode	errcode;
+	curl_mime	*mime;
+	static char errbuffer[CURL_ERROR_SIZE];
+
+	ch_http_response_t	*resp = calloc(sizeof(ch_http_response_t), 1);
+	if (resp == NULL)
+		return NULL;
+
+	set_query_id(resp);
+	resp->memory_limit = curl_memory_limit;
+
+	assert(conn && conn->curl);
+
+	errbuffer[0] = '\0';
+	curl_easy_reset(conn->curl);
+
+	url = setup_request(conn, conn->curl, query, tables, ntables, resp,
+			errbuffer, conn, &mime);
+	if (url == NULL)
+		goto oom;
+
+	curl_error_happened = false;
+	errcode = curl_easy_perform(conn->curl);
+	free(url);
+	if (mime)
+		curl_mime_free(mime);
+
+	finish_request(conn->curl, errcode, resp, errbuffer);
+	return resp;
+
+oom:
+	free(resp);
+	return NULL;
+}
+
+/*
+ * Requests sent with ch_http_send_query share one multi handle, so waiting
+ * for any of them keeps all the others going.
+ */
+static CURLM *curl_multi = NULL;
+
+struct ch_http_request_t
+{
+	CURL	   *curl;
+	char	   *url;
+	char	   *query;
+	curl_mime  *mime;
+	ch_http_response_t *resp;
+	CURLcode	result;
+	bool		added;			/* in the multi handle */
+	bool		done;
+	char		errbuffer[CURL_ERROR_SIZE];
+};
+
+static void request_free(ch_http_request_t *req)
+{
+	if (req->curl)
+	{
+		if (req->added)
+			curl_multi_remove_handle(curl_multi, req->curl);
+		curl_easy_cleanup(req->curl);
+	}
+	if (req->mime)
+		curl_mime_free(req->mime);
+	if (req->resp)
+		ch_http_response_free(req->resp);
+	free(req->url);
+	free(req->query);
+	free(req);
+}
+
+/*
+ * Start the query on its own connection and return without waiting for
+ * the result. Returns NULL on OOM.
+ */
+ch_http_request_t *ch_http_send_query(ch_http_connection_t *conn, const char *query,
+		ch_http_external_table *tables, size_t ntables)
+{
+	int		running;
+	ch_http_request_t *req = calloc(sizeof(ch_http_request_t), 1);
+
+	if (req == NULL)
+		return NULL;
+
+	if (curl_multi == NULL && (curl_multi = curl_multi_init()) == NULL)
+		goto oom;
+
+	/* curl does not copy the post data */
+	req->query = strdup(query);
+	req->resp = calloc(sizeof(ch_http_response_t), 1);
+	req->curl = curl_easy_init();
+	if (req->query == NULL || req->resp == NULL || req->curl == NULL)
+		goto oom;
+
+	set_query_id(req->resp);
+	req->resp->memory_limit = curl_memory_limit;
+	req->url = setup_request(conn, req->curl, req->query, tables, ntables,
+			req->resp, req->errbuffer, req, &req->mime);
+	if (req->url == NULL)
+		goto oom;
+
+	curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
+	if (curl_multi_add_handle(curl_multi, req->curl) != CURLM_OK)
+		goto oom;
+	req->added = true;
+
+	curl_multi_perform(curl_multi, &running);
+	return req;
+
+oom:
+	request_free(req);
+	return NULL;
+}
+
+/*
+ * Wait until the request is over and return its response. The request is
+ * freed.
+ */
+ch_http_response_t *ch_http_wait_query(ch_http_request_t *req)
+{
+	ch_http_response_t *resp;
+
+	while (!req->done)
+	{
+		int			running,
+					nmsgs;
+		CURLMsg	   *msg;
+		CURLMcode	mcode = curl_multi_perform(curl_multi, &running);
+
+		while ((msg = curl_multi_info_read(curl_multi, &nmsgs)) != NULL)
+		{
+			ch_http_request_t *done;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &done);
+			done->result = msg->data.result;
+			done->done = true;
+			done->added = false;
+			curl_multi_remove_handle(curl_multi, done->curl);
+		}
+
+		if (mcode != CURLM_OK && !req->done)
+		{
+			snprintf(req->errbuffer, CURL_ERROR_SIZE, "%s",
+					curl_multi_strerror(mcode));
+			req->result = CURLE_SEND_ERROR;
+			req->done = true;
+			req->added = false;
+			curl_multi_remove_handle(curl_multi, req->curl);
+		}
+		else if (!req->done)
+			curl_multi_wait(curl_multi, NULL, 0, 1000, NULL);
+	}
+
+	finish_request(req->curl, req->result, req->resp, req->errbuffer);
+	resp = req->resp;
+	req->resp = NULL;
+	request_free(req);
 
 	return resp;
 }
 
+/*
+ * Abandon the request, its connection is closed.
+ */
+void ch_http_cancel_query(ch_http_request_t *req)
+{
+	request_free(req);
+}
+
 void ch_http_close(ch_http_connection_t *conn)
 {
 	free(conn->base_url);
@@ -181,8 +615,13 @@ char *ch_http_last_error(void)
 
 void ch_http_response_free(ch_http_response_t *resp)
 {
-	if (resp->data)
+	if (resp->mapped)
+		munmap(resp->data, resp->datasize);
+	else if (resp->data)
 		free(resp->data);
 
+	if (resp->spilled)
+		curl_temp_ops->close(resp->spill_file);
+
 	free(resp);
 }
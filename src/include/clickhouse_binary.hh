@@ -6,6 +6,12 @@ extern "C" {
 #endif
 
 typedef struct ch_binary_connection_t ch_binary_connection_t;
+struct ch_temp_file_ops;
+
+/* receives totals of the progress packets */
+typedef void (*ch_binary_progress_func)(uint32_t ticket, const char *query_id,
+		uint64_t rows_read, uint64_t bytes_read, uint64_t total_rows);
+
 typedef struct ch_binary_response_t
 {
 	void			   *values;
@@ -13,6 +19,22 @@ typedef struct ch_binary_response_t
 	size_t				blocks_count;
 	char			   *error;
 	bool				success;
+	bool				canceled;	/* error is the cancellation */
+	char				query_id[37];
+	void			   *spill;		/* blocks saved to a temporary file */
+
+	/* statistics of the query, times are in milliseconds */
+	double				total_time;
+	double				first_block_time;	/* since the query was sent */
+	double				wait_time;			/* waiting for the socket */
+	double				decompress_time;
+	double				decode_time;		/* reading of blocks */
+	uint64_t			bytes;				/* received from the socket */
+	uint64_t			uncompressed_bytes;
+	uint64_t			rows;
+	uint64_t			server_rows_read;	/* from progress packets */
+	uint64_t			server_bytes_read;
+	uint64_t			server_total_rows;	/* estimated by the server */
 } ch_binary_response_t;
 
 typedef struct {
@@ -43,6 +65,15 @@ typedef struct {
 	Oid		array_type;	/* used on selects */
 } ch_binary_array_t;
 
+/* single column table sent along with a query */
+typedef struct {
+	const char *name;
+	const char *type_name;	/* ClickHouse type of the column */
+	Oid		typid;
+	Datum  *datums;
+	size_t	len;
+} ch_binary_external_table_t;
+
 typedef struct {
 	MemoryContext	memcxt;	/* used for cleanup */
 	MemoryContextCallback callback;
@@ -52,6 +83,8 @@ typedef struct {
 	size_t	len;
 	void  *conversion_states;
 	char *table_name;
+	char *query;		/* without values, for statistics */
+	uint64_t rows;		/* appended so far */
 
 	Datum	*values;
 	bool	*nulls;
@@ -64,8 +97,13 @@ extern ch_binary_connection_t *ch_binary_connect(char *host, int port,
 		char *database, char *user, char *password, char **error);
 extern void ch_binary_close(ch_binary_connection_t *conn);
 extern ch_binary_response_t *ch_binary_simple_query(ch_binary_connection_t *conn,
-		const char *query, bool (*check_cancel)(void));
+		const char *query, bool (*check_cancel)(void),
+		ch_binary_external_table_t *tables, size_t ntables);
 extern void ch_binary_response_free(ch_binary_response_t *resp);
+extern void ch_binary_set_memory_limit(size_t limit,
+		const struct ch_temp_file_ops *ops);
+extern void ch_binary_set_progress_func(ch_binary_progress_func func,
+		uint32_t ticket);
 
 /* reading */
 void ch_binary_read_state_init(ch_binary_read_state_t *state, ch_binary_response_t *resp);
@@ -6,6 +6,14 @@
 #include "lib/stringinfo.h"
 
 typedef struct ch_http_connection_t ch_http_connection_t;
+typedef struct ch_http_request_t ch_http_request_t;
+struct ch_temp_file_ops;
+
+/* receives totals of X-ClickHouse-Progress headers */
+typedef void (*ch_http_progress_report_func)(uint32_t ticket,
+		const char *query_id, uint64_t rows_read, uint64_t bytes_read,
+		uint64_t total_rows);
+
 typedef struct ch_http_response_t
 {
 	char			   *data;
@@ -13,7 +21,17 @@ typedef struct ch_http_response_t
 	long				http_status;
 	char				query_id[37];
 	double				pretransfer_time;
+	double				starttransfer_time;	/* first byte of the response */
 	double				total_time;
+	uint64_t			server_rows_read;	/* from X-ClickHouse-Summary */
+	uint64_t			server_bytes_read;
+	uint64_t			server_elapsed_ns;
+	ch_http_progress_report_func progress_report;
+	uint32_t			progress_ticket;
+	size_t				memory_limit;	/* data beyond it goes to spill_file */
+	int					spill_file;
+	bool				spilled;
+	bool				mapped;		/* data is the mapped file */
 } ch_http_response_t;
 
 typedef enum
@@ -32,9 +50,20 @@ typedef struct {
 	bool	done;
 } ch_http_read_state;
 
+/* table sent along with a query as multipart data, or query parameter */
+typedef struct {
+	const char *name;
+	const char *structure;	/* column definitions, "value Int32", or NULL
+							 * for a query parameter */
+	const char *data;		/* rows in TabSeparated format, or the value
+							 * of the query parameter */
+	size_t		datasize;
+} ch_http_external_table;
+
 typedef struct {
 	StringInfoData	sql;
 	char		   *sql_begin;		/* beginning part of constructed sql */
+	uint64			nrows;			/* rows in sql */
 	List		   *target_attrs;	/* list of target attribute numbers */
 	int				p_nums;			/* number of parameters to transmit */
 	ch_http_connection_t *conn;
@@ -42,9 +71,18 @@ typedef struct {
 
 void ch_http_init(int verbose, uint32_t query_id_prefix);
 void ch_http_set_progress_func(void *progressfunc);
+void ch_http_set_progress_report(ch_http_progress_report_func func,
+		uint32_t ticket);
+void ch_http_set_memory_limit(size_t limit, const struct ch_temp_file_ops *ops);
 ch_http_connection_t *ch_http_connection(char *connstring);
 void ch_http_close(ch_http_connection_t *conn);
 ch_http_response_t *ch_http_simple_query(ch_http_connection_t *conn, const char *query);
+ch_http_response_t *ch_http_external_query(ch_http_connection_t *conn, const char *query,
+		ch_http_external_table *tables, size_t ntables);
+ch_http_request_t *ch_http_send_query(ch_http_connection_t *conn, const char *query,
+		ch_http_external_table *tables, size_t ntables);
+ch_http_response_t *ch_http_wait_query(ch_http_request_t *req);
+void ch_http_cancel_query(ch_http_request_t *req);
 char *ch_http_last_error(void);
 
 /* read */
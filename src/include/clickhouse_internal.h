@@ -8,6 +8,7 @@ typedef struct ch_http_connection_t
 	CURL			   *curl;
 	char			   *base_url;
 	size_t				base_url_len;
+	Oid					serverid;	/* foreign server, for statistics */
 } ch_http_connection_t;
 
 typedef struct ch_binary_connection_t
@@ -15,6 +16,24 @@ typedef struct ch_binary_connection_t
 	void			  *client;
 	void			  *options;
 	char			  *error;
+	Oid				   serverid;	/* foreign server, for statistics */
 } ch_binary_connection_t;
 
+/*
+ * Temporary files keeping the parts of results beyond the memory limit of
+ * the drivers.  They are provided by pglink.c, so the files are postgres
+ * temporary files, subject to temp_file_limit, temp_tablespaces and
+ * log_temp_files.  The functions are called while the result is received
+ * and do not throw, failures are reported by -1 or false and the error is
+ * raised when the driver returns.
+ */
+typedef struct ch_temp_file_ops
+{
+	int			(*create) (void);
+	bool		(*write) (int file, const char *data, size_t len, off_t offset);
+	bool		(*read) (int file, char *data, size_t len, off_t offset);
+	int			(*get_fd) (int file);	/* open descriptor, for mmap */
+	void		(*close) (int file);
+} ch_temp_file_ops;
+
 #endif
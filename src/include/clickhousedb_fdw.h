@@ -25,6 +25,28 @@
 #include "nodes/pathnodes.h"
 #endif
 
+/*
+ * Statistics of remote queries, shown by EXPLAIN ANALYZE. Times are in
+ * milliseconds, server side numbers are zero if the server did not send them.
+ */
+typedef struct ch_query_stats
+{
+	double		first_block_time;	/* from sending the query to the first
+									 * data of the result */
+	double		wait_time;		/* waiting for the network */
+	double		decompress_time;
+	double		decode_time;	/* reading blocks of the result */
+	double		convert_time;	/* making tuples of the result */
+	double		server_time;	/* elapsed time reported by the server */
+	uint64		bytes;			/* received, compressed if compression
+								 * is used */
+	uint64		uncompressed_bytes;
+	uint64		blocks;
+	uint64		rows;
+	uint64		server_rows_read;
+	uint64		server_bytes_read;
+} ch_query_stats;
+
 /* libclickhouse_link.c */
 typedef struct ch_cursor ch_cursor;
 typedef struct ch_cursor
@@ -35,15 +57,35 @@ typedef struct ch_cursor
 	void	*query_response;
 	void	*read_state;
 	char	*query;
-	double	 request_time;
-	double	 total_time;
+	ch_query_stats stats;
 	size_t   columns_count;
 	uintptr_t	*conversion_states; /* for binary */
 } ch_cursor;
 
+/* Arrays used as sets with this many elements are sent as external tables */
+#define EXTERNAL_TABLE_MIN_VALUES	100
+
+/*
+ * Local values sent along with a query, available there as table "name",
+ * or as query parameter {name:Type} if as_param is set.
+ */
+typedef struct ch_external_table
+{
+	char	   *name;
+	Oid			typid;			/* type of values */
+	int			nvalues;
+	Datum	   *values;
+	bool		as_param;		/* single value of query parameter */
+} ch_external_table;
+
 typedef void (*disconnect_method)(void *conn);
 typedef void (*check_conn_method)(const char *password, UserMapping *user);
 typedef ch_cursor *(*simple_query_method)(void *conn, const char *query);
+typedef ch_cursor *(*external_query_method)(void *conn, const char *query,
+	List *tables);
+typedef void *(*send_query_method)(void *conn, const char *query,
+	List *tables);
+typedef ch_cursor *(*wait_query_method)(void *conn, void *pending);
 typedef void (*simple_insert_method)(void *conn, const char *query);
 typedef void (*cursor_free_method)(ch_cursor *cursor);
 typedef void **(*cursor_fetch_row_method)(ch_cursor *cursor, List *attrs,
@@ -56,6 +98,9 @@ typedef struct
 {
 	disconnect_method			disconnect;
 	simple_query_method			simple_query;
+	external_query_method		external_query;
+	send_query_method			send_query;		/* returns without waiting, or NULL */
+	wait_query_method			wait_query;
 	cursor_free_method			cursor_free;
 	cursor_fetch_row_method		fetch_row;
 	prepare_insert_method		prepare_insert;
@@ -74,11 +119,13 @@ typedef struct {
 	char       *username;
 	char       *password;
 	char       *dbname;
+	Oid			serverid;	/* for statistics of remote queries */
 } ch_connection_details;
 
-ch_connection chfdw_http_connect(char *connstring);
+ch_connection chfdw_http_connect(char *connstring, Oid serverid);
 ch_connection chfdw_binary_connect(ch_connection_details *details);
 text *chfdw_http_fetch_raw_data(ch_cursor *cursor);
+const char *chfdw_external_type_name(Oid typid);
 List *chfdw_construct_create_tables(ImportForeignSchemaStmt *stmt, ForeignServer *server);
 
 typedef enum {
@@ -159,9 +206,15 @@ typedef struct CHFdwRelationInfo
 	/* joinclauses contains only JOIN/ON conditions for an outer join */
 	List	   *joinclauses;	/* List of RestrictInfo */
 
-	/* Grouping information */
+	/* Grouping information, also used for DISTINCT and window functions */
 	List	   *grouped_tlist;
 
+	/* Upper relation information */
+	UpperRelationKind stage;
+
+	/* True means that the query_pathkeys is safe to push down */
+	bool		qp_is_pushdown_safe;
+
 	/* Subquery information */
 	bool		make_outerrel_subquery; /* do we deparse outerrel as a
                                          * subquery? */
@@ -179,6 +232,24 @@ typedef struct CHFdwRelationInfo
 	/* Custom */
 	CHRemoteTableEngine		ch_table_engine;
 	char					ch_table_sign_field[NAMEDATALEN];
+	char				   *ch_parallel_key;	/* splits parallel scans */
+	Bitmapset			   *ch_prewhere_attrs;	/* columns cheap to read first,
+												 * offset as in pull_varattnos */
+	char				   *ch_sample;		/* SAMPLE clause, or NULL */
+	double					ch_sample_fraction;	/* expected share of rows */
+	bool					ch_sample_scale;	/* scale aggregates by
+												 * _sample_factor */
+	char				   *ch_dictionary;	/* dictionary backing the table */
+	AttrNumber				ch_dictionary_key;	/* key column of it */
+
+	/*
+	 * Joins with a dictionary as the inner side are deparsed as lookups of
+	 * ch_dict_key, an expression of the outer side, in the dictionary.
+	 * ch_dict_rels collects the dictionary tables replaced by lookups
+	 * anywhere under the join.
+	 */
+	Expr				   *ch_dict_key;
+	Relids					ch_dict_rels;
 } CHFdwRelationInfo;
 
 /* in clickhouse_fdw.c */
@@ -196,6 +267,16 @@ chfdw_extract_options(List *defelems, char **driver, char **host, int *port,
                          char **dbname, char **username, char **password);
 
 /* in deparse.c */
+
+/* How a parameter of the remote query is used */
+typedef enum
+{
+	CH_PARAM_VALUE,
+	CH_PARAM_SET,				/* array on the right side of IN */
+	CH_PARAM_LIMIT,				/* LIMIT count */
+	CH_PARAM_OFFSET				/* LIMIT offset, count */
+} ChParamKind;
+
 extern void chfdw_classify_conditions(PlannerInfo *root,
                                RelOptInfo *baserel,
                                List *input_conds,
@@ -208,12 +289,58 @@ extern char *chfdw_deparse_insert_sql(StringInfo buf, RangeTblEntry *rte,
                              Index rtindex, Relation rel,
                              List *targetAttrs);
 extern Expr *chfdw_find_em_expr(EquivalenceClass *ec, RelOptInfo *rel);
+extern Expr *chfdw_find_em_expr_for_input_target(PlannerInfo *root,
+                                    EquivalenceClass *ec, PathTarget *target);
 extern List *chfdw_build_tlist_to_deparse(RelOptInfo *foreignrel);
-extern void chfdw_deparse_select_stmt_for_rel(StringInfo buf, PlannerInfo *root,
+extern bool chfdw_deparse_select_stmt_for_rel(StringInfo buf, PlannerInfo *root,
                                     RelOptInfo *foreignrel, List *tlist,
-                                    List *remote_conds, List *pathkeys, bool is_subquery,
-                                    List **retrieved_attrs, List **params_list);
+                                    List *remote_conds, List *pathkeys,
+                                    bool has_final_sort, bool has_limit,
+                                    bool is_subquery, List **retrieved_attrs,
+                                    List **params_list, List **param_kinds);
 extern const char *chfdw_get_jointype_name(JoinType jointype);
+extern void chfdw_deparse_relation_name(StringInfo buf, Relation rel);
+extern void chfdw_deparse_literal(StringInfo buf, Datum value, bool isnull,
+                                  Oid type, int32 typmod);
+extern void chfdw_deparse_analyze_info_sql(StringInfo buf, Relation rel);
+extern void chfdw_deparse_slice_cond(StringInfo buf, const char *parallel_key,
+									 int nslices, bool has_where);
+extern void chfdw_deparse_analyze_sql(StringInfo buf, Relation rel,
+									  double samplerows, double totalrows,
+									  bool has_sampling_key, int targrows,
+									  List **retrieved_attrs);
+
+/* in result_cache.c */
+extern void chfdw_init_result_cache(void);
+extern bool chfdw_result_cache_enabled(void);
+extern Size chfdw_result_cache_max_size(void);
+extern char *chfdw_result_cache_lookup(UserMapping *user, const char *query,
+									   Size *len);
+extern void chfdw_result_cache_store(UserMapping *user, const char *query,
+									 const char *rows, Size len, int ttl);
+
+/* in stat_statements.c */
+typedef enum
+{
+	CH_QUERY_DONE,
+	CH_QUERY_FAILED,
+	CH_QUERY_CANCELED
+} ChQueryOutcome;
+
+extern void chfdw_init_stat_statements(void);
+extern bool chfdw_stat_statements_enabled(void);
+extern void chfdw_stat_statements_record(Oid serverid, const char *query,
+										 ChQueryOutcome outcome, double time,
+										 uint64 rows, uint64 bytes,
+										 uint64 remote_rows_read);
+
+/* in progress.c */
+extern void chfdw_init_progress(void);
+extern uint32 chfdw_progress_begin(Oid serverid, const char *query);
+extern void chfdw_progress_report(uint32 ticket, const char *query_id,
+								  uint64 rows_read, uint64 bytes_read,
+								  uint64 total_rows);
+extern void chfdw_progress_end(uint32 ticket);
 
 /* in shippable.c */
 extern bool chfdw_is_builtin(Oid objectId);
@@ -268,7 +395,8 @@ typedef enum {
 	CF_AJBOOL_OUT,
 	CF_HSTORE_FETCHVAL,		/* -> operation on hstore */
 	CF_INTARRAY_IDX,
-	CF_CH_FUNCTION		/* adapted clickhouse function */
+	CF_CH_FUNCTION,		/* adapted clickhouse function */
+	CF_CH_TEMPLATE		/* function mapped in ch_function_map */
 } custom_object_type;
 
 typedef struct CustomObjectDef
@@ -278,6 +406,7 @@ typedef struct CustomObjectDef
 	char					custom_name[NAMEDATALEN];	/* \0 - no custom name, \1 - many names */
 	Oid						rowfunc;
 	void				   *context;
+	char				   *chtemplate;	/* for CF_CH_TEMPLATE, $n are arguments */
 } CustomObjectDef;
 
 typedef struct CustomColumnInfo
@@ -297,6 +426,7 @@ extern CustomObjectDef *chfdw_check_for_custom_type(Oid typeoid);
 extern void modifyCustomVar(CustomObjectDef *def, Node *node);
 extern void chfdw_apply_custom_table_options(CHFdwRelationInfo *fpinfo, Oid relid);
 extern CustomColumnInfo *chfdw_get_custom_column_info(Oid relid, uint16 varattno);
+extern List *chfdw_parse_key_columns(const char *key);
 extern CustomObjectDef *chfdw_check_for_custom_operator(Oid opoid, Form_pg_operator form);
 
 extern Datum ch_timestamp_out(PG_FUNCTION_ARGS);
@@ -305,7 +435,6 @@ extern Datum ch_time_out(PG_FUNCTION_ARGS);
 
 extern bool chfdw_is_shippable(Oid objectId, Oid classId, CHFdwRelationInfo *fpinfo,
 		CustomObjectDef **outcdef);
-extern double time_diff(struct timeval *prior, struct timeval *latter);
 
 /* compat */
 #if PG_VERSION_NUM < 120000
@@ -12,6 +12,8 @@
  */
 #include "postgres.h"
 
+#include <math.h>
+
 #include "clickhousedb_fdw.h"
 
 #include "access/reloptions.h"
@@ -78,6 +80,10 @@ clickhousedb_fdw_validator(PG_FUNCTION_ARGS)
 	List	   *options_list = untransformRelOptions(PG_GETARG_DATUM(0));
 	Oid			catalog = PG_GETARG_OID(1);
 	ListCell   *cell;
+	bool		has_sample = false,
+				has_sampling_key = false,
+				has_dictionary = false,
+				has_dictionary_key = false;
 
 	/* Build our options lists if we didn't yet. */
 	InitChFdwOptions();
@@ -113,8 +119,72 @@ clickhousedb_fdw_validator(PG_FUNCTION_ARGS)
 			         errhint("Valid options in this context are: %s",
 			                 buf.data)));
 		}
+
+		/* check the values of boolean options */
+		if (strcmp(def->defname, "early_dispatch") == 0 ||
+				strcmp(def->defname, "prewhere") == 0 ||
+				strcmp(def->defname, "sample_scale") == 0)
+			(void) defGetBoolean(def);
+		else if (strcmp(def->defname, "sample") == 0)
+		{
+			/* a fraction of rows, or an approximate number of rows */
+			char	   *val = defGetString(def);
+			char	   *end;
+			double		sample = strtod(val, &end);
+
+			if (*end != '\0' || end == val || sample <= 0 ||
+					(sample > 1 && sample != floor(sample)))
+				ereport(ERROR,
+				        (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+				         errmsg("invalid value for option \"sample\": \"%s\"", val),
+				         errhint("Use a fraction in (0, 1] or a number of rows.")));
+			has_sample = true;
+		}
+		else if (strcmp(def->defname, "sample_offset") == 0)
+		{
+			char	   *val = defGetString(def);
+			char	   *end;
+			double		offset = strtod(val, &end);
+
+			if (*end != '\0' || end == val || offset < 0 || offset >= 1)
+				ereport(ERROR,
+				        (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+				         errmsg("invalid value for option \"sample_offset\": \"%s\"", val),
+				         errhint("Use a fraction in [0, 1).")));
+		}
+		else if (strcmp(def->defname, "sampling_key") == 0)
+			has_sampling_key = true;
+		else if (strcmp(def->defname, "dictionary") == 0)
+			has_dictionary = true;
+		else if (strcmp(def->defname, "dictionary_key") == 0)
+			has_dictionary_key = true;
+		else if (strcmp(def->defname, "cache_ttl") == 0)
+		{
+			/* seconds the results are kept in the result cache */
+			char	   *val = defGetString(def);
+			char	   *end;
+			long		ttl = strtol(val, &end, 10);
+
+			if (*end != '\0' || end == val || ttl < 0 || ttl > INT_MAX / 1000)
+				ereport(ERROR,
+				        (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+				         errmsg("invalid value for option \"cache_ttl\": \"%s\"", val),
+				         errhint("Use a number of seconds, 0 disables caching.")));
+		}
 	}
 
+	/* ClickHouse refuses SAMPLE on tables without SAMPLE BY */
+	if (has_sample && !has_sampling_key)
+		ereport(ERROR,
+		        (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+		         errmsg("option \"sample\" requires option \"sampling_key\"")));
+
+	/* joins are rewritten to lookups by the key column */
+	if (has_dictionary != has_dictionary_key)
+		ereport(ERROR,
+		        (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+		         errmsg("options \"dictionary\" and \"dictionary_key\" must be used together")));
+
 	PG_RETURN_VOID();
 }
 
@@ -133,8 +203,23 @@ InitChFdwOptions(void)
 	{
 		{"table_name", ForeignTableRelationId, false},
 		{"engine", ForeignTableRelationId, false},
+		{"parallel_key", ForeignTableRelationId, false},
+		{"sorting_key", ForeignTableRelationId, false},
+		{"partition_key", ForeignTableRelationId, false},
+		{"prewhere", ForeignTableRelationId, false},
+		{"sampling_key", ForeignTableRelationId, false},
+		{"sample", ForeignTableRelationId, false},
+		{"sample_offset", ForeignTableRelationId, false},
+		{"sample_scale", ForeignTableRelationId, false},
+		{"dictionary", ForeignTableRelationId, false},
+		{"dictionary_key", ForeignTableRelationId, false},
+		{"early_dispatch", ForeignTableRelationId, false},
+		{"early_dispatch", ForeignServerRelationId, false},
+		{"cache_ttl", ForeignTableRelationId, false},
+		{"cache_ttl", ForeignServerRelationId, false},
 		{"driver", ForeignServerRelationId, false},
 		{"aggregatefunction", AttributeRelationId, false},
+		{"prewhere", AttributeRelationId, false},
 		{NULL, InvalidOid, false}
 	};
 
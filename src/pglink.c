@@ -1,10 +1,14 @@
 #include "postgres.h"
 
 #include "catalog/pg_type_d.h"
+#include "commands/tablespace.h"
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "parser/parse_coerce.h"
 #include "parser/parse_type.h"
+#include "pgstat.h"
+#include "portability/instr_time.h"
+#include "storage/fd.h"
 #include "utils/builtins.h"
 #include "utils/timestamp.h"
 #include "utils/lsyscache.h"
@@ -21,12 +25,17 @@
 #include "clickhousedb_fdw.h"
 #include "clickhouse_http.h"
 #include "clickhouse_binary.hh"
+#include "clickhouse_internal.h"
 
 static bool		initialized = false;
 
 static void http_disconnect(void *conn);
 static ch_cursor *http_simple_query(void *conn, const char *query);
-static void http_simple_insert(void *conn, const char *query);
+static ch_cursor *http_external_query(void *conn, const char *query,
+		List *tables);
+static void *http_send_query(void *conn, const char *query, List *tables);
+static ch_cursor *http_wait_query(void *conn, void *pending);
+static void http_simple_insert(ch_http_insert_state *state);
 static void http_cursor_free(void *);
 static void **http_fetch_row(ch_cursor *, List *, TupleDesc, Datum *, bool *);
 static void *http_prepare_insert(void *, ResultRelInfo *, List *, char *, char *);
@@ -35,6 +44,9 @@ static void http_insert_tuple(void *, TupleTableSlot *);
 static libclickhouse_methods http_methods = {
 	.disconnect=http_disconnect,
 	.simple_query=http_simple_query,
+	.external_query=http_external_query,
+	.send_query=http_send_query,
+	.wait_query=http_wait_query,
 	.fetch_row=http_fetch_row,
 	.prepare_insert=http_prepare_insert,
 	.insert_tuple=http_insert_tuple
@@ -42,6 +54,8 @@ static libclickhouse_methods http_methods = {
 
 static void binary_disconnect(void *conn);
 static ch_cursor *binary_simple_query(void *conn, const char *query);
+static ch_cursor *binary_external_query(void *conn, const char *query,
+		List *tables);
 static void binary_cursor_free(void *cursor);
 static void binary_simple_insert(void *conn, const char *query);
 static void **binary_fetch_row(ch_cursor *cursor, List* attrs, TupleDesc tupdesc,
@@ -53,11 +67,25 @@ static void *binary_prepare_insert(void *, ResultRelInfo *, List *,
 static libclickhouse_methods binary_methods = {
 	.disconnect=binary_disconnect,
 	.simple_query=binary_simple_query,
+	.external_query=binary_external_query,
 	.fetch_row=binary_fetch_row,
 	.prepare_insert=binary_prepare_insert,
 	.insert_tuple=binary_insert_tuple
 };
 
+/*
+ * Query sent without waiting for its result.  The driver request is
+ * abandoned if the memory context goes away before the result is taken.
+ */
+typedef struct
+{
+	void	   *request;
+	char	   *query;
+	List	   *tables;
+	uint32		progress;		/* ticket of the progress of the query */
+	MemoryContextCallback callback;
+} ch_pending_query;
+
 static int http_progress_callback(void *clientp, double dltotal, double dlnow,
 		double ultotal, double ulnow)
 {
@@ -67,6 +95,181 @@ static int http_progress_callback(void *clientp, double dltotal, double dlnow,
 	return 0;
 }
 
+/*
+ * Temporary files of the drivers.  They are created outside of resource
+ * owners and closed when the result is freed.  Errors are caught, because
+ * the drivers call the functions from their callbacks, and raised again
+ * with raise_temp_file_error() when the driver returns.
+ */
+static int	temp_file_errcode = 0;
+static char temp_file_errmsg[256];
+
+static void
+save_temp_file_error(MemoryContext cxt)
+{
+	ErrorData  *edata;
+
+	MemoryContextSwitchTo(cxt);
+	edata = CopyErrorData();
+	FlushErrorState();
+
+	if (temp_file_errcode == 0)
+	{
+		temp_file_errcode = edata->sqlerrcode;
+		strlcpy(temp_file_errmsg, edata->message, sizeof(temp_file_errmsg));
+	}
+	FreeErrorData(edata);
+}
+
+static void
+raise_temp_file_error(void)
+{
+	int			code = temp_file_errcode;
+
+	if (code == 0)
+		return;
+
+	temp_file_errcode = 0;
+	ereport(ERROR,
+			(errcode(code),
+			 errmsg("%s", temp_file_errmsg)));
+}
+
+static int
+temp_file_create(void)
+{
+	MemoryContext cxt = CurrentMemoryContext;
+	volatile File file = -1;
+
+	PG_TRY();
+	{
+		PrepareTempTablespaces();
+		file = OpenTemporaryFile(true);
+	}
+	PG_CATCH();
+	{
+		save_temp_file_error(cxt);
+	}
+	PG_END_TRY();
+
+	return file;
+}
+
+static bool
+temp_file_write(int file, const char *data, size_t len, off_t offset)
+{
+	MemoryContext cxt = CurrentMemoryContext;
+	volatile bool ok = true;
+
+	PG_TRY();
+	{
+		while (len > 0)
+		{
+			int			amount = (int) Min(len, (size_t) PG_INT32_MAX);
+			int			res;
+
+#if PG_VERSION_NUM >= 120000
+			res = FileWrite(file, (char *) data, amount, offset,
+							WAIT_EVENT_BUFFILE_WRITE);
+#else
+			if (FileSeek(file, offset, SEEK_SET) != offset)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not seek in temporary file: %m")));
+			res = FileWrite(file, (char *) data, amount,
+							WAIT_EVENT_BUFFILE_WRITE);
+#endif
+			if (res <= 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not write to temporary file: %m")));
+
+			data += res;
+			len -= res;
+			offset += res;
+		}
+	}
+	PG_CATCH();
+	{
+		save_temp_file_error(cxt);
+		ok = false;
+	}
+	PG_END_TRY();
+
+	return ok;
+}
+
+static bool
+temp_file_read(int file, char *data, size_t len, off_t offset)
+{
+	MemoryContext cxt = CurrentMemoryContext;
+	volatile bool ok = true;
+
+	PG_TRY();
+	{
+		while (len > 0)
+		{
+			int			amount = (int) Min(len, (size_t) PG_INT32_MAX);
+			int			res;
+
+#if PG_VERSION_NUM >= 120000
+			res = FileRead(file, data, amount, offset,
+						   WAIT_EVENT_BUFFILE_READ);
+#else
+			if (FileSeek(file, offset, SEEK_SET) != offset)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not seek in temporary file: %m")));
+			res = FileRead(file, data, amount, WAIT_EVENT_BUFFILE_READ);
+#endif
+			if (res < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not read temporary file: %m")));
+			if (res == 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("unexpected end of temporary file")));
+
+			data += res;
+			len -= res;
+			offset += res;
+		}
+	}
+	PG_CATCH();
+	{
+		save_temp_file_error(cxt);
+		ok = false;
+	}
+	PG_END_TRY();
+
+	return ok;
+}
+
+static int
+temp_file_get_fd(int file)
+{
+	/* reopens the file if fd.c has closed it */
+	if (FileSize(file) < 0)
+		return -1;
+
+	return FileGetRawDesc(file);
+}
+
+static void
+temp_file_close(int file)
+{
+	FileClose(file);
+}
+
+static const ch_temp_file_ops temp_file_ops = {
+	.create=temp_file_create,
+	.write=temp_file_write,
+	.read=temp_file_read,
+	.get_fd=temp_file_get_fd,
+	.close=temp_file_close
+};
+
 static bool is_canceled(void)
 {
 	/* this variable is bool on pg < 12, but sig_atomic_t on above versions */
@@ -76,8 +279,38 @@ static bool is_canceled(void)
 	return false;
 }
 
+/*
+ * Publish the query in the progress view, the driver reports the progress
+ * of the next query with the ticket.
+ */
+static uint32
+http_progress_begin(void *conn, const char *query)
+{
+	uint32		ticket;
+
+	ticket = chfdw_progress_begin(((ch_http_connection_t *) conn)->serverid,
+								  query);
+	if (ticket != 0)
+		ch_http_set_progress_report(chfdw_progress_report, ticket);
+
+	return ticket;
+}
+
+static uint32
+binary_progress_begin(void *conn, const char *query)
+{
+	uint32		ticket;
+
+	ticket = chfdw_progress_begin(((ch_binary_connection_t *) conn)->serverid,
+								  query);
+	if (ticket != 0)
+		ch_binary_set_progress_func(chfdw_progress_report, ticket);
+
+	return ticket;
+}
+
 ch_connection
-chfdw_http_connect(char *connstring)
+chfdw_http_connect(char *connstring, Oid serverid)
 {
 	ch_connection res;
 	ch_http_connection_t *conn = ch_http_connection(connstring);
@@ -98,6 +331,7 @@ chfdw_http_connect(char *connstring)
 		         errmsg("could not connect to server: %s", error)));
 	}
 
+	conn->serverid = serverid;
 	res.conn = conn;
 	res.methods = &http_methods;
 	res.is_binary = false;
@@ -144,30 +378,135 @@ kill_query(void *conn, const char *query_id)
 	pfree(query);
 }
 
+/*
+ * ClickHouse type of the column of an external table with values of given
+ * type, NULL if such values are not supported.
+ */
+const char *
+chfdw_external_type_name(Oid typid)
+{
+	switch (typid)
+	{
+		case INT2OID:
+			return "Int16";
+		case INT4OID:
+			return "Int32";
+		case INT8OID:
+			return "Int64";
+		case TEXTOID:
+		case VARCHAROID:
+			return "String";
+		default:
+			return NULL;
+	}
+}
+
+/* Append value in TabSeparated escaping */
+static void
+append_tsv_value(StringInfo buf, const char *val)
+{
+	for (const char *c = val; *c; c++)
+	{
+		switch (*c)
+		{
+			case '\\':
+				appendStringInfoString(buf, "\\\\");
+				break;
+			case '\t':
+				appendStringInfoString(buf, "\\t");
+				break;
+			case '\n':
+				appendStringInfoString(buf, "\\n");
+				break;
+			default:
+				appendStringInfoChar(buf, *c);
+		}
+	}
+}
+
 static ch_cursor *
 http_simple_query(void *conn, const char *query)
 {
-	int			attempts = 0;
+	return http_external_query(conn, query, NIL);
+}
+
+static ch_http_external_table *
+http_external_tables(List *tables, int *ntables)
+{
+	ch_http_external_table *ext = NULL;
+	ListCell   *lc;
+	int			i = 0;
+
+	if (tables != NIL)
+		ext = palloc(sizeof(ch_http_external_table) * list_length(tables));
+
+	foreach(lc, tables)
+	{
+		ch_external_table *table = lfirst(lc);
+		StringInfoData	buf;
+		Oid			outfunc;
+		bool		isvarlena;
+
+		getTypeOutputInfo(table->typid, &outfunc, &isvarlena);
+
+		initStringInfo(&buf);
+		for (int j = 0; j < table->nvalues; j++)
+		{
+			append_tsv_value(&buf, OidOutputFunctionCall(outfunc,
+						table->values[j]));
+			if (!table->as_param)
+				appendStringInfoChar(&buf, '\n');
+		}
+
+		ext[i].name = table->name;
+		ext[i].structure = table->as_param ? NULL :
+			psprintf("value %s", chfdw_external_type_name(table->typid));
+		ext[i].data = buf.data;
+		ext[i].datasize = buf.len;
+		i++;
+	}
+
+	*ntables = i;
+	return ext;
+}
+
+/*
+ * Rows of the result in TabSeparated format, each one ends with a newline.
+ */
+static uint64
+count_tsv_rows(ch_http_response_t *resp)
+{
+	const char *pos = resp->data;
+	const char *end = resp->data + resp->datasize;
+	uint64		rows = 0;
+
+	while (pos < end && (pos = memchr(pos, '\n', end - pos)) != NULL)
+	{
+		rows++;
+		pos++;
+	}
+
+	return rows;
+}
+
+static ch_cursor *
+http_make_cursor(void *conn, ch_http_response_t *resp, const char *query)
+{
 	MemoryContext	tempcxt,
 					oldcxt;
 	ch_cursor	*cursor;
-	ch_http_response_t *resp;
-
-	ch_http_set_progress_func(http_progress_callback);
+	Oid			serverid = ((ch_http_connection_t *) conn)->serverid;
 
-again:
-	resp = ch_http_simple_query(conn, query);
-	if (resp == NULL)
-		elog(ERROR, "out of memory");
+	if (resp->http_status != 200)
+		chfdw_stat_statements_record(serverid, query,
+				resp->http_status == 418 ? CH_QUERY_CANCELED : CH_QUERY_FAILED,
+				resp->total_time * 1000, 0, 0, 0);
 
-	attempts++;
 	if (resp->http_status == 419)
 	{
 		char *error = pnstrdup(resp->data, resp->datasize);
 		ch_http_response_free(resp);
-
-		if (attempts < 3)
-			goto again;
+		raise_temp_file_error();
 
 		ereport(ERROR,
 		        (errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
@@ -177,6 +516,7 @@ again:
 	{
 		kill_query(conn, resp->query_id);
 		ch_http_response_free(resp);
+		raise_temp_file_error();
 
 		ereport(ERROR,
 		        (errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
@@ -186,6 +526,7 @@ again:
 	{
 		char *error = pnstrdup(resp->data, resp->datasize);
 		ch_http_response_free(resp);
+		raise_temp_file_error();
 
 		ereport(ERROR,
 		        (errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
@@ -202,10 +543,21 @@ again:
 	cursor->query_response = resp;
 	cursor->read_state = palloc0(sizeof(ch_http_read_state));
 	cursor->query = pstrdup(query);
-	cursor->request_time = resp->pretransfer_time * 1000;
-	cursor->total_time = resp->total_time * 1000;
+	cursor->stats.first_block_time = resp->starttransfer_time * 1000;
+	cursor->stats.wait_time = (resp->total_time - resp->pretransfer_time) * 1000;
+	cursor->stats.server_time = resp->server_elapsed_ns / 1000000.0;
+	cursor->stats.bytes = resp->datasize;
+	cursor->stats.uncompressed_bytes = resp->datasize;
+	cursor->stats.blocks = resp->datasize > 0 ? 1 : 0;
+	cursor->stats.server_rows_read = resp->server_rows_read;
+	cursor->stats.server_bytes_read = resp->server_bytes_read;
 	ch_http_read_state_init(cursor->read_state, resp->data, resp->datasize);
 
+	if (chfdw_stat_statements_enabled())
+		chfdw_stat_statements_record(serverid, query, CH_QUERY_DONE,
+				resp->total_time * 1000, count_tsv_rows(resp),
+				resp->datasize, resp->server_rows_read);
+
 	cursor->memcxt = tempcxt;
 	cursor->callback.func = http_cursor_free;
 	cursor->callback.arg = cursor;
@@ -215,18 +567,113 @@ again:
 	return cursor;
 }
 
+static ch_cursor *
+http_external_query(void *conn, const char *query, List *tables)
+{
+	int			attempts = 0;
+	ch_http_response_t *resp;
+	ch_http_external_table *ext;
+	int			ntables;
+	uint32		progress;
+
+	ext = http_external_tables(tables, &ntables);
+	ch_http_set_progress_func(http_progress_callback);
+	ch_http_set_memory_limit((size_t) work_mem * 1024L, &temp_file_ops);
+	progress = http_progress_begin(conn, query);
+
+again:
+	resp = ch_http_external_query(conn, query, ext, ntables);
+	if (resp == NULL)
+		elog(ERROR, "out of memory");
+
+	attempts++;
+	if (resp->http_status == 419 && attempts < 3 && temp_file_errcode == 0)
+	{
+		ch_http_response_free(resp);
+		goto again;
+	}
+
+	ch_http_set_progress_report(NULL, 0);
+	chfdw_progress_end(progress);
+	return http_make_cursor(conn, resp, query);
+}
+
 static void
-http_simple_insert(void *conn, const char *query)
+http_pending_free(void *arg)
 {
-	ch_cursor	*cursor;
+	ch_pending_query *pending = arg;
 
-	ch_http_response_t *resp = ch_http_simple_query(conn, query);
+	if (pending->request)
+		ch_http_cancel_query(pending->request);
+	chfdw_progress_end(pending->progress);
+}
+
+static void *
+http_send_query(void *conn, const char *query, List *tables)
+{
+	ch_pending_query *pending;
+	ch_http_external_table *ext;
+	int			ntables;
+
+	ext = http_external_tables(tables, &ntables);
+	ch_http_set_progress_func(http_progress_callback);
+	ch_http_set_memory_limit((size_t) work_mem * 1024L, &temp_file_ops);
+
+	pending = palloc0(sizeof(ch_pending_query));
+	pending->progress = http_progress_begin(conn, query);
+	pending->request = ch_http_send_query(conn, query, ext, ntables);
+	ch_http_set_progress_report(NULL, 0);
+	if (pending->request == NULL)
+		elog(ERROR, "out of memory");
+
+	pending->query = pstrdup(query);
+	pending->tables = tables;
+	pending->callback.func = http_pending_free;
+	pending->callback.arg = pending;
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, &pending->callback);
+
+	return pending;
+}
+
+static ch_cursor *
+http_wait_query(void *conn, void *arg)
+{
+	ch_pending_query *pending = arg;
+	ch_http_response_t *resp;
+
+	resp = ch_http_wait_query(pending->request);
+	pending->request = NULL;
+	chfdw_progress_end(pending->progress);
+
+	/* communication errors are retried on the main connection */
+	if (resp->http_status == 419)
+	{
+		ch_http_response_free(resp);
+		return http_external_query(conn, pending->query, pending->tables);
+	}
+
+	return http_make_cursor(conn, resp, pending->query);
+}
+
+/*
+ * Send the rows collected so far, the statistics count the beginning of the
+ * query without the rows.
+ */
+static void
+http_simple_insert(ch_http_insert_state *state)
+{
+	const char *query = state->sql.data;
+	Oid			serverid = state->conn->serverid;
+
+	ch_http_response_t *resp = ch_http_simple_query(state->conn, query);
 	if (resp == NULL)
 	{
 		char *error = ch_http_last_error();
 		if (error == NULL)
 			error = "undefined";
 
+		chfdw_stat_statements_record(serverid, state->sql_begin,
+				CH_QUERY_FAILED, 0, 0, 0, 0);
 		ereport(ERROR,
 		        (errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
 		         errmsg("clickhouse_fdw: communication error: %s", error)));
@@ -235,6 +682,10 @@ http_simple_insert(void *conn, const char *query)
 	if (resp->http_status != 200)
 	{
 		char *error = pnstrdup(resp->data, resp->datasize);
+
+		chfdw_stat_statements_record(serverid, state->sql_begin,
+				resp->http_status == 418 ? CH_QUERY_CANCELED : CH_QUERY_FAILED,
+				resp->total_time * 1000, 0, 0, 0);
 		ch_http_response_free(resp);
 
 		ereport(ERROR,
@@ -243,6 +694,8 @@ http_simple_insert(void *conn, const char *query)
 				 errdetail("query: %.1024s", query)));
 	}
 
+	chfdw_stat_statements_record(serverid, state->sql_begin, CH_QUERY_DONE,
+			resp->total_time * 1000, state->nrows, state->sql.len, 0);
 	ch_http_response_free(resp);
 }
 
@@ -295,6 +748,7 @@ http_fetch_row(ch_cursor *cursor, List *attrs, TupleDesc tupdesc, Datum *v, bool
 						   "expected column count (%lu).", attcount)));
 	}
 
+	cursor->stats.rows++;
 	return (void **) values;
 }
 
@@ -449,12 +903,15 @@ http_insert_tuple(void *istate, TupleTableSlot *slot)
 	ch_http_insert_state *state = istate;
 
 	extend_insert_query(state, slot);
+	if (slot != NULL)
+		state->nrows++;
 
 	if ((slot == NULL && state->sql.len > 0)
 			|| state->sql.len > (MaxAllocSize / 2 /* 512MB */))
 	{
-		http_simple_insert(state->conn, state->sql.data);
+		http_simple_insert(state);
 		resetStringInfo(&state->sql);
+		state->nrows = 0;
 	}
 }
 
@@ -479,6 +936,7 @@ chfdw_binary_connect(ch_connection_details *details)
 		         errmsg("clickhouse_fdw: connection error: %s", error)));
 	}
 
+	conn->serverid = details->serverid;
 	res.conn = conn;
 	res.methods = &binary_methods;
 	res.is_binary = true;
@@ -494,18 +952,58 @@ binary_disconnect(void *conn)
 
 static ch_cursor *
 binary_simple_query(void *conn, const char *query)
+{
+	return binary_external_query(conn, query, NIL);
+}
+
+static ch_binary_external_table_t *
+binary_external_tables(List *tables, int *ntables)
+{
+	ch_binary_external_table_t *ext = NULL;
+	ListCell   *lc;
+	int			i = 0;
+
+	if (tables != NIL)
+		ext = palloc(sizeof(ch_binary_external_table_t) * list_length(tables));
+
+	foreach(lc, tables)
+	{
+		ch_external_table *table = lfirst(lc);
+
+		/* the protocol revision we use predates query parameters */
+		Assert(!table->as_param);
+
+		ext[i].name = table->name;
+		ext[i].type_name = chfdw_external_type_name(table->typid);
+		/* varchar values are appended like text */
+		ext[i].typid = (table->typid == VARCHAROID) ? TEXTOID : table->typid;
+		ext[i].datums = table->values;
+		ext[i].len = table->nvalues;
+		i++;
+	}
+
+	*ntables = i;
+	return ext;
+}
+
+static ch_cursor *
+binary_make_cursor(void *conn, ch_binary_response_t *resp, const char *query)
 {
 	MemoryContext	tempcxt,
 					oldcxt;
 	ch_cursor	*cursor;
 	ch_binary_read_state_t *state;
-
-	ch_binary_response_t *resp = ch_binary_simple_query(conn, query, &is_canceled);
+	Oid			serverid = ((ch_binary_connection_t *) conn)->serverid;
 
 	if (!resp->success)
 	{
 		char *error = pstrdup(resp->error);
+
+		chfdw_stat_statements_record(serverid, query,
+				resp->canceled ? CH_QUERY_CANCELED : CH_QUERY_FAILED,
+				resp->total_time, 0, resp->bytes, resp->server_rows_read);
 		ch_binary_response_free(resp);
+		raise_temp_file_error();
 
 		ereport(ERROR,
 		        (errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
@@ -522,6 +1020,18 @@ binary_simple_query(void *conn, const char *query)
 	cursor->query = pstrdup(query);
 	cursor->read_state = state;
 	cursor->columns_count = resp->columns_count;
+	cursor->stats.first_block_time = resp->first_block_time;
+	cursor->stats.wait_time = resp->wait_time;
+	cursor->stats.decompress_time = resp->decompress_time;
+	cursor->stats.decode_time = resp->decode_time;
+	cursor->stats.bytes = resp->bytes;
+	cursor->stats.uncompressed_bytes = resp->uncompressed_bytes;
+	cursor->stats.blocks = resp->blocks_count;
+	cursor->stats.rows = resp->rows;
+	cursor->stats.server_rows_read = resp->server_rows_read;
+	cursor->stats.server_bytes_read = resp->server_bytes_read;
+	chfdw_stat_statements_record(serverid, query, CH_QUERY_DONE,
+			resp->total_time, resp->rows, resp->bytes, resp->server_rows_read);
 	ch_binary_read_state_init(cursor->read_state, resp);
 	cursor->conversion_states = palloc0(sizeof(uintptr_t) * cursor->columns_count);
 
@@ -542,6 +1052,24 @@ binary_simple_query(void *conn, const char *query)
 	return cursor;
 }
 
+static ch_cursor *
+binary_external_query(void *conn, const char *query, List *tables)
+{
+	ch_binary_response_t *resp;
+	ch_binary_external_table_t *ext;
+	int			ntables;
+	uint32		progress;
+
+	ext = binary_external_tables(tables, &ntables);
+	ch_binary_set_memory_limit((size_t) work_mem * 1024L, &temp_file_ops);
+	progress = binary_progress_begin(conn, query);
+	resp = ch_binary_simple_query(conn, query, &is_canceled, ext, ntables);
+	ch_binary_set_progress_func(NULL, 0);
+	chfdw_progress_end(progress);
+
+	return binary_make_cursor(conn, resp, query);
+}
+
 static void **
 binary_fetch_row(ch_cursor *cursor, List *attrs, TupleDesc tupdesc,
 	Datum *values, bool *nulls)
@@ -553,10 +1081,13 @@ binary_fetch_row(ch_cursor *cursor, List *attrs, TupleDesc tupdesc,
 	size_t		attcount = list_length(attrs);
 
 	if (state->error)
+	{
+		raise_temp_file_error();
 		ereport(ERROR,
 		        (errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
 		         errmsg("clickhouse_fdw: error while reading row: %s",
 					 state->error)));
+	}
 
 	if (!have_data)
 		return NULL;
@@ -680,6 +1211,7 @@ binary_prepare_insert(void *conn, ResultRelInfo *rri, List *target_attrs,
 	state->callback.arg = state;
 	state->conn = conn;
 	state->table_name = pstrdup(table_name);
+	state->query = pstrdup(query);
 	MemoryContextRegisterResetCallback(tempcxt, &state->callback);
 
 	/* time for c++ stuff */
@@ -714,10 +1246,34 @@ binary_insert_tuple(void *istate, TupleTableSlot *slot)
 
 		for (size_t i = 0; i < state->outdesc->natts; i++)
 			ch_binary_column_append_data(state, i);
+		state->rows++;
 	}
 	else
 	{
-		ch_binary_insert_columns(state);
+		instr_time	start,
+					duration;
+
+		INSTR_TIME_SET_CURRENT(start);
+		PG_TRY();
+		{
+			ch_binary_insert_columns(state);
+		}
+		PG_CATCH();
+		{
+			INSTR_TIME_SET_CURRENT(duration);
+			INSTR_TIME_SUBTRACT(duration, start);
+			chfdw_stat_statements_record(state->conn->serverid, state->query,
+					CH_QUERY_FAILED, INSTR_TIME_GET_MILLISEC(duration),
+					0, 0, 0);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		chfdw_stat_statements_record(state->conn->serverid, state->query,
+				CH_QUERY_DONE, INSTR_TIME_GET_MILLISEC(duration),
+				state->rows, 0, 0);
 		state->success = true;
 	}
 }
@@ -751,6 +1307,235 @@ readstr(ch_connection conn, char *val)
 		return val;
 }
 
+static void
+append_key_option(StringInfo buf, const char *name, char *key)
+{
+	List	   *columns;
+	ListCell   *lc;
+
+	if (key == NULL)
+		return;
+
+	columns = chfdw_parse_key_columns(key);
+	if (columns == NIL)
+		return;
+
+	appendStringInfo(buf, ", %s '", name);
+	foreach (lc, columns)
+	{
+		if (lc != list_head(columns))
+			appendStringInfoString(buf, ", ");
+		appendStringInfoString(buf, (char *) lfirst(lc));
+	}
+	appendStringInfoChar(buf, '\'');
+	list_free_deep(columns);
+}
+
+/* Append ClickHouse string literal */
+static void
+append_ch_literal(StringInfo buf, const char *val)
+{
+	appendStringInfoChar(buf, '\'');
+	for (const char *c = val; *c; c++)
+	{
+		if (*c == '\'' || *c == '\\')
+			appendStringInfoChar(buf, '\\');
+		appendStringInfoChar(buf, *c);
+	}
+	appendStringInfoChar(buf, '\'');
+}
+
+/*
+ * Split ClickHouse type like "Nullable(Decimal(10, 2))" to its name and
+ * the list of parameters, which are types, numbers or quoted strings.
+ * Parameters are returned as they are, nested types are parsed by caller.
+ */
+static char *
+parse_ch_type(const char *type, List **args)
+{
+	const char *p = type;
+	const char *start;
+	char	   *name;
+	int			depth = 0;
+	char		quote = '\0';
+
+	*args = NIL;
+	while (isspace((unsigned char) *p))
+		p++;
+
+	start = p;
+	while (isalnum((unsigned char) *p) || *p == '_')
+		p++;
+	name = pnstrdup(start, p - start);
+
+	while (isspace((unsigned char) *p))
+		p++;
+	if (*p != '(')
+		return name;
+
+	for (start = ++p; *p; p++)
+	{
+		if (quote)
+		{
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			else if (*p == quote)
+				quote = '\0';
+		}
+		else if (*p == '\'' || *p == '`' || *p == '"')
+			quote = *p;
+		else if (*p == '(')
+			depth++;
+		else if ((*p == ',' || *p == ')') && depth == 0)
+		{
+			const char *end = p;
+
+			while (isspace((unsigned char) *start))
+				start++;
+			while (end > start && isspace((unsigned char) end[-1]))
+				end--;
+			*args = lappend(*args, pnstrdup(start, end - start));
+
+			if (*p == ')')
+				break;
+			start = p + 1;
+		}
+		else if (*p == ')')
+			depth--;
+	}
+
+	return name;
+}
+
+/*
+ * Append PostgreSQL type for the ClickHouse type of imported column.
+ *
+ * Nullable, LowCardinality and Array wrappers are unwrapped, Nullable and
+ * Array are reported to the caller.  For AggregateFunction columns the type
+ * of the argument is used and the function goes to *aggfunc.
+ */
+static void
+append_pg_type(StringInfo buf, const char *chtype, bool *is_nullable,
+			   bool *is_array, char **aggfunc)
+{
+	List	   *args;
+	char	   *name = parse_ch_type(chtype, &args);
+	int			nargs = list_length(args);
+
+	if (strcmp(name, "Nullable") == 0 && nargs == 1)
+	{
+		*is_nullable = true;
+		append_pg_type(buf, linitial(args), is_nullable, is_array, aggfunc);
+	}
+	else if (strcmp(name, "LowCardinality") == 0 && nargs == 1)
+		append_pg_type(buf, linitial(args), is_nullable, is_array, aggfunc);
+	else if (strcmp(name, "Array") == 0 && nargs == 1)
+	{
+		*is_array = true;
+		append_pg_type(buf, linitial(args), is_nullable, is_array, aggfunc);
+	}
+	else if (strcmp(name, "AggregateFunction") == 0 && nargs >= 2)
+	{
+		*aggfunc = linitial(args);
+		append_pg_type(buf, lsecond(args), is_nullable, is_array, aggfunc);
+	}
+	else if (strcmp(name, "SimpleAggregateFunction") == 0 && nargs == 2)
+		append_pg_type(buf, lsecond(args), is_nullable, is_array, aggfunc);
+	else if (strcmp(name, "Decimal") == 0)
+	{
+		if (nargs != 2)
+			elog(ERROR, "clickhouse_fdw: could not import Decimal field, "
+				"should be two parameters on definition");
+
+		appendStringInfo(buf, "NUMERIC(%s, %s)", (char *) linitial(args),
+						 (char *) lsecond(args));
+	}
+	else if (strcmp(name, "Decimal32") == 0 && nargs == 1)
+		appendStringInfo(buf, "NUMERIC(9, %s)", (char *) linitial(args));
+	else if (strcmp(name, "Decimal64") == 0 && nargs == 1)
+		appendStringInfo(buf, "NUMERIC(18, %s)", (char *) linitial(args));
+	else if (strcmp(name, "Decimal128") == 0 && nargs == 1)
+		appendStringInfo(buf, "NUMERIC(38, %s)", (char *) linitial(args));
+	else if (strcmp(name, "FixedString") == 0 && nargs == 1)
+		appendStringInfo(buf, "VARCHAR(%s)", (char *) linitial(args));
+	else if (strcmp(name, "Enum8") == 0 || strcmp(name, "Enum16") == 0)
+		appendStringInfoString(buf, "TEXT");
+	else if (strcmp(name, "Tuple") == 0)
+	{
+		appendStringInfoString(buf, "TEXT");
+		elog(NOTICE, "clickhouse_fdw: ClickHouse <Tuple> type was "
+			"translated to <TEXT> type, please create composite type and alter the column if needed");
+	}
+	else if (strcmp(name, "DateTime") == 0)
+		/* the time zone is only used for output on ClickHouse side */
+		appendStringInfoString(buf, "TIMESTAMP");
+	else
+	{
+		bool		found = false;
+
+		for (size_t i = 0; nargs == 0 && i < STR_TYPES_COUNT; i++)
+		{
+			if (strcmp(str_types_map[i][0], name) == 0)
+			{
+				found = true;
+				appendStringInfoString(buf, str_types_map[i][1]);
+				break;
+			}
+		}
+
+		if (!found)
+			elog(ERROR, "clickhouse_fdw: could not map type: %s", chtype);
+	}
+}
+
+/*
+ * Finish CREATE FOREIGN TABLE statement with the options of the table.
+ */
+static void
+append_table_options(StringInfo buf, ForeignServer *server,
+					 char **table_values)
+{
+	char	   *table_name = table_values[0],
+			   *engine = table_values[1],
+			   *engine_full = table_values[2],
+			   *sorting_key = table_values[3],
+			   *partition_key = table_values[4],
+			   *sampling_key = table_values[5];
+
+	appendStringInfo(buf, "\n) SERVER %s OPTIONS (table_name '%s'",
+		server->servername, table_name);
+
+	if (engine && engine_full && strcmp(engine, "CollapsingMergeTree") == 0)
+	{
+		char *sub = strstr(engine_full, ")");
+		if (sub)
+		{
+			sub[1] = '\0';
+			appendStringInfo(buf, ", engine '%s'", engine_full);
+		}
+	}
+	else if (engine)
+		appendStringInfo(buf, ", engine '%s'", engine);
+
+	/* only plain columns of the keys are used for PREWHERE */
+	append_key_option(buf, "sorting_key", sorting_key);
+	append_key_option(buf, "partition_key", partition_key);
+
+	/* the whole expression, it's only checked to allow SAMPLE */
+	if (sampling_key && *sampling_key)
+		appendStringInfo(buf, ", sampling_key %s",
+						 quote_literal_cstr(sampling_key));
+
+	appendStringInfoString(buf, ");\n");
+}
+
+/*
+ * Construct CREATE FOREIGN TABLE statements for IMPORT FOREIGN SCHEMA.
+ *
+ * Columns of all the tables are fetched by one query, joined with their
+ * tables and ordered by table, so each table is a run of rows.  LIMIT TO
+ * and EXCEPT are applied by ClickHouse too.
+ */
 List *
 chfdw_construct_create_tables(ImportForeignSchemaStmt *stmt, ForeignServer *server)
 {
@@ -758,11 +1543,14 @@ chfdw_construct_create_tables(ImportForeignSchemaStmt *stmt, ForeignServer *serv
 	UserMapping	   *user = GetUserMapping(userid, server->serverid);
 	ch_connection	conn = chfdw_get_connection(user);
 	ch_cursor	   *cursor;
-	char		   *query,
-				   *driver;
+	char		   *driver;
 	List		   *result = NIL,
-				   *datts = NIL;
+				   *attrs;
 	char		  **row_values;
+	char		   *table_values[6] = {NULL};
+	StringInfoData	query;
+	StringInfoData	buf;
+	ListCell	   *lc;
 
 	/* default settings */
 	ch_connection_details	details = {"127.0.0.1", 8123, NULL, NULL, "default"};
@@ -771,205 +1559,91 @@ chfdw_construct_create_tables(ImportForeignSchemaStmt *stmt, ForeignServer *serv
 	chfdw_extract_options(server->options, &driver, &details.host,
 		&details.port, &details.dbname, &details.username, &details.password);
 
-	query = psprintf("select name, engine, engine_full "
-			"from system.tables where database='%s' and name not like '.inner.%%'", details.dbname);
-	cursor = conn.methods->simple_query(conn.conn, query);
+	initStringInfo(&query);
+	appendStringInfoString(&query, "select t.name, t.engine, t.engine_full, "
+		"t.sorting_key, t.partition_key, t.sampling_key, c.name, c.type "
+		"from system.columns as c inner join system.tables as t "
+		"on t.database = c.database and t.name = c.table "
+		"where c.database = ");
+	append_ch_literal(&query, details.dbname);
+	appendStringInfoString(&query, " and c.table not like '.inner.%'");
+
+	if (stmt->list_type == FDW_IMPORT_SCHEMA_LIMIT_TO ||
+		stmt->list_type == FDW_IMPORT_SCHEMA_EXCEPT)
+	{
+		appendStringInfoString(&query,
+			stmt->list_type == FDW_IMPORT_SCHEMA_EXCEPT ?
+			" and c.table not in (" : " and c.table in (");
+		foreach(lc, stmt->table_list)
+		{
+			RangeVar   *rv = (RangeVar *) lfirst(lc);
 
-	datts = list_make2_int(1,2);
+			if (lc != list_head(stmt->table_list))
+				appendStringInfoString(&query, ", ");
+			append_ch_literal(&query, rv->relname);
+		}
+		appendStringInfoChar(&query, ')');
+	}
+	appendStringInfoString(&query, " order by c.table, c.position");
+
+	cursor = conn.methods->simple_query(conn.conn, query.data);
+	attrs = list_concat(list_make4_int(1, 2, 3, 4), list_make4_int(5, 6, 7, 8));
 
+	initStringInfo(&buf);
 	while ((row_values = (char **) conn.methods->fetch_row(cursor,
-				list_make3_int(1,2,3), NULL, NULL, NULL)) != NULL)
+				attrs, NULL, NULL, NULL)) != NULL)
 	{
-		StringInfoData	buf;
-		ch_cursor  *table_def;
 		char	   *table_name = readstr(conn, row_values[0]);
-		char	   *engine = readstr(conn, row_values[1]);
-		char	   *engine_full = readstr(conn, row_values[2]);
-		char	  **dvalues;
-		bool		first = true;
+		char	   *column_name = readstr(conn, row_values[6]);
+		char	   *remote_type = readstr(conn, row_values[7]);
+		bool		is_nullable = false,
+					is_array = false;
+		char	   *aggfunc = NULL;
 
-		if (table_name == NULL)
+		if (table_name == NULL || column_name == NULL || remote_type == NULL)
 			continue;
 
-		if (list_length(stmt->table_list))
-		{
-			ListCell *lc;
-			bool found = false;
-
-			foreach(lc, stmt->table_list)
-			{
-				RangeVar   *rv = (RangeVar *) lfirst(lc);
-				if (strcmp(rv->relname, table_name) == 0)
-					found = true;
-			}
-
-			if (stmt->list_type == FDW_IMPORT_SCHEMA_EXCEPT && found)
-				continue;
-			else if (stmt->list_type == FDW_IMPORT_SCHEMA_LIMIT_TO && !found)
-				continue;
-		}
-
-		initStringInfo(&buf);
-		appendStringInfo(&buf, "CREATE FOREIGN TABLE %s.%s (\n",
-			stmt->local_schema, table_name);
-		query = psprintf("select name, type from system.columns where database='%s' and table='%s'", details.dbname, table_name);
-		table_def = conn.methods->simple_query(conn.conn, query);
-
-		while ((dvalues = (char **) conn.methods->fetch_row(table_def,
-			datts, NULL, NULL, NULL)) != NULL)
+		if (table_values[0] == NULL || strcmp(table_values[0], table_name) != 0)
 		{
-			bool	is_nullable = false,
-					is_array = false,
-					add_type = true;
-
-			char   *remote_type = readstr(conn, dvalues[1]),
-				   *pos;
-			List   *options = NIL;
-
-			if (!first)
-				appendStringInfoString(&buf, ",\n");
-			first = false;
-
-			/* name */
-			appendStringInfo(&buf, "\t\"%s\" ", readstr(conn, dvalues[0]));
-			while ((pos = strstr(remote_type, "(")) != NULL)
+			if (table_values[0] != NULL)
 			{
-				char *brpart = pnstrdup(pos, strstr(remote_type, ")") - pos + 1);
-
-				if (strncmp(remote_type, "Decimal", strlen("Decimal")) == 0)
-				{
-					appendStringInfoString(&buf, "NUMERIC");
-					appendStringInfoString(&buf, brpart);
-					if (strstr(pos, ",") == NULL)
-						elog(ERROR, "clickhouse_fdw: could not import Decimal field, "
-							"should be two parameters on definition");
-
-					add_type = false;
-					break;
-				}
-				else if (strncmp(remote_type, "FixedString", strlen("FixedString")) == 0)
-				{
-					appendStringInfoString(&buf, "VARCHAR");
-					appendStringInfoString(&buf, brpart);
-					add_type = false;
-					break;
-				}
-				else if (strncmp(remote_type, "Enum8", strlen("Enum8")) == 0)
-				{
-					appendStringInfoString(&buf, "TEXT");
-					add_type = false;
-					break;
-				}
-				else if (strncmp(remote_type, "Enum16", strlen("Enum16")) == 0)
-				{
-					appendStringInfoString(&buf, "TEXT");
-					add_type = false;
-					break;
-				}
-				else if (strncmp(remote_type, "Tuple", strlen("Tuple")) == 0)
-				{
-					appendStringInfoString(&buf, "TEXT");
-					elog(NOTICE, "clickhouse_fdw: ClickHouse <Tuple> type was "
-						"translated to <TEXT> type, please create composite type and alter the column if needed");
-					add_type = false;
-					break;
-				}
-				else if (strncmp(remote_type, "Array", strlen("Array")) == 0)
-					is_array = true;
-				else if (strncmp(remote_type, "Nullable", strlen("Nullable")) == 0)
-					is_nullable = true;
-				else if (strncmp(remote_type, "AggregateFunction", strlen("AggregateFunction")) == 0)
-				{
-					char *pos2 = strstr(pos, ",");
-					if (pos2 == NULL)
-						elog(ERROR, "clickhouse_fdw: expected comma in AggregateFunction");
-
-					char *func = pnstrdup(pos + 1, strstr(pos + 1, ",") - pos - 1);
-					options = lappend(options, makeInteger(1));
-					options = lappend(options, makeString(func));
-					pos = pos2 + 1; /* also there is space */
-				}
-
-				remote_type = pos + 1;
+				append_table_options(&buf, server, table_values);
+				result = lappend(result, pstrdup(buf.data));
 			}
 
-			if (add_type)
+			/* values are only valid until the next row */
+			for (int i = 0; i < 6; i++)
 			{
-				bool found = false;
-				if ((pos = strstr(remote_type, ")")) != NULL)
-				{
-					/* we need to remove that last brackets */
-					*pos = '\0';
-				}
+				char   *val = readstr(conn, row_values[i]);
 
-				for (size_t i = 0; i < STR_TYPES_COUNT; i++)
-				{
-					if (strcmp(str_types_map[i][0], remote_type) == 0)
-					{
-						found = true;
-						appendStringInfoString(&buf, str_types_map[i][1]);
-						break;
-					}
-				}
-
-				if (!found)
-					elog(ERROR, "clickhouse_fdw: could not map type: %s", remote_type);
+				table_values[i] = val ? pstrdup(val) : NULL;
 			}
 
-			if (options != NIL)
-			{
-				bool first = true;
-				ListCell *lc;
-
-				appendStringInfoString(&buf, " OPTIONS (");
-				foreach(lc, options)
-				{
-					Value	*val = lfirst(lc);
-					if (IsA(val, Integer))
-					{
-						if (!first)
-							appendStringInfoString(&buf, ", ");
-						first = false;
-						switch intVal(val) {
-							case 1:
-								appendStringInfoString(&buf, "AggregateFunction");
-								break;
-							default:
-								elog(ERROR, "programming error");
-						}
-					}
-					else
-						appendStringInfo(&buf, " '%s'", strVal(val));
-				}
-				appendStringInfoString(&buf, ")");
-				list_free_deep(options);
-			}
+			resetStringInfo(&buf);
+			appendStringInfo(&buf, "CREATE FOREIGN TABLE %s.%s (\n",
+				stmt->local_schema, table_values[0]);
+		}
+		else
+			appendStringInfoString(&buf, ",\n");
 
-			if (is_array)
-				appendStringInfoString(&buf, "[]");
+		/* name */
+		appendStringInfo(&buf, "\t\"%s\" ", column_name);
+		append_pg_type(&buf, remote_type, &is_nullable, &is_array, &aggfunc);
 
-			if (!is_nullable)
-				appendStringInfoString(&buf, " NOT NULL");
-		}
+		if (aggfunc != NULL)
+			appendStringInfo(&buf, " OPTIONS (AggregateFunction '%s')", aggfunc);
 
-		appendStringInfo(&buf, "\n) SERVER %s OPTIONS (table_name '%s'",
-			server->servername, table_name);
+		if (is_array)
+			appendStringInfoString(&buf, "[]");
 
-		if (engine && engine_full && strcmp(engine, "CollapsingMergeTree") == 0)
-		{
-			char *sub = strstr(engine_full, ")");
-			if (sub)
-			{
-				sub[1] = '\0';
-				appendStringInfo(&buf, ", engine '%s'", engine_full);
-			}
-		}
-		else if (engine)
-			appendStringInfo(&buf, ", engine '%s'", engine);
+		if (!is_nullable)
+			appendStringInfoString(&buf, " NOT NULL");
+	}
 
-		appendStringInfoString(&buf, ");\n");
-		result = lappend(result, buf.data);
-		MemoryContextDelete(table_def->memcxt);
+	if (table_values[0] != NULL)
+	{
+		append_table_options(&buf, server, table_values);
+		result = lappend(result, pstrdup(buf.data));
 	}
 
 	MemoryContextDelete(cursor->memcxt);
@@ -0,0 +1,370 @@
+/*-------------------------------------------------------------------------
+ *
+ * progress.c
+ *		  Progress of remote queries of clickhouse_fdw
+ *
+ * Every backend has a slot in shared memory where pglink.c publishes the
+ * remote query it is waiting for, and the drivers report the progress sent
+ * by ClickHouse: Progress packets of the binary protocol and
+ * X-ClickHouse-Progress headers of HTTP.  A backend runs one remote query
+ * at a time, except for the queries sent ahead of time, so the slot shows
+ * the one started last.  The ticket of the query makes sure that the
+ * progress of a query sent ahead of time does not overwrite the next one.
+ *
+ * Only the backend writes its slot.  Readers copy the slot between two
+ * reads of changecount and retry if it changed or is odd, the way
+ * st_changecount of PgBackendStatus works, so nobody waits for a lock.  The
+ * numbers of the progress are atomics updated without changecount.
+ *
+ * The progress needs the library in shared_preload_libraries.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/pg_authid.h"
+#include "funcapi.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "postmaster/autovacuum.h"
+#include "replication/walsender.h"
+#include "storage/backendid.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include "clickhousedb_fdw.h"
+
+#define PROGRESS_QUERY_LEN	1024	/* longer queries are truncated */
+
+typedef struct ChProgressSlot
+{
+	int			changecount;	/* odd while the fields below are written */
+	uint32		ticket;			/* of the current query, 0 if there is none */
+	int			pid;
+	Oid			userid;
+	Oid			serverid;
+	TimestampTz query_start;
+	char		query_id[37];	/* remote query_id, empty until reported */
+	char		query[PROGRESS_QUERY_LEN];
+
+	pg_atomic_uint64 rows_read;
+	pg_atomic_uint64 bytes_read;
+	pg_atomic_uint64 total_rows;	/* estimated by ClickHouse */
+} ChProgressSlot;
+
+#define progress_begin_write(slot) \
+	do { \
+		(slot)->changecount++; \
+		pg_write_barrier(); \
+	} while (0)
+
+#define progress_end_write(slot) \
+	do { \
+		pg_write_barrier(); \
+		(slot)->changecount++; \
+		Assert(((slot)->changecount & 1) == 0); \
+	} while (0)
+
+#define PROGRESS_NAME	"clickhouse_fdw progress"
+
+/* GUC variables */
+static bool track_progress = true;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ChProgressSlot *progress_slots = NULL;
+static int	progress_nslots = 0;
+
+/* slot of this backend and the last ticket given out */
+static ChProgressSlot *my_slot = NULL;
+static uint32 last_ticket = 0;
+
+static void progress_shmem_startup(void);
+static void progress_xact_callback(XactEvent event, void *arg);
+
+PG_FUNCTION_INFO_V1(clickhousedb_progress);
+
+/*
+ * Upper bound of MaxBackends, which is not known yet when the libraries
+ * are preloaded.
+ */
+static int
+max_backends(void)
+{
+	return MaxConnections + autovacuum_max_workers + 1 +
+		max_worker_processes + max_wal_senders;
+}
+
+/*
+ * Define the settings of the progress and request shared memory for it.
+ */
+void
+chfdw_init_progress(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomBoolVariable("clickhouse_fdw.track_progress",
+							 "Publishes the progress of remote queries.",
+							 NULL,
+							 &track_progress,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	RequestAddinShmemSpace(mul_size(max_backends(), sizeof(ChProgressSlot)));
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = progress_shmem_startup;
+}
+
+static void
+progress_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	progress_nslots = MaxBackends;
+	progress_slots = ShmemInitStruct(PROGRESS_NAME,
+									 mul_size(progress_nslots,
+											  sizeof(ChProgressSlot)),
+									 &found);
+	if (!found)
+	{
+		int			i;
+
+		memset(progress_slots, 0, progress_nslots * sizeof(ChProgressSlot));
+		for (i = 0; i < progress_nslots; i++)
+		{
+			pg_atomic_init_u64(&progress_slots[i].rows_read, 0);
+			pg_atomic_init_u64(&progress_slots[i].bytes_read, 0);
+			pg_atomic_init_u64(&progress_slots[i].total_rows, 0);
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Publish the remote query the backend is going to wait for.  Returns the
+ * ticket to report its progress with, 0 if the progress is not tracked.
+ */
+uint32
+chfdw_progress_begin(Oid serverid, const char *query)
+{
+	static bool callback_registered = false;
+	volatile ChProgressSlot *slot;
+	TimestampTz now;
+	Oid			userid;
+	int			len;
+
+	if (progress_slots == NULL || !track_progress ||
+		MyBackendId == InvalidBackendId || MyBackendId > progress_nslots)
+		return 0;
+
+	if (!callback_registered)
+	{
+		RegisterXactCallback(progress_xact_callback, NULL);
+		callback_registered = true;
+	}
+
+	if (++last_ticket == 0)
+		last_ticket = 1;
+
+	len = pg_mbcliplen(query, strlen(query), PROGRESS_QUERY_LEN - 1);
+	now = GetCurrentTimestamp();
+	userid = GetUserId();
+	my_slot = &progress_slots[MyBackendId - 1];
+	slot = my_slot;
+
+	progress_begin_write(slot);
+	slot->ticket = last_ticket;
+	slot->pid = MyProcPid;
+	slot->userid = userid;
+	slot->serverid = serverid;
+	slot->query_start = now;
+	slot->query_id[0] = '\0';
+	memcpy((char *) slot->query, query, len);
+	slot->query[len] = '\0';
+	pg_atomic_write_u64(&my_slot->rows_read, 0);
+	pg_atomic_write_u64(&my_slot->bytes_read, 0);
+	pg_atomic_write_u64(&my_slot->total_rows, 0);
+	progress_end_write(slot);
+
+	return last_ticket;
+}
+
+/*
+ * Progress of the query as reported by ClickHouse, the numbers are totals
+ * since the beginning of the query.
+ */
+void
+chfdw_progress_report(uint32 ticket, const char *query_id, uint64 rows_read,
+					  uint64 bytes_read, uint64 total_rows)
+{
+	volatile ChProgressSlot *slot = my_slot;
+
+	if (ticket == 0 || slot == NULL || slot->ticket != ticket)
+		return;
+
+	if (query_id != NULL && slot->query_id[0] == '\0')
+	{
+		progress_begin_write(slot);
+		strlcpy((char *) slot->query_id, query_id, sizeof(slot->query_id));
+		progress_end_write(slot);
+	}
+
+	pg_atomic_write_u64(&my_slot->rows_read, rows_read);
+	pg_atomic_write_u64(&my_slot->bytes_read, bytes_read);
+	pg_atomic_write_u64(&my_slot->total_rows, total_rows);
+}
+
+/*
+ * The query is over, the slot is freed unless another query has been
+ * started since.
+ */
+void
+chfdw_progress_end(uint32 ticket)
+{
+	volatile ChProgressSlot *slot = my_slot;
+
+	if (ticket == 0 || slot == NULL || slot->ticket != ticket)
+		return;
+
+	progress_begin_write(slot);
+	slot->ticket = 0;
+	progress_end_write(slot);
+}
+
+/*
+ * No remote query outlives the transaction, errors can leave the slot
+ * taken.
+ */
+static void
+progress_xact_callback(XactEvent event, void *arg)
+{
+	volatile ChProgressSlot *slot = my_slot;
+
+	if (slot == NULL || slot->ticket == 0)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			progress_begin_write(slot);
+			slot->ticket = 0;
+			progress_end_write(slot);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Remote queries in progress.  Query text of other users is shown only to
+ * the members of pg_read_all_stats.
+ */
+Datum
+clickhousedb_progress(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcxt;
+	Oid			userid = GetUserId();
+	bool		read_all = is_member_of_role(userid, DEFAULT_ROLE_READ_ALL_STATS);
+	int			i;
+
+	if (progress_slots == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("clickhouse_fdw progress of remote queries is not enabled"),
+				 errhint("Add clickhouse_fdw to shared_preload_libraries.")));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcxt);
+
+	for (i = 0; i < progress_nslots; i++)
+	{
+		volatile ChProgressSlot *slot = &progress_slots[i];
+		ChProgressSlot copy;
+		uint64		rows_read,
+					bytes_read,
+					total_rows;
+		Datum		values[8];
+		bool		nulls[8] = {false};
+
+		/* the backend doesn't wait for us, retry until we see no change */
+		for (;;)
+		{
+			int			before = slot->changecount;
+
+			pg_read_barrier();
+			memcpy(&copy, (char *) slot, offsetof(ChProgressSlot, rows_read));
+			rows_read = pg_atomic_read_u64(&progress_slots[i].rows_read);
+			bytes_read = pg_atomic_read_u64(&progress_slots[i].bytes_read);
+			total_rows = pg_atomic_read_u64(&progress_slots[i].total_rows);
+			pg_read_barrier();
+
+			if (before == slot->changecount && (before & 1) == 0)
+				break;
+
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (copy.ticket == 0)
+			continue;
+
+		values[0] = Int32GetDatum(copy.pid);
+		values[1] = ObjectIdGetDatum(copy.serverid);
+		if (copy.query_id[0] != '\0')
+			values[2] = CStringGetTextDatum(copy.query_id);
+		else
+			nulls[2] = true;
+		if (read_all || has_privs_of_role(userid, copy.userid))
+			values[3] = CStringGetTextDatum(copy.query);
+		else
+			values[3] = CStringGetTextDatum("<insufficient privilege>");
+		values[4] = TimestampTzGetDatum(copy.query_start);
+		values[5] = Int64GetDatum(rows_read);
+		values[6] = Int64GetDatum(bytes_read);
+		values[7] = Int64GetDatum(total_rows);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
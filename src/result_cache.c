@@ -0,0 +1,462 @@
+/*-------------------------------------------------------------------------
+ *
+ * result_cache.c
+ *		  Shared cache of remote query results for clickhouse_fdw
+ *
+ * Results of scans with the cache_ttl option are kept in dynamic shared
+ * memory, so a query sent again by any backend is answered without going
+ * to ClickHouse until the result expires.  Entries are found by server,
+ * user mapping and hash of the remote query, the whole query is kept with
+ * the result to tell colliding hashes apart.  When the cache is full the
+ * least recently used entries are evicted.
+ *
+ * The cache needs the library in shared_preload_libraries and a non-zero
+ * clickhouse_fdw.result_cache_size.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/hash.h"
+#include "access/htup_details.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/dsa.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "clickhousedb_fdw.h"
+
+typedef struct ChResultCacheKey
+{
+	Oid			serverid;
+	Oid			umid;			/* user mapping */
+	uint64		hash;			/* hash of the remote query */
+} ChResultCacheKey;
+
+typedef struct ChResultCacheEntry
+{
+	ChResultCacheKey key;		/* hash key (must be first) */
+	dsa_pointer data;			/* query followed by rows */
+	Size		keylen;			/* length of the query */
+	Size		size;			/* allocated size of data */
+	TimestampTz expires;
+	pg_atomic_uint64 last_used;	/* value of the clock on last hit */
+} ChResultCacheEntry;
+
+typedef struct ChResultCacheState
+{
+	LWLock	   *lock;			/* protects hash table and bytes */
+	int			tranche_id;		/* for locks of the area */
+	dsa_handle	area;			/* DSM_HANDLE_INVALID until first use */
+	Size		bytes;			/* size of all the entries */
+	pg_atomic_uint64 clock;		/* counts uses of the entries */
+	pg_atomic_uint64 hits;
+	pg_atomic_uint64 misses;
+	pg_atomic_uint64 stores;
+	pg_atomic_uint64 evictions;
+} ChResultCacheState;
+
+#define RESULT_CACHE_NAME	"clickhouse_fdw result cache"
+
+/* GUC variables */
+static int	result_cache_size = 0;	/* in kB */
+static int	result_cache_entries = 1024;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ChResultCacheState *cache_state = NULL;
+static HTAB *cache_hash = NULL;
+static dsa_area *cache_area = NULL;
+
+static void result_cache_shmem_startup(void);
+static dsa_area *get_cache_area(void);
+static void remove_entry(ChResultCacheEntry *entry);
+static bool evict_entry(TimestampTz now);
+
+PG_FUNCTION_INFO_V1(clickhousedb_result_cache);
+PG_FUNCTION_INFO_V1(clickhousedb_result_cache_reset);
+
+/*
+ * Define the settings of the cache and request shared memory for it.
+ */
+void
+chfdw_init_result_cache(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("clickhouse_fdw.result_cache_size",
+							"Sets the size of shared cache of remote query results.",
+							"Zero disables the cache.",
+							&result_cache_size,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("clickhouse_fdw.result_cache_entries",
+							"Sets the maximum number of results in shared cache.",
+							NULL,
+							&result_cache_entries,
+							1024,
+							16,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	if (result_cache_size == 0)
+		return;
+
+	RequestAddinShmemSpace(add_size(MAXALIGN(sizeof(ChResultCacheState)),
+									hash_estimate_size(result_cache_entries,
+													   sizeof(ChResultCacheEntry))));
+	RequestNamedLWLockTranche(RESULT_CACHE_NAME, 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = result_cache_shmem_startup;
+}
+
+static void
+result_cache_shmem_startup(void)
+{
+	HASHCTL		info;
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	cache_state = ShmemInitStruct(RESULT_CACHE_NAME,
+								  sizeof(ChResultCacheState), &found);
+	if (!found)
+	{
+		cache_state->lock = &(GetNamedLWLockTranche(RESULT_CACHE_NAME))->lock;
+		cache_state->tranche_id = LWLockNewTrancheId();
+		cache_state->area = DSM_HANDLE_INVALID;
+		cache_state->bytes = 0;
+		pg_atomic_init_u64(&cache_state->clock, 0);
+		pg_atomic_init_u64(&cache_state->hits, 0);
+		pg_atomic_init_u64(&cache_state->misses, 0);
+		pg_atomic_init_u64(&cache_state->stores, 0);
+		pg_atomic_init_u64(&cache_state->evictions, 0);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(ChResultCacheKey);
+	info.entrysize = sizeof(ChResultCacheEntry);
+	cache_hash = ShmemInitHash(RESULT_CACHE_NAME " hash",
+							   result_cache_entries, result_cache_entries,
+							   &info, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Is there a cache to keep the results in.
+ */
+bool
+chfdw_result_cache_enabled(void)
+{
+	return cache_state != NULL;
+}
+
+/*
+ * Largest result which can be kept, the rows of larger ones are not
+ * collected at all.  They are collected in one chunk of memory, so it has
+ * to fit an allocation too.
+ */
+Size
+chfdw_result_cache_max_size(void)
+{
+	return Min((Size) result_cache_size * 1024, MaxAllocSize / 2);
+}
+
+/*
+ * Attach to the area holding the results, create it on first use.
+ */
+static dsa_area *
+get_cache_area(void)
+{
+	MemoryContext oldcxt;
+
+	if (cache_area != NULL)
+		return cache_area;
+
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+	LWLockRegisterTranche(cache_state->tranche_id, RESULT_CACHE_NAME);
+	LWLockAcquire(cache_state->lock, LW_EXCLUSIVE);
+
+	if (cache_state->area == DSM_HANDLE_INVALID)
+	{
+		cache_area = dsa_create(cache_state->tranche_id);
+		dsa_pin(cache_area);
+		cache_state->area = dsa_get_handle(cache_area);
+	}
+	else
+		cache_area = dsa_attach(cache_state->area);
+
+	/* keep the area mapped until the backend exits */
+	dsa_pin_mapping(cache_area);
+
+	LWLockRelease(cache_state->lock);
+	MemoryContextSwitchTo(oldcxt);
+
+	return cache_area;
+}
+
+static void
+make_cache_key(ChResultCacheKey *key, UserMapping *user, const char *query)
+{
+	memset(key, 0, sizeof(ChResultCacheKey));
+	key->serverid = user->serverid;
+	key->umid = user->umid;
+	key->hash = DatumGetUInt64(hash_any_extended((const unsigned char *) query,
+												 strlen(query), 0));
+}
+
+/*
+ * Look up the result of the query.  Returns a copy of the rows stored by
+ * chfdw_result_cache_store in the current memory context, or NULL on a
+ * miss.
+ */
+char *
+chfdw_result_cache_lookup(UserMapping *user, const char *query, Size *len)
+{
+	ChResultCacheKey key;
+	ChResultCacheEntry *entry;
+	dsa_area   *area = get_cache_area();
+	Size		keylen = strlen(query);
+	char	   *result = NULL;
+
+	make_cache_key(&key, user, query);
+
+	LWLockAcquire(cache_state->lock, LW_SHARED);
+
+	entry = hash_search(cache_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL && entry->keylen == keylen &&
+		entry->expires > GetCurrentTimestamp())
+	{
+		char	   *data = dsa_get_address(area, entry->data);
+
+		if (memcmp(data, query, keylen) == 0)
+		{
+			*len = entry->size - MAXALIGN(keylen);
+			result = palloc(*len);
+			memcpy(result, data + MAXALIGN(keylen), *len);
+
+			pg_atomic_write_u64(&entry->last_used,
+								pg_atomic_fetch_add_u64(&cache_state->clock, 1));
+		}
+	}
+
+	LWLockRelease(cache_state->lock);
+
+	if (result != NULL)
+		pg_atomic_fetch_add_u64(&cache_state->hits, 1);
+	else
+		pg_atomic_fetch_add_u64(&cache_state->misses, 1);
+
+	return result;
+}
+
+/*
+ * Keep the rows of the query for ttl seconds.  Expired entries and then the
+ * least recently used ones are evicted to make room.  The result is silently
+ * dropped if it does not fit.
+ */
+void
+chfdw_result_cache_store(UserMapping *user, const char *query,
+						 const char *rows, Size len, int ttl)
+{
+	ChResultCacheKey key;
+	ChResultCacheEntry *entry;
+	dsa_area   *area = get_cache_area();
+	dsa_pointer data;
+	Size		keylen = strlen(query);
+	Size		size = MAXALIGN(keylen) + len;
+	TimestampTz now = GetCurrentTimestamp();
+	char	   *ptr;
+
+	if (size > chfdw_result_cache_max_size())
+		return;
+
+	make_cache_key(&key, user, query);
+
+	LWLockAcquire(cache_state->lock, LW_EXCLUSIVE);
+
+	/* another backend could store the same query meanwhile */
+	entry = hash_search(cache_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+		remove_entry(entry);
+
+	while (cache_state->bytes + size > (Size) result_cache_size * 1024 ||
+		   hash_get_num_entries(cache_hash) >= result_cache_entries)
+	{
+		if (!evict_entry(now))
+			break;
+	}
+
+	data = dsa_allocate_extended(area, size, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(data))
+	{
+		LWLockRelease(cache_state->lock);
+		return;
+	}
+
+	entry = hash_search(cache_hash, &key, HASH_ENTER_NULL, NULL);
+	if (entry == NULL)
+	{
+		dsa_free(area, data);
+		LWLockRelease(cache_state->lock);
+		return;
+	}
+
+	ptr = dsa_get_address(area, data);
+	memcpy(ptr, query, keylen);
+	memcpy(ptr + MAXALIGN(keylen), rows, len);
+
+	entry->data = data;
+	entry->keylen = keylen;
+	entry->size = size;
+	entry->expires = TimestampTzPlusMilliseconds(now, (int64) ttl * 1000);
+	pg_atomic_init_u64(&entry->last_used,
+					   pg_atomic_fetch_add_u64(&cache_state->clock, 1));
+	cache_state->bytes += size;
+
+	LWLockRelease(cache_state->lock);
+
+	pg_atomic_fetch_add_u64(&cache_state->stores, 1);
+}
+
+/* Exclusive lock must be held */
+static void
+remove_entry(ChResultCacheEntry *entry)
+{
+	dsa_free(cache_area, entry->data);
+	cache_state->bytes -= entry->size;
+	hash_search(cache_hash, &entry->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Remove an expired entry, or the least recently used one if none has
+ * expired.  Exclusive lock must be held.  Returns false if the cache is
+ * empty.
+ */
+static bool
+evict_entry(TimestampTz now)
+{
+	HASH_SEQ_STATUS status;
+	ChResultCacheEntry *entry,
+			   *victim = NULL;
+	uint64		oldest = PG_UINT64_MAX;
+
+	hash_seq_init(&status, cache_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		uint64		last_used = pg_atomic_read_u64(&entry->last_used);
+
+		if (entry->expires <= now)
+		{
+			victim = entry;
+			hash_seq_term(&status);
+			break;
+		}
+
+		if (last_used < oldest)
+		{
+			oldest = last_used;
+			victim = entry;
+		}
+	}
+
+	if (victim == NULL)
+		return false;
+
+	remove_entry(victim);
+	pg_atomic_fetch_add_u64(&cache_state->evictions, 1);
+	return true;
+}
+
+static void
+check_result_cache(void)
+{
+	if (cache_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("clickhouse_fdw result cache is not enabled"),
+				 errhint("Add clickhouse_fdw to shared_preload_libraries and set clickhouse_fdw.result_cache_size.")));
+}
+
+/*
+ * Counters of the cache and its current size.
+ */
+Datum
+clickhousedb_result_cache(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6] = {false};
+	long		entries;
+	Size		bytes;
+
+	check_result_cache();
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	LWLockAcquire(cache_state->lock, LW_SHARED);
+	entries = hash_get_num_entries(cache_hash);
+	bytes = cache_state->bytes;
+	LWLockRelease(cache_state->lock);
+
+	values[0] = Int64GetDatum(pg_atomic_read_u64(&cache_state->hits));
+	values[1] = Int64GetDatum(pg_atomic_read_u64(&cache_state->misses));
+	values[2] = Int64GetDatum(pg_atomic_read_u64(&cache_state->stores));
+	values[3] = Int64GetDatum(pg_atomic_read_u64(&cache_state->evictions));
+	values[4] = Int64GetDatum(entries);
+	values[5] = Int64GetDatum(bytes);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Drop all the results and reset the counters.
+ */
+Datum
+clickhousedb_result_cache_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+	ChResultCacheEntry *entry;
+
+	check_result_cache();
+	(void) get_cache_area();
+
+	LWLockAcquire(cache_state->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, cache_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		remove_entry(entry);
+
+	pg_atomic_write_u64(&cache_state->hits, 0);
+	pg_atomic_write_u64(&cache_state->misses, 0);
+	pg_atomic_write_u64(&cache_state->stores, 0);
+	pg_atomic_write_u64(&cache_state->evictions, 0);
+
+	LWLockRelease(cache_state->lock);
+
+	PG_RETURN_VOID();
+}
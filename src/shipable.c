@@ -165,19 +165,24 @@ chfdw_is_shippable(Oid objectId, Oid classId, CHFdwRelationInfo *fpinfo,
 	ShippableCacheKey key;
 	ShippableCacheEntry *entry;
 
-	/* Built-in objects are presumed shippable. */
-	if (chfdw_is_builtin(objectId))
-		return true;
-
+	/* Functions could be mapped by the user, built-in ones too. */
 	if (classId == ProcedureRelationId)
 	{
 		CustomObjectDef *cdef = chfdw_check_for_custom_function(objectId);
 		if (outcdef != NULL)
 			*outcdef = cdef;
 
-		return (cdef && cdef->cf_type != CF_UNSHIPPABLE);
+		if (cdef)
+			return cdef->cf_type != CF_UNSHIPPABLE;
+
+		return chfdw_is_builtin(objectId);
 	}
-	else if (classId == TypeRelationId && chfdw_check_for_custom_type(objectId) != NULL)
+
+	/* Built-in objects are presumed shippable. */
+	if (chfdw_is_builtin(objectId))
+		return true;
+
+	if (classId == TypeRelationId && chfdw_check_for_custom_type(objectId) != NULL)
 		return true;
 	else if (classId == OperatorRelationId && chfdw_check_for_custom_operator(objectId, NULL) != NULL)
 		return true;
@@ -0,0 +1,100 @@
+-- Functions and aggregates shipped to ClickHouse by templates. $1, $2, ...
+-- in chtemplate are replaced by arguments of the call, for ordered-set
+-- aggregates direct arguments come first. $const1, $const2, ... accept only
+-- constants, the call is not shipped otherwise. Rows added by the extension
+-- are marked as builtin and are not dumped.
+CREATE TABLE ch_function_map (
+	pgfunc		regprocedure PRIMARY KEY,
+	chtemplate	text NOT NULL,
+	builtin		boolean NOT NULL DEFAULT false
+);
+SELECT pg_catalog.pg_extension_config_dump('ch_function_map', 'WHERE NOT builtin');
+
+CREATE FUNCTION ch_function_map_invalidate()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'clickhousedb_function_map_invalidate'
+LANGUAGE C;
+
+CREATE TRIGGER ch_function_map_invalidate
+	AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON ch_function_map
+	FOR EACH STATEMENT EXECUTE PROCEDURE ch_function_map_invalidate();
+
+INSERT INTO ch_function_map VALUES
+	('percentile_cont(float8, float8)', 'if(count($2) > 0, quantileExactInclusive($const1)($2), NULL)', true),
+	('string_agg(text, text)', 'if(count($1) > 0, arrayStringConcat(groupArray($1), $const2), NULL)', true);
+
+-- Shared cache of remote query results, the library has to be loaded with
+-- shared_preload_libraries and clickhouse_fdw.result_cache_size set.
+CREATE FUNCTION clickhouse_fdw_result_cache(
+	OUT hits bigint,
+	OUT misses bigint,
+	OUT stores bigint,
+	OUT evictions bigint,
+	OUT entries bigint,
+	OUT bytes bigint)
+RETURNS record
+AS 'MODULE_PATHNAME', 'clickhousedb_result_cache'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW clickhouse_fdw_result_cache AS
+	SELECT * FROM clickhouse_fdw_result_cache();
+
+CREATE FUNCTION clickhouse_fdw_result_cache_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'clickhousedb_result_cache_reset'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION clickhouse_fdw_result_cache_reset() FROM PUBLIC;
+
+-- Statistics of remote queries, the library has to be loaded with
+-- shared_preload_libraries.
+CREATE FUNCTION clickhouse_fdw_stat_statements(
+	OUT serverid oid,
+	OUT userid oid,
+	OUT queryid bigint,
+	OUT query text,
+	OUT calls bigint,
+	OUT total_time float8,
+	OUT mean_time float8,
+	OUT rows bigint,
+	OUT bytes bigint,
+	OUT remote_rows_read bigint,
+	OUT errors bigint,
+	OUT cancels bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'clickhousedb_stat_statements'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW clickhouse_fdw_stat_statements AS
+	SELECT s.srvname AS server, st.*
+	FROM clickhouse_fdw_stat_statements() st
+	LEFT JOIN pg_foreign_server s ON s.oid = st.serverid;
+
+CREATE FUNCTION clickhouse_fdw_stat_statements_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'clickhousedb_stat_statements_reset'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION clickhouse_fdw_stat_statements_reset() FROM PUBLIC;
+
+-- Remote queries in progress, the library has to be loaded with
+-- shared_preload_libraries.
+CREATE FUNCTION clickhouse_fdw_progress(
+	OUT pid int,
+	OUT serverid oid,
+	OUT query_id text,
+	OUT query text,
+	OUT query_start timestamptz,
+	OUT rows_read bigint,
+	OUT bytes_read bigint,
+	OUT total_rows bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'clickhousedb_progress'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW clickhouse_fdw_progress AS
+	SELECT p.pid, s.srvname AS server, p.query_id, p.query, p.query_start,
+		clock_timestamp() - p.query_start AS elapsed,
+		p.rows_read, p.bytes_read, p.total_rows
+	FROM clickhouse_fdw_progress() p
+	LEFT JOIN pg_foreign_server s ON s.oid = p.serverid;
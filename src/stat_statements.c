@@ -0,0 +1,460 @@
+/*-------------------------------------------------------------------------
+ *
+ * stat_statements.c
+ *		  Statistics of remote queries of clickhouse_fdw
+ *
+ * Remote queries sent by pglink.c are counted in shared memory per foreign
+ * server, user and fingerprint of the query.  The fingerprint is a hash of the
+ * query with its literals replaced by '?', so queries which differ only in
+ * constants are counted together.  Counters are atomics updated under a
+ * shared lock, the exclusive one is taken only to add or remove entries.
+ * When there is no room for a new query the entry with the fewest calls is
+ * removed.
+ *
+ * The statistics need the library in shared_preload_libraries.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <ctype.h>
+
+#include "access/hash.h"
+#include "catalog/pg_authid.h"
+#include "funcapi.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+
+#include "clickhousedb_fdw.h"
+
+#define STAT_QUERY_LEN	1024	/* longer queries are truncated */
+
+typedef struct ChStatKey
+{
+	Oid			serverid;
+	Oid			userid;
+	uint64		queryid;		/* hash of the normalized query */
+} ChStatKey;
+
+typedef struct ChStatEntry
+{
+	ChStatKey	key;			/* hash key (must be first) */
+	pg_atomic_uint64 calls;
+	pg_atomic_uint64 total_time;	/* in microseconds */
+	pg_atomic_uint64 rows;
+	pg_atomic_uint64 bytes;
+	pg_atomic_uint64 remote_rows_read;
+	pg_atomic_uint64 errors;
+	pg_atomic_uint64 cancels;
+	char		query[STAT_QUERY_LEN];	/* normalized query */
+} ChStatEntry;
+
+typedef struct ChStatState
+{
+	LWLock	   *lock;			/* protects the hash table */
+} ChStatState;
+
+#define STAT_STATEMENTS_NAME	"clickhouse_fdw stat statements"
+
+/* GUC variables */
+static int	stat_statements_max = 1000;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ChStatState *stat_state = NULL;
+static HTAB *stat_hash = NULL;
+
+static void stat_statements_shmem_startup(void);
+static char *normalize_query(const char *query, int *len);
+static ChStatEntry *enter_entry(ChStatKey *key, const char *query, int len);
+
+PG_FUNCTION_INFO_V1(clickhousedb_stat_statements);
+PG_FUNCTION_INFO_V1(clickhousedb_stat_statements_reset);
+
+/*
+ * Define the settings of the statistics and request shared memory for them.
+ */
+void
+chfdw_init_stat_statements(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("clickhouse_fdw.stat_statements_max",
+							"Sets the maximum number of remote queries tracked.",
+							"Zero disables the statistics.",
+							&stat_statements_max,
+							1000,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	if (stat_statements_max == 0)
+		return;
+
+	RequestAddinShmemSpace(add_size(MAXALIGN(sizeof(ChStatState)),
+									hash_estimate_size(stat_statements_max,
+													   sizeof(ChStatEntry))));
+	RequestNamedLWLockTranche(STAT_STATEMENTS_NAME, 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = stat_statements_shmem_startup;
+}
+
+static void
+stat_statements_shmem_startup(void)
+{
+	HASHCTL		info;
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	stat_state = ShmemInitStruct(STAT_STATEMENTS_NAME,
+								 sizeof(ChStatState), &found);
+	if (!found)
+		stat_state->lock = &(GetNamedLWLockTranche(STAT_STATEMENTS_NAME))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(ChStatKey);
+	info.entrysize = sizeof(ChStatEntry);
+	stat_hash = ShmemInitHash(STAT_STATEMENTS_NAME " hash",
+							  stat_statements_max, stat_statements_max,
+							  &info, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Are remote queries counted.
+ */
+bool
+chfdw_stat_statements_enabled(void)
+{
+	return stat_state != NULL;
+}
+
+/*
+ * Count the remote query.  Time is in milliseconds, rows and bytes are the
+ * ones received for a select and sent for an insert.
+ */
+void
+chfdw_stat_statements_record(Oid serverid, const char *query,
+							 ChQueryOutcome outcome, double time,
+							 uint64 rows, uint64 bytes, uint64 remote_rows_read)
+{
+	ChStatKey	key;
+	ChStatEntry *entry;
+	char	   *norm;
+	int			len;
+
+	if (stat_state == NULL)
+		return;
+
+	norm = normalize_query(query, &len);
+
+	memset(&key, 0, sizeof(ChStatKey));
+	key.serverid = serverid;
+	key.userid = GetUserId();
+	key.queryid = DatumGetUInt64(hash_any_extended((const unsigned char *) norm,
+												   len, 0));
+
+	LWLockAcquire(stat_state->lock, LW_SHARED);
+
+	entry = hash_search(stat_hash, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		LWLockRelease(stat_state->lock);
+		LWLockAcquire(stat_state->lock, LW_EXCLUSIVE);
+
+		entry = enter_entry(&key, norm, len);
+		if (entry == NULL)
+		{
+			LWLockRelease(stat_state->lock);
+			pfree(norm);
+			return;
+		}
+	}
+
+	pg_atomic_fetch_add_u64(&entry->calls, 1);
+	pg_atomic_fetch_add_u64(&entry->total_time, (uint64) (time * 1000));
+	pg_atomic_fetch_add_u64(&entry->rows, rows);
+	pg_atomic_fetch_add_u64(&entry->bytes, bytes);
+	pg_atomic_fetch_add_u64(&entry->remote_rows_read, remote_rows_read);
+	if (outcome == CH_QUERY_FAILED)
+		pg_atomic_fetch_add_u64(&entry->errors, 1);
+	else if (outcome == CH_QUERY_CANCELED)
+		pg_atomic_fetch_add_u64(&entry->cancels, 1);
+
+	LWLockRelease(stat_state->lock);
+	pfree(norm);
+}
+
+/*
+ * Find or add the entry of the query, the one with the fewest calls is
+ * removed if there is no room.  Exclusive lock must be held.  Returns NULL
+ * if the entry could not be added.
+ */
+static ChStatEntry *
+enter_entry(ChStatKey *key, const char *query, int len)
+{
+	ChStatEntry *entry;
+	bool		found;
+
+	/* another backend could add it meanwhile */
+	entry = hash_search(stat_hash, key, HASH_FIND, NULL);
+	if (entry != NULL)
+		return entry;
+
+	if (hash_get_num_entries(stat_hash) >= stat_statements_max)
+	{
+		HASH_SEQ_STATUS status;
+		ChStatEntry *victim = NULL;
+		uint64		fewest = PG_UINT64_MAX;
+
+		hash_seq_init(&status, stat_hash);
+		while ((entry = hash_seq_search(&status)) != NULL)
+		{
+			uint64		calls = pg_atomic_read_u64(&entry->calls);
+
+			if (calls < fewest)
+			{
+				fewest = calls;
+				victim = entry;
+			}
+		}
+
+		if (victim != NULL)
+			hash_search(stat_hash, &victim->key, HASH_REMOVE, NULL);
+	}
+
+	entry = hash_search(stat_hash, key, HASH_ENTER_NULL, &found);
+	if (entry == NULL || found)
+		return entry;
+
+	pg_atomic_init_u64(&entry->calls, 0);
+	pg_atomic_init_u64(&entry->total_time, 0);
+	pg_atomic_init_u64(&entry->rows, 0);
+	pg_atomic_init_u64(&entry->bytes, 0);
+	pg_atomic_init_u64(&entry->remote_rows_read, 0);
+	pg_atomic_init_u64(&entry->errors, 0);
+	pg_atomic_init_u64(&entry->cancels, 0);
+
+	len = pg_mbcliplen(query, len, STAT_QUERY_LEN - 1);
+	memcpy(entry->query, query, len);
+	entry->query[len] = '\0';
+
+	return entry;
+}
+
+static bool
+is_ident_char(char c)
+{
+	return isalnum((unsigned char) c) || c == '_' || IS_HIGHBIT_SET(c);
+}
+
+/*
+ * Add '?' in place of a literal, "?, ?" of lists becomes "?.." so lists of
+ * any length have one fingerprint.
+ */
+static void
+append_literal(StringInfo buf)
+{
+	if (buf->len >= 5 && strcmp(buf->data + buf->len - 5, "?.., ") == 0)
+		buf->len -= 2;
+	else if (buf->len >= 3 && strcmp(buf->data + buf->len - 3, "?, ") == 0)
+	{
+		buf->len -= 2;
+		appendStringInfoString(buf, "..");
+	}
+	else
+		appendStringInfoChar(buf, '?');
+
+	buf->data[buf->len] = '\0';
+}
+
+/*
+ * Replace string and number literals of the query with '?'.  Quoted
+ * identifiers and names of query parameters are kept as they are.
+ */
+static char *
+normalize_query(const char *query, int *len)
+{
+	StringInfoData buf;
+	const char *p = query;
+
+	initStringInfo(&buf);
+
+	while (*p != '\0')
+	{
+		char		c = *p;
+
+		if (c == '\'')
+		{
+			for (p++; *p != '\0'; p++)
+			{
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+				else if (*p == '\'' && p[1] == '\'')
+					p++;
+				else if (*p == '\'')
+				{
+					p++;
+					break;
+				}
+			}
+			append_literal(&buf);
+		}
+		else if (c == '`' || c == '"')
+		{
+			const char *start = p;
+
+			for (p++; *p != '\0' && *p != c; p++)
+			{
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+			}
+			if (*p != '\0')
+				p++;
+			appendBinaryStringInfo(&buf, start, p - start);
+		}
+		else if (isdigit((unsigned char) c) &&
+				 (p == query || !is_ident_char(p[-1])))
+		{
+			/* fractions, exponents and hex digits are parts of the number */
+			for (p++; isalnum((unsigned char) *p) || *p == '.' ||
+				 ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E'));
+				 p++)
+				;
+			append_literal(&buf);
+		}
+		else
+		{
+			appendStringInfoChar(&buf, c);
+			p++;
+		}
+	}
+
+	*len = buf.len;
+	return buf.data;
+}
+
+static void
+check_stat_statements(void)
+{
+	if (stat_state == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("clickhouse_fdw statistics of remote queries are not enabled"),
+				 errhint("Add clickhouse_fdw to shared_preload_libraries and set clickhouse_fdw.stat_statements_max.")));
+}
+
+/*
+ * Counters of all the remote queries.  Query text of other users is shown
+ * only to the members of pg_read_all_stats.
+ */
+Datum
+clickhousedb_stat_statements(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcxt;
+	HASH_SEQ_STATUS status;
+	ChStatEntry *entry;
+	Oid			userid = GetUserId();
+	bool		read_all = is_member_of_role(userid, DEFAULT_ROLE_READ_ALL_STATS);
+
+	check_stat_statements();
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcxt);
+
+	LWLockAcquire(stat_state->lock, LW_SHARED);
+
+	hash_seq_init(&status, stat_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		Datum		values[12];
+		bool		nulls[12] = {false};
+		uint64		calls = pg_atomic_read_u64(&entry->calls);
+		double		total_time = pg_atomic_read_u64(&entry->total_time) / 1000.0;
+
+		values[0] = ObjectIdGetDatum(entry->key.serverid);
+		values[1] = ObjectIdGetDatum(entry->key.userid);
+		if (read_all || has_privs_of_role(userid, entry->key.userid))
+		{
+			values[2] = Int64GetDatum((int64) entry->key.queryid);
+			values[3] = CStringGetTextDatum(entry->query);
+		}
+		else
+		{
+			nulls[2] = true;
+			values[3] = CStringGetTextDatum("<insufficient privilege>");
+		}
+		values[4] = Int64GetDatum(calls);
+		values[5] = Float8GetDatum(total_time);
+		values[6] = Float8GetDatum(calls > 0 ? total_time / calls : 0);
+		values[7] = Int64GetDatum(pg_atomic_read_u64(&entry->rows));
+		values[8] = Int64GetDatum(pg_atomic_read_u64(&entry->bytes));
+		values[9] = Int64GetDatum(pg_atomic_read_u64(&entry->remote_rows_read));
+		values[10] = Int64GetDatum(pg_atomic_read_u64(&entry->errors));
+		values[11] = Int64GetDatum(pg_atomic_read_u64(&entry->cancels));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(stat_state->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Forget all the remote queries.
+ */
+Datum
+clickhousedb_stat_statements_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+	ChStatEntry *entry;
+
+	check_stat_statements();
+
+	LWLockAcquire(stat_state->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, stat_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		hash_search(stat_hash, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(stat_state->lock);
+
+	PG_RETURN_VOID();
+}
@@ -102,6 +102,35 @@ SELECT a, dictGet('regression.t3_dict', 'val', (a, 'key' || a::text)) as val, su
 EXPLAIN (VERBOSE, COSTS OFF) SELECT a, dictGet('regression.t3_dict', 'val', (1, 'key' || a::text)) as val, sum(b) FROM t3 GROUP BY a, val ORDER BY a;
 SELECT a, dictGet('regression.t3_dict', 'val', (1, 'key' || a::text)) as val, sum(b) FROM t3 GROUP BY a, val ORDER BY a;
 
+--- joins with dictionary tables are rewritten to dictGet
+SELECT clickhousedb_raw_query($$
+	CREATE TABLE regression.t4_map (key UInt64, val String) ENGINE = TinyLog;
+$$);
+SELECT clickhousedb_raw_query($$
+	INSERT INTO regression.t4_map SELECT number, concat('val', toString(number))
+	FROM numbers(1, 5);
+$$);
+CREATE FOREIGN TABLE t4_bad (key int, val text) SERVER loopback
+	OPTIONS (table_name 't4_map', dictionary 'regression.t4_dict');
+CREATE FOREIGN TABLE t4_map (key int, val text) SERVER loopback
+	OPTIONS (dictionary 'regression.t4_dict', dictionary_key 'key');
+SELECT clickhousedb_raw_query($$
+	create dictionary regression.t4_dict (key UInt64, val String)
+    primary key key
+    source(clickhouse(host '127.0.0.1' port 9000 db 'regression' table 't4_map' user 'default' password ''))
+    layout(hashed())
+    lifetime(10);
+$$);
+
+EXPLAIN (VERBOSE, COSTS OFF) SELECT t3.a, t4.val FROM t3 JOIN t4_map t4 ON t4.key = t3.a;
+SELECT t3.a, t4.val FROM t3 JOIN t4_map t4 ON t4.key = t3.a ORDER BY t3.a;
+
+EXPLAIN (VERBOSE, COSTS OFF) SELECT t3.a, t4.val FROM t4_map t4 JOIN t3 ON t4.key = t3.a WHERE t4.val <> 'val2';
+SELECT t3.a, t4.val FROM t4_map t4 JOIN t3 ON t4.key = t3.a WHERE t4.val <> 'val2' ORDER BY t3.a;
+
+EXPLAIN (VERBOSE, COSTS OFF) SELECT t3.a, t4.key, t4.val FROM t3 LEFT JOIN t4_map t4 ON t4.key = t3.a;
+SELECT t3.a, t4.key, t4.val FROM t3 LEFT JOIN t4_map t4 ON t4.key = t3.a ORDER BY t3.a;
+
 DROP USER MAPPING FOR CURRENT_USER SERVER loopback;
 SELECT clickhousedb_raw_query('DROP DATABASE regression');
 DROP EXTENSION IF EXISTS clickhouse_fdw CASCADE;
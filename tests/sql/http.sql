@@ -137,6 +137,8 @@ SELECT c3, c4 FROM ft1 ORDER BY c3, c1 LIMIT 1;  -- should work again
 
 \set VERBOSITY default
 ANALYZE ft1;
+SELECT reltuples FROM pg_class WHERE relname = 'ft1';
+SELECT count(*) > 0 AS has_stats FROM pg_stats WHERE tablename = 'ft1';
 
 EXPLAIN (COSTS OFF) SELECT * FROM ft1 ORDER BY c3, c1 OFFSET 100 LIMIT 10;
 SELECT * FROM ft1 ORDER BY c3, c1 OFFSET 100 LIMIT 10;
@@ -149,6 +151,50 @@ EXPLAIN (VERBOSE, COSTS OFF) SELECT t1 FROM ft1 t1 ORDER BY t1.c3, t1.c1 OFFSET
 
 SELECT t1 FROM ft1 t1 ORDER BY t1.c3, t1.c1 OFFSET 100 LIMIT 10;
 
+-- non-constant LIMIT and OFFSET are evaluated locally and sent as values
+PREPARE st_limit(int, int) AS SELECT c1 FROM ft1 ORDER BY c1 LIMIT $1 OFFSET $2;
+SET plan_cache_mode = force_generic_plan;
+EXPLAIN (VERBOSE, COSTS OFF) EXECUTE st_limit(3, 100);
+EXECUTE st_limit(3, 100);
+EXECUTE st_limit(-1, 0);
+EXECUTE st_limit(3, -1);
+RESET plan_cache_mode;
+DEALLOCATE st_limit;
+
+-- arrays are sent as sets, large ones as external tables
+PREPARE st_in(int[]) AS SELECT c1 FROM ft1 WHERE c1 = ANY($1) ORDER BY c1;
+SET plan_cache_mode = force_generic_plan;
+EXPLAIN (VERBOSE, COSTS OFF) EXECUTE st_in('{1, 2}');
+EXECUTE st_in('{1, 2, 3}');
+EXECUTE st_in(array_fill(105, ARRAY[150]));
+PREPARE st_in_or(int[]) AS SELECT c1 FROM ft1 WHERE c1 = ANY($1) OR c1 = 5 ORDER BY c1;
+EXPLAIN (VERBOSE, COSTS OFF) EXECUTE st_in_or('{1, 2}');
+EXECUTE st_in_or('{1, 2, NULL}');
+RESET plan_cache_mode;
+DEALLOCATE st_in;
+SELECT c1 FROM ft1 WHERE c1 = ANY(ARRAY(SELECT generate_series(105, 300))) ORDER BY c1;
+
+-- large constant arrays are parameters too, and scalar parameters are typed
+-- query parameters over HTTP
+EXPLAIN (VERBOSE, COSTS OFF) SELECT c1 FROM ft1 WHERE c1 = ANY(array_fill(105, ARRAY[150])) ORDER BY c1;
+SELECT c1 FROM ft1 WHERE c1 = ANY(array_fill(105, ARRAY[150])) ORDER BY c1;
+PREPARE st_eq(int, text) AS SELECT c1, c2 FROM ft2 WHERE c1 = $1 AND c2 = $2;
+SET plan_cache_mode = force_generic_plan;
+EXPLAIN (VERBOSE, COSTS OFF) EXECUTE st_eq(5, 'AAA5');
+EXECUTE st_eq(5, 'AAA5');
+EXECUTE st_eq(6, 'AAA5');
+EXECUTE st_eq(7, E'AAA7\t');
+RESET plan_cache_mode;
+DEALLOCATE st_eq;
+
+-- join clauses are sent as parameters of the inner scan
+CREATE TABLE loc1 (id int);
+INSERT INTO loc1 VALUES (5);
+ANALYZE loc1;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT loc1.id, ft2.c2 FROM loc1 JOIN ft2 ON ft2.c1 = loc1.id;
+SELECT loc1.id, ft2.c2 FROM loc1 JOIN ft2 ON ft2.c1 = loc1.id;
+DROP TABLE loc1;
+
 SELECT * FROM ft1 WHERE false;
 
 EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM ft1 t1 WHERE t1.c1 = 101 AND t1.c6 = '1' AND t1.c7 >= '1';
@@ -176,6 +222,219 @@ EXPLAIN (VERBOSE, COSTS OFF) SELECT t1.c1, t2.c1 FROM ft2 t1 LEFT JOIN ft1 t2 ON
 EXPLAIN SELECT DISTINCT t1.c1, t2.c1 FROM ft2 t1 LEFT JOIN ft1 t2 ON (t1.c1 = t2.c1) order by t1.c1 LIMIT 10;
 SELECT DISTINCT t1.c1, t2.c1 FROM ft2 t1 LEFT JOIN ft1 t2 ON (t1.c1 = t2.c1) order by t1.c1 LIMIT 10;
 
+EXPLAIN (VERBOSE, COSTS OFF) SELECT t1.c1, t1.c2 FROM ft2 t1 WHERE EXISTS (SELECT 1 FROM ft1 t2 WHERE t1.c1 = t2.c1 AND t2.c2 = 5);
+SELECT t1.c1, t1.c2 FROM ft2 t1 WHERE EXISTS (SELECT 1 FROM ft1 t2 WHERE t1.c1 = t2.c1 AND t2.c2 = 5) ORDER BY t1.c1;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT t1.c1 FROM ft1 t1 WHERE NOT EXISTS (SELECT 1 FROM ft2 t2 WHERE t1.c1 = t2.c1);
+SELECT t1.c1 FROM ft1 t1 WHERE NOT EXISTS (SELECT 1 FROM ft2 t2 WHERE t1.c1 = t2.c1) ORDER BY t1.c1;
+
+EXPLAIN (VERBOSE, COSTS OFF) SELECT c1, c2, row_number() OVER (PARTITION BY c2 ORDER BY c1) FROM ft1 WHERE c1 < 15 ORDER BY c1;
+SELECT c1, c2, row_number() OVER (PARTITION BY c2 ORDER BY c1) FROM ft1 WHERE c1 < 15 ORDER BY c1;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT c1, lag(c1, 1, 0) OVER (ORDER BY c1) FROM ft1 WHERE c1 < 5 ORDER BY c1;
+SELECT c1, lag(c1, 1, 0) OVER (ORDER BY c1) FROM ft1 WHERE c1 < 5 ORDER BY c1;
+
+SELECT clickhousedb_raw_query('CREATE TABLE regression.tp1 (c1 Int, c2 Int)
+	ENGINE = MergeTree ORDER BY (c1);');
+SELECT clickhousedb_raw_query('CREATE TABLE regression.tp2 (c1 Int, c2 Int)
+	ENGINE = MergeTree ORDER BY (c1);');
+SELECT clickhousedb_raw_query('INSERT INTO regression.tp1
+	SELECT number, number % 10 FROM numbers(1, 100);');
+SELECT clickhousedb_raw_query('INSERT INTO regression.tp2
+	SELECT number, number % 10 FROM numbers(101, 100);');
+CREATE TABLE pt (c1 int, c2 int) PARTITION BY RANGE (c1);
+CREATE FOREIGN TABLE pt_p1 PARTITION OF pt FOR VALUES FROM (1) TO (101)
+	SERVER loopback OPTIONS (table_name 'tp1');
+CREATE FOREIGN TABLE pt_p2 PARTITION OF pt FOR VALUES FROM (101) TO (201)
+	SERVER loopback OPTIONS (table_name 'tp2');
+SET enable_partitionwise_aggregate = on;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT count(*), sum(c1), max(c1) FROM pt;
+SELECT count(*), sum(c1), max(c1) FROM pt;
+RESET enable_partitionwise_aggregate;
+DROP TABLE pt;
+
+CREATE FOREIGN TABLE ft1_par (c1 int, c2 int)
+	SERVER loopback OPTIONS (table_name 't1', parallel_key 'c1');
+SET max_parallel_workers_per_gather = 2;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT array_agg(c1 ORDER BY c1) FROM ft1_par WHERE c1 < 10;
+SELECT array_agg(c1 ORDER BY c1) FROM ft1_par WHERE c1 < 10;
+RESET max_parallel_workers_per_gather;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+DROP FOREIGN TABLE ft1_par;
+
+SELECT c1 FROM ft1 WHERE c1 < 4 UNION ALL SELECT c1 FROM ft2 WHERE c1 < 4 ORDER BY 1;
+SELECT count(*) FROM (SELECT c1 FROM ft1 UNION ALL SELECT c1 FROM ft2 LIMIT 3) s;
+-- under LIMIT only the next sibling's query is sent ahead
+SELECT count(*) FROM (
+	SELECT c1 FROM ft1 WHERE c1 < 91001 UNION ALL
+	SELECT c1 FROM ft2 WHERE c1 < 91002 UNION ALL
+	SELECT c1 FROM ft3 WHERE c1 < 91003 UNION ALL
+	SELECT c1 FROM ft4 WHERE c1 < 91004 LIMIT 3) s;
+SELECT clickhousedb_raw_query('SYSTEM FLUSH LOGS');
+SELECT trim(E'\n' FROM clickhousedb_raw_query($$
+	SELECT countIf(query LIKE '%91001%') > 0 AND
+		countIf(query LIKE '%91003%' OR query LIKE '%91004%') = 0
+	FROM system.query_log WHERE query NOT LIKE '%query_log%'$$)) AS sent;
+
+CREATE FOREIGN TABLE ft1_early (c1 int, c2 int)
+	SERVER loopback OPTIONS (table_name 't1', early_dispatch 'true');
+SELECT count(*) FROM ft1_early a JOIN generate_series(1, 5) g ON a.c1 = g;
+PREPARE st_early(int) AS SELECT c1 FROM ft1_early WHERE c1 < $1 ORDER BY c1;
+EXECUTE st_early(4);
+DEALLOCATE st_early;
+ALTER FOREIGN TABLE ft1_early OPTIONS (SET early_dispatch 'maybe');
+DROP FOREIGN TABLE ft1_early;
+
+SET enable_hashjoin = off;
+SET enable_mergejoin = off;
+SET enable_material = off;
+SELECT g, count(*) FROM generate_series(1, 3) g, ft2 WHERE ft2.c1 <= 2 GROUP BY g ORDER BY g;
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+RESET enable_material;
+
+SELECT clickhousedb_raw_query('CREATE TABLE regression.tbig (c1 Int, c2 String)
+	ENGINE = MergeTree ORDER BY (c1);');
+SELECT clickhousedb_raw_query('INSERT INTO regression.tbig
+	SELECT number, toString(number) FROM numbers(20000);');
+CREATE FOREIGN TABLE ft_big (c1 int, c2 text)
+	SERVER loopback OPTIONS (table_name 'tbig');
+SET work_mem = '64kB';
+SELECT count(*), sum(c1), sum(length(c2)) FROM (SELECT * FROM ft_big OFFSET 0) s;
+SET temp_file_limit = 0;
+SELECT count(*), sum(c1), sum(length(c2)) FROM (SELECT * FROM ft_big OFFSET 0) s;
+RESET temp_file_limit;
+RESET work_mem;
+DROP FOREIGN TABLE ft_big;
+
+INSERT INTO ch_function_map VALUES ('md5(text)', 'lower(hex(MD5($1)))');
+EXPLAIN (VERBOSE, COSTS OFF) SELECT c1 FROM ft2 WHERE md5(c2) = 'd43d15f17eb3ada99f95eebce8578761';
+SELECT c1 FROM ft2 WHERE md5(c2) = 'd43d15f17eb3ada99f95eebce8578761';
+DELETE FROM ch_function_map WHERE pgfunc = 'md5(text)'::regprocedure;
+INSERT INTO ch_function_map VALUES ('textcat(text,text)', 'replaceAll(concat($1, ''$2''), ''$2'', $2)');
+EXPLAIN (VERBOSE, COSTS OFF) SELECT c1 FROM ft2 WHERE textcat(c2, '-x') = 'AAA5-x';
+SELECT c1 FROM ft2 WHERE textcat(c2, '-x') = 'AAA5-x';
+DELETE FROM ch_function_map WHERE pgfunc = 'textcat(text,text)'::regprocedure;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT c1 FROM ft2 WHERE md5(c2) = 'd43d15f17eb3ada99f95eebce8578761';
+EXPLAIN (VERBOSE, COSTS OFF) SELECT percentile_cont(0.5) WITHIN GROUP (ORDER BY c1) FROM ft2;
+SELECT percentile_cont(0.5) WITHIN GROUP (ORDER BY c1) IS NULL FROM ft2 WHERE c1 < 0;
+SELECT percentile_cont(0.5) WITHIN GROUP (ORDER BY c1) FROM ft2;
+SELECT percentile_cont(0.5) WITHIN GROUP (ORDER BY c1) IS NULL FROM ft2 WHERE c1 < 0;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT percentile_cont(0.5) WITHIN GROUP (ORDER BY c1 DESC) FROM ft2;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT string_agg(c2, ',') FROM ft2 WHERE c1 < 4;
+-- the separator has to be a constant
+EXPLAIN (VERBOSE, COSTS OFF) SELECT string_agg(c2, c2) FROM ft2 WHERE c1 < 4;
+SELECT length(string_agg(c2, ',')) FROM ft2 WHERE c1 < 4;
+
+SELECT clickhousedb_raw_query('CREATE TABLE regression.events (id Int32, payload String)
+	ENGINE = MergeTree PARTITION BY id % 4 ORDER BY (id);');
+SELECT clickhousedb_raw_query('INSERT INTO regression.events
+	SELECT number, toString(number) FROM numbers(1000);');
+CREATE FOREIGN TABLE ft_events (id int, payload text) SERVER loopback
+	OPTIONS (table_name 'events', engine 'MergeTree', sorting_key 'id');
+EXPLAIN (VERBOSE, COSTS OFF) SELECT id FROM ft_events WHERE id < 100 AND payload = '10';
+SELECT id FROM ft_events WHERE id < 100 AND payload = '10';
+EXPLAIN (VERBOSE, COSTS OFF) SELECT count(*) FROM ft_events WHERE id < 100;
+SELECT count(*) FROM ft_events WHERE id < 100;
+ALTER FOREIGN TABLE ft_events OPTIONS (ADD prewhere 'false');
+EXPLAIN (VERBOSE, COSTS OFF) SELECT id FROM ft_events WHERE id < 100 AND payload = '10';
+DROP FOREIGN TABLE ft_events;
+
+SELECT clickhousedb_raw_query('CREATE TABLE regression.visits (id Int32, url String)
+	ENGINE = MergeTree ORDER BY intHash32(id) SAMPLE BY intHash32(id);');
+SELECT clickhousedb_raw_query('INSERT INTO regression.visits
+	SELECT number, toString(number) FROM numbers(10000);');
+CREATE FOREIGN TABLE ft_visits (id int, url text) SERVER loopback
+	OPTIONS (table_name 'visits', sample '0.1');
+CREATE FOREIGN TABLE ft_visits (id int, url text) SERVER loopback
+	OPTIONS (table_name 'visits', sampling_key 'intHash32(id)', sample '1.5');
+CREATE FOREIGN TABLE ft_visits (id int, url text) SERVER loopback
+	OPTIONS (table_name 'visits', sampling_key 'intHash32(id)', sample '0.1');
+EXPLAIN (VERBOSE, COSTS OFF) SELECT id FROM ft_visits WHERE id < 100;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT count(*) FROM ft_visits;
+SELECT count(*) BETWEEN 500 AND 1500 FROM ft_visits;
+ALTER FOREIGN TABLE ft_visits OPTIONS (ADD sample_offset '0.5', ADD sample_scale 'true');
+EXPLAIN (VERBOSE, COSTS OFF) SELECT count(*), sum(id) FROM ft_visits;
+SELECT count(*) BETWEEN 7000 AND 13000 FROM ft_visits;
+-- ANALYZE asks SAMPLE for a number of rows, not for a rounded fraction
+SET default_statistics_target = 1;
+ANALYZE ft_visits;
+RESET default_statistics_target;
+SELECT reltuples FROM pg_class WHERE relname = 'ft_visits';
+SELECT attname, n_distinct FROM pg_stats WHERE tablename = 'ft_visits'
+	ORDER BY attname;
+DROP FOREIGN TABLE ft_visits;
+
+SELECT clickhousedb_raw_query('CREATE TABLE regression.panel (id Int32, hits Int32)
+	ENGINE = MergeTree ORDER BY (id);');
+SELECT clickhousedb_raw_query('INSERT INTO regression.panel
+	SELECT number, number FROM numbers(100);');
+CREATE FOREIGN TABLE ft_panel (id int, hits int) SERVER loopback
+	OPTIONS (table_name 'panel', cache_ttl '-1');
+CREATE FOREIGN TABLE ft_panel (id int, hits int) SERVER loopback
+	OPTIONS (table_name 'panel', cache_ttl '600');
+SELECT clickhouse_fdw_result_cache_reset();
+SELECT sum(hits) FROM ft_panel WHERE id < 50;
+-- the cached result is returned until it expires
+SELECT clickhousedb_raw_query('INSERT INTO regression.panel VALUES (1, 1000);');
+SELECT sum(hits) FROM ft_panel WHERE id < 50;
+SELECT sum(hits) FROM ft_panel WHERE id < 60;
+SELECT hits, misses, stores, entries FROM clickhouse_fdw_result_cache;
+ALTER FOREIGN TABLE ft_panel OPTIONS (SET cache_ttl '0');
+SELECT sum(hits) FROM ft_panel WHERE id < 50;
+DROP FOREIGN TABLE ft_panel;
+
+-- statistics of the remote query in EXPLAIN ANALYZE
+CREATE FUNCTION remote_stats(query text, options text) RETURNS jsonb AS $$
+DECLARE
+	plan	json;
+BEGIN
+	EXECUTE 'EXPLAIN (ANALYZE, FORMAT JSON, ' || options || ') ' || query
+		INTO plan;
+	RETURN (plan->0->'Plan')::jsonb;
+END;
+$$ LANGUAGE plpgsql;
+SELECT s->>'Node Type' AS node, s->>'Remote Rows' AS rows,
+	(s->>'Remote Blocks')::int > 0 AS blocks,
+	(s->>'Remote Bytes')::int > 0 AS bytes,
+	(s->>'Remote First Block Time')::float >= 0 AS first_block,
+	(s->>'Tuple Conversion Time')::float >= 0 AS conversion,
+	s ? 'Server Rows Read' AS server_rows
+	FROM remote_stats('SELECT c1 FROM ft1 WHERE c1 <= 10', 'TIMING ON') s;
+SELECT s->>'Remote Rows' AS rows, s ? 'Remote Wait Time' AS timed
+	FROM remote_stats('SELECT c1 FROM ft1 WHERE c1 <= 5', 'TIMING OFF') s;
+DROP FUNCTION remote_stats(text, text);
+
+-- statistics of remote queries
+SELECT clickhouse_fdw_stat_statements_reset();
+SELECT count(*) FROM ft1 WHERE c1 < 10;
+SELECT count(*) FROM ft1 WHERE c1 < 20;
+CREATE FOREIGN TABLE ft_missing (id int) SERVER loopback
+	OPTIONS (table_name 'no_such_table');
+DO $$ BEGIN PERFORM * FROM ft_missing; EXCEPTION WHEN OTHERS THEN NULL; END $$;
+DROP FOREIGN TABLE ft_missing;
+SELECT query, calls, rows, errors, cancels, total_time > 0 AS timed,
+	mean_time <= total_time AS mean
+	FROM clickhouse_fdw_stat_statements WHERE server = 'loopback'
+	ORDER BY query;
+-- query text of other users is hidden without pg_read_all_stats
+CREATE ROLE regress_ch_stats;
+SET ROLE regress_ch_stats;
+SELECT query, queryid IS NULL AS hidden, calls
+	FROM clickhouse_fdw_stat_statements() s JOIN pg_foreign_server f
+	ON f.oid = s.serverid WHERE srvname = 'loopback' ORDER BY calls;
+RESET ROLE;
+DROP ROLE regress_ch_stats;
+-- progress of remote queries, the slot is freed when the query is over
+SELECT count(*) FROM ft1 WHERE c1 < 10;
+SELECT server, query_id, query, elapsed, rows_read, bytes_read, total_rows
+	FROM clickhouse_fdw_progress WHERE pid = pg_backend_pid();
+EXPLAIN (VERBOSE, COSTS OFF) SELECT DISTINCT c2 FROM ft1 WHERE c1 < 20 ORDER BY c2;
+SELECT DISTINCT c2 FROM ft1 WHERE c1 < 20 ORDER BY c2;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT DISTINCT ON (c2) c2, c1 FROM ft1 ORDER BY c2, c1 DESC;
+SELECT DISTINCT ON (c2) c2, c1 FROM ft1 ORDER BY c2, c1 DESC;
+
 RESET enable_hashjoin;
 RESET enable_nestloop;
 
@@ -211,6 +470,10 @@ EXPLAIN (VERBOSE, COSTS OFF) SELECT (CASE WHEN c1 < 10 THEN 1 WHEN c1 < 50 THEN
 	sum(length(c2)) FROM ft2 GROUP BY a ORDER BY a;
 SELECT (CASE WHEN c1 < 10 THEN 1 WHEN c1 < 50 THEN 2 ELSE 3 END) a,
 	sum(length(c2)) FROM ft2 GROUP BY a ORDER BY a;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT (CASE WHEN c1 < 10 THEN 1 WHEN c1 < 50 THEN 2 ELSE 3 END) a,
+	sum(length(c2)) FROM ft2 GROUP BY a ORDER BY 2 DESC LIMIT 2;
+SELECT (CASE WHEN c1 < 10 THEN 1 WHEN c1 < 50 THEN 2 ELSE 3 END) a,
+	sum(length(c2)) FROM ft2 GROUP BY a ORDER BY 2 DESC LIMIT 2;
 
 EXPLAIN (VERBOSE, COSTS OFF) SELECT SUM(c1) FILTER (WHERE c1 < 20) FROM ft2;
 SELECT SUM(c1) FILTER (WHERE c1 < 20) FROM ft2;
@@ -69,12 +69,25 @@ SELECT clickhousedb_raw_query('INSERT INTO regression.tuples SELECT
     (number, toString(number), number + 1.0)
     FROM numbers(10);');
 
+-- wrapped and parametrized types
+SELECT clickhousedb_raw_query('CREATE TABLE regression.wrapped (
+    c1 Int32,
+    c2 DateTime(''UTC''),
+    c3 Nullable(Decimal(10, 2)),
+    c4 Decimal64(4),
+    c5 Array(Nullable(Int32)),
+    c6 LowCardinality(Nullable(String)),
+    c7 Enum8(''a('' = 1, ''b, c)'' = 2)
+) ENGINE = MergeTree PARTITION BY c1 ORDER BY (c1);
+');
+
 IMPORT FOREIGN SCHEMA "<does not matter>" FROM SERVER loopback INTO clickhouse;
 
 \d+ clickhouse.ints;
 \d+ clickhouse.types;
 \d+ clickhouse.arrays;
 \d+ clickhouse.tuples;
+\d+ clickhouse.wrapped;
 
 SELECT * FROM clickhouse.ints ORDER BY c1 DESC LIMIT 4;
 SELECT * FROM clickhouse.types ORDER BY c1 LIMIT 2;